@@ -0,0 +1,462 @@
+#include "AsyncIO.hpp"
+#include "src/ThreadPool/ThreadPool.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#if defined(__linux__)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#elif !defined(_WIN32)
+#include <unistd.h>
+#endif
+
+namespace SoraMem
+{
+    struct AsyncIO::Pending
+    {
+#ifdef _WIN32
+        OVERLAPPED  overlapped = {};
+#endif
+        IOCallback  done;
+    };
+
+    namespace
+    {
+#ifdef _WIN32
+        constexpr ULONG_PTR stopKey = 1;
+        constexpr int64_t cancelled = -static_cast<int64_t>(ERROR_OPERATION_ABORTED);
+#else
+        constexpr int64_t cancelled = -static_cast<int64_t>(ECANCELED);
+#endif
+
+        std::runtime_error ioError(int64_t result)
+        {
+            return std::runtime_error("Asynchronous I/O failed. Error code: " + std::to_string(-result));
+        }
+
+        // Completions of requests submitted from a callback while the queue was full, set while a callback runs.
+        // The thread running callbacks is the one freeing slots, so it must never wait for one.
+        struct Deferred
+        {
+            IOCallback  done;
+            int64_t     result;
+        };
+        thread_local std::vector<Deferred>* deferred = nullptr;
+    }
+
+    AsyncIO::AsyncIO(ThreadPool* pool, unsigned queueDepth)
+        : pool(pool), queueDepth((std::max)(queueDepth, 1u))
+    {
+        if (setupRing()) completionThread = std::thread([this]() { completionLoop(); });
+    }
+
+    AsyncIO::~AsyncIO()
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            slotFree.wait(lock, [this]() { return inFlight == 0; });
+            stopping = true;
+
+#if defined(__linux__)
+            if (ringFd >= 0) {
+                // A NOP without user data wakes the completion thread for the last time
+                const unsigned tail = std::atomic_ref<unsigned>(*sqTail).load(std::memory_order_relaxed);
+                const unsigned index = tail & sqMask;
+                io_uring_sqe& sqe = static_cast<io_uring_sqe*>(sqes)[index];
+                std::memset(&sqe, 0, sizeof(sqe));
+                sqe.opcode = IORING_OP_NOP;
+                sqArray[index] = index;
+                std::atomic_ref<unsigned>(*sqTail).store(tail + 1, std::memory_order_release);
+                while (syscall(__NR_io_uring_enter, ringFd, 1, 0, 0, nullptr, 0) < 0 && (errno == EINTR || errno == EAGAIN)) {}
+            }
+#elif defined(_WIN32)
+            if (port != NULL) PostQueuedCompletionStatus(port, 0, stopKey, NULL);
+#endif
+        }
+        if (completionThread.joinable()) completionThread.join();
+
+#if defined(__linux__)
+        if (ringFd >= 0) {
+            munmap(sqes, sqesSize);
+            if (cqRing != sqRing) munmap(cqRing, cqRingSize);
+            munmap(sqRing, sqRingSize);
+            close(ringFd);
+        }
+#elif defined(_WIN32)
+        if (port != NULL) CloseHandle(port);
+#endif
+    }
+
+    const char* AsyncIO::backendName() const noexcept
+    {
+#if defined(__linux__)
+        if (ringFd >= 0) return "io_uring";
+#elif defined(_WIN32)
+        if (port != NULL) return "IOCP";
+#endif
+        return "blocking";
+    }
+
+#if defined(__linux__)
+
+    bool AsyncIO::setupRing()
+    {
+        io_uring_params params = {};
+        const int fd = static_cast<int>(syscall(__NR_io_uring_setup, queueDepth, &params));
+        if (fd < 0) return false;   // no io_uring (old kernel, seccomp, io_uring_disabled)
+
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        const bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single) sqRingSize = cqRingSize = (std::max)(sqRingSize, cqRingSize);
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        cqRing = single ? sqRing : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        sqes = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED) {
+            if (sqes != MAP_FAILED) munmap(sqes, sqesSize);
+            if (cqRing != MAP_FAILED && cqRing != sqRing) munmap(cqRing, cqRingSize);
+            if (sqRing != MAP_FAILED) munmap(sqRing, sqRingSize);
+            close(fd);
+            return false;
+        }
+
+        uint8_t* sq = static_cast<uint8_t*>(sqRing);
+        uint8_t* cq = static_cast<uint8_t*>(cqRing);
+        sqHead  = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sqTail  = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sqMask  = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        cqHead  = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cqTail  = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cqMask  = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes    = cq + params.cq_off.cqes;
+
+        // The completion queue is twice as deep, so capping requests at the submission depth never overflows it
+        queueDepth = params.sq_entries;
+        ringFd = fd;
+        return true;
+    }
+
+    void AsyncIO::completionLoop()
+    {
+        for (;;) {
+            unsigned head = std::atomic_ref<unsigned>(*cqHead).load(std::memory_order_relaxed);
+            const unsigned tail = std::atomic_ref<unsigned>(*cqTail).load(std::memory_order_acquire);
+            if (head == tail) {
+                syscall(__NR_io_uring_enter, ringFd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+                continue;
+            }
+
+            // The kernel orders the submitter's writes before the completion, the language does not see that:
+            // every submitter held the mutex across io_uring_enter, so taking it once per batch does
+            { std::lock_guard<std::mutex> lock(mutex); }
+
+            bool stop = false;
+            for (; head != tail; ++head) {
+                const io_uring_cqe& cqe = static_cast<io_uring_cqe*>(cqes)[head & cqMask];
+                Pending* pending = reinterpret_cast<Pending*>(cqe.user_data);
+                if (pending == nullptr) {
+                    stop = true;
+                    continue;
+                }
+                finish(pending->done, cqe.res);
+                delete pending;
+            }
+            std::atomic_ref<unsigned>(*cqHead).store(head, std::memory_order_release);
+            if (stop) return;
+        }
+    }
+
+    bool AsyncIO::registerBuffers(std::span<const std::span<uint8_t>> buffers)
+    {
+        if (ringFd < 0) return false;
+
+        std::vector<iovec> vectors;
+        vectors.reserve(buffers.size());
+        for (const std::span<uint8_t>& buffer : buffers) vectors.push_back({ buffer.data(), buffer.size() });
+
+        std::unique_lock<std::mutex> lock(mutex);
+        slotFree.wait(lock, [this]() { return inFlight == 0; });
+
+        syscall(__NR_io_uring_register, ringFd, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+        fixedBuffers = !vectors.empty()
+            && syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_BUFFERS, vectors.data(), static_cast<unsigned>(vectors.size())) == 0;
+        return fixedBuffers;
+    }
+
+    int64_t AsyncIO::runBlocking(const IORequest& request)
+    {
+        const ssize_t result = request.write
+            ? pwrite(request.file, request.buffer, request.size, static_cast<off_t>(request.offset))
+            : pread(request.file, request.buffer, request.size, static_cast<off_t>(request.offset));
+        return (result < 0) ? -static_cast<int64_t>(errno) : result;
+    }
+
+#elif defined(_WIN32)
+
+    bool AsyncIO::setupRing()
+    {
+        port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+        return port != NULL;
+    }
+
+    void AsyncIO::completionLoop()
+    {
+        for (;;) {
+            DWORD bytes = 0;
+            ULONG_PTR key = 0;
+            OVERLAPPED* overlapped = nullptr;
+            const BOOL ok = GetQueuedCompletionStatus(port, &bytes, &key, &overlapped, INFINITE);
+            if (overlapped == nullptr) {
+                if (key == stopKey) return;
+                continue;
+            }
+
+            Pending* pending = CONTAINING_RECORD(overlapped, Pending, overlapped);
+            const DWORD error = ok ? ERROR_SUCCESS : GetLastError();
+            // Reading at or past the end of the file is a short read, not a failure
+            finish(pending->done, (ok || error == ERROR_HANDLE_EOF) ? static_cast<int64_t>(bytes) : -static_cast<int64_t>(error));
+            delete pending;
+        }
+    }
+
+    bool AsyncIO::registerBuffers(std::span<const std::span<uint8_t>>)
+    {
+        return false;   // registered I/O only exists for sockets
+    }
+
+    int64_t AsyncIO::runBlocking(const IORequest& request)
+    {
+        // The handle is overlapped: wait on an event whose low bit keeps the completion off the port
+        thread_local struct Event
+        {
+            HANDLE handle = CreateEvent(NULL, TRUE, FALSE, NULL);
+            ~Event() { if (handle != NULL) CloseHandle(handle); }
+        } event;
+
+        OVERLAPPED overlapped = {};
+        overlapped.Offset = static_cast<DWORD>(request.offset);
+        overlapped.OffsetHigh = static_cast<DWORD>(request.offset >> 32);
+        overlapped.hEvent = reinterpret_cast<HANDLE>(reinterpret_cast<ULONG_PTR>(event.handle) | 1);
+        DWORD bytes = 0;
+        BOOL ok = request.write
+            ? WriteFile(request.file, request.buffer, request.size, NULL, &overlapped)
+            : ReadFile(request.file, request.buffer, request.size, NULL, &overlapped);
+        if (ok || GetLastError() == ERROR_IO_PENDING) ok = GetOverlappedResult(request.file, &overlapped, &bytes, TRUE);
+        if (!ok && GetLastError() != ERROR_HANDLE_EOF) return -static_cast<int64_t>(GetLastError());
+        return bytes;
+    }
+
+#else
+
+    bool AsyncIO::setupRing()
+    {
+        return false;
+    }
+
+    void AsyncIO::completionLoop() {}
+
+    bool AsyncIO::registerBuffers(std::span<const std::span<uint8_t>>)
+    {
+        return false;
+    }
+
+    int64_t AsyncIO::runBlocking(const IORequest& request)
+    {
+        const ssize_t result = request.write
+            ? pwrite(request.file, request.buffer, request.size, static_cast<off_t>(request.offset))
+            : pread(request.file, request.buffer, request.size, static_cast<off_t>(request.offset));
+        return (result < 0) ? -static_cast<int64_t>(errno) : result;
+    }
+
+#endif
+
+    void AsyncIO::finish(IOCallback& done, int64_t result)
+    {
+        if (done && deferred == nullptr) {
+            std::vector<Deferred> queue;
+            deferred = &queue;
+            done(result);
+            for (size_t i = 0; i < queue.size(); ++i) {
+                Deferred next = std::move(queue[i]);    // its callback may defer more
+                if (next.done) next.done(next.result);
+            }
+            deferred = nullptr;
+        }
+        else if (done) {
+            done(result);
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        --inFlight;
+        slotFree.notify_all();
+    }
+
+    void AsyncIO::submit(std::span<IORequest> requests) noexcept
+    {
+        if (stopping.load(std::memory_order_relaxed)) {
+            for (IORequest& request : requests) {
+                if (request.done) request.done(cancelled);
+            }
+            return;
+        }
+
+        for (size_t next = 0; next < requests.size(); ) {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (deferred != nullptr && inFlight >= queueDepth) {
+                lock.unlock();
+                for (IORequest& request : requests.subspan(next)) {
+                    blockingFallbacks.fetch_add(1, std::memory_order_relaxed);
+                    deferred->push_back({ std::move(request.done), runBlocking(request) });
+                }
+                return;
+            }
+            slotFree.wait(lock, [this]() { return inFlight < queueDepth; });
+            const size_t count = (std::min)(requests.size() - next, static_cast<size_t>(queueDepth - inFlight));
+            inFlight += static_cast<unsigned>(count);
+            std::span<IORequest> batch = requests.subspan(next, count);
+            next += count;
+
+#if defined(__linux__)
+            if (ringFd >= 0) {
+                unsigned tail = std::atomic_ref<unsigned>(*sqTail).load(std::memory_order_relaxed);
+                for (IORequest& request : batch) {
+                    const bool fixed = fixedBuffers && request.fixedBuffer >= 0;
+                    const unsigned index = tail++ & sqMask;
+                    io_uring_sqe& sqe = static_cast<io_uring_sqe*>(sqes)[index];
+                    std::memset(&sqe, 0, sizeof(sqe));
+                    sqe.opcode = request.write ? (fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE)
+                                               : (fixed ? IORING_OP_READ_FIXED : IORING_OP_READ);
+                    sqe.fd = request.file;
+                    sqe.off = request.offset;
+                    sqe.addr = reinterpret_cast<uint64_t>(request.buffer);
+                    sqe.len = request.size;
+                    if (fixed) sqe.buf_index = static_cast<uint16_t>(request.fixedBuffer);
+                    sqe.user_data = reinterpret_cast<uint64_t>(new Pending{ std::move(request.done) });
+                    sqArray[index] = index;
+                }
+                std::atomic_ref<unsigned>(*sqTail).store(tail, std::memory_order_release);
+
+                // The whole batch goes to the kernel in one call
+                size_t submitted = 0;
+                while (submitted < count) {
+                    const long result = syscall(__NR_io_uring_enter, ringFd, static_cast<unsigned>(count - submitted), 0, 0, nullptr, 0);
+                    if (result < 0) {
+                        if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+                        break;
+                    }
+                    submitted += static_cast<size_t>(result);
+                }
+                if (submitted == count) continue;
+
+                // The kernel only takes entries inside io_uring_enter and nobody else submits under the lock, so
+                // the ones it refused are taken back off the ring and run blocking instead
+                std::atomic_ref<unsigned>(*sqTail).store(tail - static_cast<unsigned>(count - submitted), std::memory_order_release);
+                std::vector<Pending*> refused;
+                for (size_t i = submitted; i < count; ++i) {
+                    const unsigned index = (tail - static_cast<unsigned>(count - i)) & sqMask;
+                    refused.push_back(reinterpret_cast<Pending*>(static_cast<io_uring_sqe*>(sqes)[index].user_data));
+                }
+                lock.unlock();
+                blockingFallbacks.fetch_add(refused.size(), std::memory_order_relaxed);
+                for (size_t i = 0; i < refused.size(); ++i) {
+                    std::unique_ptr<Pending> pending(refused[i]);
+                    finish(pending->done, runBlocking(batch[submitted + i]));
+                }
+                continue;
+            }
+#elif defined(_WIN32)
+            if (port != NULL) {
+                lock.unlock();
+                for (IORequest& request : batch) {
+                    // Platform opens files overlapped, a handle bound by an earlier request refuses a second bind
+                    if (CreateIoCompletionPort(request.file, port, 0, 0) == NULL && GetLastError() != ERROR_INVALID_PARAMETER) {
+                        blockingFallbacks.fetch_add(1, std::memory_order_relaxed);
+                        finish(request.done, runBlocking(request));
+                        continue;
+                    }
+
+                    Pending* pending = new Pending();
+                    pending->done = std::move(request.done);
+                    pending->overlapped.Offset = static_cast<DWORD>(request.offset);
+                    pending->overlapped.OffsetHigh = static_cast<DWORD>(request.offset >> 32);
+
+                    const BOOL ok = request.write
+                        ? WriteFile(request.file, request.buffer, request.size, NULL, &pending->overlapped)
+                        : ReadFile(request.file, request.buffer, request.size, NULL, &pending->overlapped);
+                    const DWORD error = ok ? ERROR_SUCCESS : GetLastError();
+                    if (!ok && error != ERROR_IO_PENDING) {
+                        // Nothing is queued to the port for a request that failed outright
+                        finish(pending->done, (error == ERROR_HANDLE_EOF) ? 0 : -static_cast<int64_t>(error));
+                        delete pending;
+                    }
+                }
+                continue;
+            }
+#endif
+            lock.unlock();
+            for (IORequest& request : batch) {
+                if (pool == nullptr) {
+                    finish(request.done, runBlocking(request));
+                    continue;
+                }
+                pool->post([this, request = std::move(request)]() mutable { finish(request.done, runBlocking(request)); });
+            }
+        }
+    }
+
+    std::future<size_t> AsyncIO::read(Platform::FileHandle file, uint64_t offset, std::span<uint8_t> buffer)
+    {
+        if (buffer.size() > UINT32_MAX) {
+            throw std::invalid_argument("Asynchronous request larger than 4 GB: " + std::to_string(buffer.size()));
+        }
+
+        auto promise = std::make_shared<std::promise<size_t>>();
+        std::future<size_t> result = promise->get_future();
+
+        IORequest request;
+        request.file = file;
+        request.offset = offset;
+        request.buffer = buffer.data();
+        request.size = static_cast<uint32_t>(buffer.size());
+        request.done = [promise](int64_t bytes) {
+            if (bytes < 0) promise->set_exception(std::make_exception_ptr(ioError(bytes)));
+            else promise->set_value(static_cast<size_t>(bytes));
+        };
+        submit({ &request, 1 });
+        return result;
+    }
+
+    std::future<size_t> AsyncIO::write(Platform::FileHandle file, uint64_t offset, std::span<const uint8_t> buffer)
+    {
+        if (buffer.size() > UINT32_MAX) {
+            throw std::invalid_argument("Asynchronous request larger than 4 GB: " + std::to_string(buffer.size()));
+        }
+
+        auto promise = std::make_shared<std::promise<size_t>>();
+        std::future<size_t> result = promise->get_future();
+
+        IORequest request;
+        request.file = file;
+        request.offset = offset;
+        request.buffer = const_cast<uint8_t*>(buffer.data());
+        request.size = static_cast<uint32_t>(buffer.size());
+        request.write = true;
+        request.done = [promise](int64_t bytes) {
+            if (bytes < 0) promise->set_exception(std::make_exception_ptr(ioError(bytes)));
+            else promise->set_value(static_cast<size_t>(bytes));
+        };
+        submit({ &request, 1 });
+        return result;
+    }
+}
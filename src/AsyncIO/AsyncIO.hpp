@@ -0,0 +1,104 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <vector>
+#include "src/Platform/Platform.hpp"
+
+class ThreadPool;
+
+namespace SoraMem
+{
+    // Completion of one request: bytes transferred, or a negative error code (errno / GetLastError)
+    using IOCallback = std::function<void(int64_t result)>;
+
+    struct IORequest
+    {
+        Platform::FileHandle    file = Platform::InvalidFile;
+        uint64_t                offset = 0;
+        void*                   buffer = nullptr;
+        uint32_t                size = 0;
+        bool                    write = false;
+        int                     fixedBuffer = -1;   // index from registerBuffers, -1 = not registered
+        // Runs on the completion thread, must not throw. It may submit more requests: while every slot is
+        // taken those run blocking and their callbacks follow once this one returns.
+        IOCallback              done;
+    };
+
+    // File reads and writes that bypass the mapping: io_uring on Linux, overlapped I/O on a completion port
+    // on Windows, blocking pread/pwrite on the thread pool where neither is available. Both go through the
+    // page cache, so they stay coherent with mapped views.
+    class AsyncIO
+    {
+    public:
+        explicit AsyncIO(ThreadPool* pool = nullptr, unsigned queueDepth = 256);
+        ~AsyncIO();     // waits for every request in flight
+
+        AsyncIO(AsyncIO const&) = delete;
+        void operator=(AsyncIO const&) = delete;
+
+        // One submission for the whole batch, callbacks are moved out of the requests. Never throws: every
+        // callback runs exactly once, requests the backend refuses run blocking and a stopped AsyncIO cancels.
+        void                submit(std::span<IORequest> requests) noexcept;
+
+        // The future throws std::runtime_error if the request fails
+        std::future<size_t> read(Platform::FileHandle file, uint64_t offset, std::span<uint8_t> buffer);
+        std::future<size_t> write(Platform::FileHandle file, uint64_t offset, std::span<const uint8_t> buffer);
+
+        // Pins buffers once so fixed requests skip the per-request page lookup, replaces earlier registrations.
+        // False where the backend has no registered buffers (requests then run as plain ones).
+        bool                registerBuffers(std::span<const std::span<uint8_t>> buffers);
+
+        const char*         backendName() const noexcept;
+        // Requests that ran blocking although the native backend is up
+        uint64_t            getBlockingFallbacks() const noexcept { return blockingFallbacks.load(std::memory_order_relaxed); }
+        unsigned            getQueueDepth() const noexcept { return queueDepth; }
+
+    private:
+        struct Pending;
+
+        bool                setupRing();
+        void                completionLoop();
+        void                finish(IOCallback& done, int64_t result);
+        static int64_t      runBlocking(const IORequest& request);
+
+        ThreadPool*             pool = nullptr;
+        unsigned                queueDepth = 0;
+        bool                    fixedBuffers = false;
+
+        std::mutex              mutex;                  // submission side and the in-flight count
+        std::condition_variable slotFree;
+        unsigned                inFlight = 0;
+        std::atomic<bool>       stopping{ false };
+        std::atomic<uint64_t>   blockingFallbacks{ 0 };
+        std::thread             completionThread;
+
+#if defined(__linux__)
+        int                     ringFd = -1;
+        void*                   sqRing = nullptr;
+        void*                   cqRing = nullptr;
+        size_t                  sqRingSize = 0;
+        size_t                  cqRingSize = 0;
+        void*                   sqes = nullptr;
+        size_t                  sqesSize = 0;
+
+        unsigned*               sqHead = nullptr;      // ring indices are shared with the kernel, accessed through atomic_ref
+        unsigned*               sqTail = nullptr;
+        unsigned*               sqArray = nullptr;
+        unsigned                sqMask = 0;
+        unsigned*               cqHead = nullptr;
+        unsigned*               cqTail = nullptr;
+        unsigned                cqMask = 0;
+        void*                   cqes = nullptr;
+#elif defined(_WIN32)
+        HANDLE                  port = NULL;
+#endif
+    };
+}
@@ -0,0 +1,1074 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "CRC32_64/CRC32_64.hpp"
+#include "CRCTree/CRCTree.hpp"
+#include "MemCopy/MemCopy.hpp"
+#include "MMFile/MMFile.hpp"
+#include "MemoryManager/MemoryManager.hpp"
+#include "Platform/Platform.hpp"
+#include "SnapshotStore/SnapshotStore.hpp"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Throughput benchmarks, run all suites or only the ones named on the command line:
+//   SoraMemBenchmark [crc] [combine] [crcinit] [checksum] [pool] [views] [viewtable] [tmpfiles] [governor] [copy] [memcopy] [numa] [filecopy] [fork] [snapshot] [crctree] [pmnt] [append] [hugepages] [prefetch] [asyncio] [coroutines] ...
+
+auto& print = std::cout;
+
+namespace
+{
+	// Best-of-N wall time in seconds
+	double measure(const std::function<void()>& fn, int repeats = 5)
+	{
+		double best = 1e30;
+		for (int i = 0; i < repeats; ++i) {
+			auto start = std::chrono::steady_clock::now();
+			fn();
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+			best = (std::min)(best, elapsed.count());
+		}
+		return best;
+	}
+
+	void report(const std::string& label, double bytes, double seconds)
+	{
+		print << std::setw(32) << std::left << label << std::fixed << std::setprecision(2)
+			<< bytes / seconds / 1e9 << " GB/s\n";
+	}
+
+	void benchCRC()
+	{
+		print << "--- CRC kernels ---\n";
+		std::vector<uint8_t> buffer(256ull << 20);
+		for (size_t i = 0; i < buffer.size(); ++i) buffer[i] = static_cast<uint8_t>(i * 131 + (i >> 13));
+
+		const CRC32_64::Kernel kernels[] = { CRC32_64::Kernel::Bytewise, CRC32_64::Kernel::Slice8, CRC32_64::Kernel::Slice16,
+			CRC32_64::Kernel::PCLMUL, CRC32_64::Kernel::VPCLMUL };
+		const CRC32_64::Kernel best = CRC32_64::getKernel();
+
+		for (CRC32_64::Kernel kernel : kernels) {
+			if (!CRC32_64::isKernelSupported(kernel)) {
+				print << std::setw(32) << std::left << CRC32_64::kernelName(kernel) << "not supported\n";
+				continue;
+			}
+			CRC32_64::setKernel(kernel);
+
+			// The bytewise loop is slow enough that a slice of the buffer gives a stable figure
+			const size_t size = (kernel == CRC32_64::Kernel::Bytewise) ? buffer.size() / 8 : buffer.size();
+			CRC32_64 crc;
+			double t32 = measure([&]() { crc.reset32(); crc.appendCRC32(buffer.data(), size); });
+			double t64 = measure([&]() { crc.reset64(); crc.appendCRC64(buffer.data(), size); });
+			report(std::string(CRC32_64::kernelName(kernel)) + " CRC32", static_cast<double>(size), t32);
+			report(std::string(CRC32_64::kernelName(kernel)) + " CRC64", static_cast<double>(size), t64);
+		}
+		CRC32_64::setKernel(best);
+	}
+
+	void benchCombine()
+	{
+		print << "--- CRC combine ---\n";
+		const int combines = 1 << 20;
+		const size_t granularity = 65536;
+		volatile uint64_t sink = 0;
+
+		double tFull = measure([&]() {
+			uint64_t crc = 0;
+			for (int i = 0; i < combines; ++i) crc = CRC32_64::combineCRC64(crc, static_cast<uint64_t>(i), granularity);
+			sink = crc;
+		}, 3);
+		const uint64_t shift = CRC32_64::combineGen64(granularity);
+		double tCached = measure([&]() {
+			uint64_t crc = 0;
+			for (int i = 0; i < combines; ++i) crc = CRC32_64::combineOp64(crc, static_cast<uint64_t>(i), shift);
+			sink = crc;
+		}, 3);
+
+		print << std::setw(32) << std::left << "combineCRC64 (64 KB)" << std::fixed << std::setprecision(1) << tFull / combines * 1e9 << " ns/op\n";
+		print << std::setw(32) << std::left << "combineOp64 (cached shift)" << tCached / combines * 1e9 << " ns/op\n";
+	}
+
+	void benchCRCInit()
+	{
+		using namespace SoraMem;
+		print << "--- CRC table setup (CRC-32C, CRC-64/GO-ISO) ---\n";
+		const char* path = "temp/bench.conf.soramem";
+		std::remove(path);
+
+		// Alternating with the defaults, so every init computes the tables again
+		double tInit = measure([&]() { CRC32_64::init(0x1EDC6F41, 0x1B); CRC32_64::init(); }, 5);
+		MemMng.loadConfig(path, 0x1EDC6F41, 0x1B);	// written once
+		double tLoad = measure([&]() { MemMng.loadConfig(path, 0x1EDC6F41, 0x1B); }, 5);
+		MemMng.releaseConfig();
+
+		print << std::setw(32) << std::left << "computed at startup" << std::fixed << std::setprecision(1) << tInit * 1e6 << " us\n";
+		print << std::setw(32) << std::left << "mapped from .conf.soramem" << tLoad * 1e6 << " us\n";
+	}
+
+	void benchChecksum()
+	{
+		using namespace SoraMem;
+		print << "--- MMFile checksum ---\n";
+		const size_t size = 512ull << 20;
+
+		MMFile* file = nullptr;
+		MemMng.createTmp(file, size);
+		{
+			MemView& view = file->load(0, size);
+			for (size_t i = 0; i < size / 8; ++i) view.at<uint64_t>(i) = i * 0x9E3779B97F4A7C15ull;
+			file->unload(view);
+		}
+
+		double tSeparate = measure([&]() { MemMng.calcCRC32(file); MemMng.calcCRC64(file); }, 3);
+		report("calcCRC32 + calcCRC64", static_cast<double>(size), tSeparate);
+
+		for (size_t window : { size_t(8) << 20, size_t(16) << 20, size_t(64) << 20 }) {
+			MemMng.setChecksumWindow(window);
+			double t = measure([&]() { MemMng.calcCRC(file); }, 3);
+			report("calcCRC, " + std::to_string(window >> 20) + " MB windows", static_cast<double>(size), t);
+		}
+		MemMng.setChecksumWindow(16 * 1024 * 1024);
+		MemMng.free(file);
+	}
+
+	void benchViews()
+	{
+		using namespace SoraMem;
+		print << "--- MMFile view cache ---\n";
+		const size_t size = 64ull << 20;
+		const int loads = 1 << 18;
+
+		MMFile* file = nullptr;
+		MemMng.createTmp(file, size);
+
+		// Random 4 KB reads, with a zero budget every unload unmaps like the uncached loader did
+		auto randomLoads = [&]() {
+			uint64_t seed = 0x2545F4914F6CDD1Dull, sum = 0;
+			for (int i = 0; i < loads; ++i) {
+				seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+				MemView& view = file->load((seed % (size / 4096)) * 4096, 4096);
+				sum += view.at<uint64_t>(0);
+				file->unload(view);
+			}
+			return sum;
+		};
+
+		const size_t granularity = MemMng.getSysGranularity();
+		MemMng.setViewCache(0, granularity);
+		double tUncached = measure([&]() { randomLoads(); }, 3);
+		MemMng.setViewCache(256ull << 20, 1 << 20);
+		double tCached = measure([&]() { randomLoads(); }, 3);
+
+		print << std::setw(32) << std::left << "load/unload, no cache" << std::fixed << std::setprecision(1) << tUncached / loads * 1e9 << " ns/op\n";
+		print << std::setw(32) << std::left << "load/unload, 1 MB windows" << tCached / loads * 1e9 << " ns/op\n";
+		MemMng.free(file);
+	}
+
+	void benchViewTable()
+	{
+		using namespace SoraMem;
+		print << "--- MMFile view table, threads sharing one file ---\n";
+		const size_t size = 64ull << 20;
+		const int loads = 1 << 17;
+
+		MMFile* file = nullptr;
+		MemMng.createTmp(file, size);
+		MemMng.setViewCache(256ull << 20, 1 << 20);
+		for (size_t offset = 0; offset < size; offset += 1 << 20) file->unload_s(file->load_s(offset, 8));	// every window cached
+
+		// Each thread loads and unloads its own random 4 KB ranges, all landing in cached windows
+		auto run = [&](unsigned threads) {
+			std::vector<std::thread> workers;
+			std::atomic<uint64_t> sink{ 0 };
+			for (unsigned t = 0; t < threads; ++t) {
+				workers.emplace_back([&, t]() {
+					uint64_t seed = 0x2545F4914F6CDD1Dull + t, sum = 0;
+					for (int i = 0; i < loads; ++i) {
+						seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+						MemView& view = file->load_s((seed % (size / 4096)) * 4096, 4096);
+						sum += view.at<uint64_t>(0);
+						file->unload_s(view);
+					}
+					sink.fetch_add(sum, std::memory_order_relaxed);
+				});
+			}
+			for (auto& worker : workers) worker.join();
+		};
+
+		for (unsigned threads = 1; threads <= 8; threads *= 2) {
+			double t = measure([&]() { run(threads); }, 3);
+			print << std::setw(32) << std::left << ("load_s/unload_s, " + std::to_string(threads) + " threads") << std::fixed << std::setprecision(2)
+				<< threads * static_cast<double>(loads) / t / 1e6 << " M ops/s\n";
+		}
+		MemMng.free(file);
+	}
+
+	void benchGovernor()
+	{
+		using namespace SoraMem;
+		print << "--- Memory governor, bursts of held views ---\n";
+		const size_t window = MemMng.getViewWindowSize();
+		const size_t size = 512ull << 20;
+		const int bursts = 64, held = 48;
+
+		MMFile* file = nullptr;
+		MemMng.createTmp(file, size);
+		const Platform::MemoryStatus status = Platform::getMemoryStatus();
+		print << std::setw(32) << std::left << "memory limit / available" << (status.limit >> 20) << " / " << (status.available >> 20) << " MB\n";
+
+		// Each burst holds a few dozen random windows and lets them go, the cache keeps what it may
+		auto run = [&](size_t& peak) {
+			uint64_t seed = 0x9E3779B97F4A7C15ull;
+			std::vector<MemView*> views;
+			peak = 0;
+			for (int burst = 0; burst < bursts; ++burst) {
+				for (int i = 0; i < held; ++i) {
+					seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+					views.push_back(&file->load_s((seed % (size / window)) * window, 4096));
+					peak = (std::max)(peak, static_cast<size_t>(MemMng.getUsedMemory().load()));
+				}
+				for (MemView* view : views) file->unload_s(*view);
+				views.clear();
+			}
+		};
+
+		size_t peakFree = 0, peakGoverned = 0;
+		double tFree = measure([&]() { run(peakFree); }, 3);
+		file->unloadAll_s();
+
+		GovernorConfig config;
+		config.softBudget = MemMng.getUsedMemory().load() + 64 * window;
+		config.hardBudget = config.softBudget + 64 * window;
+		MemMng.getGovernor().start(config);
+		double tGoverned = measure([&]() { run(peakGoverned); }, 3);
+		MemMng.getGovernor().stop();
+
+		const double loads = static_cast<double>(bursts) * held;
+		print << std::setw(32) << std::left << "no governor" << std::fixed << std::setprecision(1) << tFree / loads * 1e9 << " ns/load, peak "
+			<< (peakFree >> 20) << " MB mapped\n";
+		print << std::setw(32) << std::left << "soft 64 MB, hard 128 MB" << tGoverned / loads * 1e9 << " ns/load, peak "
+			<< (peakGoverned >> 20) << " MB mapped\n";
+		MemMng.free(file);
+	}
+
+	void benchTmpFiles()
+	{
+		using namespace SoraMem;
+		print << "--- createTmp ---\n";
+		const size_t size = 1 << 20;
+		const int files = 64;
+		std::vector<MMFile*> created(files);
+
+		// Only createTmp is timed, the frees and the warm refill happen outside the measurement
+		auto timeCreates = [&](bool warm) {
+			double best = 1e30;
+			for (int repeat = 0; repeat < 5; ++repeat) {
+				if (warm) while (MemMng.getWarmFiles() < files) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				auto start = std::chrono::steady_clock::now();
+				for (MMFile*& file : created) MemMng.createTmp(file, size);
+				std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+				best = (std::min)(best, elapsed.count());
+				for (MMFile* file : created) MemMng.free(file);
+			}
+			return best;
+		};
+
+		double tCold = timeCreates(false);
+		MemMng.setWarmFiles(files, size);
+		double tWarm = timeCreates(true);
+		MemMng.setWarmFiles(0, 0);
+
+		print << std::setw(32) << std::left << "createTmp 1 MB, cold" << std::fixed << std::setprecision(1) << tCold / files * 1e6 << " us/op\n";
+		print << std::setw(32) << std::left << "createTmp 1 MB, warm pool" << tWarm / files * 1e6 << " us/op\n";
+	}
+
+	void benchCopy()
+	{
+		using namespace SoraMem;
+		print << "--- Copy kernels, 4 KB to 4 GB ---\n";
+
+		// Source and destination both have to fit in memory next to everything else
+		const size_t largest = size_t(4) << 30;
+		size_t capacity = largest;
+		while (capacity > 4096 && 2 * capacity > Platform::getAvailableMemory() / 10 * 8) capacity /= 4;
+
+		std::vector<uint8_t> src(capacity + 64), dst(capacity + 64);
+		for (size_t i = 0; i < src.size(); i += 4096) src[i] = static_cast<uint8_t>(i >> 12);
+
+		const MemCopy::Kernel kernels[] = { MemCopy::Kernel::Memcpy, MemCopy::Kernel::RepMovsb, MemCopy::Kernel::AVX2,
+			MemCopy::Kernel::AVX2Stream, MemCopy::Kernel::AVX512Stream };
+
+		for (size_t size = 4096; size <= largest; size *= 4) {
+			const std::string label = (size < (1 << 20)) ? std::to_string(size >> 10) + " KB" :
+				(size < (size_t(1) << 30)) ? std::to_string(size >> 20) + " MB" : std::to_string(size >> 30) + " GB";
+			if (size > capacity) {
+				print << std::setw(32) << std::left << label << "skipped, not enough memory\n";
+				continue;
+			}
+
+			// Small sizes loop over the same buffers so every run moves at least 256 MB
+			const size_t rounds = (std::max)(size_t(1), (size_t(256) << 20) / size);
+			for (MemCopy::Kernel kernel : kernels) {
+				if (!MemCopy::isKernelSupported(kernel)) continue;
+				double t = measure([&]() {
+					for (size_t r = 0; r < rounds; ++r) MemCopy::copy(dst.data() + 1, src.data(), size, kernel);
+				}, 3);
+				report(label + ", " + MemCopy::kernelName(kernel), static_cast<double>(size) * rounds, t);
+			}
+			print << std::setw(32) << std::left << label + ", selected" << MemCopy::kernelName(MemCopy::bestKernel(size)) << "\n";
+		}
+	}
+
+	void benchMemcopy()
+	{
+		using namespace SoraMem;
+		print << "--- MemoryManager::memcopy ---\n";
+		print << std::setw(32) << std::left << "calibrated core bandwidth" << std::fixed << std::setprecision(2)
+			<< MemMng.getCopyBandwidth() / 1e9 << " GB/s\n";
+
+		const size_t largest = 256ull << 20;
+		std::vector<uint8_t> src(largest);
+		for (size_t i = 0; i < src.size(); i += 4096) src[i] = static_cast<uint8_t>(i >> 12);
+
+		MMFile* file = nullptr;
+		MemMng.createTmp(file, largest);
+		for (size_t size = 64 * 1024; size <= largest; size *= 16) {
+			const CopyPlan plan = MemMng.planCopy(size);
+			const size_t rounds = (std::max)(size_t(1), (size_t(256) << 20) / size);
+			double t = measure([&]() {
+				for (size_t r = 0; r < rounds; ++r) MemMng.memcopy(file, src.data(), size);
+			}, 3);
+			report(std::to_string(size >> 10) + " KB, " + std::to_string(plan.tasks) + " task(s)", static_cast<double>(size) * rounds, t);
+		}
+		MemMng.free(file);
+	}
+
+	void benchNuma()
+	{
+		using namespace SoraMem;
+		print << "--- NUMA routed memcopy and CRC, 256 MB ---\n";
+		const size_t size = 256ull << 20;
+		const size_t threads = MemMng.getThreadPool()->getThreadCount();
+
+		// A single node box gets two made up nodes over the same CPUs, which shows the routing cost only
+		Platform::NumaTopology topology = Platform::getNumaTopology();
+		print << std::setw(32) << std::left << "nodes" << topology.size() << (topology.size() < 2 ? ", faking 2" : "") << "\n";
+		if (topology.size() < 2) topology = { topology[0], topology[0] };
+
+		std::vector<uint8_t> src(size);
+		for (size_t i = 0; i < src.size(); i += 4096) src[i] = static_cast<uint8_t>(i >> 12);
+		MMFile* file = nullptr;
+		MemMng.createTmp(file, size);
+
+		auto run = [&](const std::string& label) {
+			MemMng.resetNumaStats();
+			report(label + ", memcopy", static_cast<double>(size), measure([&]() { MemMng.memcopy(file, src.data(), size); }, 3));
+			report(label + ", CRC32+64", static_cast<double>(size), measure([&]() { MemMng.calcCRC(file); }, 3));
+			const NumaStats stats = MemMng.getNumaStats();
+			if (stats.localChunks + stats.remoteChunks > 0) {
+				print << std::setw(32) << std::left << label + ", local chunks" << std::setprecision(1)
+					<< 100.0 * stats.localChunks / (stats.localChunks + stats.remoteChunks) << " % of "
+					<< stats.localChunks + stats.remoteChunks << "\n";
+			}
+		};
+
+		run("plain pool");
+		std::unique_ptr<ThreadPool> numaPool = std::make_unique<ThreadPool>(threads, topology);
+		MemMng.setThreadPool(numaPool);
+		run("NUMA pool");
+
+		std::unique_ptr<ThreadPool> plainPool = std::make_unique<ThreadPool>(threads);
+		MemMng.setThreadPool(plainPool);
+		MemMng.free(file);
+	}
+
+	void benchFileCopy()
+	{
+		using namespace SoraMem;
+		print << "--- MMFile to MMFile copy ---\n";
+		const size_t size = 256ull << 20;
+
+		MMFile* src = nullptr;
+		MMFile* dst = nullptr;
+		MemMng.createTmp(src, size);
+		MemMng.createTmp(dst, size);
+		{
+			MemView& view = src->load(0, size);
+			for (size_t i = 0; i < size / 8; ++i) view.at<uint64_t>(i) = i;
+			src->unload(view);
+		}
+
+		const bool kernelCopy = Platform::copyFileRange(src->getFileHandle(), 0, dst->getFileHandle(), 0, 4096);
+		print << std::setw(32) << std::left << "kernel copy available" << (kernelCopy ? "yes" : "no") << "\n";
+
+		for (bool kernel : { true, false }) {
+			MemMng.setKernelFileCopy(kernel);
+			double t = measure([&]() { MemMng.memcopy(dst, 0, src, 0, size); }, 3);
+			report(kernel ? "copy_file_range" : "views", static_cast<double>(size), t);
+		}
+		MemMng.setKernelFileCopy(true);
+
+		// What the overload did before: copy the whole file by path (into a scratch file, dst stays mapped)
+		const std::string from = Platform::getFilePath(src->getFileHandle());
+		const std::string scratch = from + ".copy";
+		double tPath = measure([&]() { Platform::copyFile(from, scratch); }, 3);
+		std::remove(scratch.c_str());
+		report("copy by path", static_cast<double>(size), tPath);
+
+		MemMng.free(src);
+		MemMng.free(dst);
+	}
+
+	void benchFork()
+	{
+		using namespace SoraMem;
+		print << "--- What-if copies of a 256 MB base, 1 % of pages written ---\n";
+		const size_t size = 256ull << 20;
+		const size_t page = MemMng.getSysGranularity();
+
+		MMFile* base = nullptr;
+		MemMng.createTmp(base, size);
+		{
+			MemView& view = base->load(0, size);
+			for (size_t i = 0; i < size / 8; ++i) view.at<uint64_t>(i) = i;
+			base->unload(view);
+		}
+
+		// Each job gets its copy and touches every hundredth page, the copy is freed afterwards
+		auto job = [&](MMFile* copy) {
+			MemView& view = copy->load_s(0, size);
+			for (size_t offset = 0; offset < size; offset += 100 * page) view.at<uint64_t>(offset / 8) += 1;
+			copy->unload_s(view);
+			MemMng.free(copy);
+		};
+
+		double tCopy = measure([&]() {
+			MMFile* copy = nullptr;
+			MemMng.createTmp(copy, size);
+			MemMng.memcopy(copy, 0, base, 0, size);
+			job(copy);
+		}, 3);
+		double tFork = measure([&]() { job(MemMng.fork(base)); }, 3);
+
+		print << std::setw(32) << std::left << "createTmp + memcopy" << std::fixed << std::setprecision(2) << tCopy * 1e3 << " ms/job\n";
+		print << std::setw(32) << std::left << "fork" << tFork * 1e3 << " ms/job\n";
+		MemMng.free(base);
+	}
+
+	void benchSnapshot()
+	{
+		using namespace SoraMem;
+		print << "--- Snapshots of a 256 MB file, 1 % of 64 KB granules written between them ---\n";
+		const size_t size = 256ull << 20;
+		const size_t granule = 64 * 1024;
+		std::remove("temp/bench.sl.soramem");
+		std::remove("temp/bench.si.soramem");
+
+		MMFile* file = nullptr;
+		MemMng.createTmp(file, size);
+		{
+			MemView& view = file->load(0, size);
+			for (size_t i = 0; i < size / 8; ++i) view.at<uint64_t>(i) = i;
+			file->unload(view);
+		}
+
+		{
+			SnapshotStore store(MemMng, file, "temp/bench", 8, granule);
+			double tFull = measure([&]() { store.snapshot(); }, 1);
+			uint64_t round = 0;
+			double tDelta = measure([&]() {
+				++round;
+				for (size_t offset = (round % 100) * granule; offset < size; offset += 100 * granule) {
+					MemView& view = file->load_s(offset, 8);
+					view.at<uint64_t>(0) += round;
+					file->unload_s(view);
+				}
+				store.snapshot();
+			}, 10);
+			const uint64_t written = store.getLastWritten();
+			double tRestore = measure([&]() { store.restore(store.getCurrentID()); }, 3);
+
+			print << std::setw(32) << std::left << "full snapshot" << std::fixed << std::setprecision(2) << tFull * 1e3 << " ms\n";
+			print << std::setw(32) << std::left << "incremental snapshot" << tDelta * 1e3 << " ms, " << written / 1024 << " KB written\n";
+			print << std::setw(32) << std::left << "restore newest" << tRestore * 1e3 << " ms\n";
+		}
+		MemMng.free(file);
+		std::remove("temp/bench.sl.soramem");
+		std::remove("temp/bench.si.soramem");
+	}
+
+	void benchCRCTree()
+	{
+		using namespace SoraMem;
+		print << "--- CRC64 of a 256 MB file after 1 % of its blocks were written ---\n";
+		const size_t size = 256ull << 20;
+		const size_t gran = MemMng.getSysGranularity();
+
+		MMFile* file = nullptr;
+		MemMng.createTmp(file, size);
+		{
+			MemView& view = file->load(0, size);
+			for (size_t i = 0; i < size / 8; ++i) view.at<uint64_t>(i) = i;
+			file->unload(view);
+		}
+		MMFile* copy = nullptr;
+		MemMng.createTmp(copy, size);
+		MemMng.memcopy(copy, 0, file, 0, size);
+
+		CRCTree& tree = MemMng.getCRCTree(file);
+		double tBuild = measure([&]() { tree.update(); }, 1);
+		uint64_t round = 0;
+		auto touch = [&]() {
+			++round;
+			for (size_t offset = (round % 100) * gran; offset < size; offset += 100 * gran) {
+				MemView& view = file->load_s(offset, 8);
+				view.at<uint64_t>(0) += round;
+				file->unload_s(view);
+			}
+		};
+		double tFull = measure([&]() { touch(); MemMng.calcCRC64(file); }, 5);
+		double tTree = measure([&]() { touch(); tree.update(); }, 5);
+		MemMng.diff(file, copy);
+		size_t ranges = 0;
+		double tDiff = measure([&]() { touch(); ranges = MemMng.diff(file, copy).size(); }, 5);
+
+		print << std::setw(32) << std::left << "tree build" << std::fixed << std::setprecision(2) << tBuild * 1e3 << " ms\n";
+		print << std::setw(32) << std::left << "calcCRC64 (full pass)" << tFull * 1e3 << " ms\n";
+		print << std::setw(32) << std::left << "CRCTree::update" << tTree * 1e3 << " ms\n";
+		print << std::setw(32) << std::left << "diff against a copy" << tDiff * 1e3 << " ms, " << ranges << " ranges\n";
+		MemMng.free(copy);
+		MemMng.free(file);
+	}
+
+	void benchPmnt()
+	{
+		using namespace SoraMem;
+		print << "--- Restart with 256 MB of data: re-ingest into a temp file vs reopen a permanent one ---\n";
+		const size_t size = 256ull << 20;
+		std::vector<uint8_t> source(size);
+		for (size_t i = 0; i < size / 8; ++i) reinterpret_cast<uint64_t*>(source.data())[i] = i;
+
+		MemMng.setPmntDir("temp/");
+		std::remove("temp/bench.bin.soramem");
+		MMFile* file = nullptr;
+		MemMng.createPmnt(file, "bench", size);
+		MemMng.memcopy(file, source.data(), size);
+		double tSeal = measure([&]() { MemMng.sealPmnt(file); }, 1);
+		MemMng.free(file);
+
+		double tIngest = measure([&]() {
+			MMFile* tmp = nullptr;
+			MemMng.createTmp(tmp, size);
+			MemMng.memcopy(tmp, source.data(), size);
+			MemMng.free(tmp);
+			}, 3);
+		double tOpen = measure([&]() {
+			MemMng.createPmnt(file, "bench", size, PmntCheck::None);
+			MemMng.free(file);
+			}, 3);
+		double tVerified = measure([&]() {
+			MemMng.createPmnt(file, "bench", size, PmntCheck::Now);
+			MemMng.free(file);
+			}, 3);
+
+		print << std::setw(32) << std::left << "first seal" << std::fixed << std::setprecision(2) << tSeal * 1e3 << " ms\n";
+		print << std::setw(32) << std::left << "re-ingest (createTmp + copy)" << tIngest * 1e3 << " ms\n";
+		print << std::setw(32) << std::left << "reopen + close" << tOpen * 1e3 << " ms\n";
+		print << std::setw(32) << std::left << "reopen, CRC64 checked + close" << tVerified * 1e3 << " ms\n";
+		std::remove("temp/bench.bin.soramem");
+	}
+
+	void benchAppend()
+	{
+		using namespace SoraMem;
+		print << "--- MMFile append ---\n";
+		const size_t record = 4096;
+		const size_t total = 64ull << 20;
+		std::vector<uint8_t> payload(record, 0x5a);
+
+		MMFile* file = nullptr;
+		MemMng.createTmp(file, record);
+
+		// Every append grows the file by one record and writes it through a view
+		auto appendViews = [&]() {
+			file->resize(record);
+			for (size_t size = record; size < total; size += record) {
+				file->resize(size + record);
+				MemView& view = file->load(size, record);
+				std::memcpy(view.getPtr(), payload.data(), record);
+				file->unload(view);
+			}
+		};
+
+		double tResize = measure(appendViews, 3);
+		report("resize per append", static_cast<double>(total), tResize);
+
+		file->reserve(1ull << 30);
+		double tGrow = measure(appendViews, 3);
+		report("growable, views", static_cast<double>(total), tGrow);
+
+		double tData = measure([&]() {
+			file->resize(record);
+			for (size_t size = record; size < total; size += record) {
+				file->resize(size + record);
+				std::memcpy(static_cast<uint8_t*>(file->getData()) + size, payload.data(), record);
+			}
+		}, 3);
+		report("growable, getData", static_cast<double>(total), tData);
+
+		MemMng.free(file);
+	}
+
+	void benchPrefetch()
+	{
+		using namespace SoraMem;
+		print << "--- Prefetch / read-ahead ---\n";
+		const size_t size = 512ull << 20;
+		const size_t step = 1ull << 20;
+
+		MMFile* file = nullptr;
+		MemMng.createTmp(file, size);
+		{
+			MemView& view = file->load(0, size);
+			for (size_t i = 0; i < size / 8; ++i) view.at<uint64_t>(i) = i * 0x9E3779B97F4A7C15ull;
+			file->unload(view);
+		}
+
+		// Consumer that does some work per window, so there is time to overlap the reads with
+		std::atomic<uint64_t> sink{ 0 };
+		auto consume = [&]() {
+			for (size_t offset = 0; offset < size; offset += step) {
+				MemView& view = file->load_s(offset, step);
+				const uint64_t* data = static_cast<const uint64_t*>(view.getPtr());
+				uint64_t h = 0;
+				for (size_t i = 0; i < step / 8; ++i) h = (h ^ data[i]) * 0x100000001B3ull;
+				sink.fetch_add(h, std::memory_order_relaxed);
+				file->unload_s(view);
+			}
+		};
+
+		// Written back and dropped from the page cache before every pass, so each one reads from disk
+		auto coldPass = [&](size_t readAhead) {
+			file->setReadAhead(0);
+			file->unloadAll_s();
+			Platform::flushFile(file->getFileHandle());
+			const bool dropped = Platform::adviseFile(file->getFileHandle(), 0, size, Platform::Advice::DontNeed);
+			file->setReadAhead(readAhead);
+			auto start = std::chrono::steady_clock::now();
+			consume();
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+			return dropped ? elapsed.count() : -1.0;
+		};
+
+		for (size_t readAhead : { size_t(0), size_t(8) << 20, size_t(32) << 20 }) {
+			double best = 1e30;
+			for (int i = 0; i < 3; ++i) best = (std::min)(best, coldPass(readAhead));
+			if (best < 0) {
+				print << std::setw(32) << std::left << "cold cache" << "cannot drop the page cache here\n";
+				break;
+			}
+			report(readAhead == 0 ? "cold, no read-ahead" : "cold, read-ahead " + std::to_string(readAhead >> 20) + " MB", static_cast<double>(size), best);
+		}
+		file->setReadAhead(0);
+
+		MemMng.free(file);
+	}
+
+	void benchAsyncIO()
+	{
+		using namespace SoraMem;
+		print << "--- Async I/O ---\n";
+		const size_t size = 512ull << 20;
+		const size_t chunk = 1ull << 20;
+		const size_t depth = 16;
+		AsyncIO& io = MemMng.getAsyncIO();
+		print << std::setw(32) << std::left << "backend" << io.backendName() << "\n";
+
+		MMFile* file = nullptr;
+		MemMng.createTmp(file, size);
+		{
+			MemView& view = file->load(0, size);
+			for (size_t i = 0; i < size / 8; ++i) view.at<uint64_t>(i) = i * 0x9E3779B97F4A7C15ull;
+			file->unload(view);
+		}
+
+		std::atomic<uint64_t> sink{ 0 };
+		auto hash = [&](const uint8_t* p) {
+			const uint64_t* data = reinterpret_cast<const uint64_t*>(p);
+			uint64_t h = 0;
+			for (size_t i = 0; i < chunk / 8; ++i) h = (h ^ data[i]) * 0x100000001B3ull;
+			sink.fetch_add(h, std::memory_order_relaxed);
+		};
+
+		auto cold = [&](const std::function<void()>& pass) {
+			double best = 1e30;
+			for (int i = 0; i < 3; ++i) {
+				file->unloadAll();
+				Platform::flushFile(file->getFileHandle());
+				Platform::adviseFile(file->getFileHandle(), 0, size, Platform::Advice::DontNeed);
+				auto start = std::chrono::steady_clock::now();
+				pass();
+				std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+				best = (std::min)(best, elapsed.count());
+			}
+			return best;
+		};
+
+		report("views (page faults)", static_cast<double>(size), cold([&]() {
+			for (size_t offset = 0; offset < size; offset += chunk) {
+				MemView& view = file->load(offset, chunk);
+				hash(static_cast<const uint8_t*>(view.getPtr()));
+				file->unload(view);
+			}
+		}));
+
+		// depth reads in flight, each buffer is consumed then immediately reissued further ahead
+		std::vector<std::vector<uint8_t>> buffers(depth, std::vector<uint8_t>(chunk));
+		for (bool fixed : { false, true }) {
+			if (fixed) {
+				std::vector<std::span<uint8_t>> spans(buffers.begin(), buffers.end());
+				if (!io.registerBuffers(spans)) break;
+			}
+			double t = cold([&]() {
+				std::vector<std::future<size_t>> inFlight(depth);
+				std::vector<IORequest> batch(depth);
+				std::vector<std::promise<size_t>> promises(size / chunk);
+				for (size_t slot = 0; slot < depth; ++slot) {
+					batch[slot] = { file->getFileHandle(), slot * chunk, buffers[slot].data(), static_cast<uint32_t>(chunk), false, fixed ? int(slot) : -1,
+						[&promises, slot](int64_t bytes) { promises[slot].set_value(static_cast<size_t>(bytes)); } };
+					inFlight[slot] = promises[slot].get_future();
+				}
+				io.submit(batch);
+
+				for (size_t index = 0; index < size / chunk; ++index) {
+					const size_t slot = index % depth;
+					inFlight[slot].get();
+					hash(buffers[slot].data());
+
+					const size_t next = index + depth;
+					if (next < size / chunk) {
+						IORequest request{ file->getFileHandle(), next * chunk, buffers[slot].data(), static_cast<uint32_t>(chunk), false, fixed ? int(slot) : -1,
+							[&promises, next](int64_t bytes) { promises[next].set_value(static_cast<size_t>(bytes)); } };
+						inFlight[slot] = promises[next].get_future();
+						io.submit({ &request, 1 });
+					}
+				}
+			});
+			report(fixed ? "async, registered buffers" : "async read, depth " + std::to_string(depth), static_cast<double>(size), t);
+		}
+		io.registerBuffers({});
+
+		MemMng.free(file);
+	}
+
+	void benchCoroutines()
+	{
+		using namespace SoraMem;
+		print << "--- Coroutines ---\n";
+		const size_t size = 4ull << 20;
+		const int operations = 128;
+		std::vector<uint8_t> data(size, 0x5a);
+		std::atomic<uint64_t> sink{ 0 };
+
+		// One thread doing the operations back to back
+		double tBlocking = measure([&]() {
+			for (int i = 0; i < operations; ++i) {
+				MMFile* file = nullptr;
+				MemMng.memcopy(file, data.data(), size);
+				sink.fetch_add(MemMng.calcCRC64(file), std::memory_order_relaxed);
+				MemMng.free(file);
+			}
+		}, 3);
+		report("blocking, one thread", static_cast<double>(size) * operations, tBlocking);
+
+		// One thread starting every operation, each resumes on the pool when its step is done
+		double tAwait = measure([&]() {
+			std::atomic<int> done{ 0 };
+			auto operation = [&]() -> Detached {
+				MMFile* file = nullptr;
+				co_await MemMng.copyAsync(file, data.data(), size);
+				sink.fetch_add(co_await MemMng.crc64Async(file), std::memory_order_relaxed);
+				MemMng.free(file);
+				done.fetch_add(1, std::memory_order_release);
+			};
+			for (int i = 0; i < operations; ++i) operation();
+			while (done.load(std::memory_order_acquire) < operations) std::this_thread::yield();
+		}, 3);
+		report(std::to_string(operations) + " coroutines in flight", static_cast<double>(size) * operations, tAwait);
+	}
+
+	// dTLB load misses of the calling thread, unavailable without a PMU (VMs) or perf_event permission
+	class TlbCounter
+	{
+	public:
+		TlbCounter()
+		{
+#ifdef __linux__
+			perf_event_attr attr{};
+			attr.size = sizeof(attr);
+			attr.type = PERF_TYPE_HW_CACHE;
+			attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+			attr.disabled = 1;
+			attr.exclude_kernel = 1;
+			fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+		}
+		~TlbCounter()
+		{
+#ifdef __linux__
+			if (fd >= 0) close(fd);
+#endif
+		}
+
+		bool available() const { return fd >= 0; }
+
+		// Runs fn once and returns the misses it caused
+		long long count(const std::function<void()>& fn)
+		{
+#ifdef __linux__
+			if (fd >= 0) {
+				ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+				ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+				fn();
+				ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+				long long misses = 0;
+				return (read(fd, &misses, sizeof(misses)) == sizeof(misses)) ? misses : -1;
+			}
+#endif
+			fn();
+			return -1;
+		}
+
+	private:
+		int fd = -1;
+	};
+
+	void benchHugePages()
+	{
+		using namespace SoraMem;
+		print << "--- Huge pages ---\n";
+		const size_t size = 256ull << 20;
+		const size_t reads = 1ull << 24;
+		print << std::setw(32) << std::left << "huge page size" << MemMng.getHugePageSize() / 1024 << " KB\n";
+
+		TlbCounter tlb;
+		std::atomic<uint64_t> sink{ 0 };
+
+		for (bool huge : { false, true }) {
+			MMFile* file = nullptr;
+			MemMng.createTmp(file, size, huge);
+			const std::string name = !huge ? "4 KB pages" : (file->getSysPageSize() > MemMng.getSysGranularity() ? "hugetlbfs" : "THP advised");
+
+			MemView& view = file->load(0, size);
+			uint64_t* data = static_cast<uint64_t*>(view.getPtr());
+			const size_t words = size / sizeof(uint64_t);
+			for (size_t i = 0; i < words; ++i) data[i] = i;
+
+			auto sequential = [&]() {
+				uint64_t sum = 0;
+				for (size_t i = 0; i < words; ++i) sum += data[i];
+				sink.fetch_add(sum, std::memory_order_relaxed);
+			};
+			auto random = [&]() {
+				uint64_t sum = 0, x = 88172645463325252ull;
+				for (size_t i = 0; i < reads; ++i) {
+					x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+					sum += data[x % words];
+				}
+				sink.fetch_add(sum, std::memory_order_relaxed);
+			};
+
+			report(name + " sequential", static_cast<double>(size), measure(sequential, 3));
+			double tRandom = measure(random, 3);
+			print << std::setw(32) << std::left << (name + " random") << std::fixed << std::setprecision(2)
+				<< reads / tRandom / 1e6 << " M reads/s\n";
+
+			if (tlb.available()) {
+				print << std::setw(32) << std::left << (name + " dTLB misses") << "seq " << tlb.count(sequential)
+					<< ", random " << tlb.count(random) << "\n";
+			}
+
+			file->unload(view);
+			MemMng.free(file);
+		}
+		if (!tlb.available()) print << std::setw(32) << std::left << "dTLB misses" << "no PMU access\n";
+	}
+
+	// The previous ThreadPool (one mutex-guarded std::function queue), kept as the baseline for the pool suite
+	class LegacyThreadPool
+	{
+	public:
+		explicit LegacyThreadPool(size_t threadCount) : stop(false)
+		{
+			for (size_t i = 0; i < threadCount; ++i) {
+				workers.emplace_back([this]() { workerLoop(); });
+			}
+		}
+
+		~LegacyThreadPool()
+		{
+			{
+				std::lock_guard<std::mutex> lock(queueMutex);
+				stop = true;
+			}
+			condition.notify_all();
+			for (std::thread& worker : workers) worker.join();
+		}
+
+		template<typename F>
+		auto submit(F&& f) -> std::future<std::invoke_result_t<F>>
+		{
+			using return_type = std::invoke_result_t<F>;
+			auto task = std::make_shared<std::packaged_task<return_type()>>(std::forward<F>(f));
+			std::future<return_type> res = task->get_future();
+			{
+				std::lock_guard<std::mutex> lock(queueMutex);
+				tasks.emplace([task]() { (*task)(); });
+			}
+			condition.notify_one();
+			return res;
+		}
+
+	private:
+		std::vector<std::thread> workers;
+		std::queue<std::function<void()>> tasks;
+		std::mutex queueMutex;
+		std::condition_variable condition;
+		bool stop;
+
+		void workerLoop()
+		{
+			for (;;) {
+				std::function<void()> task;
+				{
+					std::unique_lock<std::mutex> lock(queueMutex);
+					condition.wait(lock, [this]() { return stop || !tasks.empty(); });
+					if (stop && tasks.empty()) return;
+					task = std::move(tasks.front());
+					tasks.pop();
+				}
+				task();
+			}
+		}
+	};
+
+	void reportRate(const std::string& label, double tasks, double seconds)
+	{
+		print << std::setw(32) << std::left << label << std::fixed << std::setprecision(2)
+			<< tasks / seconds / 1e6 << " M tasks/s\n";
+	}
+
+	void benchPool()
+	{
+		print << "--- ThreadPool ---\n";
+		const size_t threads = (std::max)(2u, std::thread::hardware_concurrency());
+		const int tasks = 1 << 18;
+		std::atomic<uint64_t> sink{ 0 };
+		std::vector<std::future<void>> futures;
+		futures.reserve(tasks);
+
+		{
+			LegacyThreadPool legacy(threads);
+			double t = measure([&]() {
+				futures.clear();
+				for (int i = 0; i < tasks; ++i) futures.emplace_back(legacy.submit([&sink, i]() { sink.fetch_add(i, std::memory_order_relaxed); }));
+				for (auto& f : futures) f.get();
+			}, 3);
+			reportRate("legacy submit + future", tasks, t);
+		}
+
+		ThreadPool pool(threads);
+		double tSubmit = measure([&]() {
+			futures.clear();
+			for (int i = 0; i < tasks; ++i) futures.emplace_back(pool.submit([&sink, i]() { sink.fetch_add(i, std::memory_order_relaxed); }));
+			for (auto& f : futures) f.get();
+		}, 3);
+		reportRate("submit + future", tasks, tSubmit);
+
+		std::atomic<int> pending{ 0 };
+		auto waitPending = [&]() { while (pending.load(std::memory_order_acquire) != 0) std::this_thread::yield(); };
+
+		double tPost = measure([&]() {
+			pending.store(tasks, std::memory_order_relaxed);
+			for (int i = 0; i < tasks; ++i) pool.post([&sink, &pending, i]() { sink.fetch_add(i, std::memory_order_relaxed); pending.fetch_sub(1, std::memory_order_release); });
+			waitPending();
+		}, 3);
+		reportRate("post", tasks, tPost);
+
+		// Tasks spawned from inside the pool land on the worker's own deque
+		const int fanOut = 256;
+		double tNested = measure([&]() {
+			pending.store(tasks, std::memory_order_relaxed);
+			for (int i = 0; i < tasks / fanOut; ++i) {
+				pool.post([&]() {
+					for (int j = 0; j < fanOut; ++j) pool.post([&sink, &pending, j]() { sink.fetch_add(j, std::memory_order_relaxed); pending.fetch_sub(1, std::memory_order_release); });
+				});
+			}
+			waitPending();
+		}, 3);
+		reportRate("post from workers", tasks, tNested);
+
+		// One latch for the whole range against one future per chunk
+		double tBulk = measure([&]() {
+			pool.parallel_for(0, tasks, 1, [&sink](size_t lo, size_t) { sink.fetch_add(lo, std::memory_order_relaxed); });
+		}, 3);
+		reportRate("parallel_for (grain 1)", tasks, tBulk);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	std::unique_ptr<ThreadPool> pool = std::make_unique<ThreadPool>((std::max)(2u, std::thread::hardware_concurrency()));
+	MemMng.initManager();
+	MemMng.setThreadPool(pool);
+	MemMng.setTmpDir("temp/");
+
+	const std::vector<std::pair<std::string, std::function<void()>>> suites = {
+		{ "crc", benchCRC },
+		{ "combine", benchCombine },
+		{ "crcinit", benchCRCInit },
+		{ "checksum", benchChecksum },
+		{ "pool", benchPool },
+		{ "views", benchViews },
+		{ "viewtable", benchViewTable },
+		{ "tmpfiles", benchTmpFiles },
+		{ "governor", benchGovernor },
+		{ "copy", benchCopy },
+		{ "memcopy", benchMemcopy },
+		{ "numa", benchNuma },
+		{ "filecopy", benchFileCopy },
+		{ "fork", benchFork },
+		{ "snapshot", benchSnapshot },
+		{ "crctree", benchCRCTree },
+		{ "pmnt", benchPmnt },
+		{ "append", benchAppend },
+		{ "hugepages", benchHugePages },
+		{ "prefetch", benchPrefetch },
+		{ "asyncio", benchAsyncIO },
+		{ "coroutines", benchCoroutines },
+	};
+
+	for (const auto& suite : suites) {
+		bool selected = argc < 2;
+		for (int i = 1; i < argc; ++i) selected = selected || suite.first == argv[i];
+		if (selected) suite.second();
+	}
+	return 0;
+}
@@ -1,111 +1,490 @@
 #include "CRC32_64.hpp"
+#include "src/Platform/Platform.hpp"
+#include "src/MMFile/SoraMemFileSpecification.hpp"
 
-using Matrix64 = std::array<uint64_t, 64>;
-using Matrix32 = std::array<uint32_t, 32>;
+#include <cstring>
+#include <immintrin.h>
+#include <stdexcept>
 
-std::array<uint32_t, 256> CRC32_64::table32;
-std::array<uint64_t, 256> CRC32_64::table64;
-std::array<Matrix64, 64> CRC32_64::crc64_shift_matrices;
-std::array<Matrix32, 32> CRC32_64::crc32_shift_matrices;
+#ifdef _MSC_VER
+#include <stdlib.h>
+#define SORAMEM_BSWAP64(x) _byteswap_uint64(x)
+#else
+#define SORAMEM_BSWAP64(x) __builtin_bswap64(x)
+#endif
 
-uint32_t CRC32_64::poly32 = 0;
-uint64_t CRC32_64::poly64 = 0;
+// Constant initialised, so the default polynomials need no table generation at startup
+constexpr CRC32_64::Tables<uint32_t> CRC32_64::defaultTables32 = [] {
+	Tables<uint32_t> tables;
+	calcTables(tables, reflect32(defaultPoly32));
+	return tables;
+}();
+constexpr CRC32_64::Tables<uint64_t> CRC32_64::defaultTables64 = [] {
+	Tables<uint64_t> tables;
+	calcTables(tables, reflect64(defaultPoly64));
+	return tables;
+}();
+std::shared_ptr<const CRC32_64::Tables<uint32_t>> CRC32_64::customTables32;
+std::shared_ptr<const CRC32_64::Tables<uint64_t>> CRC32_64::customTables64;
 
-uint32_t CRC32_64::appendCRC32(const uint8_t* data, size_t len) {
-	for (size_t i = 0; i < len; ++i) {
-		const uint8_t& val = data[len - 1 - i];
-		crc32 = (crc32 >> 8) ^ table32[(crc32 ^ val) & 0xFF];
+const CRC32_64::SliceLUT<uint32_t>* CRC32_64::sliceTable32 = &defaultTables32.slice;
+const CRC32_64::SliceLUT<uint64_t>* CRC32_64::sliceTable64 = &defaultTables64.slice;
+const CRC32_64::FoldConstants* CRC32_64::fold32 = &defaultTables32.fold;
+const CRC32_64::FoldConstants* CRC32_64::fold64 = &defaultTables64.fold;
+const std::array<uint64_t, 64>* CRC32_64::crc64_powers = &defaultTables64.powers;
+const std::array<uint32_t, 64>* CRC32_64::crc32_powers = &defaultTables32.powers;
+uint64_t CRC32_64::crc64_unscale = defaultTables64.unscale;
+uint32_t CRC32_64::crc32_unscale = defaultTables32.unscale;
+
+uint32_t CRC32_64::poly32 = defaultTables32.poly;
+uint64_t CRC32_64::poly64 = defaultTables64.poly;
+
+// The checksum covers the buffer from its last byte to its first (data[len - 1 - i] is the i-th
+// byte of the stream). Every kernel below keeps that order so they stay interchangeable, the wide
+// ones walk the buffer downwards and byte-swap each word/lane into stream order.
+
+namespace
+{
+	template<typename T>
+	using SliceLUT = std::array<std::array<T, 256>, 16>;
+	using FoldConstants = std::array<std::array<uint64_t, 2>, 16>;
+
+	inline uint64_t loadStream64(const uint8_t* p)
+	{
+		// 8 stream bytes p[7], p[6], ..., p[0] as a little-endian word
+		uint64_t w;
+		std::memcpy(&w, p, sizeof(w));
+		return SORAMEM_BSWAP64(w);
+	}
+
+	template<typename T>
+	inline T sliceStep8(uint64_t w, const SliceLUT<T>& lut, int base)
+	{
+		return lut[base + 7][w & 0xFF] ^ lut[base + 6][(w >> 8) & 0xFF] ^
+			lut[base + 5][(w >> 16) & 0xFF] ^ lut[base + 4][(w >> 24) & 0xFF] ^
+			lut[base + 3][(w >> 32) & 0xFF] ^ lut[base + 2][(w >> 40) & 0xFF] ^
+			lut[base + 1][(w >> 48) & 0xFF] ^ lut[base][w >> 56];
+	}
+
+	SORAMEM_TARGET("ssse3")
+	inline __m128i reverseMask128()
+	{
+		return _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	}
+
+	// 16 stream bytes ending at p + 16, stream byte 0 in lane byte 0
+	SORAMEM_TARGET("ssse3")
+	inline __m128i loadStream128(const uint8_t* p)
+	{
+		return _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)), reverseMask128());
+	}
+
+	SORAMEM_TARGET("pclmul,ssse3")
+	inline __m128i fold128(__m128i x, __m128i k)
+	{
+		return _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), _mm_clmulepi64_si128(x, k, 0x11));
+	}
+
+	SORAMEM_TARGET("avx512f,avx512bw,vpclmulqdq")
+	inline __m512i loadStream512(const uint8_t* p)
+	{
+		__m512i x = _mm512_shuffle_epi8(_mm512_loadu_si512(p), _mm512_broadcast_i32x4(reverseMask128()));
+		return _mm512_shuffle_i64x2(x, x, 0x1B);	// lane order 3, 2, 1, 0
+	}
+
+	SORAMEM_TARGET("avx512f,avx512bw,vpclmulqdq")
+	inline __m512i fold512(__m512i x, __m512i k)
+	{
+		return _mm512_xor_si512(_mm512_clmulepi64_epi128(x, k, 0x00), _mm512_clmulepi64_epi128(x, k, 0x11));
+	}
+
+	template<typename T>
+	T bytewise(T crc, const uint8_t* data, size_t len, const SliceLUT<T>& lut)
+	{
+		for (size_t i = 0; i < len; ++i) {
+			const uint8_t& val = data[len - 1 - i];
+			crc = (crc >> 8) ^ lut[0][(crc ^ val) & 0xFF];
+		}
+		return crc;
+	}
+
+	template<typename T>
+	T sliceBy8(T crc, const uint8_t* data, size_t len, const SliceLUT<T>& lut)
+	{
+		while (len >= 8) {
+			len -= 8;
+			crc = sliceStep8<T>(loadStream64(data + len) ^ crc, lut, 0);
+		}
+		return bytewise(crc, data, len, lut);
+	}
+
+	template<typename T>
+	T sliceBy16(T crc, const uint8_t* data, size_t len, const SliceLUT<T>& lut)
+	{
+		while (len >= 16) {
+			len -= 16;
+			crc = sliceStep8<T>(loadStream64(data + len + 8) ^ crc, lut, 8) ^
+				sliceStep8<T>(loadStream64(data + len), lut, 0);
+		}
+		return sliceBy8(crc, data, len, lut);
+	}
+
+	template<typename T>
+	SORAMEM_TARGET("pclmul,ssse3")
+	T foldPCLMUL(T crc, const uint8_t* data, size_t len, const SliceLUT<T>& lut, const FoldConstants& fold)
+	{
+		if (len < 128) return sliceBy16(crc, data, len, lut);
+
+		const __m128i k128 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(fold[0].data()));
+		const __m128i k256 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(fold[1].data()));
+		const __m128i k384 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(fold[2].data()));
+		const __m128i k512 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(fold[3].data()));
+
+		// The running register enters as the low bits of the first chunk
+		__m128i x0 = _mm_xor_si128(loadStream128(data + len - 16), _mm_set_epi64x(0, static_cast<int64_t>(crc)));
+		__m128i x1 = loadStream128(data + len - 32);
+		__m128i x2 = loadStream128(data + len - 48);
+		__m128i x3 = loadStream128(data + len - 64);
+		len -= 64;
+
+		for (; len >= 64; len -= 64) {
+			x0 = _mm_xor_si128(fold128(x0, k512), loadStream128(data + len - 16));
+			x1 = _mm_xor_si128(fold128(x1, k512), loadStream128(data + len - 32));
+			x2 = _mm_xor_si128(fold128(x2, k512), loadStream128(data + len - 48));
+			x3 = _mm_xor_si128(fold128(x3, k512), loadStream128(data + len - 64));
+		}
+
+		__m128i x = _mm_xor_si128(_mm_xor_si128(fold128(x0, k384), fold128(x1, k256)), _mm_xor_si128(fold128(x2, k128), x3));
+
+		for (; len >= 16; len -= 16) {
+			x = _mm_xor_si128(fold128(x, k128), loadStream128(data + len - 16));
+		}
+
+		// Reduce the last 128 bits through the tables: running them through a zero register gives x * x^bits mod poly
+		alignas(16) uint8_t last[16];
+		_mm_store_si128(reinterpret_cast<__m128i*>(last), _mm_shuffle_epi8(x, reverseMask128()));
+		crc = sliceBy16<T>(0, last, 16, lut);
+
+		return sliceBy16(crc, data, len, lut);
+	}
+
+	template<typename T>
+	SORAMEM_TARGET("pclmul,ssse3,avx512f,avx512bw,vpclmulqdq")
+	T foldVPCLMUL(T crc, const uint8_t* data, size_t len, const SliceLUT<T>& lut, const FoldConstants& fold)
+	{
+		if (len < 512) return foldPCLMUL(crc, data, len, lut, fold);
+
+		const __m512i k512 = _mm512_broadcast_i32x4(_mm_loadu_si128(reinterpret_cast<const __m128i*>(fold[3].data())));
+		const __m512i k1024 = _mm512_broadcast_i32x4(_mm_loadu_si128(reinterpret_cast<const __m128i*>(fold[7].data())));
+		const __m512i k1536 = _mm512_broadcast_i32x4(_mm_loadu_si128(reinterpret_cast<const __m128i*>(fold[11].data())));
+		const __m512i k2048 = _mm512_broadcast_i32x4(_mm_loadu_si128(reinterpret_cast<const __m128i*>(fold[15].data())));
+
+		__m512i z0 = _mm512_xor_si512(loadStream512(data + len - 64),
+			_mm512_inserti32x4(_mm512_setzero_si512(), _mm_set_epi64x(0, static_cast<int64_t>(crc)), 0));
+		__m512i z1 = loadStream512(data + len - 128);
+		__m512i z2 = loadStream512(data + len - 192);
+		__m512i z3 = loadStream512(data + len - 256);
+		len -= 256;
+
+		for (; len >= 256; len -= 256) {
+			z0 = _mm512_xor_si512(fold512(z0, k2048), loadStream512(data + len - 64));
+			z1 = _mm512_xor_si512(fold512(z1, k2048), loadStream512(data + len - 128));
+			z2 = _mm512_xor_si512(fold512(z2, k2048), loadStream512(data + len - 192));
+			z3 = _mm512_xor_si512(fold512(z3, k2048), loadStream512(data + len - 256));
+		}
+
+		__m512i z = _mm512_xor_si512(_mm512_xor_si512(fold512(z0, k1536), fold512(z1, k1024)), _mm512_xor_si512(fold512(z2, k512), z3));
+
+		for (; len >= 64; len -= 64) {
+			z = _mm512_xor_si512(fold512(z, k512), loadStream512(data + len - 64));
+		}
+
+		// Lane 0 holds the earliest chunk of the last 64 stream bytes
+		const __m128i k128 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(fold[0].data()));
+		const __m128i k256 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(fold[1].data()));
+		const __m128i k384 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(fold[2].data()));
+		__m128i x = _mm_xor_si128(
+			_mm_xor_si128(fold128(_mm512_extracti32x4_epi32(z, 0), k384), fold128(_mm512_extracti32x4_epi32(z, 1), k256)),
+			_mm_xor_si128(fold128(_mm512_extracti32x4_epi32(z, 2), k128), _mm512_extracti32x4_epi32(z, 3)));
+
+		for (; len >= 16; len -= 16) {
+			x = _mm_xor_si128(fold128(x, k128), loadStream128(data + len - 16));
+		}
+
+		alignas(16) uint8_t last[16];
+		_mm_store_si128(reinterpret_cast<__m128i*>(last), _mm_shuffle_epi8(x, reverseMask128()));
+		crc = sliceBy16<T>(0, last, 16, lut);
+
+		return sliceBy16(crc, data, len, lut);
+	}
+
+	// a * b * x^(bits + 1) mod poly: the carry-less product is reduced by running it through a zero register
+	template<typename T>
+	SORAMEM_TARGET("pclmul")
+	T clmulScaled(T a, T b, const SliceLUT<T>& lut)
+	{
+		constexpr int shift = 64 - sizeof(T) * 8;
+		const __m128i product = _mm_clmulepi64_si128(_mm_set_epi64x(0, static_cast<int64_t>(static_cast<uint64_t>(a) << shift)),
+			_mm_set_epi64x(0, static_cast<int64_t>(static_cast<uint64_t>(b) << shift)), 0x00);
+		const uint64_t first = static_cast<uint64_t>(_mm_cvtsi128_si64(product));
+		const uint64_t second = static_cast<uint64_t>(_mm_cvtsi128_si64(_mm_unpackhi_epi64(product, product)));
+		return sliceStep8<T>(first, lut, 8) ^ sliceStep8<T>(second, lut, 0);
+	}
+
+	// Portable a * b * x^(bits + 1) mod poly
+	template<typename T>
+	T multScaled(T a, T b, T poly, const SliceLUT<T>& lut)
+	{
+		T r = 0;
+		for (int i = 0; i < static_cast<int>(sizeof(T) * 8); ++i) {
+			r ^= b & (T(0) - ((a >> (sizeof(T) * 8 - 1 - i)) & 1));
+			b = (b >> 1) ^ (poly & (T(0) - (b & 1)));
+		}
+		for (size_t i = 0; i < sizeof(T); ++i)
+			r = (r >> 8) ^ lut[0][r & 0xFF];
+		return (r >> 1) ^ (poly & (T(0) - (r & 1)));
 	}
+}
+
+std::atomic<CRC32_64::Kernel> CRC32_64::kernel = CRC32_64::Kernel::Bytewise;
+std::atomic<CRC32_64::Kernel32> CRC32_64::kernel32{ +[](uint32_t crc, const uint8_t* data, size_t len) { return bytewise(crc, data, len, *sliceTable32); } };
+std::atomic<CRC32_64::Kernel64> CRC32_64::kernel64{ +[](uint64_t crc, const uint8_t* data, size_t len) { return bytewise(crc, data, len, *sliceTable64); } };
+std::atomic<bool> CRC32_64::kernelChosen = false;
+
+uint32_t CRC32_64::appendCRC32(const uint8_t* data, size_t len) {
+	crc32 = kernel32.load(std::memory_order_relaxed)(crc32, data, len);
 	return crc32;
 }
 
 uint64_t CRC32_64::appendCRC64(const uint8_t* data, size_t len) {
-	for (size_t i = 0; i < len; ++i) {
-		const uint8_t& val = data[len - 1 - i];
-		crc64 = (crc64 >> 8) ^ table64[(crc64 ^ val) & 0xFF];
-	}
+	crc64 = kernel64.load(std::memory_order_relaxed)(crc64, data, len);
 	return crc64;
 }
 
-uint64_t CRC32_64::gf2_matrix_times(const Matrix64& mat, uint64_t vec) {
-	uint64_t sum = 0;
-	for (int i = 0; vec; ++i, vec >>= 1)
-		if (vec & 1) sum ^= mat[i];
-	return sum;
+bool CRC32_64::isKernelSupported(Kernel kernel) noexcept
+{
+	const SoraMem::Platform::CpuFeatures& cpu = SoraMem::Platform::getCpuFeatures();
+	switch (kernel) {
+	case Kernel::Bytewise:
+	case Kernel::Slice8:
+	case Kernel::Slice16:
+		return true;
+	case Kernel::PCLMUL:
+		return cpu.pclmul && cpu.ssse3;
+	case Kernel::VPCLMUL:
+		return cpu.pclmul && cpu.ssse3 && cpu.avx512f && cpu.avx512bw && cpu.vpclmulqdq;
+	}
+	return false;
 }
 
-uint32_t CRC32_64::gf2_matrix_times(const Matrix32& mat, uint32_t vec) {
-	uint32_t sum = 0;
-	for (int i = 0; vec; ++i, vec >>= 1)
-		if (vec & 1) sum ^= mat[i];
-	return sum;
+CRC32_64::Kernel CRC32_64::bestKernel() noexcept
+{
+	if (isKernelSupported(Kernel::VPCLMUL)) return Kernel::VPCLMUL;
+	if (isKernelSupported(Kernel::PCLMUL)) return Kernel::PCLMUL;
+	return Kernel::Slice16;
 }
 
-void CRC32_64::gf2_matrix_square(Matrix64& square, const Matrix64& mat) {
-	for (int i = 0; i < 64; ++i)
-		square[i] = gf2_matrix_times(mat, mat[i]);
+const char* CRC32_64::kernelName(Kernel kernel) noexcept
+{
+	switch (kernel) {
+	case Kernel::Bytewise:	return "Bytewise";
+	case Kernel::Slice8:	return "Slice-by-8";
+	case Kernel::Slice16:	return "Slice-by-16";
+	case Kernel::PCLMUL:	return "PCLMULQDQ";
+	case Kernel::VPCLMUL:	return "VPCLMULQDQ";
+	}
+	return "Unknown";
 }
 
-void CRC32_64::gf2_matrix_square(Matrix32& square, const Matrix32& mat) {
-	for (int i = 0; i < 32; ++i)
-		square[i] = gf2_matrix_times(mat, mat[i]);
+void CRC32_64::setKernel(Kernel _kernel)
+{
+	if (!isKernelSupported(_kernel)) {
+		throw std::runtime_error(std::string("CRC kernel not supported by this CPU: ") + kernelName(_kernel));
+	}
+	applyKernel(_kernel);
+	kernelChosen.store(true, std::memory_order_relaxed);
 }
 
+void CRC32_64::applyKernel(Kernel _kernel) noexcept
+{
+	Kernel32 k32 = nullptr;
+	Kernel64 k64 = nullptr;
+	switch (_kernel) {
+	case Kernel::Bytewise:
+		k32 = [](uint32_t crc, const uint8_t* data, size_t len) { return bytewise(crc, data, len, *sliceTable32); };
+		k64 = [](uint64_t crc, const uint8_t* data, size_t len) { return bytewise(crc, data, len, *sliceTable64); };
+		break;
+	case Kernel::Slice8:
+		k32 = [](uint32_t crc, const uint8_t* data, size_t len) { return sliceBy8(crc, data, len, *sliceTable32); };
+		k64 = [](uint64_t crc, const uint8_t* data, size_t len) { return sliceBy8(crc, data, len, *sliceTable64); };
+		break;
+	case Kernel::Slice16:
+		k32 = [](uint32_t crc, const uint8_t* data, size_t len) { return sliceBy16(crc, data, len, *sliceTable32); };
+		k64 = [](uint64_t crc, const uint8_t* data, size_t len) { return sliceBy16(crc, data, len, *sliceTable64); };
+		break;
+	case Kernel::PCLMUL:
+		k32 = [](uint32_t crc, const uint8_t* data, size_t len) { return foldPCLMUL(crc, data, len, *sliceTable32, *fold32); };
+		k64 = [](uint64_t crc, const uint8_t* data, size_t len) { return foldPCLMUL(crc, data, len, *sliceTable64, *fold64); };
+		break;
+	case Kernel::VPCLMUL:
+		k32 = [](uint32_t crc, const uint8_t* data, size_t len) { return foldVPCLMUL(crc, data, len, *sliceTable32, *fold32); };
+		k64 = [](uint64_t crc, const uint8_t* data, size_t len) { return foldVPCLMUL(crc, data, len, *sliceTable64, *fold64); };
+		break;
+	}
+	kernel32.store(k32, std::memory_order_relaxed);
+	kernel64.store(k64, std::memory_order_relaxed);
+	kernel.store(_kernel, std::memory_order_relaxed);
+}
 
-void CRC32_64::crc64_init_shift_matrix() {
-	Matrix64 mat;
+void CRC32_64::init(uint32_t _poly32, uint64_t _poly64)
+{
+	const uint32_t reflected32 = reflect32(_poly32);
+	const uint64_t reflected64 = reflect64(_poly64);
+	if (reflected32 == defaultTables32.poly) {
+		bindTables(defaultTables32);
+	}
+	else if (reflected32 != poly32) {
+		auto tables = std::make_shared<Tables<uint32_t>>();
+		calcTables(*tables, reflected32);
+		bindTables(*tables);
+		customTables32 = std::move(tables);
+	}
+	if (reflected64 == defaultTables64.poly) {
+		bindTables(defaultTables64);
+	}
+	else if (reflected64 != poly64) {
+		auto tables = std::make_shared<Tables<uint64_t>>();
+		calcTables(*tables, reflected64);
+		bindTables(*tables);
+		customTables64 = std::move(tables);
+	}
+	if (!kernelChosen.load(std::memory_order_relaxed)) applyKernel(bestKernel());
+}
 
-	// Initial matrix: x^1 mod poly
-	mat[0] = poly64;
-	for (int i = 1; i < 64; ++i)
-		mat[i] = 1ULL << (i - 1);
+void CRC32_64::resetTables() noexcept
+{
+	bindTables(defaultTables32);
+	bindTables(defaultTables64);
+}
 
-	crc64_shift_matrices[0] = mat;
+CRC32_64::Binding CRC32_64::getBinding()
+{
+	return { sliceTable32, sliceTable64, fold32, fold64, crc32_powers, crc64_powers, crc32_unscale, crc64_unscale,
+		poly32, poly64, customTables32, customTables64 };
+}
 
-	for (int i = 1; i < 64; ++i) {
-		Matrix64 next;
-		gf2_matrix_square(next, crc64_shift_matrices[i - 1]);
-		crc64_shift_matrices[i] = next;
-	}
+void CRC32_64::setBinding(const Binding& binding) noexcept
+{
+	sliceTable32 = binding.sliceTable32;
+	sliceTable64 = binding.sliceTable64;
+	fold32 = binding.fold32;
+	fold64 = binding.fold64;
+	crc32_powers = binding.crc32_powers;
+	crc64_powers = binding.crc64_powers;
+	crc32_unscale = binding.crc32_unscale;
+	crc64_unscale = binding.crc64_unscale;
+	poly32 = binding.poly32;
+	poly64 = binding.poly64;
+	customTables32 = binding.owner32;
+	customTables64 = binding.owner64;
+}
+
+uint64_t CRC32_64::crc64XZ(const uint8_t* data, size_t len, uint64_t crc) noexcept
+{
+	crc = ~crc;
+	if (isKernelSupported(Kernel::PCLMUL)) crc = foldPCLMUL(crc, data, len, defaultTables64.slice, defaultTables64.fold);
+	else crc = sliceBy16(crc, data, len, defaultTables64.slice);
+	return ~crc;
 }
 
-void CRC32_64::crc32_init_shift_matrix() {
-	Matrix32 mat;
+void CRC32_64::bindTables(const Tables<uint32_t>& tables) noexcept
+{
+	sliceTable32 = &tables.slice;
+	fold32 = &tables.fold;
+	crc32_powers = &tables.powers;
+	crc32_unscale = tables.unscale;
+	poly32 = tables.poly;
+}
 
-	// Initial matrix: x^1 mod poly
-	mat[0] = poly32;
-	for (int i = 1; i < 32; ++i)
-		mat[i] = 1ULL << (i - 1);
+void CRC32_64::bindTables(const Tables<uint64_t>& tables) noexcept
+{
+	sliceTable64 = &tables.slice;
+	fold64 = &tables.fold;
+	crc64_powers = &tables.powers;
+	crc64_unscale = tables.unscale;
+	poly64 = tables.poly;
+}
 
-	crc32_shift_matrices[0] = mat;
+// The conf arrays have the layout of the std::array tables (no padding), so they are used where they lie
 
-	for (int i = 1; i < 32; ++i) {
-		Matrix32 next;
-		gf2_matrix_square(next, crc32_shift_matrices[i - 1]);
-		crc32_shift_matrices[i] = next;
-	}
+void CRC32_64::useTables(const SoraMem::SoraMemConfigFormat& conf)
+{
+	sliceTable32 = reinterpret_cast<const SliceLUT<uint32_t>*>(conf.crc32_slice16Lookup);
+	fold32 = reinterpret_cast<const FoldConstants*>(conf.crc32Fold);
+	crc32_powers = reinterpret_cast<const std::array<uint32_t, 64>*>(conf.crc32Powers);
+	crc32_unscale = conf.crc32Unscale;
+	poly32 = conf.crc32Poly;
+
+	sliceTable64 = reinterpret_cast<const SliceLUT<uint64_t>*>(conf.crc64_slice16Lookup);
+	fold64 = reinterpret_cast<const FoldConstants*>(conf.crc64Fold);
+	crc64_powers = reinterpret_cast<const std::array<uint64_t, 64>*>(conf.crc64Powers);
+	crc64_unscale = conf.crc64Unscale;
+	poly64 = conf.crc64Poly;
+}
+
+void CRC32_64::writeTables(SoraMem::SoraMemConfigFormat& conf, uint32_t _poly32, uint64_t _poly64)
+{
+	auto exportTables = [](const auto& tables, auto& poly, auto& unscale, auto& lookup8, auto& lookup16, auto& slice, auto& fold, auto& powers) {
+		poly = tables.poly;
+		unscale = tables.unscale;
+		std::memcpy(lookup8, tables.slice[0].data(), sizeof(lookup8));
+		std::memcpy(slice, tables.slice.data(), sizeof(slice));
+		std::memcpy(fold, tables.fold.data(), sizeof(fold));
+		std::memcpy(powers, tables.powers.data(), sizeof(powers));
+
+		// Two stream bytes per step, the first one in the low half of the index
+		for (uint32_t i = 0; i < 65536; ++i) lookup16[i] = tables.slice[1][i & 0xFF] ^ tables.slice[0][i >> 8];
+	};
+
+	auto tables32 = std::make_unique<Tables<uint32_t>>();
+	calcTables(*tables32, reflect32(_poly32));
+	exportTables(*tables32, conf.crc32Poly, conf.crc32Unscale, conf.crc32_8bitLookup, conf.crc32_16bitLookup,
+		conf.crc32_slice16Lookup, conf.crc32Fold, conf.crc32Powers);
+
+	auto tables64 = std::make_unique<Tables<uint64_t>>();
+	calcTables(*tables64, reflect64(_poly64));
+	exportTables(*tables64, conf.crc64Poly, conf.crc64Unscale, conf.crc64_8bitLookup, conf.crc64_16bitLookup,
+		conf.crc64_slice16Lookup, conf.crc64Fold, conf.crc64Powers);
+
+	const size_t lookups = offsetof(SoraMem::SoraMemConfigFormat, crc32Unscale) - offsetof(SoraMem::SoraMemConfigFormat, crc32_8bitLookup);
+	conf.lookupCRC = crc64XZ(reinterpret_cast<const uint8_t*>(conf.crc32_8bitLookup), lookups);
+}
+
+// The shift operator is kept as x^(8 * len2 - bits - 1) so that applying it is a single carry-less
+// multiply whose x^(bits + 1) surplus falls out of the table reduction for free.
+
+uint64_t CRC32_64::combineGen64(size_t len2) {
+	return multModP(xPow8n(len2, *crc64_powers, poly64), crc64_unscale, poly64);
+}
+
+uint32_t CRC32_64::combineGen32(size_t len2) {
+	return multModP(xPow8n(len2, *crc32_powers, poly32), crc32_unscale, poly32);
 }
 
-uint64_t CRC32_64::crc64_shift(uint64_t crc, size_t len_bytes) {
-	size_t n = len_bytes * 8;  // convert to bits
-	for (int i = 0; n; ++i, n >>= 1)
-		if (n & 1)
-			crc = gf2_matrix_times(crc64_shift_matrices[i], crc);
-	return crc;
+uint64_t CRC32_64::combineOp64(uint64_t crc1, uint64_t crc2, uint64_t shift) {
+	static const bool clmul = SoraMem::Platform::getCpuFeatures().pclmul;
+	return (clmul ? clmulScaled(shift, crc1, *sliceTable64) : multScaled(shift, crc1, poly64, *sliceTable64)) ^ crc2;
 }
 
-uint32_t CRC32_64::crc32_shift(uint32_t crc, size_t len_bytes) {
-	size_t n = len_bytes * 8;  // convert to bits
-	for (int i = 0; n; ++i, n >>= 1)
-		if (n & 1)
-			crc = gf2_matrix_times(crc32_shift_matrices[i], crc);
-	return crc;
+uint32_t CRC32_64::combineOp32(uint32_t crc1, uint32_t crc2, uint32_t shift) {
+	static const bool clmul = SoraMem::Platform::getCpuFeatures().pclmul;
+	return (clmul ? clmulScaled(shift, crc1, *sliceTable32) : multScaled(shift, crc1, poly32, *sliceTable32)) ^ crc2;
 }
 
 uint64_t CRC32_64::combineCRC64(uint64_t crc1, uint64_t crc2, size_t len2) {
-	return CRC32_64::crc64_shift(crc1, len2) ^ crc2;
+	return combineOp64(crc1, crc2, combineGen64(len2));
 }
 
 uint32_t CRC32_64::combineCRC32(uint32_t crc1, uint32_t crc2, size_t len2) {
-	return crc32_shift(crc1, len2) ^ crc2;
+	return combineOp32(crc1, crc2, combineGen32(len2));
 }
\ No newline at end of file
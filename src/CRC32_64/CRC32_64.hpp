@@ -1,24 +1,58 @@
 #pragma once
 #include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace SoraMem { struct SoraMemConfigFormat; }
 
 class CRC32_64
 {
 public:
+	// Table/carry-less multiply implementations of appendCRC32/appendCRC64, all bit-identical
+	enum class Kernel : uint8_t
+	{
+		Bytewise,	// 1 byte per step, 256-entry table
+		Slice8,		// 8 bytes per step, 8 x 256-entry tables
+		Slice16,	// 16 bytes per step, 16 x 256-entry tables
+		PCLMUL,		// 4 x 128-bit folding with PCLMULQDQ
+		VPCLMUL		// 4 x 512-bit folding with AVX-512 VPCLMULQDQ
+	};
+
+	static constexpr uint32_t defaultPoly32 = 0x04C11DB7;			// CRC32-ISO_HDLC
+	static constexpr uint64_t defaultPoly64 = 0x42F0E1EBA9EA3693;	// CRC64-XZ
+
 	CRC32_64() { reset(); }
 	
-	static void init(uint32_t _poly32 = 0x04C11DB7, uint64_t _poly64 = 0x42F0E1EBA9EA3693)
-	{
-		if (poly32 == 0) poly32 = reflect32(_poly32);
-		if (poly64 == 0) poly64 = reflect64(_poly64);
-		if (table32[1] == 0) {
-			table32 = calcLUT(poly32);
-			crc32_init_shift_matrix();
-		}
-		if (table64[1] == 0) {
-			table64 = calcLUT(poly64);
-			crc64_init_shift_matrix();
-		}
-	}
+	// Picks the fastest kernel, unless setKernel chose one, and the polynomials (normal form). The tables of
+	// the defaults are built at compile time, other polynomials have theirs computed here. Not while checksums run.
+	static void init(uint32_t _poly32 = defaultPoly32, uint64_t _poly64 = defaultPoly64);
+	static void resetTables() noexcept;		// back to the default polynomials
+
+	// The tables in use, to put them back after switching (keeps computed ones alive)
+	struct Binding;
+	static Binding	getBinding();
+	static void		setBinding(const Binding& binding) noexcept;
+	static uint32_t	getPoly32() noexcept { return reflect32(poly32); }	// normal form
+	static uint64_t	getPoly64() noexcept { return reflect64(poly64); }
+
+	// zlib style CRC64-XZ on the built-in tables whatever is bound, crc is a previous result to continue from.
+	// For file headers, which must check out under any polynomials.
+	static uint64_t crc64XZ(const uint8_t* data, size_t len, uint64_t crc = 0) noexcept;
+
+	// Tables of a .conf.soramem body: useTables switches to them in place (the memory must outlive every
+	// checksum), writeTables computes them and the 8/16-bit lookups into conf for its polynomials.
+	static void useTables(const SoraMem::SoraMemConfigFormat& conf);
+	static void writeTables(SoraMem::SoraMemConfigFormat& conf, uint32_t _poly32, uint64_t _poly64);
+
+	static bool			isKernelSupported(Kernel kernel) noexcept;
+	static Kernel		bestKernel() noexcept;
+	// Kept by later init calls, throws if the CPU lacks the instructions. Safe while checksums run: the
+	// kernels give the same results and each append uses one of them.
+	static void			setKernel(Kernel kernel);
+	static Kernel		getKernel() noexcept { return kernel.load(std::memory_order_relaxed); }
+	static const char*	kernelName(Kernel kernel) noexcept;
 
 	constexpr static uint8_t reflect_byte(uint8_t b) {
 		b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
@@ -80,14 +114,54 @@ public:
 
 	static uint32_t combineCRC32(uint32_t crc1, uint32_t crc2, size_t len2);
 
+	// Opaque "shift by len2 bytes" operator, generate once when many combines share the same len2:
+	// combineOp(crc1, crc2, combineGen(len2)) == combineCRC(crc1, crc2, len2)
+	static uint64_t combineGen64(size_t len2);
+
+	static uint32_t combineGen32(size_t len2);
+
+	static uint64_t combineOp64(uint64_t crc1, uint64_t crc2, uint64_t shift);
+
+	static uint32_t combineOp32(uint32_t crc1, uint32_t crc2, uint32_t shift);
+
 private:
-	using Matrix64 = std::array<uint64_t, 64>;
-	using Matrix32 = std::array<uint32_t, 32>;
+	template<typename T>
+	using SliceLUT = std::array<std::array<T, 256>, 16>;
+
+	// Folding multipliers, fold[i] = { x^(128(i+1)+63), x^(128(i+1)-1) } mod poly, bit-reflected to 64 bits
+	using FoldConstants = std::array<std::array<uint64_t, 2>, 16>;
+
+	using Kernel32 = uint32_t(*)(uint32_t crc, const uint8_t* data, size_t len);
+	using Kernel64 = uint64_t(*)(uint64_t crc, const uint8_t* data, size_t len);
+
+	// Everything the kernels and combines use for one polynomial
+	template<typename T>
+	struct Tables
+	{
+		T					poly = 0;		// reflected
+		T					unscale = 0;
+		SliceLUT<T>			slice{};		// slice[0] is the bytewise table
+		FoldConstants		fold{};
+		std::array<T, 64>	powers{};
+	};
+
+	template<typename T>
+	static constexpr void calcTables(Tables<T>& tables, T poly)
+	{
+		tables.poly = poly;
+		calcSliceLUT(tables.slice, calcLUT(poly));
+		calcFoldConstants(tables.fold, poly);
+		calcPowerTable(tables.powers, tables.unscale, poly);
+	}
+
+	static void applyKernel(Kernel kernel) noexcept;
+	static void bindTables(const Tables<uint32_t>& tables) noexcept;
+	static void bindTables(const Tables<uint64_t>& tables) noexcept;
 
 	template<typename T = uint32_t>
-	static std::array<T, 256> calcLUT(T poly)
+	static constexpr std::array<T, 256> calcLUT(T poly)
 	{
-		std::array<T, 256> table;
+		std::array<T, 256> table{};
 		for (int i = 0; i < 256; ++i) {
 			T crc = static_cast<T>(i);
 			for (int j = 0; j < 8; ++j) {
@@ -104,30 +178,117 @@ private:
 		return table;
 	}
 
-	static uint64_t gf2_matrix_times(const Matrix64& mat, uint64_t vec);
+	template<typename T>
+	static constexpr void calcSliceLUT(SliceLUT<T>& slice, const std::array<T, 256>& table)
+	{
+		slice[0] = table;
+		for (int k = 1; k < 16; ++k)
+			for (int i = 0; i < 256; ++i)
+				slice[k][i] = (slice[k - 1][i] >> 8) ^ table[slice[k - 1][i] & 0xFF];
+	}
 
-	static uint32_t gf2_matrix_times(const Matrix32& mat, uint32_t vec);
+	template<typename T>
+	static constexpr void calcFoldConstants(FoldConstants& fold, T poly)
+	{
+		constexpr int bits = sizeof(T) * 8;
 
-	static void gf2_matrix_square(Matrix64& square, const Matrix64& mat);
+		// x^n mod poly in the reflected domain: bit i holds x^(bits - 1 - i), multiplying by x is one CRC bit step
+		T xn = T(1) << (bits - 1);
+		auto toWord = [](T r) { return static_cast<uint64_t>(r) << (64 - bits); };
 
-	static void gf2_matrix_square(Matrix32& square, const Matrix32& mat);
+		// The carry-less product of two reflected 64-bit words comes out one bit short of the 128-bit
+		// layout, so x^(D + 64) and x^D are stored as x^(D + 63) and x^(D - 1)
+		for (int n = 1, i = 0; i < 16; ++n) {
+			xn = (xn >> 1) ^ ((xn & 1) ? poly : 0);
+			if (n == 128 * (i + 1) - 1) fold[i][1] = toWord(xn);
+			if (n == 128 * (i + 1) + 63) fold[i++][0] = toWord(xn);
+		}
+	}
 
-	static void crc64_init_shift_matrix();
+	// a * b mod poly, both operands bit-reflected (bit i holds x^(bits - 1 - i))
+	template<typename T>
+	static constexpr T multModP(T a, T b, T poly)
+	{
+		constexpr int bits = sizeof(T) * 8;
+		T product = 0;
+		for (int i = 0; i < bits; ++i) {
+			product ^= b & (T(0) - ((a >> (bits - 1 - i)) & 1));
+			b = (b >> 1) ^ (poly & (T(0) - (b & 1)));
+		}
+		return product;
+	}
 
-	static void crc32_init_shift_matrix();
+	// powers[k] = x^(8 * 2^k) mod poly, unscale = x^-(bits + 1) mod poly
+	template<typename T>
+	static constexpr void calcPowerTable(std::array<T, 64>& powers, T& unscale, T poly)
+	{
+		constexpr int bits = sizeof(T) * 8;
+		constexpr T top = T(1) << (bits - 1);
+		T x8 = top;
+		for (int i = 0; i < 8; ++i)
+			x8 = (x8 >> 1) ^ ((x8 & 1) ? poly : 0);
+
+		powers[0] = x8;
+		for (int k = 1; k < 64; ++k)
+			powers[k] = multModP(powers[k - 1], powers[k - 1], poly);
+
+		// Dividing by x undoes one CRC bit step (poly has an x^0 term, so x is invertible)
+		unscale = top;
+		for (int i = 0; i < bits + 1; ++i)
+			unscale = (unscale & top) ? ((unscale ^ poly) << 1) | 1 : unscale << 1;
+	}
+
+	template<typename T>
+	static T xPow8n(size_t n, const std::array<T, 64>& powers, T poly)
+	{
+		T result = T(1) << (sizeof(T) * 8 - 1);
+		for (int k = 0; n; ++k, n >>= 1)
+			if (n & 1)
+				result = multModP(powers[k], result, poly);
+		return result;
+	}
 
-	static uint64_t crc64_shift(uint64_t crc, size_t len_bytes);
+	// The default polynomials' tables, built at compile time
+	static const Tables<uint32_t> defaultTables32;
+	static const Tables<uint64_t> defaultTables64;
+	static std::shared_ptr<const Tables<uint32_t>> customTables32;
+	static std::shared_ptr<const Tables<uint64_t>> customTables64;
 
-	static uint32_t crc32_shift(uint32_t crc, size_t len_bytes);
+	// What the kernels and combines read: the default tables, custom ones or a mapped .conf.soramem
+	static const SliceLUT<uint32_t>* sliceTable32;
+	static const SliceLUT<uint64_t>* sliceTable64;
+	static const FoldConstants* fold32;
+	static const FoldConstants* fold64;
 
-	static std::array<uint32_t, 256> table32;
-	static std::array<uint64_t, 256> table64;
-	static std::array<Matrix64, 64> crc64_shift_matrices;
-	static std::array<Matrix32, 32> crc32_shift_matrices;
+	static std::atomic<Kernel> kernel;
+	static std::atomic<Kernel32> kernel32;
+	static std::atomic<Kernel64> kernel64;
+	static std::atomic<bool> kernelChosen;		// by setKernel, init keeps it
+	static const std::array<uint64_t, 64>* crc64_powers;
+	static const std::array<uint32_t, 64>* crc32_powers;
+	static uint64_t crc64_unscale;
+	static uint32_t crc32_unscale;
 
 	static uint32_t poly32;
 	static uint64_t poly64;
 	uint32_t crc32 = 0;
 	uint64_t crc64 = 0;
+
+public:
+	struct Binding
+	{
+		const SliceLUT<uint32_t>*				sliceTable32 = nullptr;
+		const SliceLUT<uint64_t>*				sliceTable64 = nullptr;
+		const FoldConstants*					fold32 = nullptr;
+		const FoldConstants*					fold64 = nullptr;
+		const std::array<uint32_t, 64>*			crc32_powers = nullptr;
+		const std::array<uint64_t, 64>*			crc64_powers = nullptr;
+		uint32_t								crc32_unscale = 0;
+		uint64_t								crc64_unscale = 0;
+		uint32_t								poly32 = 0;
+		uint64_t								poly64 = 0;
+		std::shared_ptr<const Tables<uint32_t>>	owner32;
+		std::shared_ptr<const Tables<uint64_t>>	owner64;
+	};
 };
 
@@ -0,0 +1,317 @@
+#include "CRCTree.hpp"
+#include "src/MemoryManager/MemoryManager.hpp"
+#include "src/MMFile/MMFile.hpp"
+#include "src/MMFile/SoraMemFileSpecification.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+#include <utility>
+
+namespace SoraMem
+{
+    namespace
+    {
+        constexpr uint32_t treeVersion = 2;     // 2: the leaves' polynomial after the leaf size
+        constexpr uint64_t taskBytes = 4 * 1024 * 1024;    // read and hashed by one task
+
+        uint64_t crc64Of(const void* data, size_t size)
+        {
+            CRC32_64 crc;
+            crc.appendCRC64(static_cast<const uint8_t*>(data), size);
+            crc.finallize64();
+            return crc.getCRC64();
+        }
+
+        // Nodes of a tree over size bytes, as rebuild lays them out
+        size_t treeNodes(uint64_t size, size_t leafSize)
+        {
+            size_t count = static_cast<size_t>((size + leafSize - 1) / leafSize);
+            size_t nodes = count;
+            while (count > 1) {
+                count = (count + 1) / 2;
+                nodes += count;
+            }
+            return nodes;
+        }
+
+        std::vector<uint8_t>& scratch(size_t size)
+        {
+            thread_local std::vector<uint8_t> buffer;
+            if (buffer.size() < size) buffer.resize(size);
+            return buffer;
+        }
+    }
+
+    CRCTree::CRCTree(MemoryManager& manager, MMFile* file) : manager(manager), file(file)
+    {
+        if (file == nullptr || !file->isValid()) {
+            throw std::invalid_argument("Invalid file or map handle.");
+        }
+        leafSize = file->getSysGran();
+        channel = file->openDirtyChannel();
+    }
+
+    CRCTree::~CRCTree()
+    {
+        file->closeDirtyChannel(channel);
+    }
+
+    void CRCTree::rebuild(uint64_t size)
+    {
+        fileSize = size;
+        levels.clear();
+        levels.emplace_back(static_cast<size_t>((size + leafSize - 1) / leafSize), 0);
+        while (levels.back().size() > 1) levels.emplace_back((levels.back().size() + 1) / 2, 0);
+
+        shifts.resize(levels.size());
+        for (size_t level = 0; level < levels.size(); ++level) shifts[level] = CRC32_64::combineGen64(static_cast<uint64_t>(leafSize) << level);
+    }
+
+    uint64_t CRCTree::nodeLength(size_t level, size_t index) const noexcept
+    {
+        const uint64_t begin = (static_cast<uint64_t>(index) << level) * leafSize;
+        const uint64_t end = (std::min)(begin + (static_cast<uint64_t>(leafSize) << level), fileSize);
+        return (end > begin) ? end - begin : 0;
+    }
+
+    void CRCTree::combineNode(size_t level, size_t index)
+    {
+        const std::vector<uint64_t>& below = levels[level - 1];
+        const size_t left = 2 * index;
+        if (left + 1 >= below.size()) {
+            levels[level][index] = below[left];
+            return;
+        }
+
+        // Checksums run from the end of the data to its start, so the right child comes first. The left one
+        // is always full, only the file's last node is short.
+        levels[level][index] = CRC32_64::combineOp64(below[left + 1], below[left], shifts[level - 1]);
+    }
+
+    uint64_t CRCTree::update()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        const uint64_t size = file->getFileSize_s();
+        std::vector<uint64_t> dirty = file->takeDirty(channel, leafSize);
+        bool allParents = false;
+
+        if (!built) {
+            rebuild(size);
+            dirty.resize(levels[0].size());
+            std::iota(dirty.begin(), dirty.end(), uint64_t(0));
+            allParents = true;
+        }
+        else if (size != fileSize) {
+            // Leaves before the old end stay, growth is marked dirty and the leaf at the boundary changes length
+            std::vector<uint64_t> leaves = std::move(levels[0]);
+            const uint64_t common = (std::min)(size, fileSize);
+            rebuild(size);
+            std::copy_n(leaves.begin(), (std::min)(leaves.size(), levels[0].size()), levels[0].begin());
+            if (common != 0) {
+                const uint64_t boundary = (common - 1) / leafSize;
+                dirty.insert(std::lower_bound(dirty.begin(), dirty.end(), boundary), boundary);
+                dirty.erase(std::unique(dirty.begin(), dirty.end()), dirty.end());
+            }
+            allParents = true;
+        }
+
+        // Runs of consecutive dirty leaves, one task each
+        const uint64_t taskLeaves = (std::max)(taskBytes / leafSize, uint64_t(1));
+        std::vector<std::pair<uint64_t, uint64_t>> runs;    // first leaf, leaves
+        for (uint64_t index : dirty) {
+            if (!runs.empty() && runs.back().first + runs.back().second == index && runs.back().second < taskLeaves) ++runs.back().second;
+            else runs.emplace_back(index, 1);
+        }
+
+        auto hashRun = [&](size_t task) {
+            const uint64_t origin = runs[task].first * leafSize;
+            const size_t length = static_cast<size_t>((std::min)((runs[task].first + runs[task].second) * leafSize, fileSize) - origin);
+            std::vector<uint8_t>& buffer = scratch(length);
+            file->read(origin, buffer.data(), length);
+            for (size_t at = 0; at < length; at += leafSize) {
+                levels[0][(origin + at) / leafSize] = crc64Of(buffer.data() + at, (std::min)(leafSize, length - at));
+            }
+        };
+        ThreadPool* pool = manager.getThreadPool();
+        if (pool == nullptr || runs.size() < 2) {
+            for (size_t task = 0; task < runs.size(); ++task) hashRun(task);
+        }
+        else {
+            pool->submit_bulk(runs.size(), hashRun);
+        }
+
+        lastUpdated = dirty.size();
+
+        // Parents of the rehashed leaves, level by level
+        for (size_t level = 1; level < levels.size(); ++level) {
+            if (allParents) {
+                for (size_t index = 0; index < levels[level].size(); ++index) combineNode(level, index);
+                continue;
+            }
+            for (uint64_t& index : dirty) index >>= 1;
+            dirty.erase(std::unique(dirty.begin(), dirty.end()), dirty.end());
+            for (uint64_t index : dirty) combineNode(level, static_cast<size_t>(index));
+        }
+
+        built = true;
+        return levels[0].empty() ? 0 : levels.back()[0];
+    }
+
+    uint64_t CRCTree::getRoot() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return (levels.empty() || levels[0].empty()) ? 0 : levels.back()[0];
+    }
+
+    size_t CRCTree::getLeafCount() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return levels.empty() ? 0 : levels[0].size();
+    }
+
+    uint64_t CRCTree::getLeaf(size_t index) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (levels.empty() || index >= levels[0].size()) {
+            throw std::out_of_range("Leaf " + std::to_string(index) + " is out of range.");
+        }
+        return levels[0][index];
+    }
+
+    void CRCTree::save(const std::string& path) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!built) {
+            throw std::runtime_error("The tree is empty until update() builds it.");
+        }
+
+        // Descriptor (chunkSize = size of the file the tree covers), the leaf size, the polynomial the leaves
+        // were hashed with, then every level
+        size_t nodes = 0;
+        for (const auto& level : levels) nodes += level.size();
+        std::vector<uint8_t> buffer(sizeof(SoraMemFileDescriptor) + sizeof(uint64_t) * (2 + nodes));
+        uint8_t* body = buffer.data() + sizeof(SoraMemFileDescriptor);
+        const uint64_t leaf = leafSize;
+        const uint64_t poly = CRC32_64::getPoly64();
+        std::memcpy(body, &leaf, sizeof(leaf));
+        std::memcpy(body + sizeof(leaf), &poly, sizeof(poly));
+        uint8_t* at = body + sizeof(leaf) + sizeof(poly);
+        for (const auto& level : levels) {
+            std::memcpy(at, level.data(), level.size() * sizeof(uint64_t));
+            at += level.size() * sizeof(uint64_t);
+        }
+
+        SoraMemFileDescriptor descriptor{};
+        descriptor.version = treeVersion;
+        descriptor.chunkSize = fileSize;
+        descriptor.flags = SoraMemFlags::CRC;   // CRC64-XZ
+        descriptor.subChunkSize = buffer.size() - sizeof(descriptor);
+        descriptor.crc = CRC32_64::crc64XZ(body, static_cast<size_t>(descriptor.subChunkSize));
+        std::memcpy(descriptor.subMagic, SoraMemSubMagicNumber::CRCTREE, sizeof(descriptor.subMagic));
+        std::memcpy(buffer.data(), &descriptor, sizeof(descriptor));
+
+        Platform::FileHandle handle = Platform::createFile(path);
+        const bool saved = Platform::isValid(handle) && Platform::writeFile(handle, 0, buffer.data(), buffer.size()) && Platform::flushFile(handle);
+        const int error = Platform::lastError();
+        Platform::closeFile(handle);
+        if (!saved) {
+            throw std::runtime_error("Failed to save the CRC tree to " + path + ". Error code: " + std::to_string(error));
+        }
+    }
+
+    bool CRCTree::load(const std::string& path)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Platform::FileHandle handle = Platform::openFile(path);
+        if (!Platform::isValid(handle)) return false;
+
+        SoraMemFileDescriptor descriptor{};
+        std::vector<uint8_t> body;
+        bool valid = Platform::readFile(handle, 0, &descriptor, sizeof(descriptor))
+            && std::memcmp(descriptor.baseMagic, "SMMF", 4) == 0 && descriptor.version == treeVersion
+            && std::memcmp(descriptor.subMagic, SoraMemSubMagicNumber::CRCTREE, sizeof(descriptor.subMagic)) == 0
+            && descriptor.chunkSize == file->getFileSize_s()
+            && descriptor.subChunkSize == sizeof(uint64_t) * (2 + treeNodes(descriptor.chunkSize, leafSize));
+        if (valid) {
+            body.resize(static_cast<size_t>(descriptor.subChunkSize));
+            valid = Platform::readFile(handle, sizeof(descriptor), body.data(), body.size())
+                && CRC32_64::crc64XZ(body.data(), body.size()) == descriptor.crc;
+        }
+        Platform::closeFile(handle);
+
+        uint64_t leaf = 0;
+        uint64_t poly = 0;
+        if (valid) {
+            std::memcpy(&leaf, body.data(), sizeof(leaf));
+            std::memcpy(&poly, body.data() + sizeof(leaf), sizeof(poly));
+        }
+        if (!valid || leaf != leafSize || poly != CRC32_64::getPoly64()) return false;
+
+        rebuild(descriptor.chunkSize);
+        const uint8_t* at = body.data() + sizeof(leaf) + sizeof(poly);
+        for (auto& level : levels) {
+            std::memcpy(level.data(), at, level.size() * sizeof(uint64_t));
+            at += level.size() * sizeof(uint64_t);
+        }
+        built = true;
+        file->takeDirty(channel, leafSize);     // the file is taken to match the tree
+        return true;
+    }
+
+    std::vector<ByteRange> CRCTree::diff(const CRCTree& a, const CRCTree& b)
+    {
+        std::vector<ByteRange> ranges;
+        if (&a == &b) return ranges;
+
+        std::scoped_lock lock(a.mutex, b.mutex);
+        if (a.leafSize != b.leafSize) {
+            throw std::invalid_argument("CRC trees with leaves of " + std::to_string(a.leafSize) + " and " + std::to_string(b.leafSize) + " bytes cannot be compared.");
+        }
+        if (!a.built || !b.built) {
+            throw std::runtime_error("The trees are empty until update() builds them.");
+        }
+
+        const uint64_t size = (std::max)(a.fileSize, b.fileSize);
+        const size_t height = (std::max)(a.levels.size(), b.levels.size());
+        if (size == 0) return ranges;
+
+        auto add = [&](uint64_t begin, uint64_t end) {
+            end = (std::min)(end, size);
+            if (!ranges.empty() && ranges.back().offset + ranges.back().size == begin) ranges.back().size += end - begin;
+            else ranges.push_back({ begin, end - begin });
+        };
+        auto hasNode = [](const CRCTree& tree, size_t level, size_t index) {
+            return level < tree.levels.size() && index < tree.levels[level].size();
+        };
+
+        // Depth first, left child first, so the ranges come out in order
+        std::vector<std::pair<size_t, size_t>> stack{ { height - 1, 0 } };
+        while (!stack.empty()) {
+            const auto [level, index] = stack.back();
+            stack.pop_back();
+
+            const uint64_t begin = (static_cast<uint64_t>(index) << level) * a.leafSize;
+            const uint64_t end = begin + (static_cast<uint64_t>(a.leafSize) << level);
+            if (begin >= size) continue;
+
+            if (hasNode(a, level, index) && hasNode(b, level, index)) {
+                if (a.levels[level][index] == b.levels[level][index] && a.nodeLength(level, index) == b.nodeLength(level, index)) continue;
+                if (level == 0) {
+                    add(begin, end);
+                    continue;
+                }
+            }
+            else if (begin >= a.fileSize || begin >= b.fileSize) {
+                add(begin, end);    // only one file reaches here
+                continue;
+            }
+            // Both have data below, the shorter tree just has no node this high
+            stack.emplace_back(level - 1, 2 * index + 1);
+            stack.emplace_back(level - 1, 2 * index);
+        }
+        return ranges;
+    }
+}
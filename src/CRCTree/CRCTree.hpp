@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace SoraMem
+{
+    class MemoryManager;
+    class MMFile;
+
+    struct ByteRange
+    {
+        uint64_t    offset = 0;
+        uint64_t    size = 0;
+    };
+
+    // CRC64 of every sysGran block of a file (the leaves) with parents folded by combineCRC64, so the root is
+    // the file's CRC64. It follows the file through a dirty tracking channel: update() only rehashes blocks
+    // marked since the last one and the parents above them, O(changed blocks + log n) for a mostly clean
+    // file. Two trees with the same leaf size are diffed top-down, equal subtrees are skipped.
+    class CRCTree
+    {
+    public:
+        // Empty until the first update(), which hashes every block
+        CRCTree(MemoryManager& manager, MMFile* file);
+        ~CRCTree();     // closes the dirty tracking channel
+
+        CRCTree(CRCTree const&) = delete;
+        void operator=(CRCTree const&) = delete;
+
+        uint64_t                update();                   // the root, writers of the file must pause meanwhile
+        uint64_t                getRoot() const;
+        uint64_t                getLastUpdated() const noexcept { return lastUpdated; }    // blocks the last update rehashed
+
+        size_t                  getLeafSize() const noexcept { return leafSize; }
+        size_t                  getLeafCount() const;
+        uint64_t                getLeaf(size_t index) const;
+        uint64_t                getFileSize() const noexcept { return fileSize; }
+
+        // The tree in a CRCTREE file. load() trusts that the file has not changed since the save and is false
+        // if the tree file is missing, damaged or made for another size, leaf size or CRC64 polynomial, the tree
+        // is then left as it was.
+        void                    save(const std::string& path) const;
+        bool                    load(const std::string& path);
+
+        // Ranges whose contents differ, merged, a size difference ends in a range covering the tail.
+        // Both trees must be up to date and share their leaf size.
+        static std::vector<ByteRange> diff(const CRCTree& a, const CRCTree& b);
+
+    private:
+        void                    rebuild(uint64_t size);     // levels for size bytes, every leaf unknown
+        uint64_t                nodeLength(size_t level, size_t index) const noexcept;
+        void                    combineNode(size_t level, size_t index);
+
+        MemoryManager&          manager;
+        MMFile*                 file;
+        uint32_t                channel = 0;
+        size_t                  leafSize = 0;
+        uint64_t                fileSize = 0;
+        bool                    built = false;
+        uint64_t                lastUpdated = 0;
+
+        std::vector<std::vector<uint64_t>> levels;          // levels[0] = leaves, the last one holds the root
+        std::vector<uint64_t>   shifts;                     // combineGen64(leafSize << level), a full left child
+
+        mutable std::mutex      mutex;
+    };
+}
@@ -1,41 +1,154 @@
 #include "MMFile.hpp"
 #include "src/MemoryManager/MemoryManager.hpp"
 
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
 #include <string>
 
 namespace SoraMem
 {
     bool MMFile::isValid() const noexcept
     {
-        return (m_hFile != INVALID_HANDLE_VALUE) && (m_hMapFile != INVALID_HANDLE_VALUE);
+        return Platform::isValid(m_hFile) && (m_hMapFile != Platform::InvalidMap);
     }
 
-    MemView& MMFile::_load(MemView& view, size_t offset, size_t size)
+    MappedWindow* MMFile::findWindow(uint64_t offset, size_t size)
     {
-        // Calculate file map start and view size
-        DWORD dwFileMapStart = static_cast<DWORD>((offset / sysGran) * sysGran);
-        view.parent = this;
-        view._offset = offset;
-        view.dwMapViewSize = static_cast<DWORD>((offset % sysGran) + size);
-        view.iViewDelta = static_cast<unsigned long>(offset - dwFileMapStart);
+        // Only windows starting at most largestWindow before the end of the range can contain it
+        const uint64_t end = offset + size;
+        for (auto it = windows.upper_bound(offset); it != windows.begin(); ) {
+            --it;
+            MappedWindow& window = it->second;
+            if (window.start + largestWindow < end) break;
+            if (window.privateCopy && !forked) continue;    // belongs to its loadPrivate view alone
+            if (window.start + window.size >= end) return &window;
+        }
+        return nullptr;
+    }
 
+    MappedWindow MMFile::mapWindow(uint64_t offset, size_t size, bool privateCopy)
+    {
+        // Map at least one cache window so neighbouring loads land in it too, private windows are never reused
+        MappedWindow window;
+        window.start = (offset / sysGran) * sysGran;
+        window.privateCopy = privateCopy;
+        uint64_t end = privateCopy ? offset + size : (std::max)(offset + size, window.start + manager->getViewWindowSize());
+        if (hugePages) end = ((end + sysGran - 1) / sysGran) * sysGran;
+        window.size = static_cast<size_t>((std::min)(end, static_cast<uint64_t>(getFileSize())) - window.start);
 
-        // Split high and low parts for 64-bit offset
-        LARGE_INTEGER newSize;
-        newSize.QuadPart = static_cast<LONGLONG>(dwFileMapStart);
+        if (privateCopy) {
+            window.address = Platform::mapViewPrivate(getMapHandle(), dataOffset + window.start, window.size, hugePages ? sysGran : 0);
+        }
+        else if (hugePages) {
+            // Huge pages need the address as well as the file offset aligned
+            window.address = Platform::mapViewAligned(getMapHandle(), dataOffset + window.start, window.size, sysGran);
+            if (window.address != nullptr) Platform::adviseHugePages(window.address, window.size);
+        }
+        else {
+            window.address = Platform::mapView(getMapHandle(), dataOffset + window.start, window.size);
+        }
 
+        if (window.address == nullptr) {
+            throw std::runtime_error("Failed to map view of file. Error code: " + std::to_string(Platform::lastError()));
+        }
 
-        // Map the file view
-        view.lpMapAddress = MapViewOfFile(getMapHandle(), FILE_MAP_ALL_ACCESS, newSize.HighPart, newSize.LowPart, view.dwMapViewSize);
+        // Update memory usage atomically
+        manager->getUsedMemory().fetch_add(window.size, std::memory_order_relaxed);
 
-        if (view.lpMapAddress == nullptr) {
-            throw std::runtime_error("Failed to map view of file. Error code: " + std::to_string(GetLastError()));
+        return window;
+    }
+
+    MappedWindow* MMFile::insertWindow(const MappedWindow& mapped)
+    {
+        std::multimap<uint64_t, MappedWindow>::iterator it;
+        if (!spareWindows.empty()) {
+            auto node = std::move(spareWindows.back());
+            spareWindows.pop_back();
+            node.key() = mapped.start;
+            node.mapped() = mapped;
+            it = windows.insert(std::move(node));
+        }
+        else {
+            it = windows.emplace(mapped.start, mapped);
         }
 
-        // Update memory usage atomically
-        manager->getUsedMemory().fetch_add(view.dwMapViewSize, std::memory_order_relaxed);
+        MappedWindow& window = it->second;
+        largestWindow = (std::max)(largestWindow, window.size);
+        return &window;
+    }
+
+    void MMFile::dropWindow(std::multimap<uint64_t, MappedWindow>::iterator it)
+    {
+        // Keep a few nodes so remapping after an eviction allocates nothing
+        constexpr size_t spareLimit = 16;
+        if (spareWindows.capacity() == 0) spareWindows.reserve(spareLimit);
+        if (spareWindows.size() < spareLimit) spareWindows.push_back(windows.extract(it));
+        else windows.erase(it);
+    }
 
-        return view;
+    MemView& MMFile::attachView(MappedWindow* window, size_t offset, size_t size, bool write)
+    {
+        MemView* view = viewTable.acquire();
+        window->refs.fetch_add(1, std::memory_order_relaxed);
+        if (write && (!window->privateCopy || forked)) markDirty(offset, size);    // loadPrivate writes never reach the file
+
+        view->parent = this;
+        view->window = window;
+        view->_offset = offset;
+        view->lpMapAddress = window->address;
+        view->iViewDelta = static_cast<uint32_t>(offset - window->start);
+        view->dwMapViewSize = static_cast<uint32_t>(view->iViewDelta + size);
+        return *view;
+    }
+
+    bool MMFile::releaseWindow(MappedWindow* window)
+    {
+        if (window->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) return false;
+        if (window->privateCopy) return true;   // its writes are dropped with the view, unmap it now
+        window->lastUse.store(manager->stampViewUse(), std::memory_order_relaxed);
+        return manager->getUsedMemory().load(std::memory_order_relaxed) > manager->getViewCacheBudget();
+    }
+
+    void MMFile::evictWindow(MappedWindow* window)
+    {
+        manager->getUsedMemory().fetch_sub(window->size, std::memory_order_relaxed);
+        manager->getGovernor().notifyUnmapped();
+        if (!window->privateCopy) Platform::flushView(window->address, window->size);  // flush modified view to file cache
+        Platform::unmapView(window->address, window->size);
+        if (window->privateCopy) {
+            --privateWindows;
+        }
+        else if (manager->getGovernor().getPressure() == MemoryPressure::Hard) {
+            Platform::adviseFile(getFileHandle(), dataOffset + window->start, window->size, Platform::Advice::DontNeed);
+        }
+
+        auto range = windows.equal_range(window->start);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (&it->second == window) {
+                dropWindow(it);
+                break;
+            }
+        }
+    }
+
+    void MMFile::trimWindows()
+    {
+        evictIdlePrivate();
+        if (manager->getUsedMemory().load(std::memory_order_relaxed) <= manager->getViewCacheBudget()) return;
+        manager->trimIdleViews(this);
+    }
+
+    void MMFile::evictIdlePrivate()
+    {
+        // Nobody can take a reference meanwhile, loads hold at least the shared lock
+        if (privateWindows == 0) return;
+        for (auto it = windows.begin(); it != windows.end(); ) {
+            MappedWindow& window = (it++)->second;
+            if (window.privateCopy && window.refs.load(std::memory_order_relaxed) == 0) evictWindow(&window);
+        }
     }
 
     MemView& MMFile::load(size_t offset, size_t size)
@@ -48,36 +161,326 @@ namespace SoraMem
             throw std::out_of_range("Offset exceeds file size. File size: " + std::to_string(getFileSize()) + ", Offset: " + std::to_string(offset));
         }
 
-        MemView view;
-        _load(view, offset, size);
-
-        // Use emplace for efficient insertion
-        return views.emplace(view.lpMapAddress, std::move(view)).first->second;
+        MappedWindow* window = findWindow(offset, size);
+        if (window == nullptr) {
+            admitWindow(size, false);
+            window = insertWindow(mapWindow(offset, size));
+        }
+        if (readAheadDistance != 0) trackStream(offset, size);
+        return attachView(window, offset, size);
     }
 
     MemView& MMFile::load_s(size_t offset, size_t size)
+    {
+        return loadShared_s(offset, size, true);
+    }
+
+    MemView& MMFile::loadForRead_s(size_t offset, size_t size)
+    {
+        return loadShared_s(offset, size, false);
+    }
+
+    MemView& MMFile::loadShared_s(size_t offset, size_t size, bool write)
     {
         {
+            // Hits only read the window map, the view slot and window refcount are atomic
             std::shared_lock<std::shared_mutex> lock(mutex);
-            if (!isValid()) {
-                throw std::invalid_argument("Invalid file or map handle.");
+            checkRange(offset, size);
+
+            if (readAheadDistance != 0) {
+                std::lock_guard<std::mutex> stream(streamMutex);
+                trackStream(offset, size);
+            }
+            if (MappedWindow* window = findWindow(offset, size)) return attachView(window, offset, size, write);
+        }
+
+        // A racing load of the same range just ends up with a second window
+        for (;;) {
+            admitWindow(size, true);
+            uint64_t epoch = 0;
+            MappedWindow mapped;
+            {
+                std::shared_lock<std::shared_mutex> lock(mutex);
+                checkRange(offset, size);
+                if (MappedWindow* window = findWindow(offset, size)) return attachView(window, offset, size, write);
+                epoch = mapEpoch;
+                mapped = mapWindow(offset, size);
             }
+
+            std::unique_lock<std::shared_mutex> lock(mutex);
+            if (mapEpoch == epoch) return attachView(insertWindow(mapped), offset, size, write);
+            discardWindow(mapped);
+        }
+    }
+
+    void MMFile::discardWindow(const MappedWindow& window) noexcept
+    {
+        manager->getUsedMemory().fetch_sub(window.size, std::memory_order_relaxed);
+        manager->getGovernor().notifyUnmapped();
+        Platform::unmapView(window.address, window.size);
+    }
+
+    void MMFile::checkRange(uint64_t offset, size_t size) const
+    {
+        if (!isValid()) {
+            throw std::invalid_argument("Invalid file or map handle.");
         }
 
         if (offset + size > getFileSize()) {
             throw std::out_of_range("Offset exceeds file size. File size: " + std::to_string(getFileSize()) + ", Offset: " + std::to_string(offset));
         }
+    }
 
-        MemView view;
-        {
-            std::lock_guard<std::mutex> lock(view.mutex);
-            _load(view, offset, size);
+    MemView& MMFile::loadPrivate(size_t offset, size_t size)
+    {
+        if (!isValid()) {
+            throw std::invalid_argument("Invalid file or map handle.");
         }
 
-        {
+        if (forked) {
+            throw std::invalid_argument("A forked file has no private views, its pages are private already.");
+        }
+
+        if (offset + size > getFileSize()) {
+            throw std::out_of_range("Offset exceeds file size. File size: " + std::to_string(getFileSize()) + ", Offset: " + std::to_string(offset));
+        }
+
+        admitWindow(size, false);
+        MappedWindow* window = insertWindow(mapWindow(offset, size, true));
+        ++privateWindows;
+        return attachView(window, offset, size);
+    }
+
+    MemView& MMFile::loadPrivate_s(size_t offset, size_t size)
+    {
+        for (;;) {
+            admitWindow(size, true);
+            uint64_t epoch = 0;
+            MappedWindow mapped;
+            {
+                std::shared_lock<std::shared_mutex> lock(mutex);
+                checkRange(offset, size);
+                if (forked) {
+                    throw std::invalid_argument("A forked file has no private views, its pages are private already.");
+                }
+                epoch = mapEpoch;
+                mapped = mapWindow(offset, size, true);
+            }
+
+            std::unique_lock<std::shared_mutex> lock(mutex);
+            if (mapEpoch != epoch) {
+                discardWindow(mapped);
+                continue;
+            }
+            MappedWindow* window = insertWindow(mapped);
+            ++privateWindows;
+            return attachView(window, offset, size);
+        }
+    }
+
+    void MMFile::admitWindow(size_t size, bool lockFile)
+    {
+        MemoryGovernor& governor = manager->getGovernor();
+        const size_t bytes = (std::max)(size, manager->getViewWindowSize());
+        if (!governor.wouldThrottle(bytes)) return;
+
+        // The cache cap follows the mapped bytes now, a fresh sample is left to the thread admit wakes
+        governor.refresh();
+        if (lockFile) {
             std::unique_lock<std::shared_mutex> lock(mutex);
-            return views.emplace(view.lpMapAddress, std::move(view)).first->second;
+            trimWindows();
         }
+        else {
+            trimWindows();
+        }
+        governor.admit(bytes);
+    }
+
+    PoolAwaitable<MemView&> MMFile::loadAsync(size_t offset, size_t size)
+    {
+        return { manager->getThreadPool(), [this, offset, size]() -> MemView& {
+            MemView& view = load_s(offset, size);
+            view.advise(Platform::Advice::WillNeed);
+            view.warmPages();
+            return view;
+        } };
+    }
+
+    void MMFile::trackStream(size_t offset, size_t size)
+    {
+        streamLength = (offset == streamEnd) ? streamLength + 1 : 0;
+        streamEnd = offset + size;
+        if (streamLength < 2) {
+            prefetchedEnd = streamEnd;
+            return;
+        }
+
+        // Top up in steps of at least half the distance so every prefetch is worth a task
+        const uint64_t fileEnd = getFileSize();
+        const uint64_t from = (std::max)(prefetchedEnd, streamEnd);
+        const uint64_t to = (std::min)(streamEnd + readAheadDistance, fileEnd);
+        if (to > from && (to - from >= readAheadDistance / 2 || to == fileEnd)) {
+            prefetch(from, to - from);
+            prefetchedEnd = to;
+        }
+    }
+
+    std::shared_future<void> MMFile::prefetch(size_t offset, size_t size)
+    {
+        if (!isValid()) {
+            throw std::invalid_argument("Invalid file or map handle.");
+        }
+
+        if (offset + size > getFileSize()) {
+            throw std::out_of_range("Offset exceeds file size. File size: " + std::to_string(getFileSize()) + ", Offset: " + std::to_string(offset));
+        }
+
+        // Map whole granules (hugetlbfs needs them) but only touch the range
+        const uint64_t start = (offset / sysGran) * sysGran;
+        const uint64_t end = (std::min)(((offset + size + sysGran - 1) / sysGran) * sysGran, static_cast<uint64_t>(getFileSize()));
+        const size_t length = static_cast<size_t>(end - start);
+        const size_t first = offset - start;
+        const size_t last = offset + size - start;
+        const Platform::MapHandle handle = getMapHandle();
+        const uint64_t fileStart = dataOffset + start;
+        const size_t page = sysPageSize;
+        auto claimed = std::make_shared<std::atomic<bool>>(false);
+
+        auto task = [handle, fileStart, length, first, last, page, claimed]() {
+            if (claimed->exchange(true, std::memory_order_acq_rel)) return;     // cancelled, the handle may be gone
+            void* address = Platform::mapView(handle, fileStart, length);
+            if (address == nullptr) return;     // only a hint, the load will fault the pages in itself
+
+            Platform::adviseView(address, length, Platform::Advice::WillNeed);
+            const volatile char* bytes = static_cast<const char*>(address);
+            for (size_t i = first - first % page; i < last; i += page) (void)bytes[i];
+            Platform::unmapView(address, length);
+        };
+
+        std::shared_future<void> done;
+        ThreadPool* pool = manager->getThreadPool();
+        if (size != 0 && pool != nullptr) {
+            done = pool->submit(task).share();
+        }
+        else {
+            if (size != 0) task();
+            std::promise<void> ready;
+            ready.set_value();
+            done = ready.get_future().share();
+        }
+
+        std::lock_guard<std::mutex> lock(prefetchMutex);
+        prefetches.erase(std::remove_if(prefetches.begin(), prefetches.end(), [](const Prefetch& p) {
+            return p.done.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        }), prefetches.end());
+        prefetches.push_back({ done, std::move(claimed) });
+        return done;
+    }
+
+    void MMFile::waitAsync()
+    {
+        std::vector<Prefetch> pending;
+        {
+            std::lock_guard<std::mutex> lock(prefetchMutex);
+            pending.swap(prefetches);
+        }
+        // Waiting for a queued one could deadlock when this runs on the pool, so those are cancelled instead
+        for (auto& p : pending) {
+            if (p.claimed->exchange(true, std::memory_order_acq_rel)) p.done.wait();
+        }
+
+        for (uint32_t ops = asyncOps->load(std::memory_order_acquire); ops != 0; ops = asyncOps->load(std::memory_order_acquire)) {
+            asyncOps->wait(ops, std::memory_order_acquire);
+        }
+    }
+
+    void MMFile::submitAsync(uint64_t offset, void* buffer, size_t size, bool write, IOCallback done)
+    {
+        if (!isValid()) {
+            throw std::invalid_argument("Invalid file or map handle.");
+        }
+
+        if (forked) {
+            throw std::invalid_argument("Asynchronous I/O on a forked file would bypass its private pages.");
+        }
+
+        if (offset + size > getFileSize()) {
+            throw std::out_of_range("Offset exceeds file size. File size: " + std::to_string(getFileSize()) + ", Offset: " + std::to_string(offset));
+        }
+
+        if (size > UINT32_MAX) {
+            throw std::invalid_argument("Asynchronous request larger than 4 GB: " + std::to_string(size));
+        }
+
+        if (write) markDirty(offset, size);
+
+        IORequest request;
+        request.file = getFileHandle();
+        request.offset = dataOffset + offset;
+        request.buffer = buffer;
+        request.size = static_cast<uint32_t>(size);
+        request.write = write;
+        request.done = [ops = asyncOps, done = std::move(done)](int64_t result) {
+            if (done) done(result);
+            if (ops->fetch_sub(1, std::memory_order_acq_rel) == 1) ops->notify_all();
+        };
+
+        // submit runs the callback exactly once whatever happens, so only the callback counts down
+        AsyncIO& io = manager->getAsyncIO();
+        asyncOps->fetch_add(1, std::memory_order_relaxed);
+        io.submit({ &request, 1 });
+    }
+
+    void MMFile::readAsync(uint64_t offset, std::span<uint8_t> buffer, IOCallback done)
+    {
+        submitAsync(offset, buffer.data(), buffer.size(), false, std::move(done));
+    }
+
+    void MMFile::writeAsync(uint64_t offset, std::span<const uint8_t> buffer, IOCallback done)
+    {
+        submitAsync(offset, const_cast<uint8_t*>(buffer.data()), buffer.size(), true, std::move(done));
+    }
+
+    std::future<size_t> MMFile::readAsync(uint64_t offset, std::span<uint8_t> buffer)
+    {
+        auto promise = std::make_shared<std::promise<size_t>>();
+        std::future<size_t> result = promise->get_future();
+        readAsync(offset, buffer, [promise](int64_t bytes) {
+            if (bytes < 0) promise->set_exception(std::make_exception_ptr(std::runtime_error("Asynchronous read failed. Error code: " + std::to_string(-bytes))));
+            else promise->set_value(static_cast<size_t>(bytes));
+        });
+        return result;
+    }
+
+    std::future<size_t> MMFile::writeAsync(uint64_t offset, std::span<const uint8_t> buffer)
+    {
+        auto promise = std::make_shared<std::promise<size_t>>();
+        std::future<size_t> result = promise->get_future();
+        writeAsync(offset, buffer, [promise](int64_t bytes) {
+            if (bytes < 0) promise->set_exception(std::make_exception_ptr(std::runtime_error("Asynchronous write failed. Error code: " + std::to_string(-bytes))));
+            else promise->set_value(static_cast<size_t>(bytes));
+        });
+        return result;
+    }
+
+    void MMFile::advise(size_t offset, size_t size, Platform::Advice advice)
+    {
+        Platform::adviseFile(getFileHandle(), dataOffset + offset, size, advice);
+
+        const uint64_t end = offset + size;
+        for (auto& entry : windows) {
+            MappedWindow& window = entry.second;
+            const uint64_t from = (std::max)(window.start, static_cast<uint64_t>(offset));
+            const uint64_t to = (std::min)(window.start + window.size, end);
+            if (window.privateCopy && advice == Platform::Advice::DontNeed) continue;  // would throw the written pages away
+            if (from < to) Platform::adviseView(static_cast<uint8_t*>(window.address) + (from - window.start), static_cast<size_t>(to - from), advice);
+        }
+    }
+
+    void MMFile::advise_s(size_t offset, size_t size, Platform::Advice advice)
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        advise(offset, size, advice);
     }
 
     void MMFile::resize(const size_t& fileSize)
@@ -90,24 +493,43 @@ namespace SoraMem
             return; // No need to resize if the size is unchanged
         }
 
-        unloadAll();
-
-        HANDLE& mapHandle = setMapHandle();
-        HANDLE& fileHandle = setFileHandle();
+        if (forked) {
+            throw std::invalid_argument("A forked file cannot be resized.");
+        }
 
-        if (mapHandle != nullptr) {
-            CloseHandle(mapHandle);
+        if (reservedBase != nullptr && alignedSize > m_fileSize && alignedSize <= growCapacity) {
+            growDirty(alignedSize);
+            growReserved(alignedSize);
+            recordSize();
+            return;
         }
 
-        LARGE_INTEGER newSize;
-        newSize.QuadPart = static_cast<LONGLONG>(alignedSize);
+        growDirty(alignedSize);
+        waitAsync();   // prefetches and async requests must not see the file shrink or change handles
+        unloadAll();
 
-        if (!SetFilePointerEx(fileHandle, newSize, NULL, FILE_BEGIN) || !SetEndOfFile(fileHandle)) {
-            throw std::runtime_error("Failed to resize file to " + std::to_string(alignedSize) + " bytes. Error code: " + std::to_string(GetLastError()));
+        ++mapEpoch;
+        Platform::closeMapping(setMapHandle());
+
+        if (!Platform::resizeFile(getFileHandle(), dataOffset + alignedSize)) {
+            throw std::runtime_error("Failed to resize file to " + std::to_string(alignedSize) + " bytes. Error code: " + std::to_string(Platform::lastError()));
         }
 
         m_fileSize = alignedSize;
         createMapObj();
+
+        if (growCapacity >= alignedSize) mapReserved();
+        recordSize();
+    }
+
+    void MMFile::recordSize()
+    {
+        // The file itself grows past it with reserve's slack, a reopen after a crash takes this size
+        if (dataOffset == 0) return;
+        const uint64_t size = m_fileSize;
+        if (!Platform::writeFile(getFileHandle(), offsetof(SoraMemFileDescriptor, chunkSize), &size, sizeof(size))) {
+            throw std::runtime_error("Failed to record the file size in its descriptor. Error code: " + std::to_string(Platform::lastError()));
+        }
     }
 
     void MMFile::resize_s(const size_t& fileSize)
@@ -116,9 +538,311 @@ namespace SoraMem
         resize(fileSize);
     }
 
+    void MMFile::growTo_s(size_t fileSize)
+    {
+        if (getFileSize_s() >= fileSize) return;
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        if (m_fileSize < fileSize) resize(fileSize);   // another writer may have grown it meanwhile
+    }
+
+    void MMFile::reserve(size_t capacity)
+    {
+        if (!isValid()) {
+            throw std::invalid_argument("Invalid file or map handle.");
+        }
+
+        if (forked) {
+            throw std::invalid_argument("A forked file cannot be resized.");
+        }
+
+        capacity = ((capacity + sysGran - 1) / sysGran) * sysGran;
+        if (capacity < m_fileSize) {
+            throw std::invalid_argument("Reserved capacity is smaller than the file: " + std::to_string(capacity));
+        }
+
+        if (reservedBase != nullptr) unloadAll();    // views may live in the old range
+        growCapacity = capacity;
+        Platform::setSparse(getFileHandle());
+        mapReserved();
+    }
+
+    void MMFile::mapReserved()
+    {
+        reservedBase = static_cast<uint8_t*>(Platform::reserveAddressSpace(growCapacity, hugePages ? sysGran : 0));
+        if (reservedBase == nullptr) {
+            throw std::runtime_error("Failed to reserve " + std::to_string(growCapacity) + " bytes of address space. Error code: " + std::to_string(Platform::lastError()));
+        }
+
+        reservedMapped = 0;
+        MappedWindow window;
+        window.address = reservedBase;
+        window.refs = 1;    // pinned, only releaseReserved unmaps it
+        reservedWindow = insertWindow(window);
+
+        growReserved(m_fileSize);
+    }
+
+    void MMFile::growReserved(size_t fileSize)
+    {
+        if (fileSize > reservedMapped) {
+            // Double the backing each time so n appends cost log(n) extensions
+            size_t target = (std::max)(fileSize, 2 * reservedMapped);
+            target = (std::min)(((target + sysGran - 1) / sysGran) * sysGran, growCapacity);
+
+            if (!Platform::resizeFile(getFileHandle(), dataOffset + target)) {
+                throw std::runtime_error("Failed to resize file to " + std::to_string(target) + " bytes. Error code: " + std::to_string(Platform::lastError()));
+            }
+#ifdef _WIN32
+            waitAsync();
+            // A section cannot outgrow its maximum size, views of the old one stay valid on their own
+            ++mapEpoch;
+            Platform::closeMapping(setMapHandle());
+            createMapObj();
+#endif
+            const size_t size = target - reservedMapped;
+            void* address = Platform::mapViewAt(getMapHandle(), dataOffset + reservedMapped, size, reservedBase + reservedMapped);
+            if (address == nullptr) {
+                throw std::runtime_error("Failed to map view of file. Error code: " + std::to_string(Platform::lastError()));
+            }
+            if (hugePages) Platform::adviseHugePages(address, size);
+            reservedSegments.emplace_back(address, size);
+            manager->getUsedMemory().fetch_add(size, std::memory_order_relaxed);
+
+            reservedMapped = target;
+            reservedWindow->size = target;
+            largestWindow = (std::max)(largestWindow, target);
+        }
+        m_fileSize = fileSize;
+    }
+
+    uint32_t MMFile::openDirtyChannel()
+    {
+        for (uint32_t channel = 0; channel < maxDirtyChannels; ++channel) {
+            if (dirtyChannels & (1u << channel)) continue;
+
+            const size_t count = (getFileSize() + sysGran - 1) / sysGran;
+            if (dirtyChannels == 0) dirtyWords = (count + 63) / 64;
+            dirtyBits[channel] = std::make_unique<std::atomic<uint64_t>[]>(dirtyWords);
+            dirtyChannels |= 1u << channel;
+            markChannel(channel, 0, getFileSize());
+            if (++dirtySerial > UINT32_MAX / maxDirtyChannels) dirtySerial = 1;
+            dirtyHandles[channel] = dirtySerial * maxDirtyChannels + channel;
+            return dirtyHandles[channel];
+        }
+        throw std::runtime_error("Every dirty tracking channel of the file is taken.");
+    }
+
+    void MMFile::closeDirtyChannel(uint32_t channel)
+    {
+        const uint32_t slot = channelSlot(channel);
+        if (slot == maxDirtyChannels) return;
+        dirtyChannels &= ~(1u << slot);
+        dirtyHandles[slot] = 0;
+        dirtyBits[slot].reset();
+        if (dirtyChannels == 0) dirtyWords = 0;
+    }
+
+    uint32_t MMFile::channelSlot(uint32_t channel) const noexcept
+    {
+        const uint32_t slot = channel % maxDirtyChannels;
+        if (channel == 0 || !(dirtyChannels & (1u << slot)) || dirtyHandles[slot] != channel) return maxDirtyChannels;
+        return slot;
+    }
+
+    void MMFile::markChannel(uint32_t channel, uint64_t offset, uint64_t size) noexcept
+    {
+        if (size == 0 || dirtyWords == 0) return;
+
+        const uint64_t first = offset / sysGran;
+        const uint64_t last = (std::min)((offset + size - 1) / sysGran, static_cast<uint64_t>(dirtyWords) * 64 - 1);
+        std::atomic<uint64_t>* bits = dirtyBits[channel].get();
+        for (uint64_t bit = first; bit <= last; ) {
+            const uint64_t end = (std::min)(last + 1, (bit | 63) + 1);
+            const uint64_t span = end - bit;
+            const uint64_t mask = ((span == 64) ? ~0ULL : ((1ULL << span) - 1)) << (bit & 63);
+            std::atomic<uint64_t>& word = bits[bit / 64];
+            if ((word.load(std::memory_order_relaxed) & mask) != mask) word.fetch_or(mask, std::memory_order_relaxed);
+            bit = end;
+        }
+    }
+
+    void MMFile::markDirty(uint64_t offset, uint64_t size) noexcept
+    {
+        for (uint32_t open = dirtyChannels; open != 0; open &= open - 1) markChannel(std::countr_zero(open), offset, size);
+    }
+
+    void MMFile::growDirty(size_t fileSize)
+    {
+        if (dirtyChannels == 0) return;
+
+        const size_t words = ((fileSize + sysGran - 1) / sysGran + 63) / 64;
+        if (words > dirtyWords) {
+            for (uint32_t open = dirtyChannels; open != 0; open &= open - 1) {
+                auto& channel = dirtyBits[std::countr_zero(open)];
+                auto bits = std::make_unique<std::atomic<uint64_t>[]>(words);
+                for (size_t i = 0; i < dirtyWords; ++i) bits[i].store(channel[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+                channel = std::move(bits);
+            }
+            dirtyWords = words;
+        }
+        if (fileSize > getFileSize()) markDirty(getFileSize(), fileSize - getFileSize());
+    }
+
+    std::vector<uint64_t> MMFile::takeDirty(uint32_t channel, size_t granule)
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        std::vector<uint64_t> granules;
+        const uint32_t slot = channelSlot(channel);
+        if (slot == maxDirtyChannels) {
+            throw std::invalid_argument("Dirty tracking channel " + std::to_string(channel) + " is not open.");
+        }
+
+        const uint64_t perGranule = (std::max)((granule + sysGran - 1) / sysGran, size_t(1));
+        const uint64_t count = (getFileSize() + perGranule * sysGran - 1) / (perGranule * sysGran);
+        if (reservedBase != nullptr) {
+            granules.resize(count);
+            for (uint64_t i = 0; i < count; ++i) granules[i] = i;
+            return granules;
+        }
+
+        std::atomic<uint64_t>* bits = dirtyBits[slot].get();
+        for (size_t i = 0; i < dirtyWords; ++i) {
+            for (uint64_t word = bits[i].exchange(0, std::memory_order_relaxed); word != 0; word &= word - 1) {
+                const uint64_t index = (i * 64 + std::countr_zero(word)) / perGranule;
+                if (index < count && (granules.empty() || granules.back() != index)) granules.push_back(index);
+            }
+        }
+
+        // Views still loaded may be written after this, the fork's pinned window only counts with views in it
+        for (auto& entry : windows) {
+            const MappedWindow& window = entry.second;
+            const uint32_t pinned = (&window == forkWindow) ? 1 : 0;
+            if (window.privateCopy && !forked) continue;
+            if (window.refs.load(std::memory_order_relaxed) > pinned) markChannel(slot, window.start, window.size);
+        }
+        return granules;
+    }
+
+    bool MMFile::isDirty(uint32_t channel) const
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        const uint32_t slot = channelSlot(channel);
+        if (slot == maxDirtyChannels) {
+            throw std::invalid_argument("Dirty tracking channel " + std::to_string(channel) + " is not open.");
+        }
+        if (reservedBase != nullptr) return true;
+
+        const std::atomic<uint64_t>* bits = dirtyBits[slot].get();
+        for (size_t i = 0; i < dirtyWords; ++i) {
+            if (bits[i].load(std::memory_order_relaxed) != 0) return true;
+        }
+        for (const auto& entry : windows) {
+            const MappedWindow& window = entry.second;
+            const uint32_t pinned = (&window == forkWindow) ? 1 : 0;
+            if (window.privateCopy && !forked) continue;
+            if (window.refs.load(std::memory_order_relaxed) > pinned) return true;
+        }
+        return false;
+    }
+
+    void MMFile::read(uint64_t offset, void* buffer, size_t size)
+    {
+        if (offset + size > getFileSize()) {
+            throw std::out_of_range("Offset exceeds file size. File size: " + std::to_string(getFileSize()) + ", Offset: " + std::to_string(offset));
+        }
+
+        if (forkWindow != nullptr) {
+            std::memcpy(buffer, static_cast<const uint8_t*>(forkWindow->address) + offset, size);
+            return;
+        }
+        const size_t step = (std::max)(manager->getViewWindowSize(), size_t(sysGran));
+        for (size_t done = 0; done < size; done += step) {
+            const size_t length = (std::min)(step, size - done);
+            MemView& view = loadForRead_s(offset + done, length);
+            std::memcpy(static_cast<uint8_t*>(buffer) + done, view.getPtr(), length);
+            unload_s(view);
+        }
+    }
+
+    void MMFile::write(uint64_t offset, const void* buffer, size_t size)
+    {
+        const size_t step = (std::max)(manager->getViewWindowSize(), size_t(sysGran));
+        for (size_t done = 0; done < size; done += step) {
+            const size_t length = (std::min)(step, size - done);
+            MemView& view = load_s(offset + done, length);
+            std::memcpy(view.getPtr(), static_cast<const uint8_t*>(buffer) + done, length);
+            unload_s(view);
+        }
+    }
+
+    void MMFile::mapFork()
+    {
+        forked = true;
+        if (getFileSize() == 0) return;
+
+        MappedWindow window;
+        window.size = getFileSize();
+        window.privateCopy = true;
+        window.address = Platform::mapViewPrivate(getMapHandle(), dataOffset, window.size, hugePages ? sysGran : 0);
+        if (window.address == nullptr) {
+            throw std::runtime_error("Failed to map view of file. Error code: " + std::to_string(Platform::lastError()));
+        }
+        if (hugePages) Platform::adviseHugePages(window.address, window.size);
+        window.refs = 1;    // pinned, unloading every view keeps the written pages
+        manager->getUsedMemory().fetch_add(window.size, std::memory_order_relaxed);
+        forkWindow = insertWindow(window);
+    }
+
+    void MMFile::releaseFork()
+    {
+        forked = false;
+        if (forkWindow == nullptr) return;
+
+        manager->getUsedMemory().fetch_sub(forkWindow->size, std::memory_order_relaxed);
+        manager->getGovernor().notifyUnmapped();
+        Platform::unmapView(forkWindow->address, forkWindow->size);
+        auto range = windows.equal_range(0);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (&it->second == forkWindow) {
+                dropWindow(it);
+                break;
+            }
+        }
+        forkWindow = nullptr;
+        largestWindow = 0;
+    }
+
+    void MMFile::releaseReserved()
+    {
+        if (reservedBase == nullptr) return;
+
+        for (auto& segment : reservedSegments) {
+            Platform::flushView(segment.first, segment.second);
+            Platform::unmapViewAt(segment.first, segment.second);
+        }
+        Platform::releaseAddressSpace(reservedBase, growCapacity);
+        manager->getUsedMemory().fetch_sub(reservedMapped, std::memory_order_relaxed);
+        manager->getGovernor().notifyUnmapped();
+
+        // Give back the geometric slack beyond the logical size
+        if (reservedMapped > m_fileSize) Platform::resizeFile(getFileHandle(), dataOffset + m_fileSize);
+
+        auto range = windows.equal_range(0);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (&it->second == reservedWindow) {
+                dropWindow(it);
+                break;
+            }
+        }
+        reservedSegments.clear();
+        reservedWindow = nullptr;
+        reservedBase = nullptr;
+        reservedMapped = 0;
+    }
+
     void MMFile::createMapObj()
     {
-        setMapHandle() = CreateFileMapping(getFileHandle(), NULL, PAGE_READWRITE, 0, 0, NULL);
+        setMapHandle() = Platform::createMapping(getFileHandle());
     }
 
     void MMFile::createMapObj_s()
@@ -129,34 +853,62 @@ namespace SoraMem
 
     void MMFile::unload(MemView& view)
     {
-        auto it = views.find(view.lpMapAddress);
-        if (it == views.end()) {
-            return; // View not found
+        MappedWindow* window = viewTable.release(view);
+        if (window == nullptr) {
+            return; // Not one of this file's views, or already unloaded
         }
 
-        manager->getUsedMemory().fetch_sub(view.dwMapViewSize, std::memory_order_relaxed);
-        FlushViewOfFile(view.getViewOrigin(), view.getViewSize());  // flush modified view to file cache
-        UnmapViewOfFile(view.lpMapAddress);
-        views.erase(it);
+        if (releaseWindow(window)) trimWindows();
     }
 
     void MMFile::unload_s(MemView& view)
     {
-        std::unique_lock<std::shared_mutex> lock(mutex);
-        unload(view);
+        bool trim = false;
+        bool privateCopy = false;
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            MappedWindow* window = viewTable.release(view);
+            if (window == nullptr) return;
+            privateCopy = window->privateCopy;
+            trim = releaseWindow(window);
+        }
+        if (!trim) return;
+
+        // Over budget the manager's trim takes the locks it can get, the exclusive one is only waited
+        // for to unmap a private window
+        if (privateCopy) {
+            std::unique_lock<std::shared_mutex> lock(mutex);
+            trimWindows();
+        }
+        else {
+            manager->trimIdleViews();
+        }
     }
 
     void MMFile::unloadAll()
     {
         size_t totalFreedMemory = 0;
 
-        for (auto it = views.begin(); it != views.end(); ) {
-            totalFreedMemory += it->second.dwMapViewSize;
-            UnmapViewOfFile(it->second.lpMapAddress);
-            it = views.erase(it); // Efficiently erase while iterating
+        viewTable.releaseAll();
+
+        releaseReserved();
+
+        // A fork's window holds its data, only releaseFork lets go of it
+        for (auto it = windows.begin(); it != windows.end(); ) {
+            if (&it->second == forkWindow) {
+                ++it;
+                continue;
+            }
+            totalFreedMemory += it->second.size;
+            Platform::unmapView(it->second.address, it->second.size);
+            dropWindow(it++);
         }
-        FlushFileBuffers(getFileHandle());
+        largestWindow = (forkWindow != nullptr) ? forkWindow->size : 0;
+        privateWindows = 0;
+
+        if (!forked) Platform::flushFile(getFileHandle());
         manager->getUsedMemory().fetch_sub(totalFreedMemory, std::memory_order_relaxed);
+        manager->getGovernor().notifyUnmapped();
     }
 
     void MMFile::unloadAll_s()
@@ -165,17 +917,34 @@ namespace SoraMem
         unloadAll();
     }
 
+    bool MMFile::flush()
+    {
+        // Private windows never reach the file, the growable range is flushed by the segments mapping it
+        bool flushed = true;
+        for (const auto& entry : windows) {
+            const MappedWindow& window = entry.second;
+            if (window.privateCopy || &window == reservedWindow) continue;
+            flushed &= Platform::flushView(window.address, window.size);
+        }
+        for (const auto& segment : reservedSegments) flushed &= Platform::flushView(segment.first, segment.second);
+        if (!forked) flushed &= Platform::flushFile(getFileHandle());
+        return flushed;
+    }
+
+    bool MMFile::flush_s()
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return flush();
+    }
+
     void MMFile::closeAllPtr()
     {
+        waitAsync();
         unloadAll();
-        if (getMapHandle() != nullptr) {
-            CloseHandle(getMapHandle());
-            setMapHandle() = nullptr;
-        }
-        if (getFileHandle() != nullptr) {
-            CloseHandle(getFileHandle());
-            setFileHandle() = nullptr;
-        }
+        releaseFork();
+        ++mapEpoch;
+        Platform::closeMapping(setMapHandle());
+        Platform::closeFile(setFileHandle());
     }
 
     void MMFile::closeAllPtr_s()
@@ -198,10 +967,20 @@ namespace SoraMem
 
     void MMFile::reset()
     {
+        waitAsync();
         unloadAll_s();
-        CloseHandle(getMapHandle());
-        setMapHandle() = nullptr;
-        m_fileSize = 0;
+        releaseFork();
+        {
+            std::unique_lock<std::shared_mutex> lock(mutex);
+            ++mapEpoch;
+            Platform::closeMapping(setMapHandle());
+            m_fileSize = 0;
+        }
+        growCapacity = 0;
+        for (uint32_t handle : dirtyHandles) closeDirtyChannel(handle);
+        readAheadDistance = 0;
+        streamEnd = prefetchedEnd = 0;
+        streamLength = 0;
     }
     
     uint32_t MMFile::getCRC32() noexcept
@@ -216,14 +995,127 @@ namespace SoraMem
 
     MMFile::~MMFile()
     {
-        FlushFileBuffers(getFileHandle());
+        if (!Platform::isValid(getFileHandle())) return;    // never opened, or handed back by MemoryManager::free
+
+        Platform::flushFile(getFileHandle());
         closeAllPtr();
         std::unique_lock<std::shared_mutex> lock(mutex);
-        manager->addTmpInactive((unsigned long)m_fileID);
+        if (!isPermanent()) manager->addTmpInactive((unsigned long)m_fileID);
         m_fileSize = 0;
         m_fileID = 0;
     }
 
+    //-------- ViewTable definitions ---------
+
+    struct ViewTable::Slot
+    {
+        MemView                 view;
+        std::atomic<uint32_t>   generation{ 0 };
+        std::atomic<uint32_t>   next{ 0 };      // free stack link, slot + 1 (0 = end)
+        std::atomic<bool>       live{ false };
+    };
+
+    ViewTable::~ViewTable()
+    {
+        for (auto& block : blocks) delete[] block.load(std::memory_order_relaxed);
+    }
+
+    ViewTable::Slot* ViewTable::slotAt(uint32_t index) const noexcept
+    {
+        const uint32_t block = static_cast<uint32_t>(std::bit_width(index / firstBlock + 1)) - 1;
+        if (block >= maxBlocks) return nullptr;
+        Slot* slots = blocks[block].load(std::memory_order_acquire);
+        if (slots == nullptr) return nullptr;
+        return slots + (index - firstBlock * ((1u << block) - 1));
+    }
+
+    void ViewTable::push(uint32_t first, uint32_t last)
+    {
+        Slot* tail = slotAt(last);
+        uint64_t head = freeHead.load(std::memory_order_relaxed);
+        do {
+            tail->next.store(static_cast<uint32_t>(head), std::memory_order_relaxed);
+        } while (!freeHead.compare_exchange_weak(head, (((head >> 32) + 1) << 32) | (first + 1),
+            std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    void ViewTable::grow()
+    {
+        std::lock_guard<std::mutex> lock(growMutex);
+        if (static_cast<uint32_t>(freeHead.load(std::memory_order_acquire)) != 0) return;   // another thread grew it
+
+        if (blockCount == maxBlocks) {
+            throw std::runtime_error("View table is full");
+        }
+
+        const uint32_t count = firstBlock << blockCount;
+        const uint32_t base = firstBlock * ((1u << blockCount) - 1);
+        Slot* slots = new Slot[count];
+        for (uint32_t i = 0; i < count; ++i) {
+            slots[i].view.slot = base + i;
+            slots[i].next.store(base + i + 2, std::memory_order_relaxed);
+        }
+        blocks[blockCount++].store(slots, std::memory_order_release);
+        push(base, base + count - 1);
+    }
+
+    MemView* ViewTable::acquire()
+    {
+        for (;;) {
+            uint64_t head = freeHead.load(std::memory_order_acquire);
+            while (static_cast<uint32_t>(head) != 0) {
+                const uint32_t index = static_cast<uint32_t>(head) - 1;
+                Slot* slot = slotAt(index);
+                const uint64_t next = slot->next.load(std::memory_order_relaxed);
+                if (freeHead.compare_exchange_weak(head, (((head >> 32) + 1) << 32) | next,
+                    std::memory_order_acquire, std::memory_order_acquire)) {
+                    slot->view.generation = slot->generation.load(std::memory_order_relaxed);
+                    slot->live.store(true, std::memory_order_release);
+                    liveViews.fetch_add(1, std::memory_order_relaxed);
+                    return &slot->view;
+                }
+            }
+            grow();
+        }
+    }
+
+    MappedWindow* ViewTable::release(MemView& view)
+    {
+        Slot* slot = (view.slot == UINT32_MAX) ? nullptr : slotAt(view.slot);
+        if (slot == nullptr || &slot->view != &view) return nullptr;
+
+        // Only one of two racing unloads of the same view gets the slot back. The loser must not read the
+        // view either, unloadAll may have handed its slot to another load already.
+        bool live = true;
+        if (!slot->live.compare_exchange_strong(live, false, std::memory_order_acq_rel)) return nullptr;
+
+        MappedWindow* window = view.window;
+        view.parent = nullptr;
+        slot->generation.fetch_add(1, std::memory_order_release);
+        liveViews.fetch_sub(1, std::memory_order_relaxed);
+        push(view.slot, view.slot);
+        return window;
+    }
+
+    void ViewTable::releaseAll()
+    {
+        for (uint32_t block = 0; block < maxBlocks; ++block) {
+            Slot* slots = blocks[block].load(std::memory_order_relaxed);
+            if (slots == nullptr) break;
+            for (uint32_t i = 0; i < (firstBlock << block); ++i) {
+                if (slots[i].live.load(std::memory_order_relaxed)) release(slots[i].view);
+            }
+        }
+    }
+
+    MemView* ViewTable::find(ViewHandle handle) const noexcept
+    {
+        Slot* slot = (handle.slot == UINT32_MAX) ? nullptr : slotAt(handle.slot);
+        if (slot == nullptr || !slot->live.load(std::memory_order_acquire)) return nullptr;
+        if (slot->generation.load(std::memory_order_acquire) != handle.generation) return nullptr;
+        return &slot->view;
+    }
+
     //-------- MemView definitions ---------
 
     MemView::~MemView()
@@ -232,6 +1124,13 @@ namespace SoraMem
         parent->unload(*this);
     }
 
+    bool MemView::advise(Platform::Advice advice) const
+    {
+        // Dropping private pages would lose what was written to them
+        if (advice == Platform::Advice::DontNeed && isPrivate()) return false;
+        return Platform::adviseView(getPtr(), getAllocatedViewSize(), advice);
+    }
+
     void* MemView::getPtr_s() const 
     {
         std::lock_guard<std::mutex> lock(mutex);
@@ -1,10 +1,18 @@
 #pragma once
 
-#include <unordered_map>
-#include <Windows.h>
+#include <atomic>
+#include <future>
+#include <map>
+#include <memory>
+#include <utility>
+#include <vector>
 #include <shared_mutex>
 #include <mutex>
+#include <stdexcept>
+#include "src/Platform/Platform.hpp"
 #include "src/CRC32_64/CRC32_64.hpp"
+#include "src/AsyncIO/AsyncIO.hpp"
+#include "src/ThreadPool/ThreadPool.hpp"
 
 namespace SoraMem
 {
@@ -12,6 +20,45 @@ namespace SoraMem
 
     class MMFile;
 
+    // One mapping of the file, shared by every view whose range it contains
+    struct MappedWindow
+    {
+        MappedWindow() {}
+        MappedWindow(const MappedWindow& other)
+            : address(other.address),
+            start(other.start),
+            size(other.size),
+            privateCopy(other.privateCopy),
+            refs(other.refs.load(std::memory_order_relaxed)),
+            lastUse(other.lastUse.load(std::memory_order_relaxed))
+        {}
+
+        MappedWindow& operator=(const MappedWindow& other)
+        {
+            address = other.address;
+            start = other.start;
+            size = other.size;
+            privateCopy = other.privateCopy;
+            refs.store(other.refs.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            lastUse.store(other.lastUse.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            return *this;
+        }
+
+        void*       address = nullptr;
+        uint64_t    start = 0;          // granule aligned file offset
+        size_t      size = 0;
+        bool        privateCopy = false;    // copy-on-write mapping, never flushed or shared between loads
+        std::atomic<uint32_t> refs{ 0 };    // views handed out, idle windows stay mapped until evicted
+        std::atomic<uint64_t> lastUse{ 0 }; // release order, the oldest idle window is evicted first
+    };
+
+    // Names a loaded view without pointing at it, stale once the view is unloaded
+    struct ViewHandle
+    {
+        uint32_t    slot = UINT32_MAX;
+        uint32_t    generation = 0;
+    };
+
     class MemView
     {
     public:
@@ -22,15 +69,17 @@ namespace SoraMem
             dwMapViewSize(other.dwMapViewSize),
             iViewDelta(other.iViewDelta),
             _offset(other._offset),
-            parent(other.parent)
-        {}
+            parent(other.parent),
+            window(other.window)
+        {}  // a copy is not registered, unloading it does nothing
 
         MemView(MemView&& other) noexcept
             : lpMapAddress(other.lpMapAddress),
             dwMapViewSize(other.dwMapViewSize),
             iViewDelta(other.iViewDelta),
             _offset(other._offset),
-            parent(other.parent)
+            parent(other.parent),
+            window(other.window)
         {
             // Leave other's data in a valid state if necessary
             other.lpMapAddress = nullptr;
@@ -38,6 +87,7 @@ namespace SoraMem
             other.iViewDelta = 0;
             other._offset = 0;
             other.parent = nullptr;
+            other.window = nullptr;
             // mutex is default constructed, not moved
         }
 
@@ -48,6 +98,7 @@ namespace SoraMem
             iViewDelta      = view.iViewDelta;
             _offset         = view._offset;
             parent          = view.parent;
+            window          = view.window;
             return *this;
         }
 
@@ -59,12 +110,14 @@ namespace SoraMem
                 iViewDelta = other.iViewDelta;
                 _offset = other._offset;
                 parent = other.parent;
+                window = other.window;
 
                 other.lpMapAddress = nullptr;
                 other.dwMapViewSize = 0;
                 other.iViewDelta = 0;
                 other._offset = 0;
                 other.parent = nullptr;
+                other.window = nullptr;
                 // mutex is not moved
             }
             return *this;
@@ -82,6 +135,9 @@ namespace SoraMem
 
         uint64_t    getViewSize() const { return static_cast<uint64_t>(dwMapViewSize); }
 
+        ViewHandle  getHandle() const noexcept { return { slot, generation }; }
+        bool        isPrivate() const noexcept { return window != nullptr && window->privateCopy; }
+
         template<typename T>
         T& at(size_t index)
         {
@@ -92,47 +148,148 @@ namespace SoraMem
         }
 
         void  warmPages();
+        bool  advise(Platform::Advice advice) const;    // hint for the view's range
         ~MemView();
 
     private:
         friend class MMFile;
+        friend class ViewTable;
 
-        LPVOID        lpMapAddress = nullptr;     // first address of the mapped view
+        void*         lpMapAddress = nullptr;     // first address of the mapped view
         uint32_t      dwMapViewSize = 0;          // the size of the view
         uint32_t      iViewDelta = 0;             // Offset from lpMapAddr
         uint64_t      _offset = 0;                // Offset from origin
 
         MMFile*       parent = nullptr;
+        MappedWindow* window = nullptr;           // mapping the view lives in
+
+        uint32_t      slot = UINT32_MAX;          // place in the parent's ViewTable, never copied or moved
+        uint32_t      generation = 0;
 
         mutable std::mutex mutex;
     };
 
+    // Views of one file. Slots come in blocks that never move until the table goes away, so references
+    // handed out stay valid, and free slots sit on a lock-free stack so threads load and unload without
+    // a common lock. Unloading bumps the slot's generation, which makes its handles stale.
+    class ViewTable
+    {
+    public:
+        ViewTable() {}
+        ~ViewTable();
+
+        ViewTable(ViewTable const&) = delete;
+        void operator=(ViewTable const&) = delete;
+
+        MemView*    acquire();
+        MappedWindow* release(MemView& view);           // the view's window, nullptr unless view is a live slot of this table
+        void        releaseAll();                       // caller excludes every other access
+        MemView*    find(ViewHandle handle) const noexcept;
+
+        size_t      getLiveViews() const noexcept { return liveViews.load(std::memory_order_relaxed); }
+
+    private:
+        struct Slot;
+
+        // Block k holds firstBlock << k slots, so a few blocks cover any realistic number of views
+        static constexpr uint32_t firstBlock = 32;
+        static constexpr uint32_t maxBlocks = 24;
+
+        Slot*       slotAt(uint32_t index) const noexcept;
+        void        push(uint32_t first, uint32_t last);    // links [first, last] onto the free stack
+        void        grow();
+
+        std::atomic<Slot*>      blocks[maxBlocks] = {};
+        std::atomic<uint64_t>   freeHead{ 0 };          // ABA tag in the high half, slot + 1 in the low half (0 = empty)
+        std::atomic<size_t>     liveViews{ 0 };
+        uint32_t                blockCount = 0;         // guarded by growMutex
+        std::mutex              growMutex;
+    };
+
     class MMFile
     {
     public:
         friend class MemoryManager;
+        friend class MemoryFilePool;
 
         MMFile(){}
 
         MemView&                load(size_t offset, size_t size); // offset and size in bytes
+        // Copy-on-write view: writes land in pages only this view sees and are dropped when it is unloaded.
+        // Every call maps a window of its own, the view cache is not used.
+        MemView&                loadPrivate(size_t offset, size_t size);
         void                    unload(MemView& view);
         void                    unloadAll();
+        // Writes of live and cached views and the file itself to disk, views stay loaded. False on a failure.
+        bool                    flush();
         void                    resize(const size_t& fileSize); // in bytes
         void                    reset();
+
+        // Growable mode: address space for capacity bytes is reserved once and the file is mapped into it
+        // contiguously. Growing within the capacity extends the file in geometric (sparse) steps and maps
+        // only the new tail, so getData() and every live view stay valid.
+        void                    reserve(size_t capacity);
+        void*                   getData()           const noexcept { return reservedBase; }
+        size_t                  getCapacity()       const noexcept { return growCapacity; }
+
+        // Access hint for [offset, offset + size): the page cache and every mapped window over the range
+        void                    advise(size_t offset, size_t size, Platform::Advice advice);
+        void                    advise_s(size_t offset, size_t size, Platform::Advice advice);
+        // Reads the range into memory on the manager's pool through a mapping of its own, the view cache is
+        // not touched. Resizing or closing the file waits for prefetches still running and cancels those
+        // still queued, so a pool task may free a file it prefetched.
+        std::shared_future<void> prefetch(size_t offset, size_t size);
+        // Loads that continue where the previous one ended count as a stream, once one is detected the next
+        // distance bytes are kept prefetched ahead of it (0 = off)
+        void                    setReadAhead(size_t distance) noexcept { readAheadDistance = distance; }
+
+        // Reads and writes through the manager's AsyncIO engine instead of the mapping, for cold data that
+        // would otherwise fault in page by page. They share the page cache with views. The buffer must stay
+        // alive until completion, resizing or closing the file waits for requests in flight.
+        std::future<size_t>     readAsync(uint64_t offset, std::span<uint8_t> buffer);
+        std::future<size_t>     writeAsync(uint64_t offset, std::span<const uint8_t> buffer);
+        void                    readAsync(uint64_t offset, std::span<uint8_t> buffer, IOCallback done);
+        void                    writeAsync(uint64_t offset, std::span<const uint8_t> buffer, IOCallback done);
         void                    createMapObj();
 
         bool                    isValid()           const noexcept;
 
-        HANDLE                  getFileHandle()     const noexcept { return m_hFile; }
-        HANDLE                  getMapHandle()      const noexcept { return m_hMapFile; }
+        Platform::FileHandle    getFileHandle()     const noexcept { return m_hFile; }
+        Platform::MapHandle     getMapHandle()      const noexcept { return m_hMapFile; }
 
         size_t                  getID()             const noexcept { return m_fileID; }
 
         uint32_t                getSysGran()        const noexcept { return sysGran; }
         uint32_t                getSysPageSize()    const noexcept { return sysPageSize; }
+        bool                    usesHugePages()     const noexcept { return hugePages; }
+        bool                    isForked()          const noexcept { return forked; }  // made by MemoryManager::fork
+        // Offsets are relative to the data, a permanent file keeps its descriptor in the block before it
+        uint64_t                getDataOffset()     const noexcept { return dataOffset; }
+        bool                    isPermanent()       const noexcept { return dataOffset != 0; }  // made by MemoryManager::createPmnt
 
         size_t                  getFileSize()       const noexcept { return m_fileSize; }
 
+        // Dirty tracking: every open channel (one per consumer, like SnapshotStore or CRCTree) has a bit per
+        // sysGran bytes. Loads mark their range since the view may be written, as do async writes and kernel
+        // copies into the file. A new channel starts all dirty, growth is dirty, and growable files always are
+        // since their getData() writes are not seen. Channels are opened and closed while the file is idle.
+        // A channel handle is never 0 and goes stale when it is closed or the file is freed: closing a stale
+        // handle does nothing, so an owner outliving the file can't close the channel of the file's next user.
+        static constexpr uint32_t maxDirtyChannels = 4;
+        uint32_t                openDirtyChannel();         // throws std::runtime_error when all are taken
+        void                    closeDirtyChannel(uint32_t channel);
+        void                    markDirty(uint64_t offset, uint64_t size) noexcept;
+        // Indices of the dirty blocks of granule bytes (rounded up to sysGran), the channel's bits are cleared
+        // except under views still loaded
+        std::vector<uint64_t>   takeDirty(uint32_t channel, size_t granule);
+        // Whether takeDirty would find anything, nothing is cleared
+        bool                    isDirty(uint32_t channel) const;
+
+        // Copy bytes through cached views of at most a view window each, since hugetlbfs files have no
+        // read/write. read() marks nothing dirty, write() marks the range like any load. A fork reads its own pages.
+        void                    read(uint64_t offset, void* buffer, size_t size);
+        void                    write(uint64_t offset, const void* buffer, size_t size);
+
         CRC32_64&               getCRC()                  noexcept { return crc; }
         uint32_t                getCRC32()                noexcept;
         uint64_t                getCRC64()                noexcept;
@@ -142,24 +299,73 @@ namespace SoraMem
         //--------- Thread-safe methods ----------
 
         MemView&                load_s(size_t offset, size_t size); // offset and size in bytes
+        // Awaitable load_s: the range is mapped and faulted in on the manager's pool, the coroutine resumes there
+        PoolAwaitable<MemView&> loadAsync(size_t offset, size_t size);
+        MemView&                loadPrivate_s(size_t offset, size_t size);
 
         void                    unload_s(MemView& view);
         void                    unloadAll_s();
+        bool                    flush_s();
         void                    resize_s(const size_t& fileSize); // in bytes
+        void                    growTo_s(size_t fileSize);        // resize_s only if smaller, never shrinks
         void                    createMapObj_s();
 
         size_t                  getID_s();
 
         size_t                  getFileSize_s() const;
 
+        size_t                  getCachedWindows() const { return windows.size(); }
+        size_t                  getLiveViews()     const noexcept { return viewTable.getLiveViews(); }
+        // nullptr once the view behind the handle has been unloaded
+        MemView*                getView(ViewHandle handle) const noexcept { return viewTable.find(handle); }
+
     private:
-        MemView&                _load(MemView& view, size_t offset, size_t size);
+        // View cache: loads reuse any mapped window that contains the range, released windows stay
+        // mapped (least recently used first out) while the manager is under its mapped-bytes budget.
+        // Window refcounts are atomic so hits only need the shared lock, eviction takes the exclusive one.
+        MappedWindow*           findWindow(uint64_t offset, size_t size);
+        MappedWindow            mapWindow(uint64_t offset, size_t size, bool privateCopy = false);
+        MappedWindow*           insertWindow(const MappedWindow& mapped);
+        // Loads map under the shared lock and insert under the exclusive one, a window mapped before a resize
+        // or close in between (mapEpoch moved) is unmapped again and the load retried
+        void                    discardWindow(const MappedWindow& window) noexcept;
+        void                    checkRange(uint64_t offset, size_t size) const;
+        MemView&                attachView(MappedWindow* window, size_t offset, size_t size, bool write = true);
+        // load_s for the manager's own reads (checksums, copy sources), the range is not marked dirty
+        MemView&                loadForRead_s(size_t offset, size_t size);
+        MemView&                loadShared_s(size_t offset, size_t size, bool write);
+        bool                    releaseWindow(MappedWindow* window);    // true when an idle window should be trimmed
+        void                    evictWindow(MappedWindow* window);
+        void                    dropWindow(std::multimap<uint64_t, MappedWindow>::iterator it);
+        // Loads needing a new window wait while it would break the governor's hard budget, idle windows
+        // are evicted first
+        void                    admitWindow(size_t size, bool lockFile);
+        void                    trimWindows();          // idle private windows, then the manager's trim when over budget
+        void                    evictIdlePrivate();
+
+        void                    trackStream(size_t offset, size_t size);
+        void                    submitAsync(uint64_t offset, void* buffer, size_t size, bool write, IOCallback done);
+        void                    waitAsync();
+
+        // Forks map the whole base file copy-on-write once, written pages live as long as that mapping
+        void                    mapFork();
+        void                    releaseFork();
+
+        uint32_t                channelSlot(uint32_t channel) const noexcept;  // maxDirtyChannels when stale
+        void                    markChannel(uint32_t channel, uint64_t offset, uint64_t size) noexcept;
+        void                    growDirty(size_t fileSize);
+
+        void                    recordSize();   // a permanent file's descriptor keeps the logical size
+
+        void                    mapReserved();
+        void                    growReserved(size_t fileSize);
+        void                    releaseReserved();
 
         void                    closeAllPtr();
         void                    closeAllPtr_s();
 
-        HANDLE&                 setFileHandle()     noexcept { return m_hFile; }
-        HANDLE&                 setMapHandle()      noexcept { return m_hMapFile; }
+        Platform::FileHandle&   setFileHandle()     noexcept { return m_hFile; }
+        Platform::MapHandle&    setMapHandle()      noexcept { return m_hMapFile; }
 
         size_t&                 setID()             noexcept { return m_fileID; }
 
@@ -171,8 +377,9 @@ namespace SoraMem
 
         //--- Member Variables
 
-        HANDLE m_hMapFile = nullptr;        // handle for the file's memory-mapped region
-        HANDLE m_hFile = nullptr;           // the file handle
+        Platform::MapHandle  m_hMapFile = Platform::InvalidMap;     // handle for the file's memory-mapped region
+        uint64_t mapEpoch = 0;              // bumped under the exclusive lock whenever the mapping is closed or replaced
+        Platform::FileHandle m_hFile = Platform::InvalidFile;       // the file handle
 
         size_t m_fileSize = 0;              // temporary storage for file sizes  
         size_t m_fileID = 0;
@@ -180,12 +387,53 @@ namespace SoraMem
         uint32_t sysGran = 0;               // System granularity size
         uint32_t sysPageSize = 0;           // System page size
 
-        const uint64_t alignment = 64;    // Standard file alignment in bytes
+        uint64_t dataOffset = 0;            // file bytes before the data, sysGran aligned
+        uint64_t alignment = 64;            // Standard file alignment in bytes, the huge page size on hugetlbfs
+        bool hugePages = false;             // windows are huge page aligned and advised (sysGran is the huge page size)
         
         MemoryManager* manager = nullptr;
         CRC32_64 crc;
 
-        std::unordered_map<LPVOID, MemView> views;
+        ViewTable viewTable;
+        std::multimap<uint64_t, MappedWindow> windows;      // keyed by window start
+        std::vector<std::multimap<uint64_t, MappedWindow>::node_type> spareWindows;   // unmapped nodes, reused by insertWindow
+        size_t largestWindow = 0;                           // bounds the backwards search in findWindow
+        size_t privateWindows = 0;                          // loadPrivate windows, unmapped with their view
+
+        bool forked = false;
+        MappedWindow* forkWindow = nullptr;                 // pinned, the fork's only window
+
+        size_t growCapacity = 0;                            // set by reserve, 0 = plain resize
+        uint8_t* reservedBase = nullptr;
+        size_t reservedMapped = 0;                          // file bytes backing the range, >= m_fileSize
+        MappedWindow* reservedWindow = nullptr;             // pinned window covering [0, reservedMapped)
+        std::vector<std::pair<void*, size_t>> reservedSegments;
+
+        uint32_t dirtyChannels = 0;                         // bitmask of open channels
+        uint32_t dirtyHandles[maxDirtyChannels] = {};       // handle of each open channel, serial * max + slot
+        uint32_t dirtySerial = 0;
+        size_t dirtyWords = 0;                              // per channel
+        std::unique_ptr<std::atomic<uint64_t>[]> dirtyBits[maxDirtyChannels];  // replaced under the exclusive lock only
+
+        size_t readAheadDistance = 0;
+        uint64_t streamEnd = 0;                             // end of the previous load
+        uint64_t prefetchedEnd = 0;                         // read-ahead issued up to here
+        uint32_t streamLength = 0;                          // consecutive loads continuing the stream
+        std::mutex streamMutex;                             // load_s only holds the shared lock
+        struct Prefetch
+        {
+            std::shared_future<void>            done;
+            std::shared_ptr<std::atomic<bool>>  claimed;    // by the task when it starts, or by waitAsync to cancel it
+        };
+        std::vector<Prefetch> prefetches;
+        std::mutex prefetchMutex;
+        // Shared with completion callbacks, which may still touch it after the file is gone
+        std::shared_ptr<std::atomic<uint32_t>> asyncOps = std::make_shared<std::atomic<uint32_t>>(0);
+
+        uint32_t poolIndex = 0;                             // place in the MemoryFilePool slabs
+        std::atomic<bool> inUse{ false };                   // handed out by createTmp, the governor skips the rest
+        std::atomic<uint32_t> nextFree{ 0 };                // MemoryFilePool stack link, index + 1 (0 = end)
+
         mutable std::shared_mutex mutex;
     };
 
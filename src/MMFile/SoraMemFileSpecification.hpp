@@ -17,6 +17,7 @@ namespace SoraMem
         constexpr char DATA[8]        = { 'D','A','T','A',' ',' ',' ',' ' };    // Data file
         constexpr char SNAPLIST[8]    = { 'S','N','A','P','L','I','S','T' };    // Snapshots manager file
         constexpr char SNAPDATA[8]    = { 'S','N','A','P','D','A','T','A' };    // Snapshot file
+        constexpr char CRCTREE[8]     = { 'C','R','C','T','R','E','E',' ' };    // CRC tree of a data file
     }
 
 #pragma pack(push, 1)
@@ -49,8 +50,18 @@ namespace SoraMem
         uint64_t    crc64_8bitLookup[256];               // CRC64 8bit lookup table
         uint32_t    crc32_16bitLookup[65536];            // CRC32 16bit lookup table
         uint64_t    crc64_16bitLookup[65536];            // CRC64 16bit lookup table
-        
-        uint8_t     alignment2[851968 - 790112];         // 832KB alignment (this struct + 64 bytes header)
+        uint32_t    crc32Unscale;                        // CRC32 x^-33 mod polynomial (reflected)
+        uint32_t    alignment3;                          // Alignment
+        uint64_t    crc64Unscale;                        // CRC64 x^-65 mod polynomial (reflected)
+        uint32_t    crc32_slice16Lookup[16][256];        // CRC32 slice-by-16 lookup tables, [0] is the 8bit one
+        uint64_t    crc64_slice16Lookup[16][256];        // CRC64 slice-by-16 lookup tables, [0] is the 8bit one
+        uint64_t    crc32Fold[16][2];                    // CRC32 carry-less multiply folding constants
+        uint64_t    crc64Fold[16][2];                    // CRC64 carry-less multiply folding constants
+        uint32_t    crc32Powers[64];                     // CRC32 x^(8 * 2^k) mod polynomial, combine shifts
+        uint64_t    crc64Powers[64];                     // CRC64 x^(8 * 2^k) mod polynomial, combine shifts
+        uint64_t    lookupCRC;                           // CRC64-XZ of the 8bit and 16bit lookup tables
+
+        uint8_t     alignment2[851968 - 840568];         // 832KB alignment (this struct + 64 bytes header)
     };
 
     struct SoraMemSnapshotListFormat // .sl.soramem
@@ -0,0 +1,207 @@
+#include "MemCopy.hpp"
+#include "src/Platform/Platform.hpp"
+
+#include <atomic>
+#include <cstring>
+#include <immintrin.h>
+#include <stdexcept>
+#include <string>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace SoraMem
+{
+    namespace MemCopy
+    {
+        namespace
+        {
+            // Below this the call overhead of anything but the C library dominates
+            constexpr size_t smallCopy = 4096;
+
+            std::atomic<size_t> streamThreshold{ 8 * 1024 * 1024 };
+
+            void copyRepMovsb(void* dst, const void* src, size_t size)
+            {
+#ifdef _MSC_VER
+                __movsb(static_cast<unsigned char*>(dst), static_cast<const unsigned char*>(src), size);
+#else
+                __asm__ volatile("rep movsb" : "+D"(dst), "+S"(src), "+c"(size) : : "memory");
+#endif
+            }
+
+            template<bool stream>
+            SORAMEM_TARGET("avx2")
+            inline void store256(uint8_t* p, __m256i v)
+            {
+                if constexpr (stream) _mm256_stream_si256(reinterpret_cast<__m256i*>(p), v);
+                else _mm256_store_si256(reinterpret_cast<__m256i*>(p), v);
+            }
+
+            // The first and last vector are copied with unaligned accesses (they may overlap the body),
+            // the body runs from the first aligned destination address
+            template<bool stream>
+            SORAMEM_TARGET("avx2")
+            void copyAVX2(uint8_t* dst, const uint8_t* src, size_t size)
+            {
+                if (size < 64) {
+                    std::memcpy(dst, src, size);
+                    return;
+                }
+
+                const __m256i head = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src));
+                const __m256i tail = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + size - 32));
+
+                const size_t skip = (32 - (reinterpret_cast<uintptr_t>(dst) & 31)) & 31;
+                uint8_t* d = dst + skip;
+                const uint8_t* s = src + skip;
+                size_t n = size - skip;
+
+                for (; n >= 128; n -= 128, d += 128, s += 128) {
+                    const __m256i v0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s));
+                    const __m256i v1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + 32));
+                    const __m256i v2 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + 64));
+                    const __m256i v3 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + 96));
+                    store256<stream>(d, v0);
+                    store256<stream>(d + 32, v1);
+                    store256<stream>(d + 64, v2);
+                    store256<stream>(d + 96, v3);
+                }
+                for (; n >= 32; n -= 32, d += 32, s += 32) {
+                    store256<stream>(d, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s)));
+                }
+
+                // Non-temporal stores are weakly ordered, fence them before anyone else can look
+                if constexpr (stream) _mm_sfence();
+
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst), head);
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + size - 32), tail);
+            }
+
+            SORAMEM_TARGET("avx512f")
+            void copyAVX512Stream(uint8_t* dst, const uint8_t* src, size_t size)
+            {
+                if (size < 128) {
+                    copyAVX2<false>(dst, src, size);
+                    return;
+                }
+
+                const __m512i head = _mm512_loadu_si512(src);
+                const __m512i tail = _mm512_loadu_si512(src + size - 64);
+
+                const size_t skip = (64 - (reinterpret_cast<uintptr_t>(dst) & 63)) & 63;
+                uint8_t* d = dst + skip;
+                const uint8_t* s = src + skip;
+                size_t n = size - skip;
+
+                // Large copies walk four pages side by side, which keeps more DRAM rows open at once
+                constexpr size_t page = 4096;
+                for (; n >= 4 * page; n -= 4 * page, d += 4 * page, s += 4 * page) {
+                    for (size_t line = 0; line < page; line += 64) {
+                        const __m512i v0 = _mm512_loadu_si512(s + line);
+                        const __m512i v1 = _mm512_loadu_si512(s + page + line);
+                        const __m512i v2 = _mm512_loadu_si512(s + 2 * page + line);
+                        const __m512i v3 = _mm512_loadu_si512(s + 3 * page + line);
+                        _mm512_stream_si512(reinterpret_cast<__m512i*>(d + line), v0);
+                        _mm512_stream_si512(reinterpret_cast<__m512i*>(d + page + line), v1);
+                        _mm512_stream_si512(reinterpret_cast<__m512i*>(d + 2 * page + line), v2);
+                        _mm512_stream_si512(reinterpret_cast<__m512i*>(d + 3 * page + line), v3);
+                    }
+                }
+                for (; n >= 256; n -= 256, d += 256, s += 256) {
+                    const __m512i v0 = _mm512_loadu_si512(s);
+                    const __m512i v1 = _mm512_loadu_si512(s + 64);
+                    const __m512i v2 = _mm512_loadu_si512(s + 128);
+                    const __m512i v3 = _mm512_loadu_si512(s + 192);
+                    _mm512_stream_si512(reinterpret_cast<__m512i*>(d), v0);
+                    _mm512_stream_si512(reinterpret_cast<__m512i*>(d + 64), v1);
+                    _mm512_stream_si512(reinterpret_cast<__m512i*>(d + 128), v2);
+                    _mm512_stream_si512(reinterpret_cast<__m512i*>(d + 192), v3);
+                }
+                for (; n >= 64; n -= 64, d += 64, s += 64) {
+                    _mm512_stream_si512(reinterpret_cast<__m512i*>(d), _mm512_loadu_si512(s));
+                }
+                _mm_sfence();
+
+                _mm512_storeu_si512(dst, head);
+                _mm512_storeu_si512(dst + size - 64, tail);
+            }
+        }
+
+        bool isKernelSupported(Kernel kernel) noexcept
+        {
+            const Platform::CpuFeatures& cpu = Platform::getCpuFeatures();
+            switch (kernel) {
+            case Kernel::Memcpy:
+            case Kernel::RepMovsb:
+                return true;
+            case Kernel::AVX2:
+            case Kernel::AVX2Stream:
+                return cpu.avx2;
+            case Kernel::AVX512Stream:
+                return cpu.avx512f && cpu.avx2;
+            }
+            return false;
+        }
+
+        Kernel bestKernel(size_t totalSize) noexcept
+        {
+            const Platform::CpuFeatures& cpu = Platform::getCpuFeatures();
+
+            // A copy larger than the cache would only evict the working set
+            if (totalSize >= getStreamThreshold()) {
+                if (isKernelSupported(Kernel::AVX512Stream)) return Kernel::AVX512Stream;
+                if (isKernelSupported(Kernel::AVX2Stream)) return Kernel::AVX2Stream;
+            }
+            if (totalSize < smallCopy) return Kernel::Memcpy;
+            if (cpu.erms) return Kernel::RepMovsb;
+            if (cpu.avx2) return Kernel::AVX2;
+            return Kernel::Memcpy;
+        }
+
+        const char* kernelName(Kernel kernel) noexcept
+        {
+            switch (kernel) {
+            case Kernel::Memcpy:        return "memcpy";
+            case Kernel::RepMovsb:      return "rep movsb";
+            case Kernel::AVX2:          return "AVX2";
+            case Kernel::AVX2Stream:    return "AVX2 stream";
+            case Kernel::AVX512Stream:  return "AVX-512 stream";
+            }
+            return "unknown";
+        }
+
+        void setStreamThreshold(size_t bytes) noexcept
+        {
+            streamThreshold.store(bytes, std::memory_order_relaxed);
+        }
+
+        size_t getStreamThreshold() noexcept
+        {
+            return streamThreshold.load(std::memory_order_relaxed);
+        }
+
+        void copy(void* dst, const void* src, size_t size, Kernel kernel)
+        {
+            if (!isKernelSupported(kernel)) {
+                throw std::runtime_error(std::string("Copy kernel not supported by this CPU: ") + kernelName(kernel));
+            }
+
+            uint8_t* d = static_cast<uint8_t*>(dst);
+            const uint8_t* s = static_cast<const uint8_t*>(src);
+            switch (kernel) {
+            case Kernel::Memcpy:        std::memcpy(d, s, size); break;
+            case Kernel::RepMovsb:      copyRepMovsb(d, s, size); break;
+            case Kernel::AVX2:          copyAVX2<false>(d, s, size); break;
+            case Kernel::AVX2Stream:    copyAVX2<true>(d, s, size); break;
+            case Kernel::AVX512Stream:  copyAVX512Stream(d, s, size); break;
+            }
+        }
+
+        void copy(void* dst, const void* src, size_t size)
+        {
+            copy(dst, src, size, bestKernel(size));
+        }
+    }
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace SoraMem
+{
+    // Raw memory copy kernels, selected at runtime from the CPU features and the copy size
+    namespace MemCopy
+    {
+        enum class Kernel : uint8_t
+        {
+            Memcpy,         // C library memcpy
+            RepMovsb,       // microcoded string copy, fast with ERMS
+            AVX2,           // 32-byte unaligned loads, destination aligned stores
+            AVX2Stream,     // 32-byte non-temporal stores, the destination bypasses the cache
+            AVX512Stream    // 64-byte non-temporal stores
+        };
+
+        bool        isKernelSupported(Kernel kernel) noexcept;
+        Kernel      bestKernel(size_t totalSize) noexcept;     // totalSize is the whole copy, not one chunk of it
+        const char* kernelName(Kernel kernel) noexcept;
+
+        // Copies of at least this many bytes in total stream their stores past the cache
+        void        setStreamThreshold(size_t bytes) noexcept;
+        size_t      getStreamThreshold() noexcept;
+
+        void        copy(void* dst, const void* src, size_t size, Kernel kernel); // throws if the CPU lacks the instructions
+        void        copy(void* dst, const void* src, size_t size);                // bestKernel(size)
+    }
+}
@@ -0,0 +1,142 @@
+#include "MemoryGovernor.hpp"
+#include "src/MemoryManager/MemoryManager.hpp"
+
+#include <stdexcept>
+#include <string>
+
+namespace SoraMem
+{
+    void MemoryGovernor::start(const GovernorConfig& newConfig)
+    {
+        stop();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            config = newConfig;
+            stopping = false;
+        }
+        poll();
+        running.store(true, std::memory_order_relaxed);
+        thread = std::thread(&MemoryGovernor::run, this);
+    }
+
+    void MemoryGovernor::stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        if (thread.joinable()) thread.join();
+
+        running.store(false, std::memory_order_relaxed);
+        pressure.store(MemoryPressure::None, std::memory_order_relaxed);
+        cacheCap.store(SIZE_MAX, std::memory_order_relaxed);
+        notifyUnmapped();   // waiting loads go through without a governor
+    }
+
+    void MemoryGovernor::run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping) {
+            lock.unlock();
+            poll();
+            lock.lock();
+            // Throttled loads wake it early
+            wake.wait_for(lock, config.pollInterval);
+        }
+    }
+
+    MemoryPressure MemoryGovernor::poll()
+    {
+        return poll(Platform::getMemoryStatus());
+    }
+
+    MemoryPressure MemoryGovernor::poll(const Platform::MemoryStatus& sample)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            status = sample;
+        }
+        return evaluate(sample, true);
+    }
+
+    MemoryPressure MemoryGovernor::refresh()
+    {
+        return evaluate(getStatus(), false);
+    }
+
+    MemoryPressure MemoryGovernor::evaluate(const Platform::MemoryStatus& sample, bool trim)
+    {
+        GovernorConfig current;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            current = config;
+        }
+
+        // An unknown limit leaves only the configured budgets, there is no headroom to measure
+        const uint64_t limit = sample.limit;
+        const uint64_t soft = (current.softBudget != 0) ? current.softBudget : (limit != 0) ? limit / 2 : UINT64_MAX;
+        const uint64_t hard = (current.hardBudget != 0) ? current.hardBudget : (limit != 0) ? limit / 4 * 3 : UINT64_MAX;
+        const uint64_t reserve = static_cast<uint64_t>(current.minHeadroom * static_cast<double>(limit));
+        const bool shortOfHeadroom = limit != 0 && sample.available < reserve;
+        const bool nearlyOut = limit != 0 && sample.available < reserve / 2;
+        const uint64_t mapped = manager.getUsedMemory().load(std::memory_order_relaxed);
+
+        MemoryPressure level = MemoryPressure::None;
+        if (mapped > soft || shortOfHeadroom) level = MemoryPressure::Soft;
+        if (mapped > hard || nearlyOut) level = MemoryPressure::Hard;
+
+        // Mapped bytes the view cache may keep, idle windows are cheap to give up when memory runs short
+        size_t cap = SIZE_MAX;
+        if (mapped > soft) cap = static_cast<size_t>(soft);
+        if (shortOfHeadroom || level == MemoryPressure::Hard) cap = 0;
+
+        softBudget.store(static_cast<size_t>(soft), std::memory_order_relaxed);
+        hardBudget.store(static_cast<size_t>(hard), std::memory_order_relaxed);
+        pressure.store(level, std::memory_order_relaxed);
+        cacheCap.store(cap, std::memory_order_relaxed);
+
+        if (trim && current.trimIdleFiles && level != MemoryPressure::None) manager.trimIdleViews();
+        notifyUnmapped();   // the budgets may have moved
+        return level;
+    }
+
+    Platform::MemoryStatus MemoryGovernor::getStatus() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return status;
+    }
+
+    bool MemoryGovernor::wouldThrottle(size_t bytes) const noexcept
+    {
+        return running.load(std::memory_order_relaxed)
+            && manager.getUsedMemory().load(std::memory_order_relaxed) + bytes > hardBudget.load(std::memory_order_relaxed);
+    }
+
+    void MemoryGovernor::admit(size_t bytes)
+    {
+        if (!wouldThrottle(bytes)) return;
+
+        throttledLoads.fetch_add(1, std::memory_order_relaxed);
+        std::unique_lock<std::mutex> lock(mutex);
+        const auto deadline = std::chrono::steady_clock::now() + config.throttleTimeout;
+        waiters.fetch_add(1, std::memory_order_relaxed);
+        wake.notify_all();
+
+        // Room comes from other threads unloading (and trimming) or the governor thread evicting, both signal
+        const bool admitted = room.wait_until(lock, deadline, [&]() { return !wouldThrottle(bytes); });
+        waiters.fetch_sub(1, std::memory_order_relaxed);
+        if (!admitted) {
+            throw std::runtime_error("Mapping " + std::to_string(bytes) + " bytes would exceed the hard budget of "
+                + std::to_string(getHardBudget()) + " bytes");
+        }
+    }
+
+    void MemoryGovernor::notifyUnmapped() noexcept
+    {
+        if (waiters.load(std::memory_order_relaxed) == 0) return;
+        // Taking the lock orders the change before a waiter's next look
+        { std::lock_guard<std::mutex> lock(mutex); }
+        room.notify_all();
+    }
+}
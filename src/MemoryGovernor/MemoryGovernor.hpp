@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include "src/Platform/Platform.hpp"
+
+namespace SoraMem
+{
+    class MemoryManager;
+
+    struct GovernorConfig
+    {
+        // Without a known memory limit a budget left at 0 is off and no headroom is kept
+        size_t      softBudget = 0;         // mapped bytes, idle windows are evicted above it (0 = half the memory limit)
+        size_t      hardBudget = 0;         // mapped bytes, loads needing a new window wait above it (0 = 3/4 of the limit)
+        double      minHeadroom = 0.1;      // share of the limit to keep available, below it every idle window goes
+        // Evict idle windows of every file from the governor thread instead of at each file's next unload.
+        // It takes each file's lock, so files must then only be used through the _s calls.
+        bool        trimIdleFiles = false;
+        std::chrono::milliseconds pollInterval{ 100 };
+        std::chrono::milliseconds throttleTimeout{ 2000 };  // a throttled load throws std::runtime_error after this
+    };
+
+    enum class MemoryPressure : uint8_t
+    {
+        None,
+        Soft,       // over the soft budget or short of headroom: idle windows are evicted
+        Hard        // over the hard budget or nearly out of memory: page cache dropped, new windows wait
+    };
+
+    // Keeps a manager's mapped views inside soft and hard budgets derived from the system (or container)
+    // memory state. It acts through the view cache budget, which every file applies when it unloads, by
+    // dropping the page cache of evicted windows, and by making loads wait for room.
+    class MemoryGovernor
+    {
+    public:
+        explicit MemoryGovernor(MemoryManager& manager) : manager(manager) {}
+        ~MemoryGovernor() { stop(); }
+
+        MemoryGovernor(MemoryGovernor const&) = delete;
+        void operator=(MemoryGovernor const&) = delete;
+
+        void                    start(const GovernorConfig& config);   // restarts with the new config if running
+        void                    stop();
+        bool                    isRunning() const noexcept { return running.load(std::memory_order_relaxed); }
+
+        // Samples the memory state and updates the pressure now, the governor thread does this every pollInterval
+        MemoryPressure          poll();
+        MemoryPressure          poll(const Platform::MemoryStatus& sample);     // from a sample taken elsewhere
+        // Budgets and pressure for the mapped bytes now against the last sample, nothing is read or trimmed.
+        // Cheap enough for the load path.
+        MemoryPressure          refresh();
+
+        MemoryPressure          getPressure() const noexcept { return pressure.load(std::memory_order_relaxed); }
+        Platform::MemoryStatus  getStatus() const;
+        size_t                  getSoftBudget() const noexcept { return softBudget.load(std::memory_order_relaxed); }
+        size_t                  getHardBudget() const noexcept { return hardBudget.load(std::memory_order_relaxed); }
+        uint64_t                getThrottledLoads() const noexcept { return throttledLoads.load(std::memory_order_relaxed); }
+
+        // Mapped bytes above which files evict their idle windows, under the current pressure
+        size_t                  getCacheCap() const noexcept { return cacheCap.load(std::memory_order_relaxed); }
+
+        // True when mapping bytes more would break the hard budget
+        bool                    wouldThrottle(size_t bytes) const noexcept;
+        // Waits until bytes more fit in the hard budget, throws std::runtime_error after throttleTimeout
+        void                    admit(size_t bytes);
+        // Mapped memory went down, throttled loads look again (cheap without any)
+        void                    notifyUnmapped() noexcept;
+
+    private:
+        void                    run();
+        MemoryPressure          evaluate(const Platform::MemoryStatus& sample, bool trim);
+
+        MemoryManager&          manager;
+        GovernorConfig          config;                 // guarded by mutex
+        Platform::MemoryStatus  status;                 // last sample, guarded by mutex
+
+        std::atomic<MemoryPressure> pressure{ MemoryPressure::None };
+        std::atomic<size_t>     cacheCap{ SIZE_MAX };
+        std::atomic<size_t>     softBudget{ 0 };
+        std::atomic<size_t>     hardBudget{ 0 };
+        std::atomic<bool>       running{ false };
+        std::atomic<uint64_t>   throttledLoads{ 0 };
+        std::atomic<uint32_t>   waiters{ 0 };           // loads inside admit
+
+        mutable std::mutex      mutex;
+        std::condition_variable wake;
+        std::condition_variable room;                   // signalled by poll and unmapping while loads wait
+        bool                    stopping = false;
+        std::thread             thread;
+    };
+}
@@ -1,8 +1,12 @@
 #include "MemoryManager.hpp"
 
-#include <immintrin.h>
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
 #include <thread>
-#include <Windows.h>
 #include <iostream>
 #include <string>
 #include <vector>
@@ -11,35 +15,106 @@
 
 namespace SoraMem
 {
+    namespace
+    {
+        constexpr uint32_t pmntVersion = 1;
+        constexpr uint32_t confVersion = 2;
+        constexpr size_t confFileSize = sizeof(SoraMemFileDescriptor) + sizeof(SoraMemConfigFormat);
+        static_assert(confFileSize == 851968, "A .conf.soramem is 832KB");
+
+        // Covers the settings, the polynomials and the ~50KB the kernels read. The 768KB of 8/16-bit lookups
+        // only count through lookupCRC, so checking a config stays cheaper than computing its tables.
+        uint64_t configCRC(const SoraMemConfigFormat& conf)
+        {
+            const uint8_t* body = reinterpret_cast<const uint8_t*>(&conf);
+            const size_t tables = offsetof(SoraMemConfigFormat, crc32Unscale);
+            const uint64_t crc = CRC32_64::crc64XZ(body, offsetof(SoraMemConfigFormat, crc32_8bitLookup));
+            return CRC32_64::crc64XZ(body + tables, offsetof(SoraMemConfigFormat, alignment2) - tables, crc);
+        }
+    }
+
     void MemoryManager::initManager()
     {
         static std::once_flag initFlag;
         std::call_once(initFlag, [&]() {
-            SYSTEM_INFO SysInfo;
-            GetSystemInfo(&SysInfo);
-            dwSysGran = SysInfo.dwAllocationGranularity;
-            dwPageSize = SysInfo.dwPageSize;
+            Platform::SystemInfo SysInfo = Platform::getSystemInfo();
+            dwSysGran = SysInfo.allocationGranularity;
+            dwPageSize = SysInfo.pageSize;
+            hugePageSize = Platform::getHugePageSize();
             m_usedMem = 0;
             m_fileID = 0;
             permFileID = 0;
+            CRC32_64::init();   // once, a loaded config stays in use
             });
-        CRC32_64::init();
     }
 
     void MemoryManager::setTmpDir(const std::string& dir)
     {
         std::lock_guard<std::mutex> lock(mutex);
         tmpDir = dir;
-        if (!CreateDirectory(dir.c_str(), NULL) && GetLastError() != ERROR_ALREADY_EXISTS) {
+        if (!Platform::createDirectory(dir)) {
             throw std::runtime_error("Failed to create directory: " + dir);
         }
     }
 
-    void MemoryManager::createTmp(MMFile*& memPtr, const size_t& fileSize)
+    void MemoryManager::setPmntDir(const std::string& dir)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pmntDir = dir;
+        if (!Platform::createDirectory(dir)) {
+            throw std::runtime_error("Failed to create directory: " + dir);
+        }
+    }
+
+    void MemoryManager::setThreadPool(std::unique_ptr<ThreadPool>& pool)
+    {
+        workerPool = std::move(pool);
+
+        numaNodes.clear();
+        if (workerPool && workerPool->isNumaAware()) {
+            for (size_t node = 0; node < workerPool->getNodeCount(); ++node) {
+                if (workerPool->getNodeWorkers(node) > 0) numaNodes.push_back(node);
+            }
+        }
+        if (numaNodes.size() < 2) numaNodes.clear();
+    }
+
+    AsyncIO& MemoryManager::getAsyncIO()
+    {
+        std::call_once(asyncOnce, [this]() { asyncIO = std::make_unique<AsyncIO>(workerPool.get()); });
+        return *asyncIO;
+    }
+
+    void MemoryManager::setViewCache(size_t budgetBytes, size_t windowSize)
+    {
+        viewCacheBudget.store(budgetBytes, std::memory_order_relaxed);
+        viewWindowSize.store(windowSize, std::memory_order_relaxed);
+    }
+
+    void MemoryManager::createTmp(MMFile*& memPtr, const size_t& fileSize, bool hugePages)
+    {
+        const size_t alignedSize = (fileSize + 63) & ~size_t(63);
+        if (!hugePages && alignedSize == warmFileSize.load(std::memory_order_relaxed)) {
+            if (MMFile* warm = filePool.acquireWarm()) {
+                refillWarm();
+                if (warm->getFileSize() != alignedSize) warm->resize(fileSize);  // setWarmFiles raced the pop
+                warm->inUse.store(true, std::memory_order_release);
+                memPtr = warm;
+                return;
+            }
+        }
+
+        memPtr = openTmp(fileSize, hugePages);
+        memPtr->inUse.store(true, std::memory_order_release);
+        refillWarm();
+    }
+
+    MMFile* MemoryManager::openTmp(size_t fileSize, bool hugePages)
     {
         MMFile* tmp = filePool.acquire();
 
-        std::string dir;
+        // Reused per thread so building the name allocates nothing once it has held the longest one
+        thread_local std::string dir;
 
         unsigned long tmpID;
         {
@@ -48,316 +123,1160 @@ namespace SoraMem
                 tmpID = m_fileID++;
             }
             else {
-                tmpID = inactiveFileID.front();
-                inactiveFileID.pop_front();
+                tmpID = inactiveFileID.back();
+                inactiveFileID.pop_back();
             }
+            dir.assign(tmpDir);
         }
 
-        dir = tmpDir + std::to_string(tmpID) + ".tmpbin";
+        char name[24];
+        std::snprintf(name, sizeof(name), "%lu.tmpbin", tmpID);
+        dir.append(name);
 
         tmp->setID() = tmpID;
         tmp->setSysGran() = dwSysGran;
         tmp->setSysPageSize() = dwPageSize;
         tmp->setManager() = this;
-        tmp->setFileHandle() = CreateFile(dir.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        tmp->alignment = 64;
+        tmp->dataOffset = 0;
+        tmp->hugePages = hugePages && hugePageSize != 0;
+        tmp->setFileHandle() = Platform::InvalidFile;
 
-        if (tmp->setFileHandle() == INVALID_HANDLE_VALUE) {
-            delete tmp;
+        if (tmp->hugePages) {
+            tmp->setFileHandle() = Platform::createHugeFile(std::to_string(tmpID), fileSize);
+            if (Platform::isValid(tmp->getFileHandle())) {
+                // hugetlbfs files only come in whole pages
+                tmp->setSysGran() = static_cast<uint32_t>((std::max)(static_cast<size_t>(dwSysGran), hugePageSize));
+                tmp->setSysPageSize() = static_cast<uint32_t>(hugePageSize);
+                tmp->alignment = hugePageSize;
+            }
+            else if (Platform::canAdviseHugePages()) {
+                tmp->setSysGran() = static_cast<uint32_t>((std::max)(static_cast<size_t>(dwSysGran), hugePageSize));
+            }
+            else {
+                tmp->hugePages = false;     // nothing would back the windows with huge pages, keep the normal granularity
+            }
+        }
+        if (!Platform::isValid(tmp->getFileHandle())) tmp->setFileHandle() = Platform::createFile(dir);
+
+        if (!Platform::isValid(tmp->getFileHandle())) {
+            addTmpInactive(tmpID);
+            filePool.release(tmp);
             throw std::runtime_error("Failed to create temporary file: " + std::string(dir));
         }
 
-        tmp->resize(fileSize);
-        memPtr = tmp;
+        try {
+            tmp->resize(fileSize);
+        }
+        catch (...) {
+            free(tmp);
+            throw;
+        }
+        return tmp;
     }
 
-    void MemoryManager::createPmnt(MMFile* memPtr, const size_t& fileSize)
+    void MemoryManager::setWarmFiles(size_t count, size_t fileSize)
     {
-        MMFile& tmp = *memPtr;
+        const size_t alignedSize = (fileSize + 63) & ~size_t(63);
+        if (count == 0 || alignedSize != warmFileSize.load(std::memory_order_relaxed)) {
+            // Files of the old size are no use any more
+            warmTarget.store(0, std::memory_order_relaxed);
+            while (warmRefilling.load(std::memory_order_acquire)) warmRefilling.wait(true, std::memory_order_acquire);
+            filePool.clear([this](MMFile* warm) { free(warm); });
+        }
+
+        warmFileSize.store(alignedSize, std::memory_order_relaxed);
+        warmTarget.store(count, std::memory_order_relaxed);
+        refillWarm();
     }
 
-    void MemoryManager::memcopy_AVX2(MMFile*& _dst, void* _src, const size_t& _size)
+    void MemoryManager::refillWarm()
     {
-        if (_dst == nullptr) {
-            createTmp(_dst, _size);
-        }
+        if (filePool.warmSize() >= warmTarget.load(std::memory_order_relaxed)) return;
+        if (warmRefilling.exchange(true, std::memory_order_acquire)) return;
+
+        auto fill = [this]() {
+            for (;;) {
+                const size_t size = warmFileSize.load(std::memory_order_relaxed);
+                while (filePool.warmSize() < warmTarget.load(std::memory_order_relaxed)) {
+                    MMFile* warm = nullptr;
+                    try {
+                        warm = openTmp(size, false);
+                    }
+                    catch (...) {
+                        break;  // only an optimisation, createTmp reports the error itself
+                    }
+                    filePool.releaseWarm(warm);
+                }
+
+                warmRefilling.store(false, std::memory_order_release);
+                warmRefilling.notify_all();
+                // A pop between the last check and the reset would otherwise go unnoticed
+                if (filePool.warmSize() >= warmTarget.load(std::memory_order_relaxed)) return;
+                if (warmRefilling.exchange(true, std::memory_order_acquire)) return;
+            }
+        };
 
+        if (workerPool) workerPool->post(fill);
+        else fill();
+    }
+
+    MemoryManager::~MemoryManager()
+    {
+        governor.stop();
+        warmTarget.store(0, std::memory_order_relaxed);
+        while (warmRefilling.load(std::memory_order_acquire)) warmRefilling.wait(true, std::memory_order_acquire);
+
+        // Permanent files still open are sealed, so they reopen as clean
+        std::vector<MMFile*> open;
         {
-            std::shared_lock<std::shared_mutex> lockDst(_dst->mutex);
-            if (_dst->getFileSize() < _size) {
-                _dst->resize(_size);
+            std::lock_guard<std::mutex> lock(mutex);
+            for (const auto& entry : pmntFiles) open.push_back(entry.first);
+        }
+        for (MMFile* file : open) {
+            try {
+                closePmnt(file);
+            }
+            catch (const std::exception& ex) {
+                std::cerr << "Failed to seal a permanent file: " << ex.what() << '\n';
             }
         }
 
-        const size_t granularity = dwSysGran; // e.g., 65536
-        const size_t maxThreads = 100;
-        const size_t totalChunks = (_size + granularity - 1) / granularity;
-        const size_t numThreads = (std::min)(maxThreads, totalChunks);
-
-        const size_t chunksPerThread = totalChunks / numThreads;
-        const size_t remainderChunks = totalChunks % numThreads;
+        releaseConfig();
+    }
 
-        std::vector<std::future<bool>> threads;
-        threads.reserve(numThreads);
+    bool MemoryManager::createPmnt(MMFile*& memPtr, const std::string& name, const size_t& fileSize, PmntCheck check)
+    {
+        PmntFile pmnt;
+        MMFile* file = filePool.acquire();
+        {
+            // Held by the entry from here, two files sealing over each other would corrupt the descriptor
+            std::lock_guard<std::mutex> lock(mutex);
+            pmnt.path = pmntDir + name + ".bin.soramem";
+            for (const auto& entry : pmntFiles) {
+                if (entry.second.path == pmnt.path) {
+                    filePool.release(file);
+                    throw std::invalid_argument("Permanent file is already open: " + pmnt.path);
+                }
+            }
+            pmntFiles[file].path = pmnt.path;
+        }
+        const std::string& path = pmnt.path;
 
-        size_t currentOffset = 0;
+        file->setID() = permFileID++;
+        file->setSysGran() = dwSysGran;
+        file->setSysPageSize() = dwPageSize;
+        file->setManager() = this;
+        file->alignment = 64;
+        file->dataOffset = dwSysGran;
+        file->hugePages = false;
 
-        for (size_t i = 0; i < numThreads; ++i) {
-            size_t thisChunkCount = chunksPerThread + (i < remainderChunks ? 1 : 0);
-            size_t chunkSize = thisChunkCount * granularity;
+        file->setFileHandle() = Platform::openFile(path);
+        const bool reopened = Platform::isValid(file->getFileHandle());
+        try {
+            SoraMemFileDescriptor& descriptor = pmnt.descriptor;
+            if (reopened) {
+                // Only the descriptor is read, the data is mapped where it lies
+                const uint64_t onDisk = Platform::getFileSize(file->getFileHandle());
+                if (!Platform::readFile(file->getFileHandle(), 0, &descriptor, sizeof(descriptor))
+                    || std::memcmp(descriptor.baseMagic, "SMMF", 4) != 0 || descriptor.version != pmntVersion
+                    || std::memcmp(descriptor.subMagic, SoraMemSubMagicNumber::DATA, sizeof(descriptor.subMagic)) != 0
+                    || descriptor.subChunkSize < sizeof(descriptor) || descriptor.subChunkSize % dwSysGran != 0 || descriptor.subChunkSize > onDisk) {
+                    throw std::runtime_error("Not a SoraMem data file, or made for a larger allocation granularity: " + path);
+                }
 
-            size_t offset = currentOffset;
-            currentOffset += chunkSize;
+                // Unsealed means it was open at a crash, resizes kept the size up to date meanwhile
+                const uint64_t size = descriptor.chunkSize;
+                if (descriptor.subChunkSize + size > onDisk) {
+                    throw std::runtime_error("Permanent file is shorter than its descriptor says: " + path);
+                }
+                file->dataOffset = descriptor.subChunkSize;
+                file->m_fileSize = static_cast<size_t>(size);
+                file->createMapObj();
+            }
+            else {
+                file->setFileHandle() = Platform::createFile(path);
+                if (!Platform::isValid(file->getFileHandle())) {
+                    throw std::runtime_error("Failed to create permanent file: " + path);
+                }
+                descriptor.version = pmntVersion;
+                descriptor.subChunkSize = file->dataOffset;    // the descriptor's block
+                std::memcpy(descriptor.subMagic, SoraMemSubMagicNumber::DATA, sizeof(descriptor.subMagic));
+                if (!Platform::resizeFile(file->getFileHandle(), file->dataOffset)) {
+                    throw std::runtime_error("Failed to resize file to " + std::to_string(file->dataOffset) + " bytes. Error code: " + std::to_string(Platform::lastError()));
+                }
+                file->createMapObj();
+                file->resize(fileSize);
+            }
+            if (!file->isValid()) {
+                throw std::runtime_error("Failed to create file mapping.");
+            }
+            pmnt.channel = file->openDirtyChannel();
+            if (descriptor.flags & SoraMemFlags::CRC) file->takeDirty(pmnt.channel, dwSysGran);    // as sealed
 
-            size_t actualSize = (std::min)(chunkSize, _size - offset); // Clamp at the end
+            // Unsealed on disk while open, so a crash before the next seal shows
+            SoraMemFileDescriptor opened = descriptor;
+            opened.chunkSize = file->getFileSize();
+            opened.flags &= ~static_cast<uint64_t>(SoraMemFlags::CRC);
+            writeDescriptor(file, path, opened);
+        }
+        catch (...) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                pmntFiles.erase(file);
+            }
+            file->reset();
+            Platform::closeFile(file->setFileHandle());
+            filePool.release(file);
+            throw;
+        }
 
-            auto tmp = workerPool->submit([this](MMFile* _dst, void* _src, size_t offset, size_t _size) {
-                MemoryManager::copyThreadsRawPtr_AVX2(_dst, _src, offset, _size);
-                return true;
-                }, _dst, _src, offset, actualSize);
-            threads.push_back(std::move(tmp));
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pmntFiles[file] = pmnt;
         }
+        file->inUse.store(true, std::memory_order_release);
+        memPtr = file;
 
-        // Ensure all of the tasks are done
-        for (auto& thread : threads) {
-            volatile bool tmp = thread.get();
+        if (reopened && check != PmntCheck::None) {
+            // A check that could not run counts as failed here, its exception is passed on
+            std::exception_ptr error;
+            bool matches = false;
+            try {
+                std::shared_future<bool> verified = verifyPmnt(file);
+                matches = check != PmntCheck::Now || verified.get();
+            }
+            catch (...) {
+                error = std::current_exception();
+            }
+            if (!matches) {
+                {
+                    // Sealing would vouch for the damaged data, the old seal goes back so it keeps failing
+                    std::lock_guard<std::mutex> lock(mutex);
+                    pmntFiles.erase(file);
+                }
+                writeDescriptor(file, path, pmnt.descriptor);
+                free(file);
+                memPtr = nullptr;
+                if (error) std::rethrow_exception(error);
+                throw std::runtime_error("Permanent file does not match its CRC64: " + path);
+            }
         }
+        return reopened;
     }
 
-    void MemoryManager::memcopy(MMFile*& _dst, void* _src, const size_t& _size)
+    void MemoryManager::sealPmnt(MMFile* file)
     {
-        if (_dst == nullptr) {
-            createTmp(_dst, _size);
+        PmntFile pmnt;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = pmntFiles.find(file);
+            if (it == pmntFiles.end()) {
+                throw std::invalid_argument("Not a permanent file.");
+            }
+            pmnt = it->second;
+        }
+        if (pmnt.verified.valid()) {
+            // It compares against the previous seal. One that could not run runs again, and the old seal
+            // goes back when it fails again.
+            try {
+                try {
+                    pmnt.verified.get();
+                }
+                catch (...) {
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        auto it = pmntFiles.find(file);
+                        if (it != pmntFiles.end()) it->second.verified = {};
+                    }
+                    verifyPmnt(file).get();
+                }
+            }
+            catch (...) {
+                writeDescriptor(file, pmnt.path, pmnt.descriptor);
+                throw;
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = pmntFiles.find(file);
+            if (it != pmntFiles.end()) pmnt.damaged = it->second.damaged;
+        }
+        if (pmnt.damaged) {
+            writeDescriptor(file, pmnt.path, pmnt.descriptor);
+            throw std::runtime_error("Permanent file does not match its CRC64 and is not sealed again: " + pmnt.path);
         }
 
+        // The data is on disk before the descriptor vouching for it
+        SoraMemFileDescriptor& descriptor = pmnt.descriptor;
+        const bool unchanged = (descriptor.flags & SoraMemFlags::CRC) && descriptor.chunkSize == file->getFileSize_s()
+            && file->takeDirty(pmnt.channel, file->getSysGran()).empty();
+        if (!unchanged) descriptor.crc = getCRCTree(file).update();
+        descriptor.chunkSize = file->getFileSize_s();
+        if (!file->flush_s()) {
+            throw std::runtime_error("Failed to flush " + pmnt.path + ". Error code: " + std::to_string(Platform::lastError()));
+        }
+        descriptor.timestamp = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+        descriptor.flags = SoraMemFlags::CRC;   // CRC64-XZ
+        writeDescriptor(file, pmnt.path, descriptor);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = pmntFiles.find(file);
+        if (it == pmntFiles.end()) return;
+        it->second.descriptor = descriptor;
+        it->second.verified = {};
+    }
+
+    std::shared_future<bool> MemoryManager::verifyPmnt(MMFile* file)
+    {
+        SoraMemFileDescriptor descriptor;
+        auto check = [this, file](const SoraMemFileDescriptor& sealed) {
+            if (!(sealed.flags & SoraMemFlags::CRC)) return false;
+            if (file->getFileSize_s() == sealed.chunkSize && calcCRC64(file) == sealed.crc) return true;
+
+            // Only unwritten data failing is damage, written data just waits for its seal
+            uint32_t channel = 0;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                auto it = pmntFiles.find(file);
+                if (it == pmntFiles.end()) return false;
+                channel = it->second.channel;
+            }
+            if (!file->isDirty(channel)) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (auto it = pmntFiles.find(file); it != pmntFiles.end()) it->second.damaged = true;
+            }
+            return false;
+        };
         {
-            std::shared_lock<std::shared_mutex> lockDst(_dst->mutex);
-            if (_dst->getFileSize() < _size) {
-                _dst->resize(_size);
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = pmntFiles.find(file);
+            if (it == pmntFiles.end()) {
+                throw std::invalid_argument("Not a permanent file.");
+            }
+            PmntFile& pmnt = it->second;
+            if (pmnt.verified.valid()) return pmnt.verified;
+
+            descriptor = pmnt.descriptor;
+            if (workerPool) {
+                pmnt.verified = workerPool->submit([check, descriptor]() { return check(descriptor); }).share();
+                return pmnt.verified;
             }
         }
 
-        const size_t chunkSize = (std::min)(static_cast<size_t>(dwSysGran * 1024), _size);
-        const size_t numThreads = (_size + chunkSize - 1) / chunkSize;
+        // Inline without a pool, checksums take the manager's lock
+        std::promise<bool> result;
+        result.set_value(check(descriptor));
+        std::shared_future<bool> verified = result.get_future().share();
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = pmntFiles.find(file);
+        if (it != pmntFiles.end() && !it->second.verified.valid()) it->second.verified = verified;
+        return verified;
+    }
 
-        std::vector<std::future<bool>> threads;
-        threads.reserve(numThreads);
+    void MemoryManager::writeDescriptor(MMFile* file, const std::string& path, const SoraMemFileDescriptor& descriptor)
+    {
+        if (!Platform::writeFile(file->getFileHandle(), 0, &descriptor, sizeof(descriptor)) || !Platform::flushFile(file->getFileHandle())) {
+            throw std::runtime_error("Failed to write the descriptor of " + path + ". Error code: " + std::to_string(Platform::lastError()));
+        }
+    }
 
-        for (size_t i = 0; i < numThreads; ++i) {
-            size_t offset = i * chunkSize;
-            size_t chunkCpy = (std::min)(chunkSize, _size - offset);
-            auto tmp = workerPool->submit([this](MMFile* _dst, void* _src, size_t offset, size_t _size) {
-                MemoryManager::copyThreadsRawPtr(_dst, _src, offset, _size);
-                return true;
-                }, _dst, _src, offset, chunkCpy);
-            threads.push_back(std::move(tmp));
+    void MemoryManager::closePmnt(MMFile* file)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (pmntFiles.find(file) == pmntFiles.end()) return;    // a fork, or dropped unsealed
         }
 
-        // Ensure all of the tasks are done
-        for (auto& thread : threads) {
-            volatile bool tmp = thread.get();
+        try {
+            sealPmnt(file);
+        }
+        catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            pmntFiles.erase(file);
+            throw;
         }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        pmntFiles.erase(file);
     }
 
-    void MemoryManager::memcopy(MMFile*& _dst, MMFile* _src, const short& _typeSize, const size_t& _size)
+    void MemoryManager::loadConfig(const std::string& path, uint32_t crc32Poly, uint64_t crc64Poly)
     {
-        if (_dst == nullptr) createTmp(_dst, _size);
-        std::unique_lock<std::shared_mutex> lockDst(_dst->mutex);
-        std::unique_lock<std::shared_mutex> lockSrc(_src->mutex);
+        // An older config stays in use until this one is mapped
+        if (mapConfig(path, crc32Poly, crc64Poly)) return;
 
-        /*if (_dst->getFileHandle() == nullptr)
+        // Computed once, the next start maps them
+        auto buffer = std::make_unique<uint8_t[]>(confFileSize);
+        SoraMemConfigFormat& conf = *reinterpret_cast<SoraMemConfigFormat*>(buffer.get() + sizeof(SoraMemFileDescriptor));
         {
-            lockDst.unlock();
+            std::lock_guard<std::mutex> lock(mutex);
+            conf.maximumSaves = 16;     // SnapshotStore's default
+            conf.sysGran = static_cast<uint32_t>(dwSysGran);
+            conf.fileSizeAlignment = 64;
+            std::strncpy(conf.temporaryDir, tmpDir.c_str(), sizeof(conf.temporaryDir) - 1);
+            std::strncpy(conf.permanentDir, pmntDir.c_str(), sizeof(conf.permanentDir) - 1);
+        }
+        CRC32_64::writeTables(conf, crc32Poly, crc64Poly);
+
+        SoraMemFileDescriptor descriptor{};
+        descriptor.version = confVersion;
+        descriptor.chunkSize = sizeof(conf);
+        descriptor.timestamp = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+        descriptor.flags = SoraMemFlags::CRC;   // CRC64-XZ
+        descriptor.subChunkSize = sizeof(conf);
+        std::memcpy(descriptor.subMagic, SoraMemSubMagicNumber::CONF, sizeof(descriptor.subMagic));
+        descriptor.crc = configCRC(conf);
+        std::memcpy(buffer.get(), &descriptor, sizeof(descriptor));
+
+        Platform::FileHandle handle = Platform::createFile(path);
+        const bool written = Platform::isValid(handle) && Platform::writeFile(handle, 0, buffer.get(), confFileSize) && Platform::flushFile(handle);
+        const int error = Platform::lastError();
+        Platform::closeFile(handle);
+        if (!written) {
+            throw std::runtime_error("Failed to write the config " + path + ". Error code: " + std::to_string(error));
+        }
+        if (!mapConfig(path, crc32Poly, crc64Poly)) {
+            throw std::runtime_error("Failed to map the config " + path + ". Error code: " + std::to_string(Platform::lastError()));
+        }
+    }
+
+    bool MemoryManager::mapConfig(const std::string& path, uint32_t crc32Poly, uint64_t crc64Poly)
+    {
+        Platform::FileHandle handle = Platform::openFile(path);
+        if (!Platform::isValid(handle)) return false;
+
+        Platform::MapHandle map = Platform::InvalidMap;
+        void* view = nullptr;
+        if (Platform::getFileSize(handle) == confFileSize) {
+            map = Platform::createMapping(handle);
+            if (map != Platform::InvalidMap) view = Platform::mapView(map, 0, confFileSize);
+        }
+
+        bool valid = view != nullptr;
+        if (valid) {
+            SoraMemFileDescriptor descriptor;
+            std::memcpy(&descriptor, view, sizeof(descriptor));
+            const SoraMemConfigFormat& conf = *reinterpret_cast<const SoraMemConfigFormat*>(static_cast<const uint8_t*>(view) + sizeof(descriptor));
+            valid = std::memcmp(descriptor.baseMagic, "SMMF", 4) == 0 && descriptor.version == confVersion
+                && std::memcmp(descriptor.subMagic, SoraMemSubMagicNumber::CONF, sizeof(descriptor.subMagic)) == 0
+                && descriptor.chunkSize == sizeof(conf) && (descriptor.flags & SoraMemFlags::CRC) && descriptor.crc == configCRC(conf)
+                && conf.crc32Poly == CRC32_64::reflect32(crc32Poly) && conf.crc64Poly == CRC32_64::reflect64(crc64Poly);
+        }
+        if (!valid) {
+            if (view != nullptr) Platform::unmapView(view, confFileSize);
+            Platform::closeMapping(map);
+            Platform::closeFile(handle);
+            return false;
+        }
+
+        // Switched to before the older config, if any, is unmapped
+        if (confView == nullptr) tablesBeforeConfig = CRC32_64::getBinding();
+        CRC32_64::useTables(*reinterpret_cast<const SoraMemConfigFormat*>(static_cast<const uint8_t*>(view) + sizeof(SoraMemFileDescriptor)));
+        std::swap(confFile, handle);
+        std::swap(confMap, map);
+        std::swap(confView, view);
+        if (view != nullptr) {
+            Platform::unmapView(view, confFileSize);
+            Platform::closeMapping(map);
+            Platform::closeFile(handle);
+        }
+        return true;
+    }
+
+    void MemoryManager::releaseConfig() noexcept
+    {
+        if (confView == nullptr) return;
+        CRC32_64::setBinding(tablesBeforeConfig);
+        tablesBeforeConfig = {};
+        Platform::unmapView(confView, confFileSize);
+        Platform::closeMapping(confMap);
+        Platform::closeFile(confFile);
+        confView = nullptr;
+    }
+
+    double MemoryManager::getCopyBandwidth() const
+    {
+        std::call_once(calibrateOnce, [this]() { calibrateCopy(); });
+        return copyBandwidth.load(std::memory_order_relaxed);
+    }
+
+    void MemoryManager::calibrateCopy() const
+    {
+        // Larger than most per-core cache shares, so the figure reflects memory rather than cache speed
+        const size_t size = 8 * 1024 * 1024;
+        std::vector<uint8_t> src(size, 1), dst(size, 0);
+
+        double best = 0;
+        for (int i = 0; i < 3; ++i) {
+            auto start = std::chrono::steady_clock::now();
+            MemCopy::copy(dst.data(), src.data(), size);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            best = (std::max)(best, size / (std::max)(elapsed.count(), 1e-9));
+        }
+        copyBandwidth.store(best, std::memory_order_relaxed);
+    }
+
+    CopyPlan MemoryManager::planCopy(size_t size) const
+    {
+        constexpr double minTaskSeconds = 100e-6;  // dispatch and view mapping stay a few percent of a task
+
+        CopyPlan plan;
+        plan.kernel = MemCopy::bestKernel(size);
+        plan.chunkSize = (std::min)(size, CopyPlan::maxChunkSize);
+
+        // A task is never below one granule, smaller copies stay inline without paying for the calibration
+        const size_t granularity = dwSysGran ? dwSysGran : 4096;
+        if (size < 2 * granularity) return plan;
+
+        const double calibrated = getCopyBandwidth();
+        const double bandwidth = (calibrated > 0) ? calibrated : 1e9;
+        const double limit = copyBandwidthLimit.load(std::memory_order_relaxed);
+        const size_t minTaskBytes = (std::max)(granularity, static_cast<size_t>(bandwidth * minTaskSeconds));
+
+        size_t tasks = size / minTaskBytes;
+        if (workerPool) tasks = (std::min)(tasks, workerPool->getThreadCount() + 1);
+        else tasks = 1;
+        if (limit > 0) {
+            tasks = (std::min)(tasks, static_cast<size_t>(std::ceil(limit / bandwidth)));
+        }
+        if (tasks <= 1) return plan;
+
+        // Granule aligned chunks so every task maps whole windows, huge copies loop over several per task
+        const size_t chunk = (size + tasks - 1) / tasks;
+        plan.chunkSize = (std::min)((chunk + granularity - 1) / granularity * granularity, CopyPlan::maxChunkSize / granularity * granularity);
+        plan.tasks = (std::min)(tasks, (size + plan.chunkSize - 1) / plan.chunkSize);
+        return plan;
+    }
+
+    void MemoryManager::setNumaStripe(size_t bytes)
+    {
+        const size_t granularity = dwSysGran ? dwSysGran : 4096;
+        numaStripe.store((std::max)(granularity, (bytes + granularity - 1) / granularity * granularity), std::memory_order_relaxed);
+    }
+
+    size_t MemoryManager::getHomeNode(size_t offset) const noexcept
+    {
+        if (numaNodes.empty()) return 0;
+        return numaNodes[offset / numaStripe.load(std::memory_order_relaxed) % numaNodes.size()];
+    }
+
+    NumaStats MemoryManager::getNumaStats() const noexcept
+    {
+        NumaStats stats;
+        stats.localChunks = numaLocalChunks.load(std::memory_order_relaxed);
+        stats.remoteChunks = numaRemoteChunks.load(std::memory_order_relaxed);
+        stats.localBytes = numaLocalBytes.load(std::memory_order_relaxed);
+        stats.remoteBytes = numaRemoteBytes.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+    void MemoryManager::resetNumaStats() noexcept
+    {
+        numaLocalChunks.store(0, std::memory_order_relaxed);
+        numaRemoteChunks.store(0, std::memory_order_relaxed);
+        numaLocalBytes.store(0, std::memory_order_relaxed);
+        numaRemoteBytes.store(0, std::memory_order_relaxed);
+    }
+
+    void MemoryManager::countNumaChunk(size_t node, size_t bytes) noexcept
+    {
+        if (workerPool->getCurrentNode() == node) {
+            numaLocalChunks.fetch_add(1, std::memory_order_relaxed);
+            numaLocalBytes.fetch_add(bytes, std::memory_order_relaxed);
+        }
+        else {
+            numaRemoteChunks.fetch_add(1, std::memory_order_relaxed);
+            numaRemoteBytes.fetch_add(bytes, std::memory_order_relaxed);
+        }
+    }
+
+    template<typename F>
+    void MemoryManager::runOnNodes(size_t offset, size_t size, size_t maxConcurrency, F&& fn)
+    {
+        if (size == 0) return;
+        const size_t stripe = numaStripe.load(std::memory_order_relaxed);
+        const size_t perStripe = (stripe + CopyPlan::maxChunkSize - 1) / CopyPlan::maxChunkSize;
+        const size_t first = offset / stripe;
+        const size_t pieces = ((offset + size - 1) / stripe - first + 1) * perStripe;
+
+        // Pieces of the first and last stripe outside the range are empty
+        auto start = [&](size_t i) { return (first + i / perStripe) * stripe + i % perStripe * CopyPlan::maxChunkSize; };
+        workerPool->submit_bulk_numa(pieces, [&](size_t i) { return getHomeNode(start(i)); }, [&](size_t i) {
+            const size_t stripeEnd = (first + i / perStripe + 1) * stripe;
+            const size_t begin = (std::max)(offset, start(i));
+            const size_t end = (std::min)({ offset + size, stripeEnd, start(i) + CopyPlan::maxChunkSize });
+            if (begin >= end) return;
+            const size_t node = getHomeNode(begin);
+            countNumaChunk(node, end - begin);
+            fn(begin - offset, end - offset, node);
+            }, maxConcurrency);
+    }
+
+    template<typename F>
+    void MemoryManager::runPlanned(size_t size, const CopyPlan& plan, F&& fn)
+    {
+        if (size == 0) return;
+        const size_t chunks = (size + plan.chunkSize - 1) / plan.chunkSize;
+        auto chunk = [&](size_t i) {
+            const size_t begin = i * plan.chunkSize;
+            fn(begin, (std::min)(begin + plan.chunkSize, size));
+        };
+        if (plan.tasks <= 1 || !workerPool) {
+            for (size_t i = 0; i < chunks; ++i) chunk(i);
+            return;
+        }
+        workerPool->submit_bulk(chunks, chunk, plan.tasks);
+    }
+
+    void MemoryManager::copyPlanned(MMFile* _dst, void* _src, size_t _size, const CopyPlan& plan)
+    {
+        if (plan.tasks > 1 && isNumaAware()) {
+            runOnNodes(0, _size, plan.tasks, [&](size_t begin, size_t end, size_t node) {
+                copyThreadsRawPtr(_dst, _src, begin, end - begin, plan.kernel, node);
+                });
+            return;
+        }
+
+        runPlanned(_size, plan, [&](size_t begin, size_t end) {
+            copyThreadsRawPtr(_dst, _src, begin, end - begin, plan.kernel);
+            });
+    }
+
+    void MemoryManager::memcopy_AVX2(MMFile*& _dst, void* _src, const size_t& _size)
+    {
+        if (_dst == nullptr) {
             createTmp(_dst, _size);
-            lockDst.lock();
-        }*/
+        }
 
-        _dst->unloadAll();
-        _src->unloadAll();
+        _dst->growTo_s(_size);
 
-        CHAR lpDstFileName[MAX_PATH] = "";
-        CHAR lpSrcFileName[MAX_PATH] = "";
+        // Planned like memcopy, with the AVX2 kernels (streaming once the copy outgrows the cache)
+        CopyPlan plan = planCopy(_size);
+        if (MemCopy::isKernelSupported(MemCopy::Kernel::AVX2)) {
+            plan.kernel = (_size >= MemCopy::getStreamThreshold()) ? MemCopy::Kernel::AVX2Stream : MemCopy::Kernel::AVX2;
+        }
+        copyPlanned(_dst, _src, _size, plan);
+    }
 
-        GetFinalPathNameByHandle(_dst->getFileHandle(), lpDstFileName, MAX_PATH, FILE_NAME_NORMALIZED);
-        GetFinalPathNameByHandle(_src->getFileHandle(), lpSrcFileName, MAX_PATH, FILE_NAME_NORMALIZED);
+    void MemoryManager::memcopy(MMFile*& _dst, void* _src, const size_t& _size)
+    {
+        if (_dst == nullptr) {
+            createTmp(_dst, _size);
+        }
 
-        _dst->closeAllPtr();
-        _src->closeAllPtr();
-        CopyFile(lpSrcFileName, lpDstFileName, false);
-        _dst->setFileHandle() = CreateFile(lpDstFileName, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-        if (_dst->getFileHandle() == nullptr)
-            int e = GetLastError();
+        _dst->growTo_s(_size);
 
-        _src->setFileHandle() = CreateFile(lpSrcFileName, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-        _dst->m_fileSize = GetFileSize(_dst->getFileHandle(), NULL);
-        _dst->createMapObj();
-        _src->createMapObj();
+        copyPlanned(_dst, _src, _size, planCopy(_size));
     }
 
-    void MemoryManager::copyThreadsRawPtr(MMFile* _dst, void* _src, size_t offset, size_t _size)
+    void MemoryManager::memcopy(MMFile*& _dst, MMFile* _src, const short& _typeSize, const size_t& _size)
     {
-        MemView& dstView = _dst->load_s(offset, _size);
-        memcpy(dstView.getPtr_s(), (char*)_src + offset, _size);
-        _dst->unload_s(dstView);
+        const size_t elementSize = (_typeSize > 0) ? static_cast<size_t>(_typeSize) : 1;
+        const size_t size = _size / elementSize * elementSize;
+
+        if (_dst == nullptr) createTmp(_dst, size);
+        memcopy(_dst, 0, _src, 0, size);
     }
 
-    void MemoryManager::copyThreadsRawPtr_AVX2(MMFile* _dst, void* _src, size_t offset, size_t _size)
+    void MemoryManager::memcopy(MMFile* _dst, size_t dstOffset, MMFile* _src, size_t srcOffset, size_t _size)
     {
-        // Load destination view
-        MemView& dstView = _dst->load_s(offset, _size);
+        if (srcOffset + _size > _src->getFileSize_s()) {
+            throw std::out_of_range("Copy exceeds source size. File size: " + std::to_string(_src->getFileSize_s()) + ", End: " + std::to_string(srcOffset + _size));
+        }
+        if (_dst == _src && srcOffset < dstOffset + _size && dstOffset < srcOffset + _size) {
+            throw std::invalid_argument("Overlapping copy within one file.");
+        }
 
-        uint8_t* dstPtr = (uint8_t*)dstView.getPtr_s();
-        uint8_t* srcPtr = (uint8_t*)_src + offset;
+        _dst->growTo_s(dstOffset + _size);
 
-        size_t i = 0;
+        const CopyPlan plan = planCopy(_size);
+        if (plan.tasks > 1 && isNumaAware()) {
+            runOnNodes(dstOffset, _size, plan.tasks, [&](size_t begin, size_t end, size_t node) {
+                copyFileChunk(_dst, dstOffset + begin, _src, srcOffset + begin, end - begin, plan.kernel, node);
+                });
+            return;
+        }
 
-        // Process 32 bytes (256 bits) at a time using AVX2 with aligned loads and stores
-        for (; i + 31 < _size; i += 32) {
-            // Load 32 bytes (256 bits) from source into AVX2 register (aligned)
-            __m256i data = _mm256_load_si256(reinterpret_cast<const __m256i*>(srcPtr + i));
+        runPlanned(_size, plan, [&](size_t begin, size_t end) {
+            copyFileChunk(_dst, dstOffset + begin, _src, srcOffset + begin, end - begin, plan.kernel);
+            });
+    }
 
-            // Store 32 bytes (256 bits) to destination from AVX2 register (aligned)
-            _mm256_store_si256(reinterpret_cast<__m256i*>(dstPtr + i), data);
+    void MemoryManager::copyFileChunk(MMFile* _dst, size_t dstOffset, MMFile* _src, size_t srcOffset, size_t _size, MemCopy::Kernel kernel, size_t node)
+    {
+        // A fork's file is its base, the kernel would read or overwrite the base instead of the fork
+        if (kernelFileCopy.load(std::memory_order_relaxed) && !_src->isForked() && !_dst->isForked() &&
+            Platform::copyFileRange(_src->getFileHandle(), _src->getDataOffset() + srcOffset, _dst->getFileHandle(), _dst->getDataOffset() + dstOffset, _size)) {
+            _dst->markDirty(dstOffset, _size);
+            return;
         }
 
-        // Handle any remaining bytes that are less than 32 bytes
-        if(i < _size) memcpy(&dstPtr[i], &srcPtr[i], _size - i - 1);
+        // Not possible between these files, copy through views (a partial kernel copy is simply redone)
+        MemView& srcView = _src->loadForRead_s(srcOffset, _size);
+        MemView& dstView = _dst->load_s(dstOffset, _size);
+        if (node != SIZE_MAX) Platform::bindToNode(dstView.getPtr_s(), _size, static_cast<uint32_t>(node));
+        MemCopy::copy(dstView.getPtr_s(), srcView.getPtr_s(), _size, kernel);
+        _dst->unload_s(dstView);
+        _src->unload_s(srcView);
+    }
 
-        // Unload destination view
+    void MemoryManager::copyThreadsRawPtr(MMFile* _dst, void* _src, size_t offset, size_t _size, MemCopy::Kernel kernel, size_t node)
+    {
+        MemView& dstView = _dst->load_s(offset, _size);
+        // Best effort, the page cache of regular files follows the faulting worker's preferred node instead
+        if (node != SIZE_MAX) Platform::bindToNode(dstView.getPtr_s(), _size, static_cast<uint32_t>(node));
+        MemCopy::copy(dstView.getPtr_s(), (char*)_src + offset, _size, kernel);
         _dst->unload_s(dstView);
     }
 
+    PoolAwaitable<void> MemoryManager::copyAsync(MMFile*& _dst, void* _src, size_t _size)
+    {
+        return { workerPool.get(), [this, &_dst, _src, _size]() { memcopy(_dst, _src, _size); } };
+    }
+
+    PoolAwaitable<void> MemoryManager::copyAsync(MMFile* _dst, size_t dstOffset, MMFile* _src, size_t srcOffset, size_t _size)
+    {
+        return { workerPool.get(), [=, this]() { memcopy(_dst, dstOffset, _src, srcOffset, _size); } };
+    }
+
+    PoolAwaitable<uint32_t> MemoryManager::crc32Async(MMFile* _src)
+    {
+        return { workerPool.get(), [this, _src]() { return calcCRC32(_src); } };
+    }
+
+    PoolAwaitable<uint64_t> MemoryManager::crc64Async(MMFile* _src)
+    {
+        return { workerPool.get(), [this, _src]() { return calcCRC64(_src); } };
+    }
+
     void MemoryManager::move(MMFile* _dst, MMFile* _src)
     {
-        HANDLE thisProcess = GetCurrentProcess();
+        if (_src->isForked()) {
+            throw std::invalid_argument("A forked file cannot be moved, its pages live in its mapping.");
+        }
+
+        if (_dst->isPermanent()) closePmnt(_dst);
+        std::shared_future<bool> verified;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (auto it = pmntFiles.find(_src); it != pmntFiles.end()) verified = it->second.verified;
+        }
+        if (verified.valid()) verified.wait();     // it reads through _src
+
+        dropCRCTree(_dst);
+        dropCRCTree(_src);
         _dst->closeAllPtr();
 
-        if (!DuplicateHandle(thisProcess, _src->getFileHandle(), thisProcess, &_dst->setFileHandle(), 0, FALSE, DUPLICATE_SAME_ACCESS)) {
+        if (!Platform::duplicateFile(_src->getFileHandle(), _dst->setFileHandle())) {
             throw std::runtime_error("Failed to duplicate file handle.");
         }
 
-        if (!DuplicateHandle(thisProcess, _src->getMapHandle(), thisProcess, &_dst->setMapHandle(), 0, FALSE, DUPLICATE_SAME_ACCESS)) {
+        _dst->createMapObj();
+        if (_dst->getMapHandle() == Platform::InvalidMap) {
             throw std::runtime_error("Failed to duplicate map handle.");
         }
         
         _dst->m_fileSize = _src->getFileSize();
         //_dst->m_AllocatedSize = _src->getAllocatedSize();
         _dst->m_fileID = _src->m_fileID;
+        _dst->dataOffset = _src->dataOffset;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto node = pmntFiles.extract(_src);
+            if (!node.empty()) {
+                node.key() = _dst;
+                node.mapped().channel = _dst->openDirtyChannel();
+                pmntFiles.insert(std::move(node));
+            }
+        }
 
         _src->closeAllPtr();
     }
 
+    MMFile* MemoryManager::fork(MMFile* _src)
+    {
+        if (_src->isForked()) {
+            MMFile* copy = nullptr;
+            const size_t size = _src->getFileSize_s();
+            createTmp(copy, size);
+            memcopy(copy, 0, _src, 0, size);
+            return copy;
+        }
+
+        MMFile* copy = filePool.acquire();
+        {
+            std::shared_lock<std::shared_mutex> lockSrc(_src->mutex);
+            if (!_src->isValid()) {
+                filePool.release(copy);
+                throw std::invalid_argument("Invalid file or map handle.");
+            }
+            if (!Platform::duplicateFile(_src->getFileHandle(), copy->setFileHandle())) {
+                filePool.release(copy);
+                throw std::runtime_error("Failed to duplicate file handle.");
+            }
+
+            copy->setID() = _src->getID();
+            copy->setSysGran() = _src->getSysGran();
+            copy->setSysPageSize() = _src->getSysPageSize();
+            copy->setManager() = this;
+            copy->alignment = _src->alignment;
+            copy->hugePages = _src->hugePages;
+            copy->dataOffset = _src->dataOffset;
+            copy->m_fileSize = _src->getFileSize();
+        }
+
+        if (!copy->isPermanent()) {
+            // The name stays taken until the source and every fork are freed, a reused name is truncated
+            std::lock_guard<std::mutex> lock(mutex);
+            ++sharedNames.try_emplace(static_cast<unsigned long>(copy->getID()), 1).first->second;
+        }
+
+        try {
+            copy->createMapObj();
+            if (copy->getMapHandle() == Platform::InvalidMap) {
+                throw std::runtime_error("Failed to create file mapping.");
+            }
+            copy->mapFork();
+        }
+        catch (...) {
+            free(copy);
+            throw;
+        }
+        copy->inUse.store(true, std::memory_order_release);
+        return copy;
+    }
+
     void MemoryManager::free(MMFile* ptr) {
+        const bool permanent = ptr->isPermanent();
+        std::exception_ptr sealError;
+        if (permanent) {
+            try {
+                closePmnt(ptr);
+            }
+            catch (...) {
+                sealError = std::current_exception();
+            }
+        }
+        dropCRCTree(ptr);
+        ptr->inUse.store(false, std::memory_order_relaxed);
+        ptr->reset();
+        // A temp name goes back too, createTmp truncates the file when it hands the name out again
+        Platform::closeFile(ptr->setFileHandle());
+        if (!permanent) addTmpInactive(static_cast<unsigned long>(ptr->getID()));
         filePool.release(ptr);
+        if (sealError) std::rethrow_exception(sealError);
     }
 
-    uint32_t MemoryManager::calcCRC32(MMFile* _src) {
-        const uint64_t totalChunks = (_src->getFileSize() + getSysGranularity() - 1) / getSysGranularity();
-        const uint64_t fullChunks = _src->getFileSize() / getSysGranularity();
-        
-        auto task = [](MMFile* _src, uint64_t size, uint64_t offset) {
-            thread_local CRC32_64 crc;
-            MemView& view = _src->load(offset, size);
-            crc.reset32();
-            crc.appendCRC32((uint8_t*)view.getPtr(), size);
-            crc.finallize32();
-            _src->unload(view);
-            return crc.getCRC32();
-            };
-
-        std::vector<std::future<uint32_t>> crcCache;
-        crcCache.reserve(totalChunks);
+    CRCTree& MemoryManager::getCRCTree(MMFile* _src)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::unique_ptr<CRCTree>& tree = crcTrees[_src];
+        if (!tree) tree = std::make_unique<CRCTree>(*this, _src);
+        return *tree;
+    }
 
-        if (totalChunks > fullChunks)
+    void MemoryManager::dropCRCTree(MMFile* _src)
+    {
+        std::unique_ptr<CRCTree> tree;
         {
-            auto crc = workerPool->submit(task, _src, _src->getFileSize() - fullChunks * getSysGranularity(), fullChunks * getSysGranularity());
-            crcCache.push_back(std::move(crc));
-        }
-        for (int64_t i = fullChunks - 1; i >= 0; --i) {
-            auto crc = workerPool->submit(task, _src, getSysGranularity(), i * getSysGranularity());
-            crcCache.push_back(std::move(crc));
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = crcTrees.find(_src);
+            if (it == crcTrees.end()) return;
+            tree = std::move(it->second);
+            crcTrees.erase(it);
         }
-        uint32_t crc = 0;
-        try {
-            crc = crcCache[0].get();
-            for (uint64_t i = 1; i < totalChunks; ++i) {
-                crc = CRC32_64::combineCRC32(crc, crcCache[i].get(), getSysGranularity());
+    }
+
+    std::vector<ByteRange> MemoryManager::diff(MMFile* a, MMFile* b)
+    {
+        CRCTree& treeA = getCRCTree(a);
+        CRCTree& treeB = getCRCTree(b);
+        treeA.update();
+        treeB.update();
+        return CRCTree::diff(treeA, treeB);
+    }
+
+    void MemoryManager::trimIdleViews(MMFile* locked)
+    {
+        std::unique_lock<std::mutex> trimming(trimMutex, std::try_to_lock);
+        if (!trimming.owns_lock()) return;
+
+        // Windows are stamped from one clock, so the oldest idle ones of all files go first
+        std::vector<std::unique_lock<std::shared_mutex>> locks;
+        trimOrder.clear();
+        filePool.forEachFile([&](MMFile& file) {
+            if (!file.inUse.load(std::memory_order_acquire)) return;
+            if (&file != locked) {
+                std::unique_lock<std::shared_mutex> lock(file.mutex, std::try_to_lock);
+                if (!lock.owns_lock() || !file.inUse.load(std::memory_order_acquire)) return;
+                locks.push_back(std::move(lock));
+            }
+            file.evictIdlePrivate();
+            for (auto& entry : file.windows) {
+                MappedWindow& window = entry.second;
+                if (window.refs.load(std::memory_order_relaxed) == 0) trimOrder.push_back({ window.lastUse.load(std::memory_order_relaxed), &file, &window });
             }
+        });
+
+        const size_t budget = getViewCacheBudget();
+        if (m_usedMem.load(std::memory_order_relaxed) <= budget) return;
+
+        // Down to 7/8 of the budget, so the releases right after a trim find room instead of trimming again.
+        // Only the windows about to go are ordered.
+        const size_t target = budget - budget / 8;
+        const size_t window = (std::max)(getViewWindowSize(), size_t(1));
+        auto older = [](const IdleWindow& a, const IdleWindow& b) { return a.lastUse < b.lastUse; };
+        for (auto first = trimOrder.begin(); first != trimOrder.end(); ) {
+            const size_t used = m_usedMem.load(std::memory_order_relaxed);
+            if (used <= target) break;
+            const auto last = first + (std::min)(static_cast<size_t>(trimOrder.end() - first), (used - target) / window + 1);
+            std::nth_element(first, last - 1, trimOrder.end(), older);
+            std::sort(first, last, older);
+            for (; first != last && m_usedMem.load(std::memory_order_relaxed) > target; ++first) first->file->evictWindow(first->window);
+            if (first != last) break;
         }
-        catch (const std::exception& ex) {
-            std::cerr << "Exception from future: " << ex.what() << '\n';
+    }
+
+    void MemoryManager::addTmpInactive(const unsigned long& id)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        // A name shared with forks comes back with the last file using it
+        if (auto it = sharedNames.find(id); it != sharedNames.end()) {
+            if (--it->second != 0) return;
+            sharedNames.erase(it);
         }
-        _src->getCRC().getCRC32() = crc;
-        return crc;
+        inactiveFileID.push_back(id);
+    }
+
+    uint32_t MemoryManager::calcCRC32(MMFile* _src) {
+        streamCRC(_src, true, false);
+        return _src->getCRC32();
     }
 
     uint64_t MemoryManager::calcCRC64(MMFile* _src) {
-        const uint64_t totalChunks = (_src->getFileSize() + getSysGranularity() - 1) / getSysGranularity();
-        const uint64_t fullChunks = _src->getFileSize() / getSysGranularity();
+        streamCRC(_src, false, true);
+        return _src->getCRC64();
+    }
 
-        auto task = [](MMFile* _src, uint64_t size, uint64_t offset) {
-            thread_local CRC32_64 crc;
-            MemView& view = _src->load(offset, size);
-            crc.reset64();
-            crc.appendCRC64((uint8_t*)view.getPtr(), size);
-            crc.finallize64();
-            _src->unload(view);
-            return crc.getCRC64();
-            };
+    CRC32_64& MemoryManager::calcCRC(MMFile* _src) {
+        streamCRC(_src, true, true);
+        return _src->getCRC();
+    }
 
-        std::vector<std::future<uint64_t>> crcCache;
-        crcCache.reserve(totalChunks);
+    void MemoryManager::setChecksumWindow(size_t windowSize, size_t maxInFlight)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        crcWindowSize = windowSize;
+        crcMaxInFlight = maxInFlight;
+    }
+
+    void MemoryManager::streamCRC(MMFile* _src, bool crc32, bool crc64)
+    {
+        const uint64_t granularity = getSysGranularity();
+        const uint64_t fileSize = _src->getFileSize();
 
-        if (totalChunks > fullChunks)
+        uint64_t window;
+        size_t maxInFlight;
         {
-            auto crc = workerPool->submit(task, _src, _src->getFileSize() - fullChunks * getSysGranularity(), fullChunks * getSysGranularity());
-            crcCache.push_back(std::move(crc));
+            std::lock_guard<std::mutex> lock(mutex);
+            window = (std::max)(granularity, (crcWindowSize + granularity - 1) / granularity * granularity);
+            maxInFlight = crcMaxInFlight;
         }
-        for (int64_t i = fullChunks - 1; i >= 0; --i) {
-            auto crc = workerPool->submit(task, _src, getSysGranularity(), i * getSysGranularity());
-            crcCache.push_back(std::move(crc));
+        // In NUMA mode windows are also cut at stripe boundaries, so every window runs on the node owning it
+        const bool numa = isNumaAware();
+        const uint64_t segment = numa ? numaStripe.load(std::memory_order_relaxed) : fileSize;
+
+        // Windows are claimed in stream order (last window of the file first). Every participant maps one
+        // window at a time, so capping the participants caps the mapped windows.
+        std::vector<uint64_t> offsets;
+        std::vector<uint64_t> lengths;
+        for (uint64_t end = fileSize; end > 0; ) {
+            const uint64_t segmentStart = (end - 1) / segment * segment;
+            const uint64_t start = segmentStart + (end - 1 - segmentStart) / window * window;
+            offsets.push_back(start);
+            lengths.push_back(end - start);
+            end = start;
         }
+        const size_t totalWindows = offsets.size();
+        std::vector<uint32_t> crcs32(totalWindows);
+        std::vector<uint64_t> crcs64(totalWindows);
 
-        uint64_t crc = 0;
-        try {
-            crc = crcCache[0].get();
-            for (uint64_t i = 1; i < totalChunks; ++i) {
-                crc = CRC32_64::combineCRC64(crc, crcCache[i].get(), getSysGranularity());
+        auto task = [&](size_t i) {
+            constexpr uint64_t blockSize = 64 * 1024; // stays in L2 between the two checksums
+
+            thread_local CRC32_64 crc;
+            const uint64_t offset = offsets[i];
+            const uint64_t size = lengths[i];
+            MemView& view = _src->loadForRead_s(offset, size);
+            const uint8_t* data = (const uint8_t*)view.getPtr();
+
+            // The stream runs from the end of the window to its start, so walk the blocks backwards
+            crc.reset();
+            for (uint64_t end = size; end > 0; ) {
+                const uint64_t len = (std::min)(blockSize, end);
+                end -= len;
+                if (crc32) crc.appendCRC32(data + end, len);
+                if (crc64) crc.appendCRC64(data + end, len);
             }
+            crc.finallize();
+
+            _src->unload_s(view);
+            if (numa) countNumaChunk(getHomeNode(offset), size);
+            crcs32[i] = crc.getCRC32();
+            crcs64[i] = crc.getCRC64();
+            };
+
+        // A failed window throws from here, the file keeps the CRC it had
+        if (numa) workerPool->submit_bulk_numa(totalWindows, [&](size_t i) { return getHomeNode(offsets[i]); }, task, maxInFlight);
+        else workerPool->submit_bulk(totalWindows, task, maxInFlight);
+
+        if (crc32) _src->getCRC().getCRC32() = combineTree(std::move(crcs32), lengths);
+        if (crc64) _src->getCRC().getCRC64() = combineTree(std::move(crcs64), std::move(lengths));
+    }
+
+    template<typename T>
+    T MemoryManager::combineTree(std::vector<T> crcs, std::vector<uint64_t> lengths)
+    {
+        constexpr size_t pairsPerTask = 4096;
+
+        auto gen = [](uint64_t len2) {
+            if constexpr (sizeof(T) == 4) return CRC32_64::combineGen32(len2);
+            else return CRC32_64::combineGen64(len2);
+        };
+        auto op = [](T crc1, T crc2, T shift) {
+            if constexpr (sizeof(T) == 4) return CRC32_64::combineOp32(crc1, crc2, shift);
+            else return CRC32_64::combineOp64(crc1, crc2, shift);
+        };
+
+        if (crcs.empty()) return 0;
+
+        // Pairwise fold, one level per pass so the depth is O(log n). Within a level the right-hand sides
+        // share a length (only the first chunk, and in NUMA mode the last of a stripe, can be partial), so
+        // the shift is generated once and only the odd ones pay for their own.
+        while (crcs.size() > 1) {
+            const size_t pairs = crcs.size() / 2;
+            const uint64_t commonLength = lengths[1];
+            const T commonShift = gen(commonLength);
+
+            std::vector<T> nextCrcs((crcs.size() + 1) / 2);
+            std::vector<uint64_t> nextLengths(nextCrcs.size());
+
+            auto reduce = [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; ++i) {
+                    const uint64_t len2 = lengths[2 * i + 1];
+                    nextCrcs[i] = op(crcs[2 * i], crcs[2 * i + 1], (len2 == commonLength) ? commonShift : gen(len2));
+                    nextLengths[i] = lengths[2 * i] + len2;
+                }
+            };
+
+            workerPool->parallel_for(0, pairs, pairsPerTask, reduce);
+
+            if (crcs.size() % 2) {
+                nextCrcs.back() = crcs.back();
+                nextLengths.back() = lengths.back();
+            }
+            crcs = std::move(nextCrcs);
+            lengths = std::move(nextLengths);
         }
-        catch (const std::exception& ex) {
-            std::cerr << "Exception from future: " << ex.what() << '\n';
-        }
-        _src->getCRC().getCRC64() = crc;
-        return crc;
+        return crcs[0];
     }
 
     //------ Memory File Pool --------
 
+    MemoryFilePool::~MemoryFilePool()
+    {
+        for (auto& slab : slabs) delete[] slab.load(std::memory_order_relaxed);
+    }
+
+    MMFile* MemoryFilePool::fileAt(uint32_t index) const noexcept
+    {
+        const uint32_t slab = static_cast<uint32_t>(std::bit_width(index / slabFiles + 1)) - 1;
+        return slabs[slab].load(std::memory_order_acquire) + (index - slabFiles * ((1u << slab) - 1));
+    }
+
+    MMFile* MemoryFilePool::pop(Stack& stack)
+    {
+        uint64_t head = stack.head.load(std::memory_order_acquire);
+        while (static_cast<uint32_t>(head) != 0) {
+            MMFile* file = fileAt(static_cast<uint32_t>(head) - 1);
+            const uint64_t next = file->nextFree.load(std::memory_order_relaxed);
+            if (stack.head.compare_exchange_weak(head, (((head >> 32) + 1) << 32) | next,
+                std::memory_order_acquire, std::memory_order_acquire)) {
+                stack.count.fetch_sub(1, std::memory_order_relaxed);
+                return file;
+            }
+        }
+        return nullptr;
+    }
+
+    void MemoryFilePool::push(Stack& stack, MMFile* first, MMFile* last, size_t count)
+    {
+        stack.count.fetch_add(count, std::memory_order_relaxed);
+        uint64_t head = stack.head.load(std::memory_order_relaxed);
+        do {
+            last->nextFree.store(static_cast<uint32_t>(head), std::memory_order_relaxed);
+        } while (!stack.head.compare_exchange_weak(head, (((head >> 32) + 1) << 32) | (first->poolIndex + 1),
+            std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    void MemoryFilePool::grow()
+    {
+        std::lock_guard<std::mutex> lock(growMutex);
+        if (static_cast<uint32_t>(freeFiles.head.load(std::memory_order_acquire)) != 0) return;   // another thread grew it
+
+        if (slabCount == maxSlabs) {
+            throw std::runtime_error("Memory file pool is full");
+        }
+
+        // One allocation per slab, its files go on the free stack already linked
+        const uint32_t count = slabFiles << slabCount;
+        const uint32_t base = slabFiles * ((1u << slabCount) - 1);
+        MMFile* files = new MMFile[count];
+        for (uint32_t i = 0; i < count; ++i) {
+            files[i].poolIndex = base + i;
+            files[i].nextFree.store(base + i + 2, std::memory_order_relaxed);
+        }
+        slabs[slabCount++].store(files, std::memory_order_release);
+        push(freeFiles, files, files + count - 1, count);
+    }
+
     MMFile* MemoryFilePool::acquire()
     {
-            
-        if (!filePool.empty()) {
-            std::unique_lock<std::shared_mutex> lock(mutex);
-            MMFile* memPtr = filePool.front();
-            filePool.pop_front();
-            return memPtr;
+        for (;;) {
+            if (MMFile* file = pop(freeFiles)) return file;
+            grow();
         }
-        return new MMFile();
     }
 
     void MemoryFilePool::release(MMFile* ptr)
     {
-        ptr->reset();
-        filePool.push_back(ptr);
+        push(freeFiles, ptr, ptr, 1);
+    }
+
+    void MemoryFilePool::forEachFile(const std::function<void(MMFile&)>& fn)
+    {
+        for (uint32_t slab = 0; slab < maxSlabs; ++slab) {
+            MMFile* files = slabs[slab].load(std::memory_order_acquire);
+            if (files == nullptr) break;
+            for (uint32_t i = 0; i < (slabFiles << slab); ++i) fn(files[i]);
+        }
+    }
+
+    MMFile* MemoryFilePool::acquireWarm()
+    {
+        return pop(warmFiles);
     }
 
-    size_t MemoryFilePool::size()
+    void MemoryFilePool::releaseWarm(MMFile* ptr)
     {
-        return filePool.size();
+        push(warmFiles, ptr, ptr, 1);
     }
 
-    void MemoryFilePool::clear()
+    void MemoryFilePool::clear(const std::function<void(MMFile*)>& drop)
     {
-        filePool.clear();
+        // Free files hold no backing and stay on their stack, dropping them would only leave them stranded
+        // in their slabs while acquire grows new ones
+        while (MMFile* warm = pop(warmFiles)) drop(warm);
     }
 }
\ No newline at end of file
@@ -1,66 +1,267 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <future>
 #include <mutex>
 #include <shared_mutex>
-#include <list>
-//#include <windows.h>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "src/Platform/Platform.hpp"
 #include "src/ThreadPool/ThreadPool.hpp"
 #include "src/CRC32_64/CRC32_64.hpp"
+#include "src/MemCopy/MemCopy.hpp"
+#include "src/AsyncIO/AsyncIO.hpp"
+#include "src/MemoryGovernor/MemoryGovernor.hpp"
+#include "src/CRCTree/CRCTree.hpp"
+#include "src/MMFile/SoraMemFileSpecification.hpp"
 
 namespace SoraMem
 {
     class MMFile;
+    struct MappedWindow;
 
+    // MMFile objects are carved from slabs the pool owns and recycled through lock-free stacks, so
+    // createTmp/free allocate nothing once the pool has warmed up. A recycled file keeps its view slots.
+    // Warm files are open and sized already, createTmp only has to pop one.
     class MemoryFilePool{
     public:
+        MemoryFilePool() {}
+        ~MemoryFilePool();      // destroys every file, pooled or still in use
+
+        MemoryFilePool(MemoryFilePool const&) = delete;
+        void operator=(MemoryFilePool const&) = delete;
+
         MMFile*                 acquire();
 
-        inline void             release(MMFile* ptr);
-        inline void             clear();
+        void                    release(MMFile* ptr);   // ptr must already be reset
+        void                    clear(const std::function<void(MMFile*)>& drop);   // hands every warm file to drop, free ones stay pooled
+
+        MMFile*                 acquireWarm();          // nullptr when none is ready
+        void                    releaseWarm(MMFile* ptr);
 
-        inline size_t           size();
+        void                    forEachFile(const std::function<void(MMFile&)>& fn);   // pooled ones included
+
+        size_t                  size() const noexcept { return freeFiles.count.load(std::memory_order_relaxed); }
+        size_t                  warmSize() const noexcept { return warmFiles.count.load(std::memory_order_relaxed); }
     private:
-        std::list<MMFile*>      filePool;
-        std::shared_mutex       mutex;
+        struct Stack
+        {
+            std::atomic<uint64_t>   head{ 0 };          // ABA tag in the high half, index + 1 in the low half (0 = empty)
+            std::atomic<size_t>     count{ 0 };
+        };
+
+        // Slab k holds slabFiles << k files, indices run on across slabs
+        static constexpr uint32_t slabFiles = 16;
+        static constexpr uint32_t maxSlabs = 20;
+
+        MMFile*                 fileAt(uint32_t index) const noexcept;
+        MMFile*                 pop(Stack& stack);
+        void                    push(Stack& stack, MMFile* first, MMFile* last, size_t count);
+        void                    grow();
+
+        std::atomic<MMFile*>    slabs[maxSlabs] = {};
+        uint32_t                slabCount = 0;          // guarded by growMutex
+        std::mutex              growMutex;
+        Stack                   freeFiles;
+        Stack                   warmFiles;
+    };
+
+    // How memcopy splits a copy: up to tasks threads work through chunks of chunkSize bytes, each chunk maps
+    // one view, so chunks stay far below MemView's 32-bit size. tasks == 1 copies inline on the calling thread.
+    struct CopyPlan
+    {
+        static constexpr size_t maxChunkSize = 256 * 1024 * 1024;
+
+        size_t          tasks = 1;
+        size_t          chunkSize = 0;
+        MemCopy::Kernel kernel = MemCopy::Kernel::Memcpy;
+    };
+
+    // NUMA routed chunks of copies and checksums, by whether they ran on the node owning their pages
+    struct NumaStats
+    {
+        uint64_t        localChunks = 0;
+        uint64_t        remoteChunks = 0;
+        uint64_t        localBytes = 0;
+        uint64_t        remoteBytes = 0;
+    };
+
+    // What createPmnt checks of a reopened file besides its descriptor
+    enum class PmntCheck
+    {
+        None,           // nothing, verifyPmnt can still be called later
+        Background,     // the data's CRC64 on the worker pool, the file is usable meanwhile
+        Now             // the data's CRC64 before createPmnt returns, a mismatch throws
     };
 
     class MemoryManager {
     public:
         MemoryManager() {};
+        ~MemoryManager();   // waits for a warm file refill still running, seals permanent files still open, drops a loaded config
         void initManager();
         void setTmpDir(const std::string& dir);
-        void setThreadPool(std::unique_ptr<ThreadPool>& pool) { workerPool = std::move(pool); }
+        void setPmntDir(const std::string& dir);
+        // The previous pool must be idle. getAsyncIO's fallback keeps the pool it was created with, set this first.
+        void setThreadPool(std::unique_ptr<ThreadPool>& pool);
+        ThreadPool* getThreadPool() const noexcept { return workerPool.get(); }
+        AsyncIO& getAsyncIO();  // created on first use, falls back to the worker pool without native async I/O
 
         MemoryManager(MemoryManager const&) = delete;
         void operator=(MemoryManager const&) = delete;
 
 
-        void createTmp(MMFile*& memPtr, const size_t& fileSize);
-        void createPmnt(MMFile* memPtr, const size_t& fileSize);
+        // hugePages: back the file with hugetlbfs pages when the pool has room, otherwise advise transparent huge
+        // pages on its views. Either way its views are aligned to getHugePageSize().
+        void createTmp(MMFile*& memPtr, const size_t& fileSize, bool hugePages = false);
+        // Keep count temp files of fileSize bytes open ahead of time, refilled on the worker pool (inline
+        // without one). createTmp of that size without huge pages then just pops one. count 0 closes them.
+        void setWarmFiles(size_t count, size_t fileSize);
+        size_t getWarmFiles() const noexcept { return filePool.warmSize(); }
+
+        // Permanent files are <pmnt dir><name>.bin.soramem: a DATA descriptor (chunkSize, CRC64 of the data) in
+        // the first sysGran bytes and the data after it. An existing file is reopened in O(1), only its
+        // descriptor is read and the data is mapped as it is, fileSize is ignored then. Otherwise the file is
+        // created with fileSize bytes. True when existing data was reopened, a name already open throws.
+        // The descriptor is sealed (CRC64 of the data written) by sealPmnt and free, an open file is marked
+        // unsealed on disk so a crash shows, its descriptor follows resizes. Writes after a seal make the next
+        // check fail until sealed again.
+        bool createPmnt(MMFile*& memPtr, const std::string& name, const size_t& fileSize, PmntCheck check = PmntCheck::Background);
+        // Hashes through the file's CRC tree, so sealing again only rehashes what changed and unwritten data
+        // is not hashed at all. Data that failed a check before it was written is damaged: it is never sealed,
+        // the last seal is put back on disk and this throws std::runtime_error.
+        void sealPmnt(MMFile* file);
+        // Whether the data still matches the CRC64 it was last sealed with, false if it was never sealed.
+        // Runs once on the worker pool, later calls share the result until the next seal. Writers should wait.
+        std::shared_future<bool> verifyPmnt(MMFile* file);
+
+        // CRC tables for polynomials other than the defaults, whose tables are built at compile time. They are
+        // mapped from the .conf.soramem at path and used in place when its CRC64 checks out and it holds these
+        // polynomials, otherwise they are computed once and the file is rewritten for the next start. It also
+        // records sysGran and the directories. Checksums must not run meanwhile.
+        void loadConfig(const std::string& path, uint32_t crc32Poly, uint64_t crc64Poly);
+        void releaseConfig() noexcept;  // back to the tables in use before loadConfig, also when the manager goes
 
 
         void memcopy_AVX2(MMFile*& _dst, void* _src, const size_t& _size);
 
+        // Fewest tasks that keep memory busy: each task gets enough bytes to amortise its dispatch at the
+        // calibrated per-core bandwidth, capped by the pool size and by setCopyBandwidthLimit
+        CopyPlan planCopy(size_t size) const;
+        double getCopyBandwidth() const;   // bytes/s of one core, measured on first use by this manager
+        void setCopyBandwidthLimit(double bytesPerSecond) { copyBandwidthLimit.store(bytesPerSecond, std::memory_order_relaxed); } // 0 = no limit
+
 
         void memcopy(MMFile*& _dst, void* _src, const size_t& _size);
+        // _size bytes (whole _typeSize elements) from the start of _src to the start of _dst
         void memcopy(MMFile*& _dst, MMFile* _src, const short& _typeSize, const size_t& _size);
+        // Ranged file to file copy, ranges must not overlap. Both files stay open and live views stay valid
+        // unless _dst has to grow.
+        void memcopy(MMFile* _dst, size_t dstOffset, MMFile* _src, size_t srcOffset, size_t _size);
+        // Let file copies run inside the kernel (copy_file_range, block cloning) before falling back to views
+        void setKernelFileCopy(bool enable) { kernelFileCopy = enable; }
+
+        // NUMA mode, on when the worker pool spans several nodes: files are striped over the nodes, copies and
+        // checksums run each stripe on the workers of its node and destination views are bound to it before
+        // they are written. Stripes are granule aligned.
+        bool isNumaAware() const noexcept { return numaNodes.size() > 1; }
+        void setNumaStripe(size_t bytes);
+        size_t getNumaStripe() const noexcept { return numaStripe.load(std::memory_order_relaxed); }
+        size_t getHomeNode(size_t offset) const noexcept;   // node owning the stripe at offset, 0 outside NUMA mode
+        NumaStats getNumaStats() const noexcept;
+        void resetNumaStats() noexcept;
         
 
+        // Awaitable variants for coroutines: the work runs on the worker pool and the awaiting coroutine resumes
+        // there, arguments must stay valid until then
+        PoolAwaitable<void> copyAsync(MMFile*& _dst, void* _src, size_t _size);
+        PoolAwaitable<void> copyAsync(MMFile* _dst, size_t dstOffset, MMFile* _src, size_t srcOffset, size_t _size);
+        PoolAwaitable<uint32_t> crc32Async(MMFile* _src);
+        PoolAwaitable<uint64_t> crc64Async(MMFile* _src);
+
         void move(MMFile* _dst, MMFile* _src);
 
+        // Copy-on-write copy of _src: the fork reads _src's pages until it writes them, only written pages take
+        // memory of their own and they are never written back. A fork cannot be resized or used for async I/O,
+        // _src must not change while forks of it are alive. Forking a fork makes a full copy.
+        MMFile* fork(MMFile* _src);
+
+        // The file is released either way, a permanent one that could not be sealed throws afterwards
         void free(MMFile* ptr);
-        void addTmpInactive(const unsigned long& id) { inactiveFileID.emplace_back(id); }
+        void addTmpInactive(const unsigned long& id);
         
         uint32_t calcCRC32(MMFile* _src);
         uint64_t calcCRC64(MMFile* _src);
+        CRC32_64& calcCRC(MMFile* _src); // CRC32 and CRC64 in a single pass
+
+        // CRC tree of a file, made by the first call and kept until the file is freed or moved
+        CRCTree& getCRCTree(MMFile* _src);
+        // Byte ranges where the files differ, from their CRC trees: the first call hashes both files, later
+        // ones only what was written since. Writers of either file must pause meanwhile.
+        std::vector<ByteRange> diff(MMFile* a, MMFile* b);
+
+        // Checksums map windowSize bytes per task with at most maxInFlight windows mapped (0 = one per worker plus the caller)
+        void setChecksumWindow(size_t windowSize, size_t maxInFlight = 0);
         
+        // Released views stay mapped until mapped memory exceeds budgetBytes, loads map at least windowSize bytes
+        void setViewCache(size_t budgetBytes, size_t windowSize);
+        size_t getViewCacheBudget() const noexcept { return (std::min)(viewCacheBudget.load(std::memory_order_relaxed), governor.getCacheCap()); }
+        size_t getViewWindowSize() const noexcept { return viewWindowSize.load(std::memory_order_relaxed); }
+
+        // Soft/hard budgets for mapped views from the system and cgroup memory state, off until started
+        MemoryGovernor& getGovernor() noexcept { return governor; }
+        // Once over the view cache budget, evicts the least recently used idle windows of all open files down
+        // to 7/8 of it. The caller holds the exclusive lock of locked, if any; other files whose lock is taken
+        // are skipped, as is the whole trim while another one runs.
+        void trimIdleViews(MMFile* locked = nullptr);
+        uint64_t stampViewUse() noexcept { return viewUseClock.fetch_add(1, std::memory_order_relaxed); }   // MappedWindow::lastUse
+
         unsigned long getSysGranularity() const noexcept { return dwSysGran; }
+        size_t getHugePageSize() const noexcept { return hugePageSize; }
         
         std::atomic<unsigned long long>& getUsedMemory() noexcept { return m_usedMem; }
         
     private:
-        void copyThreadsRawPtr(MMFile* _dst, void* _src, size_t offset, size_t _size);
-        static void copyThreadsRawPtr_AVX2(MMFile* _dst, void* _src, size_t offset, size_t _size);
+        void calibrateCopy() const;
+        MMFile* openTmp(size_t fileSize, bool hugePages);
+        void refillWarm();
+
+        void copyPlanned(MMFile* _dst, void* _src, size_t _size, const CopyPlan& plan);
+        // fn(begin, end) for every chunk of the plan
+        template<typename F>
+        void runPlanned(size_t size, const CopyPlan& plan, F&& fn);
+        // node: bind the destination view there first (NUMA mode)
+        void copyThreadsRawPtr(MMFile* _dst, void* _src, size_t offset, size_t _size, MemCopy::Kernel kernel, size_t node = SIZE_MAX);
+        void copyFileChunk(MMFile* _dst, size_t dstOffset, MMFile* _src, size_t srcOffset, size_t _size, MemCopy::Kernel kernel, size_t node = SIZE_MAX);
+
+        // Cuts [offset, offset + size) at stripe boundaries, and stripes into CopyPlan::maxChunkSize pieces, and
+        // runs fn(begin, end, node) for every piece on its node on at most maxConcurrency threads, begin and end
+        // relative to offset
+        template<typename F>
+        void runOnNodes(size_t offset, size_t size, size_t maxConcurrency, F&& fn);
+        void countNumaChunk(size_t node, size_t bytes) noexcept;
+
+        void streamCRC(MMFile* _src, bool crc32, bool crc64);
+        void dropCRCTree(MMFile* _src);
+
+        struct PmntFile
+        {
+            std::string                 path;
+            SoraMemFileDescriptor       descriptor{};   // as last sealed, flags lack CRC if it never was
+            uint32_t                    channel = 0;    // dirty tracking, a seal of unwritten data reuses the CRC
+            std::shared_future<bool>    verified;
+            bool                        damaged = false;    // a check failed on data unwritten since the seal
+        };
+        void writeDescriptor(MMFile* file, const std::string& path, const SoraMemFileDescriptor& descriptor);
+        void closePmnt(MMFile* file);   // seals and forgets the file, forgotten even when the seal throws
+        bool mapConfig(const std::string& path, uint32_t crc32Poly, uint64_t crc64Poly);   // true when valid and in use
+
+        // Folds per-chunk CRCs (stream order) into one, using the worker pool for wide levels
+        template<typename T>
+        T combineTree(std::vector<T> crcs, std::vector<uint64_t> lengths);
 
 #ifdef TESTING
     public:
@@ -69,18 +270,61 @@ namespace SoraMem
         unsigned                            n_FileCreated = 0;
         unsigned long                       dwSysGran = 0;
         unsigned long                       dwPageSize = 0;
+        size_t                              hugePageSize = 0;
         
         std::string                         tmpDir = "";
+        std::string                         pmntDir = "";
+
+        size_t                              crcWindowSize = 16 * 1024 * 1024;
+        size_t                              crcMaxInFlight = 0;
+
+        mutable std::once_flag              calibrateOnce;
+        mutable std::atomic<double>         copyBandwidth = 0;
+        std::atomic<double>                 copyBandwidthLimit = 0;
+        std::atomic<bool>                   kernelFileCopy = true;
+
+        std::vector<size_t>                 numaNodes;          // pool nodes with workers, empty outside NUMA mode
+        std::atomic<size_t>                 numaStripe = 4 * 1024 * 1024;
+        std::atomic<uint64_t>               numaLocalChunks = 0;
+        std::atomic<uint64_t>               numaRemoteChunks = 0;
+        std::atomic<uint64_t>               numaLocalBytes = 0;
+        std::atomic<uint64_t>               numaRemoteBytes = 0;
+
+        std::atomic<size_t>                 viewCacheBudget = 256 * 1024 * 1024;
+        std::atomic<size_t>                 viewWindowSize = 1024 * 1024;
+        std::atomic<uint64_t>               viewUseClock = 0;
+        struct IdleWindow
+        {
+            uint64_t        lastUse;
+            MMFile*         file;
+            MappedWindow*   window;
+        };
+        std::vector<IdleWindow>             trimOrder;          // scratch for trimIdleViews
+        std::mutex                          trimMutex;          // one trim at a time, others leave it to that one
 
         std::atomic<unsigned long long>     m_usedMem;
         std::atomic<unsigned long>          m_fileID;
         std::atomic<unsigned long>          permFileID;
 
+        Platform::FileHandle                confFile = Platform::InvalidFile;   // the loaded .conf.soramem
+        Platform::MapHandle                 confMap = Platform::InvalidMap;
+        void*                               confView = nullptr;
+        CRC32_64::Binding                   tablesBeforeConfig;
+
         mutable std::mutex                  mutex;
 
-        std::list<unsigned long>            inactiveFileID;
-        MemoryFilePool                      filePool;
+        std::vector<unsigned long>          inactiveFileID;     // names free for reuse, guarded by mutex
+        std::unordered_map<unsigned long, uint32_t> sharedNames; // files holding a name forks map, guarded by mutex
+        std::atomic<size_t>                 warmTarget = 0;
+        std::atomic<size_t>                 warmFileSize = 0;   // aligned like MMFile::resize
+        std::atomic<bool>                   warmRefilling = false;
+        MemoryGovernor                      governor{ *this };  // before the files, their teardown notifies it; stopped first by ~MemoryManager
         std::unique_ptr<ThreadPool>         workerPool;
+        std::unique_ptr<AsyncIO>            asyncIO;            // after the pool, its fallback posts there
+        std::once_flag                      asyncOnce;
+        MemoryFilePool                      filePool;           // late, files still open are closed while the rest is alive
+        std::unordered_map<MMFile*, std::unique_ptr<CRCTree>> crcTrees;    // guarded by mutex, gone before the files
+        std::unordered_map<MMFile*, PmntFile> pmntFiles;    // guarded by mutex
     };
 
 }
@@ -0,0 +1,989 @@
+#include "Platform.hpp"
+
+#include <algorithm>
+
+#ifdef _WIN32
+#include <winioctl.h>
+#include <psapi.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "onecore.lib")     // VirtualAlloc2, MapViewOfFile3
+#pragma comment(lib, "psapi.lib")       // QueryWorkingSetEx
+#endif
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#ifndef _WIN32
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <fcntl.h>
+#include <fstream>
+#include <linux/falloc.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+namespace SoraMem
+{
+    namespace Platform
+    {
+        namespace
+        {
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+            void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4])
+            {
+#ifdef _MSC_VER
+                int info[4];
+                __cpuidex(info, static_cast<int>(leaf), static_cast<int>(subleaf));
+                for (int i = 0; i < 4; ++i) regs[i] = static_cast<uint32_t>(info[i]);
+#else
+                __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+            }
+
+            uint64_t xgetbv0()
+            {
+#ifdef _MSC_VER
+                return _xgetbv(0);
+#else
+                uint32_t eax, edx;
+                __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+                return (static_cast<uint64_t>(edx) << 32) | eax;
+#endif
+            }
+
+            CpuFeatures detectCpuFeatures()
+            {
+                CpuFeatures features;
+                uint32_t regs[4] = {};
+
+                cpuid(0, 0, regs);
+                const uint32_t maxLeaf = regs[0];
+                if (maxLeaf < 1) return features;
+
+                cpuid(1, 0, regs);
+                features.ssse3  = (regs[2] >> 9) & 1;
+                features.sse41  = (regs[2] >> 19) & 1;
+                features.pclmul = (regs[2] >> 1) & 1;
+
+                const bool osxsave = (regs[2] >> 27) & 1;
+                const uint64_t xcr0 = osxsave ? xgetbv0() : 0;
+                const bool ymmState = (xcr0 & 0x06) == 0x06;       // XMM | YMM
+                const bool zmmState = (xcr0 & 0xE6) == 0xE6;       // XMM | YMM | opmask | ZMM_Hi256 | Hi16_ZMM
+
+                if (maxLeaf >= 7) {
+                    cpuid(7, 0, regs);
+                    features.avx2       = ymmState && ((regs[1] >> 5) & 1);
+                    features.avx512f    = zmmState && ((regs[1] >> 16) & 1);
+                    features.avx512bw   = zmmState && ((regs[1] >> 30) & 1);
+                    features.vpclmulqdq = ymmState && ((regs[2] >> 10) & 1);
+                    features.erms       = (regs[1] >> 9) & 1;
+                }
+                return features;
+            }
+#else
+            CpuFeatures detectCpuFeatures()
+            {
+                return {};
+            }
+#endif
+
+#ifdef _WIN32
+            // Files are opened for overlapped I/O, synchronous calls wait on a per-thread event. The low bit
+            // keeps the completion off the port AsyncIO may have bound the file to.
+            OVERLAPPED overlappedAt(uint64_t offset)
+            {
+                thread_local struct Event
+                {
+                    HANDLE handle = CreateEvent(NULL, TRUE, FALSE, NULL);
+                    ~Event() { if (handle != NULL) CloseHandle(handle); }
+                } event;
+
+                OVERLAPPED at = {};
+                at.Offset = static_cast<DWORD>(offset);
+                at.OffsetHigh = static_cast<DWORD>(offset >> 32);
+                at.hEvent = reinterpret_cast<HANDLE>(reinterpret_cast<ULONG_PTR>(event.handle) | 1);
+                return at;
+            }
+
+            bool waitResult(HANDLE handle, BOOL started, OVERLAPPED& at, DWORD& done)
+            {
+                if (!started && GetLastError() != ERROR_IO_PENDING) return false;
+                return GetOverlappedResult(handle, &at, &done, TRUE);
+            }
+
+            bool control(HANDLE handle, DWORD code, void* in, DWORD inSize)
+            {
+                OVERLAPPED at = overlappedAt(0);
+                DWORD returned = 0;
+                return waitResult(handle, DeviceIoControl(handle, code, in, inSize, NULL, 0, NULL, &at), at, returned);
+            }
+#endif
+        }
+
+        const CpuFeatures& getCpuFeatures() noexcept
+        {
+            static const CpuFeatures features = detectCpuFeatures();
+            return features;
+        }
+
+#ifdef _WIN32
+
+        SystemInfo getSystemInfo()
+        {
+            SYSTEM_INFO SysInfo;
+            GetSystemInfo(&SysInfo);
+            return { SysInfo.dwAllocationGranularity, SysInfo.dwPageSize };
+        }
+
+        uint64_t getAvailableMemory()
+        {
+            MEMORYSTATUSEX status;
+            status.dwLength = sizeof(status);
+            if (!GlobalMemoryStatusEx(&status)) return 0;
+            return status.ullAvailPhys;
+        }
+
+        MemoryStatus getMemoryStatus()
+        {
+            MemoryStatus result;
+            MEMORYSTATUSEX status;
+            status.dwLength = sizeof(status);
+            if (!GlobalMemoryStatusEx(&status)) return result;
+            result.limit = status.ullTotalPhys;
+            result.available = status.ullAvailPhys;
+            result.used = status.ullTotalPhys - status.ullAvailPhys;
+            return result;
+        }
+
+        size_t getHugePageSize()
+        {
+            // Large pages are only granted to processes holding the (enabled) lock memory privilege
+            HANDLE token = nullptr;
+            if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &token)) return 0;
+            PRIVILEGE_SET privileges{};
+            privileges.PrivilegeCount = 1;
+            privileges.Control = PRIVILEGE_SET_ALL_NECESSARY;
+            privileges.Privilege[0].Attributes = SE_PRIVILEGE_ENABLED;
+            BOOL held = FALSE;
+            if (!LookupPrivilegeValueA(nullptr, "SeLockMemoryPrivilege", &privileges.Privilege[0].Luid) || !PrivilegeCheck(token, &privileges, &held)) held = FALSE;
+            CloseHandle(token);
+            return held ? GetLargePageMinimum() : 0;
+        }
+
+        int lastError() noexcept
+        {
+            return static_cast<int>(GetLastError());
+        }
+
+        bool isValid(FileHandle handle) noexcept
+        {
+            return handle != nullptr && handle != INVALID_HANDLE_VALUE;
+        }
+
+        bool createDirectory(const std::string& dir)
+        {
+            return CreateDirectory(dir.c_str(), NULL) || GetLastError() == ERROR_ALREADY_EXISTS;
+        }
+
+        FileHandle createFile(const std::string& path)
+        {
+            HANDLE handle = CreateFile(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL);
+            return (handle == INVALID_HANDLE_VALUE) ? InvalidFile : handle;
+        }
+
+        FileHandle openFile(const std::string& path)
+        {
+            HANDLE handle = CreateFile(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL);
+            return (handle == INVALID_HANDLE_VALUE) ? InvalidFile : handle;
+        }
+
+        bool duplicateFile(FileHandle src, FileHandle& dst)
+        {
+            HANDLE thisProcess = GetCurrentProcess();
+            return DuplicateHandle(thisProcess, src, thisProcess, &dst, 0, FALSE, DUPLICATE_SAME_ACCESS);
+        }
+
+        void closeFile(FileHandle& handle) noexcept
+        {
+            if (isValid(handle)) CloseHandle(handle);
+            handle = InvalidFile;
+        }
+
+        bool flushFile(FileHandle handle) noexcept
+        {
+            return isValid(handle) && FlushFileBuffers(handle);
+        }
+
+        bool resizeFile(FileHandle handle, uint64_t size)
+        {
+            LARGE_INTEGER newSize;
+            newSize.QuadPart = static_cast<LONGLONG>(size);
+            return SetFilePointerEx(handle, newSize, NULL, FILE_BEGIN) && SetEndOfFile(handle);
+        }
+
+        bool setSparse(FileHandle handle)
+        {
+            return control(handle, FSCTL_SET_SPARSE, NULL, 0);
+        }
+
+        uint64_t getFileSize(FileHandle handle)
+        {
+            LARGE_INTEGER size;
+            if (!GetFileSizeEx(handle, &size)) return 0;
+            return static_cast<uint64_t>(size.QuadPart);
+        }
+
+        std::string getFilePath(FileHandle handle)
+        {
+            CHAR lpFileName[MAX_PATH] = "";
+            GetFinalPathNameByHandle(handle, lpFileName, MAX_PATH, FILE_NAME_NORMALIZED);
+            return lpFileName;
+        }
+
+        bool copyFile(const std::string& src, const std::string& dst)
+        {
+            return CopyFile(src.c_str(), dst.c_str(), false);
+        }
+
+        bool copyFileRange(FileHandle src, uint64_t srcOffset, FileHandle dst, uint64_t dstOffset, uint64_t size)
+        {
+            // Block cloning (ReFS, Dev Drive), only for cluster aligned ranges, anything else is refused
+            DUPLICATE_EXTENTS_DATA extents = {};
+            extents.FileHandle = src;
+            extents.SourceFileOffset.QuadPart = static_cast<LONGLONG>(srcOffset);
+            extents.TargetFileOffset.QuadPart = static_cast<LONGLONG>(dstOffset);
+            extents.ByteCount.QuadPart = static_cast<LONGLONG>(size);
+            return control(dst, FSCTL_DUPLICATE_EXTENTS_TO_FILE, &extents, sizeof(extents));
+        }
+
+        bool readFile(FileHandle handle, uint64_t offset, void* buffer, size_t size)
+        {
+            uint8_t* out = static_cast<uint8_t*>(buffer);
+            while (size > 0) {
+                OVERLAPPED at = overlappedAt(offset);
+                DWORD done = 0;
+                if (!waitResult(handle, ReadFile(handle, out, static_cast<DWORD>((std::min)(size, size_t(1) << 30)), NULL, &at), at, done) || done == 0) return false;
+                out += done;
+                offset += done;
+                size -= done;
+            }
+            return true;
+        }
+
+        bool writeFile(FileHandle handle, uint64_t offset, const void* buffer, size_t size)
+        {
+            const uint8_t* in = static_cast<const uint8_t*>(buffer);
+            while (size > 0) {
+                OVERLAPPED at = overlappedAt(offset);
+                DWORD done = 0;
+                if (!waitResult(handle, WriteFile(handle, in, static_cast<DWORD>((std::min)(size, size_t(1) << 30)), NULL, &at), at, done) || done == 0) return false;
+                in += done;
+                offset += done;
+                size -= done;
+            }
+            return true;
+        }
+
+        bool punchHole(FileHandle handle, uint64_t offset, uint64_t size) noexcept
+        {
+            FILE_ZERO_DATA_INFORMATION zero = {};
+            zero.FileOffset.QuadPart = static_cast<LONGLONG>(offset);
+            zero.BeyondFinalZero.QuadPart = static_cast<LONGLONG>(offset + size);
+            return control(handle, FSCTL_SET_ZERO_DATA, &zero, sizeof(zero));
+        }
+
+        MapHandle createMapping(FileHandle handle)
+        {
+            return CreateFileMapping(handle, NULL, PAGE_READWRITE, 0, 0, NULL);
+        }
+
+        void closeMapping(MapHandle& handle) noexcept
+        {
+            if (handle != nullptr) CloseHandle(handle);
+            handle = InvalidMap;
+        }
+
+        void* mapView(MapHandle handle, uint64_t offset, size_t size)
+        {
+            // Split high and low parts for 64-bit offset
+            LARGE_INTEGER start;
+            start.QuadPart = static_cast<LONGLONG>(offset);
+            return MapViewOfFile(handle, FILE_MAP_ALL_ACCESS, start.HighPart, start.LowPart, size);
+        }
+
+        void* mapViewPrivate(MapHandle handle, uint64_t offset, size_t size, size_t)
+        {
+            // Written pages move to the paging file, views are granularity aligned anyway
+            LARGE_INTEGER start;
+            start.QuadPart = static_cast<LONGLONG>(offset);
+            return MapViewOfFile(handle, FILE_MAP_COPY, start.HighPart, start.LowPart, size);
+        }
+
+        bool flushView(void* address, size_t size) noexcept
+        {
+            return FlushViewOfFile(address, size);
+        }
+
+        bool unmapView(void* address, size_t) noexcept
+        {
+            return UnmapViewOfFile(address);
+        }
+
+        void* reserveAddressSpace(size_t size, size_t alignment)
+        {
+            MEM_ADDRESS_REQUIREMENTS requirements = {};
+            requirements.Alignment = alignment;
+            MEM_EXTENDED_PARAMETER parameter = {};
+            parameter.Type = MemExtendedParameterAddressRequirements;
+            parameter.Pointer = &requirements;
+            return VirtualAlloc2(GetCurrentProcess(), NULL, size, MEM_RESERVE | MEM_RESERVE_PLACEHOLDER, PAGE_NOACCESS,
+                (alignment != 0) ? &parameter : NULL, (alignment != 0) ? 1 : 0);
+        }
+
+        void* mapViewAt(MapHandle handle, uint64_t offset, size_t size, void* address)
+        {
+            // Split the placeholder so the view replaces exactly [address, address + size), this fails
+            // harmlessly when the placeholder already has that size
+            VirtualFree(address, size, MEM_RELEASE | MEM_PRESERVE_PLACEHOLDER);
+            return MapViewOfFile3(handle, GetCurrentProcess(), address, offset, size, MEM_REPLACE_PLACEHOLDER, PAGE_READWRITE, NULL, 0);
+        }
+
+        bool unmapViewAt(void* address, size_t) noexcept
+        {
+            return UnmapViewOfFile2(GetCurrentProcess(), address, MEM_PRESERVE_PLACEHOLDER);
+        }
+
+        bool releaseAddressSpace(void* address, size_t size) noexcept
+        {
+            VirtualFree(address, size, MEM_RELEASE | MEM_COALESCE_PLACEHOLDERS);
+            return VirtualFree(address, 0, MEM_RELEASE);
+        }
+
+        FileHandle createHugeFile(const std::string&, uint64_t)
+        {
+            // SEC_LARGE_PAGES only applies to pagefile-backed sections, which have no file handle to hand out
+            return InvalidFile;
+        }
+
+        bool adviseHugePages(void*, size_t) noexcept
+        {
+            return false;
+        }
+
+        bool canAdviseHugePages() noexcept
+        {
+            return false;
+        }
+
+        bool adviseView(void* address, size_t size, Advice advice) noexcept
+        {
+            switch (advice) {
+            case Advice::WillNeed: {
+                WIN32_MEMORY_RANGE_ENTRY range = { address, size };
+                return PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+            }
+            case Advice::DontNeed:
+                // Unlocking pages that are not locked takes them out of the working set
+                VirtualUnlock(address, size);
+                return true;
+            default:
+                return false;   // no access pattern hints for mapped views
+            }
+        }
+
+        bool adviseFile(FileHandle, uint64_t, uint64_t, Advice) noexcept
+        {
+            return false;
+        }
+
+        NumaTopology getNumaTopology()
+        {
+            NumaTopology nodes;
+            ULONG highest = 0;
+            if (GetNumaHighestNodeNumber(&highest)) {
+                nodes.resize(highest + 1);
+                for (USHORT node = 0; node <= highest; ++node) {
+                    GROUP_AFFINITY affinity = {};
+                    if (!GetNumaNodeProcessorMaskEx(node, &affinity)) continue;
+                    for (uint32_t bit = 0; bit < sizeof(KAFFINITY) * 8; ++bit) {
+                        if (affinity.Mask & (KAFFINITY(1) << bit)) nodes[node].push_back(affinity.Group * 64 + bit);
+                    }
+                }
+            }
+            if (nodes.empty()) {
+                SYSTEM_INFO SysInfo;
+                GetSystemInfo(&SysInfo);
+                nodes.resize(1);
+                for (uint32_t cpu = 0; cpu < SysInfo.dwNumberOfProcessors; ++cpu) nodes[0].push_back(cpu);
+            }
+            return nodes;
+        }
+
+        bool pinThread(const std::vector<uint32_t>& cpus) noexcept
+        {
+            if (cpus.empty()) return false;
+
+            // A thread runs in one processor group, the one of the first CPU
+            GROUP_AFFINITY affinity = {};
+            affinity.Group = static_cast<WORD>(cpus[0] / 64);
+            for (uint32_t cpu : cpus) {
+                if (cpu / 64 == affinity.Group) affinity.Mask |= KAFFINITY(1) << (cpu % 64);
+            }
+            return SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr);
+        }
+
+        bool preferNode(uint32_t) noexcept
+        {
+            // Windows already takes new pages from the node of the faulting thread's ideal processor
+            return false;
+        }
+
+        bool bindToNode(void*, size_t, uint32_t) noexcept
+        {
+            // Only MapViewOfFileExNuma places a view, at map time
+            return false;
+        }
+
+        int getPageNode(const void* address) noexcept
+        {
+            PSAPI_WORKING_SET_EX_INFORMATION info = {};
+            info.VirtualAddress = const_cast<void*>(address);
+            if (!QueryWorkingSetEx(GetCurrentProcess(), &info, sizeof(info)) || !info.VirtualAttributes.Valid) return -1;
+            return static_cast<int>(info.VirtualAttributes.Node);
+        }
+
+#else
+
+        SystemInfo getSystemInfo()
+        {
+            // mmap offsets only need page alignment, so the page is also the allocation granularity
+            const uint32_t pageSize = static_cast<uint32_t>(sysconf(_SC_PAGESIZE));
+            return { pageSize, pageSize };
+        }
+
+        uint64_t getAvailableMemory()
+        {
+            // MemAvailable counts reclaimable page cache, sysconf only free pages
+            std::ifstream meminfo("/proc/meminfo");
+            std::string line;
+            while (std::getline(meminfo, line)) {
+                if (line.compare(0, 13, "MemAvailable:") == 0) return std::stoull(line.substr(13)) * 1024;   // in kB
+            }
+            return static_cast<uint64_t>(sysconf(_SC_AVPHYS_PAGES)) * static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+        }
+
+        namespace
+        {
+            // First value of a cgroup control file, UINT64_MAX for "max" or a file that cannot be read
+            uint64_t readCgroupValue(const std::string& path)
+            {
+                std::ifstream file(path);
+                std::string value;
+                if (!(file >> value) || value == "max") return UINT64_MAX;
+                return std::strtoull(value.c_str(), nullptr, 10);
+            }
+
+            uint64_t readCgroupStat(const std::string& path, const std::string& key)
+            {
+                std::ifstream file(path);
+                std::string name;
+                uint64_t value = 0;
+                while (file >> name >> value) {
+                    if (name == key) return value;
+                }
+                return 0;
+            }
+        }
+
+        MemoryStatus getMemoryStatus()
+        {
+            MemoryStatus status;
+            uint64_t total = 0, available = 0;
+            {
+                std::ifstream meminfo("/proc/meminfo");
+                std::string line;
+                while (std::getline(meminfo, line)) {
+                    if (line.compare(0, 9, "MemTotal:") == 0) total = std::stoull(line.substr(9)) * 1024;               // in kB
+                    else if (line.compare(0, 13, "MemAvailable:") == 0) available = std::stoull(line.substr(13)) * 1024;
+                }
+            }
+            status.limit = total;
+            status.used = total - (std::min)(available, total);
+            status.available = available;
+
+            // The group this process is charged to: "0::<path>" for v2, "<id>:memory:<path>" for v1
+            std::string v2, v1;
+            {
+                std::ifstream cgroup("/proc/self/cgroup");
+                std::string line;
+                while (std::getline(cgroup, line)) {
+                    if (line.compare(0, 3, "0::") == 0) v2 = line.substr(3);
+                    else if (size_t at = line.find(":memory:"); at != std::string::npos) v1 = line.substr(at + 8);
+                }
+            }
+
+            // Inside a cgroup namespace the group's own directory is the mount root
+            uint64_t limit = UINT64_MAX, current = 0, inactive = 0;
+            if (!v2.empty()) {
+                for (const std::string& dir : { "/sys/fs/cgroup" + v2, "/sys/fs/cgroup/unified" + v2, std::string("/sys/fs/cgroup") }) {
+                    if (!std::ifstream(dir + "/memory.max")) continue;
+                    limit = readCgroupValue(dir + "/memory.max");
+                    current = readCgroupValue(dir + "/memory.current");
+                    inactive = readCgroupStat(dir + "/memory.stat", "inactive_file");
+                    break;
+                }
+            }
+            if (limit == UINT64_MAX && !v1.empty()) {
+                for (const std::string& dir : { "/sys/fs/cgroup/memory" + v1, std::string("/sys/fs/cgroup/memory") }) {
+                    if (!std::ifstream(dir + "/memory.limit_in_bytes")) continue;
+                    limit = readCgroupValue(dir + "/memory.limit_in_bytes");
+                    current = readCgroupValue(dir + "/memory.usage_in_bytes");
+                    inactive = readCgroupStat(dir + "/memory.stat", "total_inactive_file");
+                    break;
+                }
+            }
+
+            // v1 reports "no limit" as a huge number, anything above physical memory is no limit either
+            if (limit < total && current != UINT64_MAX) {
+                // Inactive file pages are the first to go on reclaim, like the kubelet's working set
+                const uint64_t used = current - (std::min)(inactive, current);
+                status.limit = limit;
+                status.used = used;
+                status.available = (std::min)(available, limit - (std::min)(used, limit));
+            }
+            return status;
+        }
+
+        size_t getHugePageSize()
+        {
+            std::ifstream meminfo("/proc/meminfo");
+            std::string line;
+            while (std::getline(meminfo, line)) {
+                if (line.compare(0, 13, "Hugepagesize:") == 0) return std::stoull(line.substr(13)) * 1024;   // in kB
+            }
+            return 0;
+        }
+
+        int lastError() noexcept
+        {
+            return errno;
+        }
+
+        bool isValid(FileHandle handle) noexcept
+        {
+            return handle >= 0;
+        }
+
+        bool createDirectory(const std::string& dir)
+        {
+            return mkdir(dir.c_str(), 0755) == 0 || errno == EEXIST;
+        }
+
+        FileHandle createFile(const std::string& path)
+        {
+            return open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        }
+
+        FileHandle openFile(const std::string& path)
+        {
+            return open(path.c_str(), O_RDWR | O_CLOEXEC);
+        }
+
+        bool duplicateFile(FileHandle src, FileHandle& dst)
+        {
+            dst = fcntl(src, F_DUPFD_CLOEXEC, 0);
+            return dst >= 0;
+        }
+
+        void closeFile(FileHandle& handle) noexcept
+        {
+            if (isValid(handle)) close(handle);
+            handle = InvalidFile;
+        }
+
+        bool flushFile(FileHandle handle) noexcept
+        {
+            return isValid(handle) && fsync(handle) == 0;
+        }
+
+        bool resizeFile(FileHandle handle, uint64_t size)
+        {
+            return ftruncate(handle, static_cast<off_t>(size)) == 0;
+        }
+
+        bool setSparse(FileHandle)
+        {
+            // ftruncate growth is already a hole on ext4/xfs/tmpfs
+            return true;
+        }
+
+        uint64_t getFileSize(FileHandle handle)
+        {
+            struct stat st;
+            if (fstat(handle, &st) != 0) return 0;
+            return static_cast<uint64_t>(st.st_size);
+        }
+
+        std::string getFilePath(FileHandle handle)
+        {
+            char lpFileName[PATH_MAX] = "";
+            const std::string link = "/proc/self/fd/" + std::to_string(handle);
+            ssize_t len = readlink(link.c_str(), lpFileName, sizeof(lpFileName) - 1);
+            if (len < 0) return "";
+            return std::string(lpFileName, static_cast<size_t>(len));
+        }
+
+        bool copyFile(const std::string& src, const std::string& dst)
+        {
+            FileHandle in = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+            if (!isValid(in)) return false;
+            FileHandle out = createFile(dst);
+            if (!isValid(out)) {
+                closeFile(in);
+                return false;
+            }
+
+            char buffer[1 << 16];
+            ssize_t n = 0;
+            bool ok = true;
+            while (ok && (n = read(in, buffer, sizeof(buffer))) > 0) {
+                for (ssize_t written = 0; written < n; ) {
+                    ssize_t w = write(out, buffer + written, static_cast<size_t>(n - written));
+                    if (w < 0) { ok = false; break; }
+                    written += w;
+                }
+            }
+            ok = ok && n == 0;
+            closeFile(in);
+            closeFile(out);
+            return ok;
+        }
+
+        bool copyFileRange(FileHandle src, uint64_t srcOffset, FileHandle dst, uint64_t dstOffset, uint64_t size)
+        {
+#ifdef __linux__
+            // Goes through the page cache, so mappings of either file see the result at once
+            loff_t in = static_cast<loff_t>(srcOffset);
+            loff_t out = static_cast<loff_t>(dstOffset);
+            while (size > 0) {
+                ssize_t copied = copy_file_range(src, &in, dst, &out, static_cast<size_t>(size), 0);
+                if (copied <= 0) return false;     // EXDEV, ENOSYS, EINVAL... or the source ended
+                size -= static_cast<uint64_t>(copied);
+            }
+            return true;
+#else
+            return false;
+#endif
+        }
+
+        bool readFile(FileHandle handle, uint64_t offset, void* buffer, size_t size)
+        {
+            uint8_t* out = static_cast<uint8_t*>(buffer);
+            while (size > 0) {
+                ssize_t done = pread(handle, out, size, static_cast<off_t>(offset));
+                if (done < 0 && errno == EINTR) continue;
+                if (done <= 0) return false;
+                out += done;
+                offset += static_cast<uint64_t>(done);
+                size -= static_cast<size_t>(done);
+            }
+            return true;
+        }
+
+        bool writeFile(FileHandle handle, uint64_t offset, const void* buffer, size_t size)
+        {
+            const uint8_t* in = static_cast<const uint8_t*>(buffer);
+            while (size > 0) {
+                ssize_t done = pwrite(handle, in, size, static_cast<off_t>(offset));
+                if (done < 0 && errno == EINTR) continue;
+                if (done <= 0) return false;
+                in += done;
+                offset += static_cast<uint64_t>(done);
+                size -= static_cast<size_t>(done);
+            }
+            return true;
+        }
+
+        bool punchHole(FileHandle handle, uint64_t offset, uint64_t size) noexcept
+        {
+#ifdef FALLOC_FL_PUNCH_HOLE
+            return fallocate(handle, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, static_cast<off_t>(offset), static_cast<off_t>(size)) == 0;
+#else
+            return false;
+#endif
+        }
+
+        MapHandle createMapping(FileHandle handle)
+        {
+            return handle;
+        }
+
+        void closeMapping(MapHandle& handle) noexcept
+        {
+            // The descriptor is owned by the file handle
+            handle = InvalidMap;
+        }
+
+        void* mapView(MapHandle handle, uint64_t offset, size_t size)
+        {
+            if (size == 0) {
+                // Same as MapViewOfFile: a zero size maps up to the end of the file
+                size = static_cast<size_t>(getFileSize(handle) - offset);
+            }
+            void* address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, handle, static_cast<off_t>(offset));
+            return (address == MAP_FAILED) ? nullptr : address;
+        }
+
+        void* mapViewPrivate(MapHandle handle, uint64_t offset, size_t size, size_t alignment)
+        {
+            // Huge pages need the address aligned as well, like mapViewAligned
+            void* address = nullptr;
+            int flags = MAP_PRIVATE;
+            if (alignment > static_cast<size_t>(sysconf(_SC_PAGESIZE))) {
+                address = reserveAddressSpace(size, alignment);
+                if (address == nullptr) return nullptr;
+                flags |= MAP_FIXED;
+            }
+
+            void* mapped = mmap(address, size, PROT_READ | PROT_WRITE, flags, handle, static_cast<off_t>(offset));
+            if (mapped == MAP_FAILED && address != nullptr) releaseAddressSpace(address, size);
+            return (mapped == MAP_FAILED) ? nullptr : mapped;
+        }
+
+        bool flushView(void* address, size_t size) noexcept
+        {
+            // FlushViewOfFile only starts the write back, MS_ASYNC is the equivalent
+            return msync(address, size, MS_ASYNC) == 0;
+        }
+
+        bool unmapView(void* address, size_t size) noexcept
+        {
+            return munmap(address, size) == 0;
+        }
+
+        void* reserveAddressSpace(size_t size, size_t alignment)
+        {
+            // Over-reserve by the alignment and give back both ends
+            const size_t slack = (alignment > 1) ? alignment : 0;
+            void* address = mmap(nullptr, size + slack, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (address == MAP_FAILED) return nullptr;
+            if (slack == 0) return address;
+
+            uint8_t* base = static_cast<uint8_t*>(address);
+            uint8_t* aligned = reinterpret_cast<uint8_t*>((reinterpret_cast<uintptr_t>(base) + alignment - 1) & ~(uintptr_t)(alignment - 1));
+            if (aligned != base) munmap(base, aligned - base);
+            if (aligned + size != base + size + slack) munmap(aligned + size, (base + size + slack) - (aligned + size));
+            return aligned;
+        }
+
+        void* mapViewAt(MapHandle handle, uint64_t offset, size_t size, void* address)
+        {
+            void* mapped = mmap(address, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, handle, static_cast<off_t>(offset));
+            return (mapped == MAP_FAILED) ? nullptr : mapped;
+        }
+
+        bool unmapViewAt(void* address, size_t size) noexcept
+        {
+            return mmap(address, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) != MAP_FAILED;
+        }
+
+        bool releaseAddressSpace(void* address, size_t size) noexcept
+        {
+            return munmap(address, size) == 0;
+        }
+
+        FileHandle createHugeFile(const std::string& name, uint64_t size)
+        {
+#ifdef MFD_HUGETLB
+            const size_t hugePage = getHugePageSize();
+            if (hugePage == 0) return InvalidFile;
+
+            int fd = memfd_create(name.c_str(), MFD_CLOEXEC | MFD_HUGETLB);
+            if (fd < 0) return InvalidFile;
+
+            // hugetlbfs reserves its pages at mmap time, a trial mapping tells whether the pool can hold the file
+            const uint64_t rounded = (((std::max)(size, uint64_t(1)) + hugePage - 1) / hugePage) * hugePage;
+            void* probe = (ftruncate(fd, static_cast<off_t>(rounded)) == 0)
+                ? mmap(nullptr, rounded, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+            if (probe == MAP_FAILED) {
+                close(fd);
+                return InvalidFile;
+            }
+            munmap(probe, rounded);
+            return fd;
+#else
+            return InvalidFile;
+#endif
+        }
+
+        bool adviseHugePages(void* address, size_t size) noexcept
+        {
+#ifdef MADV_HUGEPAGE
+            return madvise(address, size, MADV_HUGEPAGE) == 0;
+#else
+            return false;
+#endif
+        }
+
+        bool canAdviseHugePages() noexcept
+        {
+#ifdef MADV_HUGEPAGE
+            // "always [madvise] never", the bracketed mode is the active one
+            static const bool enabled = []() {
+                try {
+                    std::ifstream mode("/sys/kernel/mm/transparent_hugepage/enabled");
+                    std::string line;
+                    return std::getline(mode, line) && line.find("[never]") == std::string::npos;
+                }
+                catch (...) {
+                    return false;
+                }
+            }();
+            return enabled;
+#else
+            return false;
+#endif
+        }
+
+        bool adviseView(void* address, size_t size, Advice advice) noexcept
+        {
+            // madvise wants a page aligned start
+            const uintptr_t page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+            const uintptr_t start = reinterpret_cast<uintptr_t>(address) & ~(page - 1);
+            size += reinterpret_cast<uintptr_t>(address) - start;
+
+            int flag = MADV_NORMAL;
+            switch (advice) {
+            case Advice::Normal:        flag = MADV_NORMAL; break;
+            case Advice::Sequential:    flag = MADV_SEQUENTIAL; break;
+            case Advice::Random:        flag = MADV_RANDOM; break;
+            case Advice::WillNeed:      flag = MADV_WILLNEED; break;
+            case Advice::DontNeed:      flag = MADV_DONTNEED; break;
+            }
+            return madvise(reinterpret_cast<void*>(start), size, flag) == 0;
+        }
+
+        bool adviseFile(FileHandle handle, uint64_t offset, uint64_t size, Advice advice) noexcept
+        {
+            int flag = POSIX_FADV_NORMAL;
+            switch (advice) {
+            case Advice::Normal:        flag = POSIX_FADV_NORMAL; break;
+            case Advice::Sequential:    flag = POSIX_FADV_SEQUENTIAL; break;
+            case Advice::Random:        flag = POSIX_FADV_RANDOM; break;
+            case Advice::WillNeed:      flag = POSIX_FADV_WILLNEED; break;
+            case Advice::DontNeed:      flag = POSIX_FADV_DONTNEED; break;
+            }
+            return posix_fadvise(handle, static_cast<off_t>(offset), static_cast<off_t>(size), flag) == 0;
+        }
+
+        namespace
+        {
+            // "0-3,8,10-11", the format of the sysfs node and CPU lists
+            std::vector<uint32_t> parseList(const std::string& list)
+            {
+                std::vector<uint32_t> values;
+                const char* at = list.c_str();
+                for (;;) {
+                    char* end = nullptr;
+                    const unsigned long first = std::strtoul(at, &end, 10);
+                    if (end == at) break;
+                    unsigned long last = first;
+                    if (*end == '-') last = std::strtoul(end + 1, &end, 10);
+                    for (unsigned long value = first; value <= last; ++value) values.push_back(static_cast<uint32_t>(value));
+                    if (*end != ',') break;
+                    at = end + 1;
+                }
+                return values;
+            }
+
+            // Node masks for the mempolicy calls, the kernel takes the bit count plus one
+            constexpr uint32_t maxNodes = 1024;
+            using NodeMask = unsigned long[maxNodes / (8 * sizeof(unsigned long))];
+        }
+
+        NumaTopology getNumaTopology()
+        {
+            NumaTopology nodes;
+            std::ifstream online("/sys/devices/system/node/online");
+            std::string list;
+            if (std::getline(online, list)) {
+                for (uint32_t node : parseList(list)) {
+                    if (node >= nodes.size()) nodes.resize(node + 1);
+                    std::ifstream cpus("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+                    if (std::getline(cpus, list)) nodes[node] = parseList(list);
+                }
+            }
+            if (nodes.empty()) {
+                nodes.resize(1);
+                const long count = sysconf(_SC_NPROCESSORS_ONLN);
+                for (long cpu = 0; cpu < count; ++cpu) nodes[0].push_back(static_cast<uint32_t>(cpu));
+            }
+            return nodes;
+        }
+
+        bool pinThread(const std::vector<uint32_t>& cpus) noexcept
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for (uint32_t cpu : cpus) {
+                if (cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+            }
+            return CPU_COUNT(&set) > 0 && sched_setaffinity(0, sizeof(set), &set) == 0;
+        }
+
+        bool preferNode(uint32_t node) noexcept
+        {
+            if (node >= maxNodes) return false;
+            NodeMask mask = {};
+            mask[node / (8 * sizeof(unsigned long))] = 1ul << (node % (8 * sizeof(unsigned long)));
+            return syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, maxNodes + 1) == 0;
+        }
+
+        bool bindToNode(void* address, size_t size, uint32_t node) noexcept
+        {
+            if (node >= maxNodes) return false;
+            NodeMask mask = {};
+            mask[node / (8 * sizeof(unsigned long))] = 1ul << (node % (8 * sizeof(unsigned long)));
+
+            // Preferred rather than bound, a full node falls back to the others instead of the OOM killer.
+            // Shared memory files follow it, page cache pages follow the faulting thread's preferNode.
+            const uintptr_t page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+            const uintptr_t start = reinterpret_cast<uintptr_t>(address) & ~(page - 1);
+            size += reinterpret_cast<uintptr_t>(address) - start;
+            return syscall(SYS_mbind, start, size, MPOL_PREFERRED, mask, maxNodes + 1, 0) == 0;
+        }
+
+        int getPageNode(const void* address) noexcept
+        {
+            // move_pages without target nodes only reports where the pages are, and faults nothing in
+            const uintptr_t page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+            void* pages[1] = { reinterpret_cast<void*>(reinterpret_cast<uintptr_t>(address) & ~(page - 1)) };
+            int status[1] = { -1 };
+            if (syscall(SYS_move_pages, 0, 1, pages, nullptr, status, 0) != 0) return -1;
+            return (status[0] >= 0) ? status[0] : -1;
+        }
+
+#endif
+
+        void* mapViewAligned(MapHandle handle, uint64_t offset, size_t size, size_t alignment)
+        {
+            void* address = reserveAddressSpace(size, alignment);
+            if (address == nullptr) return nullptr;
+
+            void* mapped = mapViewAt(handle, offset, size, address);
+            if (mapped == nullptr) releaseAddressSpace(address, size);
+            return mapped;
+        }
+    }
+}
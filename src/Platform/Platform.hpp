@@ -0,0 +1,137 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#endif
+
+// Lets a single function use an instruction set the rest of the TU is not built for
+// (MSVC allows intrinsics without /arch, GCC/Clang need a per-function target).
+#if defined(__GNUC__) || defined(__clang__)
+#define SORAMEM_TARGET(isa) __attribute__((target(isa)))
+#else
+#define SORAMEM_TARGET(isa)
+#endif
+
+namespace SoraMem
+{
+    namespace Platform
+    {
+#ifdef _WIN32
+        using FileHandle = HANDLE;
+        using MapHandle  = HANDLE;
+
+        inline const FileHandle InvalidFile = nullptr;
+        inline const MapHandle  InvalidMap  = nullptr;
+#else
+        using FileHandle = int;                 // file descriptor
+        using MapHandle  = int;                 // POSIX has no mapping object, the descriptor is mapped directly
+
+        constexpr FileHandle InvalidFile = -1;
+        constexpr MapHandle  InvalidMap  = -1;
+#endif
+
+        struct CpuFeatures
+        {
+            bool ssse3 = false;
+            bool sse41 = false;
+            bool pclmul = false;
+            bool avx2 = false;                  // also requires OS support for YMM state
+            bool avx512f = false;               // also requires OS support for ZMM state
+            bool avx512bw = false;
+            bool vpclmulqdq = false;
+            bool erms = false;                  // Enhanced REP MOVSB/STOSB
+        };
+
+        // Access pattern hints for mapped memory and the page cache
+        enum class Advice : uint8_t
+        {
+            Normal,
+            Sequential,     // read ahead aggressively
+            Random,         // no read-ahead
+            WillNeed,       // start reading the range in now
+            DontNeed        // the range may be dropped from memory (dirty pages are written back first)
+        };
+
+        struct SystemInfo
+        {
+            uint32_t allocationGranularity = 0; // Alignment required for view offsets
+            uint32_t pageSize = 0;              // Hardware page size
+        };
+
+        // CPUs of every NUMA node, indexed by node id
+        using NumaTopology = std::vector<std::vector<uint32_t>>;
+
+        struct MemoryStatus
+        {
+            uint64_t limit = 0;                 // physical memory, or the cgroup limit when lower
+            uint64_t used = 0;                  // charged against limit, reclaimable page cache excluded where known
+            uint64_t available = 0;             // what can still be used before reclaim or the OOM killer
+        };
+
+        SystemInfo      getSystemInfo();
+        uint64_t        getAvailableMemory();           // physical memory that can be used without swapping
+        MemoryStatus    getMemoryStatus();              // /proc/meminfo and the cgroup (v2, else v1) on Linux
+        size_t          getHugePageSize();              // 0 without huge pages, or on Windows without SeLockMemoryPrivilege
+        const CpuFeatures& getCpuFeatures() noexcept;  // detected once by CPUID
+        int             lastError() noexcept;
+
+        bool            isValid(FileHandle handle) noexcept;
+
+        bool            createDirectory(const std::string& dir);   // true if created or already existing
+
+        // Read-write, on Windows shared and overlapped so AsyncIO can use the handle as it is
+        FileHandle      createFile(const std::string& path);       // create/truncate
+        FileHandle      openFile(const std::string& path);         // open existing
+        bool            duplicateFile(FileHandle src, FileHandle& dst);
+        void            closeFile(FileHandle& handle) noexcept;
+        bool            flushFile(FileHandle handle) noexcept;
+        bool            resizeFile(FileHandle handle, uint64_t size);
+        bool            setSparse(FileHandle handle);              // growth leaves holes instead of zero blocks
+        uint64_t        getFileSize(FileHandle handle);
+        std::string     getFilePath(FileHandle handle);
+        bool            copyFile(const std::string& src, const std::string& dst);
+        // Copy inside the kernel (reflink/block clone when the file system can), false if unsupported here
+        bool            copyFileRange(FileHandle src, uint64_t srcOffset, FileHandle dst, uint64_t dstOffset, uint64_t size);
+        // Positioned I/O that does not move the file pointer, false unless every byte went through
+        bool            readFile(FileHandle handle, uint64_t offset, void* buffer, size_t size);
+        bool            writeFile(FileHandle handle, uint64_t offset, const void* buffer, size_t size);
+        // Frees the blocks of the range, which then reads as zeros (needs setSparse on Windows)
+        bool            punchHole(FileHandle handle, uint64_t offset, uint64_t size) noexcept;
+        // Anonymous file backed by huge pages (memfd on hugetlbfs), InvalidFile if the pool cannot hold size bytes
+        FileHandle      createHugeFile(const std::string& name, uint64_t size);
+
+        MapHandle       createMapping(FileHandle handle);
+        void            closeMapping(MapHandle& handle) noexcept;
+
+        void*           mapView(MapHandle handle, uint64_t offset, size_t size); // offset must be granularity aligned
+        // Copy-on-write view: writes go to private pages, the file and other views never see them
+        void*           mapViewPrivate(MapHandle handle, uint64_t offset, size_t size, size_t alignment = 0);
+        bool            flushView(void* address, size_t size) noexcept;
+        bool            unmapView(void* address, size_t size) noexcept;
+
+        // Address space reserved up front, views can then be placed at fixed addresses inside it
+        void*           reserveAddressSpace(size_t size, size_t alignment = 0);
+        void*           mapViewAt(MapHandle handle, uint64_t offset, size_t size, void* address);
+        bool            unmapViewAt(void* address, size_t size) noexcept;     // back to reserved
+        bool            releaseAddressSpace(void* address, size_t size) noexcept; // views inside must be unmapped
+        void*           mapViewAligned(MapHandle handle, uint64_t offset, size_t size, size_t alignment);
+        bool            adviseHugePages(void* address, size_t size) noexcept;    // transparent huge pages where supported
+        bool            canAdviseHugePages() noexcept;  // false where adviseHugePages can never take effect
+        bool            adviseView(void* address, size_t size, Advice advice) noexcept;
+        bool            adviseFile(FileHandle handle, uint64_t offset, uint64_t size, Advice advice) noexcept; // page cache, POSIX only
+
+        NumaTopology    getNumaTopology();              // one node holding every CPU where there is no NUMA
+        bool            pinThread(const std::vector<uint32_t>& cpus) noexcept;     // the calling thread
+        bool            preferNode(uint32_t node) noexcept;    // new pages of the calling thread come from node first, Linux only
+        bool            bindToNode(void* address, size_t size, uint32_t node) noexcept;    // pages of the range, Linux only
+        int             getPageNode(const void* address) noexcept;     // -1 if unknown or not faulted in
+    }
+}
@@ -0,0 +1,470 @@
+#include "SnapshotStore.hpp"
+#include "src/MemoryManager/MemoryManager.hpp"
+#include "src/MMFile/MMFile.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iterator>
+#include <map>
+#include <numeric>
+#include <stdexcept>
+
+namespace SoraMem
+{
+    namespace
+    {
+        constexpr uint32_t snapshotVersion = 1;
+        constexpr uint64_t recordAlign = 4096;
+        constexpr uint64_t taskBytes = 4 * 1024 * 1024;    // read, hashed and written by one task
+
+        uint64_t alignUp(uint64_t value, uint64_t to)
+        {
+            return (value + to - 1) / to * to;
+        }
+
+        // CRC64-XZ whatever tables are bound, so stores stay readable after a custom polynomial is loaded
+        uint64_t crc64Of(const void* data, size_t size)
+        {
+            return CRC32_64::crc64XZ(static_cast<const uint8_t*>(data), size);
+        }
+
+        SoraMemFileDescriptor makeDescriptor(const char (&subMagic)[8])
+        {
+            SoraMemFileDescriptor descriptor{};
+            std::memcpy(descriptor.baseMagic, "SMMF", 4);
+            descriptor.version = snapshotVersion;
+            descriptor.timestamp = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::seconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count());
+            descriptor.flags = SoraMemFlags::CRC;   // CRC64-XZ
+            std::memcpy(descriptor.subMagic, subMagic, 8);
+            return descriptor;
+        }
+
+        bool checkDescriptor(const SoraMemFileDescriptor& descriptor, const char (&subMagic)[8])
+        {
+            return std::memcmp(descriptor.baseMagic, "SMMF", 4) == 0 && descriptor.version == snapshotVersion
+                && std::memcmp(descriptor.subMagic, subMagic, 8) == 0;
+        }
+
+        // Per thread, so pool workers keep theirs across snapshots
+        std::vector<uint8_t>& scratch(size_t size)
+        {
+            thread_local std::vector<uint8_t> buffer;
+            if (buffer.size() < size) buffer.resize(size);
+            return buffer;
+        }
+
+        // Adds [begin, end) to disjoint, merged ranges keyed by start
+        void claimRange(std::map<uint64_t, uint64_t>& claimed, uint64_t begin, uint64_t end)
+        {
+            if (begin >= end) return;
+            auto it = claimed.upper_bound(begin);
+            if (it != claimed.begin() && std::prev(it)->second >= begin) --it;
+            while (it != claimed.end() && it->first <= end) {
+                begin = (std::min)(begin, it->first);
+                end = (std::max)(end, it->second);
+                it = claimed.erase(it);
+            }
+            claimed.emplace(begin, end);
+        }
+    }
+
+    template<typename F>
+    void SnapshotStore::runTasks(size_t count, F&& fn)
+    {
+        ThreadPool* pool = manager.getThreadPool();
+        if (pool == nullptr || count < 2) {
+            for (size_t i = 0; i < count; ++i) fn(i);
+            return;
+        }
+        pool->submit_bulk(count, fn);
+    }
+
+    SnapshotStore::SnapshotStore(MemoryManager& manager, MMFile* file, const std::string& path, uint64_t maximumSaves, size_t granule)
+        : manager(manager), file(file)
+    {
+        if (file == nullptr || !file->isValid()) {
+            throw std::invalid_argument("Invalid file or map handle.");
+        }
+
+        if (file->isForked()) {
+            throw std::invalid_argument("A forked file keeps its data in private pages, it cannot be snapshotted.");
+        }
+
+        if (maximumSaves < 2 || granule == 0) {
+            throw std::invalid_argument("A snapshot store needs at least 2 saves and a granule.");
+        }
+
+        const std::string listPath = path + ".sl.soramem";
+        const std::string dataPath = path + ".si.soramem";
+        // The destructor does not run for a throwing constructor, the files are closed here
+        try {
+            listFile = Platform::openFile(listPath);
+            if (Platform::isValid(listFile)) {
+                dataFile = Platform::openFile(dataPath);
+                SoraMemFileDescriptor descriptor{};
+                if (!Platform::isValid(dataFile) || !Platform::readFile(listFile, 0, &descriptor, sizeof(descriptor))
+                    || !checkDescriptor(descriptor, SoraMemSubMagicNumber::SNAPLIST) || descriptor.chunkSize < sizeof(list)) {
+                    throw std::runtime_error("Invalid snapshot list " + listPath);
+                }
+
+                std::vector<uint8_t> body(descriptor.chunkSize);
+                if (!Platform::readFile(listFile, sizeof(descriptor), body.data(), body.size()) || crc64Of(body.data(), body.size()) != descriptor.crc) {
+                    throw std::runtime_error("Snapshot list " + listPath + " is damaged, its CRC does not match.");
+                }
+                std::memcpy(&list, body.data(), sizeof(list));
+                if (list.maximumSaves < 2 || body.size() != sizeof(list) + list.maximumSaves * sizeof(SoraMemSnapshotListItemFormat)) {
+                    throw std::runtime_error("Invalid snapshot list " + listPath);
+                }
+                items.resize(list.maximumSaves);
+                std::memcpy(items.data(), body.data() + sizeof(list), items.size() * sizeof(SoraMemSnapshotListItemFormat));
+
+                dataEnd = alignUp(Platform::getFileSize(dataFile), recordAlign);
+                if (list.currentID != 0) loadBase();
+            }
+            else {
+                listFile = Platform::createFile(listPath);
+                dataFile = Platform::createFile(dataPath);
+                if (!Platform::isValid(listFile) || !Platform::isValid(dataFile)) {
+                    throw std::runtime_error("Failed to create snapshot store " + path + ". Error code: " + std::to_string(Platform::lastError()));
+                }
+                Platform::setSparse(dataFile);  // folded records are punched out
+
+                list.maximumSaves = maximumSaves;
+                std::strncpy(list.originFileName, path.c_str(), sizeof(list.originFileName) - 1);
+                items.resize(maximumSaves);
+                writeList();
+            }
+
+            channel = file->openDirtyChannel();
+        }
+        catch (...) {
+            Platform::closeFile(listFile);
+            Platform::closeFile(dataFile);
+            throw;
+        }
+        this->granule = ((granule + file->getSysGran() - 1) / file->getSysGran()) * file->getSysGran();
+    }
+
+    SnapshotStore::~SnapshotStore()
+    {
+        file->closeDirtyChannel(channel);
+        Platform::closeFile(listFile);
+        Platform::closeFile(dataFile);
+    }
+
+    void SnapshotStore::writeList()
+    {
+        const size_t itemBytes = items.size() * sizeof(SoraMemSnapshotListItemFormat);
+        std::vector<uint8_t> buffer(sizeof(SoraMemFileDescriptor) + sizeof(list) + itemBytes);
+        uint8_t* body = buffer.data() + sizeof(SoraMemFileDescriptor);
+        std::memcpy(body, &list, sizeof(list));
+        std::memcpy(body + sizeof(list), items.data(), itemBytes);
+
+        SoraMemFileDescriptor descriptor = makeDescriptor(SoraMemSubMagicNumber::SNAPLIST);
+        descriptor.chunkSize = sizeof(list) + itemBytes;
+        descriptor.subChunkSize = itemBytes;
+        descriptor.crc = crc64Of(body, descriptor.chunkSize);
+        std::memcpy(buffer.data(), &descriptor, sizeof(descriptor));
+
+        if (!Platform::writeFile(listFile, 0, buffer.data(), buffer.size()) || !Platform::flushFile(listFile)) {
+            throw std::runtime_error("Failed to write the snapshot list. Error code: " + std::to_string(Platform::lastError()));
+        }
+    }
+
+    SnapshotStore::Record SnapshotStore::readRecord(uint64_t offset) const
+    {
+        Record record;
+        record.offset = offset;
+        if (!Platform::readFile(dataFile, offset, &record.descriptor, sizeof(record.descriptor))
+            || !checkDescriptor(record.descriptor, SoraMemSubMagicNumber::SNAPDATA)
+            || record.descriptor.subChunkSize % sizeof(SoraMemSnapshotChunkFormat) != 0) {
+            throw std::runtime_error("Invalid snapshot record at " + std::to_string(offset));
+        }
+
+        record.chunks.resize(record.descriptor.subChunkSize / sizeof(SoraMemSnapshotChunkFormat));
+        const size_t tableBytes = static_cast<size_t>(record.descriptor.subChunkSize);
+        if ((tableBytes != 0 && !Platform::readFile(dataFile, offset + sizeof(record.descriptor), record.chunks.data(), tableBytes))
+            || crc64Of(record.chunks.data(), tableBytes) != record.descriptor.crc) {
+            throw std::runtime_error("Snapshot record at " + std::to_string(offset) + " is damaged, its CRC does not match.");
+        }
+        return record;
+    }
+
+    uint64_t SnapshotStore::recordEnd(const Record& record) const noexcept
+    {
+        uint64_t end = record.offset + sizeof(record.descriptor) + record.descriptor.subChunkSize;
+        for (const auto& chunk : record.chunks) end = (std::max)(end, chunk.snapshotOffset + chunk.snapshotSize);
+        return end;
+    }
+
+    void SnapshotStore::loadBase()
+    {
+        uint64_t id = list.currentID;
+        while (item(id).lastSnapshotID != 0) id = item(id).lastSnapshotID;
+
+        const Record base = readRecord(item(id).offset);
+        baseOffset = base.offset;
+        baseCapacity = base.chunks.empty() ? 0 : base.chunks.back().originOffset + base.chunks.back().originSize;
+    }
+
+    uint64_t SnapshotStore::snapshot()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        const uint64_t fileSize = file->getFileSize_s();
+        const uint64_t count = (fileSize + granule - 1) / granule;
+        std::vector<uint64_t> dirty = file->takeDirty(channel, granule);
+
+        // A base has room for its own size only, growing past it starts a new one
+        const bool full = list.currentID == 0 || fileSize > baseCapacity;
+        if (full) {
+            dirty.resize(count);
+            std::iota(dirty.begin(), dirty.end(), uint64_t(0));
+        }
+        granuleCRC.resize(count);
+        known.resize(count);
+
+        // Runs of consecutive dirty granules, one task each
+        const uint64_t taskGranules = (std::max)(taskBytes / granule, uint64_t(1));
+        std::vector<std::pair<uint64_t, uint64_t>> runs;    // first granule, granules
+        for (uint64_t index : dirty) {
+            if (!runs.empty() && runs.back().first + runs.back().second == index && runs.back().second < taskGranules) ++runs.back().second;
+            else runs.emplace_back(index, 1);
+        }
+
+        // Room for a chunk per dirty granule, the data follows. A base keeps every granule at dataStart + offset.
+        const uint64_t offset = dataEnd;
+        const uint64_t dataStart = alignUp(offset + sizeof(SoraMemFileDescriptor) + dirty.size() * sizeof(SoraMemSnapshotChunkFormat), recordAlign);
+        std::atomic<uint64_t> cursor{ dataStart };
+        std::vector<std::vector<SoraMemSnapshotChunkFormat>> taskChunks(runs.size());
+
+        try {
+            runTasks(runs.size(), [&](size_t task) {
+                const uint64_t origin = runs[task].first * granule;
+                const size_t size = static_cast<size_t>((std::min)((runs[task].first + runs[task].second) * granule, fileSize) - origin);
+                std::vector<uint8_t>& buffer = scratch(size);
+                file->read(origin, buffer.data(), size);
+
+                // Touched granules only go in when their CRC moved since the previous snapshot
+                std::vector<SoraMemSnapshotChunkFormat>& chunks = taskChunks[task];
+                for (size_t at = 0; at < size; at += granule) {
+                    const uint64_t index = (origin + at) / granule;
+                    const size_t length = (std::min)(static_cast<size_t>(granule), size - at);
+                    const uint64_t crc = crc64Of(buffer.data() + at, length);
+                    const bool changed = full || !known[index] || granuleCRC[index] != crc;
+                    granuleCRC[index] = crc;
+                    known[index] = 1;
+                    if (!changed) continue;
+
+                    if (!chunks.empty() && chunks.back().originOffset + chunks.back().originSize == origin + at) chunks.back().originSize += length;
+                    else chunks.push_back({ origin + at, length, 0, 0 });
+                }
+
+                for (auto& chunk : chunks) {
+                    chunk.snapshotSize = chunk.originSize;
+                    chunk.snapshotOffset = full ? dataStart + chunk.originOffset : cursor.fetch_add(chunk.originSize, std::memory_order_relaxed);
+                    if (!Platform::writeFile(dataFile, chunk.snapshotOffset, buffer.data() + (chunk.originOffset - origin), static_cast<size_t>(chunk.originSize))) {
+                        throw std::runtime_error("Failed to write snapshot data. Error code: " + std::to_string(Platform::lastError()));
+                    }
+                }
+                });
+
+            std::vector<uint8_t> header(sizeof(SoraMemFileDescriptor));
+            uint64_t written = 0;
+            uint64_t end = dataStart;
+            for (const auto& chunks : taskChunks) {
+                for (const auto& chunk : chunks) {
+                    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&chunk);
+                    header.insert(header.end(), bytes, bytes + sizeof(chunk));
+                    written += chunk.snapshotSize;
+                    end = (std::max)(end, chunk.snapshotOffset + chunk.snapshotSize);
+                }
+            }
+
+            SoraMemFileDescriptor descriptor = makeDescriptor(SoraMemSubMagicNumber::SNAPDATA);
+            descriptor.chunkSize = fileSize;
+            descriptor.subChunkSize = header.size() - sizeof(descriptor);
+            descriptor.crc = crc64Of(header.data() + sizeof(descriptor), static_cast<size_t>(descriptor.subChunkSize));
+            std::memcpy(header.data(), &descriptor, sizeof(descriptor));
+
+            // The record is on disk before the list names it
+            if (!Platform::writeFile(dataFile, offset, header.data(), header.size()) || !Platform::flushFile(dataFile)) {
+                throw std::runtime_error("Failed to write the snapshot record. Error code: " + std::to_string(Platform::lastError()));
+            }
+            dataEnd = alignUp(end, recordAlign);
+            lastWritten = written;
+        }
+        catch (...) {
+            // The changes are still to be saved
+            for (uint64_t index : dirty) {
+                file->markDirty(index * granule, granule);
+                known[index] = 0;
+            }
+            throw;
+        }
+
+        const uint64_t id = list.currentID + 1;
+        if (list.lastID != 0 && id - list.lastID >= list.maximumSaves) dropOldest();
+
+        item(id) = { id, offset, full ? 0 : list.currentID, full ? 0 : list.currentOffset };
+        list.currentID = id;
+        list.currentOffset = offset;
+        if (list.lastID == 0) {
+            list.lastID = id;
+            list.lastOffset = offset;
+        }
+        writeList();
+
+        if (full) {
+            baseOffset = offset;
+            baseCapacity = fileSize;
+        }
+        return id;
+    }
+
+    void SnapshotStore::dropOldest()
+    {
+        const uint64_t oldest = list.lastID;
+        const uint64_t next = oldest + 1;
+        const SoraMemSnapshotListItemFormat base = item(oldest);
+        const SoraMemSnapshotListItemFormat delta = item(next);
+
+        // Restoring next applies the base and then its delta, which stays right while the base is overwritten
+        list.lastID = next;
+        list.lastOffset = (delta.lastSnapshotID == 0) ? delta.offset : base.offset;
+        writeList();
+
+        if (delta.lastSnapshotID == 0) {
+            // next is a base of its own, nothing reads the oldest one any more
+            const Record dropped = readRecord(base.offset);
+            Platform::punchHole(dataFile, base.offset, recordEnd(dropped) - base.offset);
+            return;
+        }
+
+        // Fold the delta into the base, whose data is laid out like the file
+        Record target = readRecord(base.offset);
+        const Record source = readRecord(delta.offset);
+        const uint64_t targetStart = target.chunks.empty() ? 0 : target.chunks.front().snapshotOffset;
+        const uint64_t targetCapacity = target.chunks.empty() ? 0 : target.chunks.back().originOffset + target.chunks.back().originSize;
+        runTasks(source.chunks.size(), [&](size_t i) {
+            const SoraMemSnapshotChunkFormat& chunk = source.chunks[i];
+            if (chunk.originOffset + chunk.originSize > targetCapacity) {
+                throw std::runtime_error("Snapshot " + std::to_string(next) + " does not fit in its base.");
+            }
+            const uint64_t to = targetStart + chunk.originOffset;
+            if (Platform::copyFileRange(dataFile, chunk.snapshotOffset, dataFile, to, chunk.snapshotSize)) return;
+
+            std::vector<uint8_t>& buffer = scratch(static_cast<size_t>(chunk.snapshotSize));
+            if (!Platform::readFile(dataFile, chunk.snapshotOffset, buffer.data(), static_cast<size_t>(chunk.snapshotSize))
+                || !Platform::writeFile(dataFile, to, buffer.data(), static_cast<size_t>(chunk.snapshotSize))) {
+                throw std::runtime_error("Failed to fold snapshot " + std::to_string(next) + ". Error code: " + std::to_string(Platform::lastError()));
+            }
+            });
+
+        target.descriptor.chunkSize = source.descriptor.chunkSize;
+        target.descriptor.timestamp = source.descriptor.timestamp;
+        if (!Platform::writeFile(dataFile, base.offset, &target.descriptor, sizeof(target.descriptor)) || !Platform::flushFile(dataFile)) {
+            throw std::runtime_error("Failed to fold snapshot " + std::to_string(next) + ". Error code: " + std::to_string(Platform::lastError()));
+        }
+
+        // The base now is next
+        item(oldest) = {};
+        item(next) = { next, base.offset, 0, 0 };
+        if (list.currentID > next && item(next + 1).lastSnapshotID == next) item(next + 1).lastOffset = base.offset;
+        if (list.currentID == next) list.currentOffset = base.offset;
+        writeList();
+
+        Platform::punchHole(dataFile, delta.offset, recordEnd(source) - delta.offset);
+    }
+
+    void SnapshotStore::restore(uint64_t id)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (list.currentID == 0 || id < list.lastID || id > list.currentID) {
+            throw std::out_of_range("No snapshot " + std::to_string(id) + ", kept are " + std::to_string(list.lastID) + " to " + std::to_string(list.currentID));
+        }
+
+        std::vector<Record> chain;  // newest first
+        for (uint64_t at = id; ; at = item(at).lastSnapshotID) {
+            chain.push_back(readRecord(item(at).offset));
+            if (item(at).lastSnapshotID == 0) break;
+        }
+
+        // Every byte comes from the newest record holding it
+        const uint64_t fileSize = chain.front().descriptor.chunkSize;
+        struct Piece
+        {
+            uint64_t from;      // in the data file
+            uint64_t origin;
+            uint64_t size;
+        };
+        std::vector<Piece> pieces;
+        std::map<uint64_t, uint64_t> claimed;
+        for (const Record& record : chain) {
+            for (const auto& chunk : record.chunks) {
+                const uint64_t end = (std::min)(chunk.originOffset + chunk.originSize, fileSize);
+                auto it = claimed.upper_bound(chunk.originOffset);
+                if (it != claimed.begin()) --it;
+                for (uint64_t at = chunk.originOffset; at < end; ) {
+                    if (it != claimed.end() && it->second <= at) {
+                        ++it;
+                        continue;
+                    }
+                    if (it != claimed.end() && it->first <= at) {
+                        at = it->second;
+                        continue;
+                    }
+                    const uint64_t stop = (it != claimed.end()) ? (std::min)(end, it->first) : end;
+                    pieces.push_back({ chunk.snapshotOffset + (at - chunk.originOffset), at, stop - at });
+                    at = stop;
+                }
+                claimRange(claimed, chunk.originOffset, end);
+            }
+        }
+
+        file->resize_s(static_cast<size_t>(fileSize));
+
+        // The newest snapshot restored means the file matches it again, so its granule CRCs are known
+        const bool current = id == list.currentID;
+        const uint64_t count = (fileSize + granule - 1) / granule;
+        if (current) {
+            granuleCRC.assign(count, 0);
+            known.assign(count, 0);
+        }
+
+        // Written through views, which mark the pieces dirty on every channel
+        runTasks(pieces.size(), [&](size_t i) {
+            const Piece& piece = pieces[i];
+            const size_t size = static_cast<size_t>(piece.size);
+            std::vector<uint8_t>& buffer = scratch(size);
+            if (!Platform::readFile(dataFile, piece.from, buffer.data(), size)) {
+                throw std::runtime_error("Failed to restore snapshot " + std::to_string(id) + ". Error code: " + std::to_string(Platform::lastError()));
+            }
+            file->write(piece.origin, buffer.data(), size);
+
+            if (!current) return;
+            // Granules wholly inside the piece, the rest are hashed again by the next snapshot
+            for (uint64_t index = (piece.origin + granule - 1) / granule; index < count; ++index) {
+                const uint64_t begin = index * granule;
+                const uint64_t end = (std::min)(begin + granule, fileSize);
+                if (end > piece.origin + piece.size) break;
+                granuleCRC[index] = crc64Of(buffer.data() + (begin - piece.origin), static_cast<size_t>(end - begin));
+                known[index] = 1;
+            }
+            });
+        if (current) file->takeDirty(channel, granule);     // nothing changed since the snapshot
+    }
+
+    std::vector<uint64_t> SnapshotStore::getSnapshots() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<uint64_t> ids;
+        if (list.currentID == 0) return ids;
+        for (uint64_t id = list.lastID; id <= list.currentID; ++id) ids.push_back(id);
+        return ids;
+    }
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "src/Platform/Platform.hpp"
+#include "src/MMFile/SoraMemFileSpecification.hpp"
+
+namespace SoraMem
+{
+    class MemoryManager;
+    class MMFile;
+
+    // Incremental snapshots of one file, driven by a dirty tracking channel of it (MMFile::openDirtyChannel).
+    //
+    // <path>.si.soramem holds the records: a SNAPDATA descriptor (chunkSize = size of the file at the time,
+    // crc = CRC64 of the chunk table), a table of SoraMemSnapshotChunkFormat and the chunk data. The first
+    // record is a full base, later ones only hold granules that changed since the previous snapshot, found
+    // by the dirty bits and filtered by a per-granule CRC64. Growing past the base writes a new base.
+    //
+    // <path>.sl.soramem chains them: a SNAPLIST descriptor, SoraMemSnapshotListFormat (current = newest,
+    // last = oldest kept) and maximumSaves items linking every snapshot to its predecessor. Past maximumSaves
+    // the oldest delta is folded into the base in place and its blocks are punched out, so the cost of a
+    // snapshot stays proportional to what changed.
+    //
+    // Writers of the file must pause while snapshot or restore runs. Forks cannot be snapshotted.
+    class SnapshotStore
+    {
+    public:
+        // Opens the store at path or creates it, maximumSaves only applies to a new one. granule is rounded up
+        // to the file's sysGran.
+        SnapshotStore(MemoryManager& manager, MMFile* file, const std::string& path, uint64_t maximumSaves = 16, size_t granule = 64 * 1024);
+        ~SnapshotStore();   // stops dirty tracking
+
+        SnapshotStore(SnapshotStore const&) = delete;
+        void operator=(SnapshotStore const&) = delete;
+
+        uint64_t                snapshot();                 // id of the new snapshot
+        void                    restore(uint64_t id);       // the file gets the size and contents it had then
+        std::vector<uint64_t>   getSnapshots() const;       // ids still kept, oldest first
+
+        uint64_t                getMaximumSaves() const noexcept { return list.maximumSaves; }
+        uint64_t                getCurrentID() const noexcept { return list.currentID; }
+        uint64_t                getLastWritten() const noexcept { return lastWritten; }    // data bytes of the last snapshot
+
+    private:
+        struct Record
+        {
+            uint64_t            offset = 0;
+            SoraMemFileDescriptor descriptor{};
+            std::vector<SoraMemSnapshotChunkFormat> chunks;
+        };
+
+        Record                  readRecord(uint64_t offset) const;
+        uint64_t                recordEnd(const Record& record) const noexcept;
+        void                    writeList();
+        void                    dropOldest();
+        void                    loadBase();                 // base of the newest chain
+
+        // fn(i) for i in [0, count) on the manager's pool, inline without one
+        template<typename F>
+        void                    runTasks(size_t count, F&& fn);
+
+        SoraMemSnapshotListItemFormat& item(uint64_t id) { return items[id % list.maximumSaves]; }
+        const SoraMemSnapshotListItemFormat& item(uint64_t id) const { return items[id % list.maximumSaves]; }
+
+        MemoryManager&          manager;
+        MMFile*                 file;
+        Platform::FileHandle    listFile = Platform::InvalidFile;
+        Platform::FileHandle    dataFile = Platform::InvalidFile;
+
+        SoraMemSnapshotListFormat list{};
+        std::vector<SoraMemSnapshotListItemFormat> items;
+
+        uint32_t                channel = 0;                // dirty tracking channel of the file
+        uint64_t                granule = 0;
+
+        uint64_t                dataEnd = 0;                // records are appended here
+        uint64_t                baseOffset = 0;
+        uint64_t                baseCapacity = 0;           // file bytes the base has room for
+        uint64_t                lastWritten = 0;
+
+        // CRC64 of every granule as of the newest snapshot, known[i] = 0 until hashed in this session
+        std::vector<uint64_t>   granuleCRC;
+        std::vector<uint8_t>    known;
+
+        mutable std::mutex      mutex;
+    };
+}
@@ -1,10 +1,25 @@
 #define TESTING
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <future>
 #include <iostream>
 #include <iomanip>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
 #include "MMFile/MMFile.hpp"
 #include "MemoryManager/MemoryManager.hpp"
 #include "CRC32_64/CRC32_64.hpp"
+#include "MemCopy/MemCopy.hpp"
+#include "SnapshotStore/SnapshotStore.hpp"
 
 #include "Timer.hpp"
 
@@ -21,6 +36,21 @@ auto test(bool a)
 
 auto& print = std::cout;
 
+// Heap allocations made by this thread, for the allocation-free paths
+thread_local size_t allocations = 0;
+
+void* operator new(size_t size)
+{
+	++allocations;
+	if (void* p = std::malloc(size ? size : 1)) return p;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
 const uint64_t maxSize = 4 * 65536 + 100;
 
 int main()
@@ -32,12 +62,158 @@ int main()
 
 	MemMng.initManager();
 	MemMng.setThreadPool(ManagerWorkerPool);
-	MemMng.setTmpDir("temp\\");
+	MemMng.setTmpDir("temp/");
 	CRC32_64::init();
 
 	{
-	print << std::setw(20) << std::left << "Tmp dir assignment: " << test(MemMng.tmpDir == "temp\\");
-	print << std::setw(20) << std::left << "SYS Granularity: " << test(MemMng.dwSysGran == 65536);
+	print << std::setw(20) << std::left << "Tmp dir assignment: " << test(MemMng.tmpDir == "temp/");
+	print << std::setw(20) << std::left << "SYS Granularity: " << test(MemMng.dwSysGran == Platform::getSystemInfo().allocationGranularity);
+	}
+
+	{
+		// External submissions, tasks spawning tasks (own deque + stealing) and futures
+		ThreadPool pool(4);
+		std::atomic<uint32_t> counter = 0;
+		std::vector<std::future<uint32_t>> results;
+		for (uint32_t i = 0; i < 1000; ++i) {
+			results.push_back(pool.submit([&pool, &counter](uint32_t value) {
+				for (int j = 0; j < 20; ++j) pool.post([&counter]() { counter.fetch_add(1, std::memory_order_relaxed); });
+				return value * 2;
+				}, i));
+		}
+
+		bool values = true;
+		for (uint32_t i = 0; i < results.size(); ++i) values = values && results[i].get() == i * 2;
+		while (counter.load() < 20000) std::this_thread::yield();
+
+		print << std::setw(20) << std::left << "ThreadPool: " << test(values && counter.load() == 20000);
+	}
+
+	{
+		// Every index exactly once (also when nested inside a worker), concurrency cap, exceptions reach the caller
+		ThreadPool pool(4);
+		std::vector<std::atomic<uint32_t>> hits(10007);
+		pool.parallel_for(0, hits.size(), 64, [&](size_t lo, size_t hi) {
+			for (size_t i = lo; i < hi; ++i) hits[i].fetch_add(1, std::memory_order_relaxed);
+			});
+		pool.submit([&]() {
+			pool.parallel_for(0, hits.size(), 1, [&](size_t lo, size_t hi) { hits[lo].fetch_add(1, std::memory_order_relaxed); });
+			}).get();
+
+		bool once = true;
+		for (auto& hit : hits) once = once && hit.load() == 2;
+
+		std::atomic<int> running = 0, peak = 0;
+		pool.submit_bulk(200, [&](size_t) {
+			int now = running.fetch_add(1) + 1;
+			for (int seen = peak.load(); now > seen && !peak.compare_exchange_weak(seen, now); );
+			std::this_thread::yield();
+			running.fetch_sub(1);
+			}, 2);
+
+		bool thrown = false;
+		try {
+			pool.submit_bulk(100, [](size_t i) { if (i == 42) throw std::runtime_error("bulk"); });
+		}
+		catch (const std::runtime_error&) {
+			thrown = true;
+		}
+
+		print << std::setw(20) << std::left << "parallel_for: " << test(once && peak.load() <= 2 && thrown);
+	}
+
+	{
+		// Every kernel must reproduce the bytewise checksum for any length/alignment
+		std::vector<uint8_t> buffer(65536 + 512);
+		uint32_t seed = 0x12345678;
+		for (uint8_t& b : buffer) {
+			seed = seed * 1664525 + 1013904223;
+			b = static_cast<uint8_t>(seed >> 24);
+		}
+
+		const size_t lengths[] = { 0, 1, 7, 8, 15, 16, 17, 63, 64, 127, 128, 129, 255, 256, 511, 512, 513, 1000, 4096, 65536 + 123 };
+		const CRC32_64::Kernel kernels[] = { CRC32_64::Kernel::Slice8, CRC32_64::Kernel::Slice16, CRC32_64::Kernel::PCLMUL, CRC32_64::Kernel::VPCLMUL };
+		const CRC32_64::Kernel best = CRC32_64::getKernel();
+
+		for (CRC32_64::Kernel kernel : kernels) {
+			if (!CRC32_64::isKernelSupported(kernel)) {
+				print << std::setw(20) << std::left << CRC32_64::kernelName(kernel) << "SKIPPED\n";
+				continue;
+			}
+
+			bool same = true;
+			for (size_t len : lengths) {
+				for (size_t offset = 0; offset < 4; ++offset) {
+					CRC32_64 ref, crc;
+					CRC32_64::setKernel(CRC32_64::Kernel::Bytewise);
+					ref.appendCRC32(buffer.data() + offset, len);
+					ref.appendCRC64(buffer.data() + offset, len);
+					CRC32_64::setKernel(kernel);
+					crc.appendCRC32(buffer.data() + offset, len);
+					crc.appendCRC64(buffer.data() + offset, len);
+					same = same && ref.getCRC32() == crc.getCRC32() && ref.getCRC64() == crc.getCRC64();
+				}
+			}
+			print << std::setw(20) << std::left << CRC32_64::kernelName(kernel) << test(same);
+		}
+
+		// An explicit choice survives init
+		CRC32_64::setKernel(CRC32_64::Kernel::Slice8);
+		CRC32_64::init();
+		print << std::setw(20) << std::left << "Kernel kept: " << test(CRC32_64::getKernel() == CRC32_64::Kernel::Slice8);
+		CRC32_64::setKernel(best);
+	}
+
+	{
+		// Every copy kernel at every source/destination misalignment, nothing written outside the range
+		std::vector<uint8_t> src(8192 + 128), dst(8192 + 256);
+		for (size_t i = 0; i < src.size(); ++i) src[i] = static_cast<uint8_t>(i * 13 + 1);
+
+		const MemCopy::Kernel kernels[] = { MemCopy::Kernel::Memcpy, MemCopy::Kernel::RepMovsb, MemCopy::Kernel::AVX2,
+			MemCopy::Kernel::AVX2Stream, MemCopy::Kernel::AVX512Stream };
+
+		for (MemCopy::Kernel kernel : kernels) {
+			if (!MemCopy::isKernelSupported(kernel)) {
+				print << std::setw(20) << std::left << MemCopy::kernelName(kernel) << "SKIPPED\n";
+				continue;
+			}
+
+			bool same = true;
+			for (size_t size : { 0, 1, 31, 32, 33, 63, 64, 127, 128, 129, 255, 256, 257, 1000, 4095, 8192 }) {
+				for (size_t misalign = 0; misalign < 64; misalign += 7) {
+					std::fill(dst.begin(), dst.end(), uint8_t(0xEE));
+					MemCopy::copy(dst.data() + 64 + misalign, src.data() + 1 + misalign / 2, size, kernel);
+					same = same && std::memcmp(dst.data() + 64 + misalign, src.data() + 1 + misalign / 2, size) == 0
+						&& dst[63 + misalign] == 0xEE && dst[64 + misalign + size] == 0xEE;
+				}
+			}
+			print << std::setw(20) << std::left << MemCopy::kernelName(kernel) << test(same);
+		}
+	}
+
+	{
+		// The stream runs backwards, so the checksum of [A|B] is B's checksum extended by A
+		std::vector<uint8_t> buffer(3 * 65536 + 77);
+		for (size_t i = 0; i < buffer.size(); ++i) buffer[i] = static_cast<uint8_t>(i * 7 + (i >> 9));
+
+		CRC32_64 whole;
+		whole.appendCRC32(buffer.data(), buffer.size());
+		whole.appendCRC64(buffer.data(), buffer.size());
+		whole.finallize();
+
+		bool same = true;
+		for (size_t split : { size_t(0), size_t(1), size_t(4095), size_t(65536), buffer.size() - 3, buffer.size() }) {
+			CRC32_64 a, b;
+			a.appendCRC32(buffer.data(), split);
+			a.appendCRC64(buffer.data(), split);
+			a.finallize();
+			b.appendCRC32(buffer.data() + split, buffer.size() - split);
+			b.appendCRC64(buffer.data() + split, buffer.size() - split);
+			b.finallize();
+			same = same && CRC32_64::combineCRC32(b.getCRC32(), a.getCRC32(), split) == whole.getCRC32()
+				&& CRC32_64::combineCRC64(b.getCRC64(), a.getCRC64(), split) == whole.getCRC64();
+		}
+		print << std::setw(20) << std::left << "CRC combine: " << test(same);
 	}
 
 	
@@ -62,10 +238,246 @@ int main()
 
 	print << std::setw(20) << std::left << "Data loaded: " << test(view.at<uint64_t>(mmf->getFileSize() / 8 -1) == mmf->getFileSize() / 8 - 1);
 
+	{
+		// Loads inside one mapped window share it, released windows stay mapped until the budget is exceeded
+		const size_t gran = MemMng.getSysGranularity();
+		MMFile* cached = nullptr;
+		MemMng.createTmp(cached, 4 * gran);
+		const auto usedBefore = MemMng.getUsedMemory().load();
+
+		MemView& a = cached->load(10, 100);
+		const auto usedOne = MemMng.getUsedMemory().load();
+		MemView& b = cached->load(2 * gran + 5, 64);
+		b.at<uint8_t>(0) = 0x5A;
+		bool shared = a.getViewOrigin() == b.getViewOrigin() && MemMng.getUsedMemory().load() == usedOne
+			&& static_cast<uint8_t*>(a.getPtr())[2 * gran + 5 - 10] == 0x5A;
+
+		void* origin = a.getViewOrigin();
+		cached->unload(a);
+		cached->unload(b);
+		MemView& c = cached->load(gran, 10);
+		bool reused = c.getViewOrigin() == origin && cached->getCachedWindows() == 1;
+		cached->unload(c);
+
+		MemMng.setViewCache(0, 1024 * 1024);
+		cached->unload(cached->load(0, 8));
+		bool evicted = cached->getCachedWindows() == 0 && MemMng.getUsedMemory().load() == usedBefore;
+		MemMng.setViewCache(256 * 1024 * 1024, 1024 * 1024);
+
+		// The budget is shared, the least recently released window goes first whichever file holds it
+		MMFile* later = nullptr;
+		MemMng.createTmp(later, 4 * gran);
+		cached->unload(cached->load(0, 8));
+		MemView& recent = later->load(0, 8);
+		MemMng.setViewCache(MemMng.getUsedMemory().load() - 1, 1024 * 1024);
+		later->unload(recent);
+		const bool global = cached->getCachedWindows() == 0;
+		MemMng.setViewCache(256 * 1024 * 1024, 1024 * 1024);
+		MemMng.free(later);
+		MemMng.free(cached);
+
+		print << std::setw(20) << std::left << "View cache: " << test(shared && reused && evicted && global);
+	}
+
+	{
+		// Handles go stale on unload, threads loading and unloading the same file leave no view behind
+		MMFile* shared = nullptr;
+		MemMng.createTmp(shared, 1024 * 1024);
+
+		MemView& first = shared->load_s(128, 64);
+		ViewHandle handle = first.getHandle();
+		bool found = shared->getView(handle) == &first;
+		shared->unload_s(first);
+		MemView& reused = shared->load_s(256, 64);
+		bool stale = shared->getView(handle) == nullptr && shared->getView(reused.getHandle()) == &reused;
+		shared->unload_s(reused);
+
+		std::vector<std::thread> threads;
+		std::atomic<bool> intact{ true };
+		for (int t = 0; t < 4; ++t) {
+			threads.emplace_back([&, t]() {
+				std::vector<MemView*> held;
+				for (int i = 0; i < 2000; ++i) {
+					MemView& view = shared->load_s((i % 256) * 4096 + t * 8, 8);
+					view.at<uint8_t>(0) = static_cast<uint8_t>(t);
+					held.push_back(&view);
+					if (held.size() == 16) {
+						for (MemView* v : held) {
+							if (shared->getView(v->getHandle()) != v) intact = false;
+							shared->unload_s(*v);
+						}
+						held.clear();
+					}
+				}
+				for (MemView* v : held) shared->unload_s(*v);
+			});
+		}
+		for (auto& thread : threads) thread.join();
+		bool drained = shared->getLiveViews() == 0;
+		MemMng.free(shared);
+
+		print << std::setw(20) << std::left << "View table: " << test(found && stale && intact.load() && drained);
+	}
+
+	{
+		// Loads racing a shrink map the size they checked or throw out_of_range, no stale window is kept
+		const size_t gran = MemMng.getSysGranularity();
+		const auto usedBefore = MemMng.getUsedMemory().load();
+		MMFile* shrinking = nullptr;
+		MemMng.createTmp(shrinking, 64 * gran);
+
+		std::atomic<bool> done{ false };
+		std::atomic<bool> sound{ true };
+		std::vector<std::thread> loaders;
+		for (size_t t = 0; t < 3; ++t) {
+			loaders.emplace_back([&, t]() {
+				for (size_t i = 0; !done.load(); ++i) {
+					try {
+						const size_t offset = (32 + (i * 7 + t) % 32) * gran;
+						MemView& view = (i % 4 == 0) ? shrinking->loadPrivate_s(offset, 64) : shrinking->load_s(offset, 64);
+						shrinking->unload_s(view);
+					}
+					catch (const std::out_of_range&) {}
+					catch (...) { sound = false; }
+				}
+			});
+		}
+		for (int i = 0; i < 200; ++i) shrinking->resize_s(((i % 2) ? 64 : 16) * gran);
+		done = true;
+		for (auto& thread : loaders) thread.join();
+		MemMng.free(shrinking);
+
+		print << std::setw(20) << std::left << "Shrinking loads: " << test(sound.load() && MemMng.getUsedMemory().load() == usedBefore);
+	}
+
+	{
+		// Once warmed up, loads from cached windows and createTmp/free cycles stay off the heap
+		MMFile* warm = nullptr;
+		MemMng.createTmp(warm, 1024 * 1024);
+		for (int i = 0; i < 64; ++i) warm->unload_s(warm->load_s((i % 16) * 4096, 64));
+
+		size_t before = allocations;
+		for (int i = 0; i < 1000; ++i) {
+			MemView& a = warm->load((i % 16) * 4096, 64);
+			MemView& b = warm->load_s((i % 7) * 8192, 128);
+			warm->unload(a);
+			warm->unload_s(b);
+		}
+		bool loads = allocations == before;
+
+		MMFile* files[4] = {};
+		for (int round = 0; round < 2; ++round) {
+			before = allocations;
+			for (MMFile*& file : files) MemMng.createTmp(file, 65536);
+			for (MMFile* file : files) MemMng.free(file);
+		}
+		bool recycled = allocations == before;
+		MemMng.free(warm);
+
+		print << std::setw(20) << std::left << "No allocations: " << test(loads && recycled);
+	}
+
+	{
+		// Warm files are ready before createTmp asks, zero filled, and refilled after being taken
+		auto waitWarm = [](size_t count) {
+			for (int i = 0; i < 2000 && MemMng.getWarmFiles() != count; ++i) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			return MemMng.getWarmFiles() == count;
+		};
+
+		MemMng.setWarmFiles(3, 100000);
+		bool filled = waitWarm(3);
+
+		MMFile* taken[2] = {};
+		bool ready = true;
+		for (MMFile*& file : taken) {
+			MemMng.createTmp(file, 100000);
+			MemView& view = file->load(99990, 8);
+			ready = ready && file->isValid() && file->getFileSize() == 100032 && view.at<uint64_t>(0) == 0;
+			view.at<uint64_t>(0) = ~0ull;
+			file->unload(view);
+		}
+		bool refilled = waitWarm(3);
+		for (MMFile* file : taken) MemMng.free(file);
+
+		MemMng.setWarmFiles(0, 0);
+		print << std::setw(20) << std::left << "Warm files: " << test(filled && ready && refilled && MemMng.getWarmFiles() == 0);
+	}
+
+	{
+		// Idle windows are held to the soft budget, a load that would break the hard one waits and then throws
+		const size_t window = MemMng.getViewWindowSize();
+		MMFile* governed = nullptr;
+		MemMng.createTmp(governed, 8 * window);
+		const size_t base = MemMng.getUsedMemory().load();
+
+		GovernorConfig config;
+		config.softBudget = base + 2 * window;
+		config.hardBudget = base + 4 * window;
+		config.minHeadroom = 0;
+		config.throttleTimeout = std::chrono::milliseconds(50);
+		MemMng.getGovernor().start(config);
+
+		std::vector<MemView*> held;
+		for (size_t i = 0; i < 4; ++i) held.push_back(&governed->load(i * window, 64));
+		bool throttled = false;
+		try {
+			governed->load(4 * window, 64);
+		}
+		catch (const std::runtime_error&) {
+			throttled = MemMng.getGovernor().getThrottledLoads() != 0;
+		}
+
+		// A checksum whose windows are refused throws and leaves the stored CRC alone
+		governed->getCRC().getCRC64() = 0x5EA1ED;
+		try {
+			MemMng.calcCRC64(governed);
+			throttled = false;
+		}
+		catch (const std::runtime_error&) {
+			throttled = throttled && governed->getCRC().getCRC64() == 0x5EA1ED;
+		}
+
+		for (MemView* v : held) governed->unload(*v);
+		bool trimmed = MemMng.getUsedMemory().load() <= base + 2 * window;
+		MemView& next = governed->load(4 * window, 64);
+		bool admitted = next.getViewOrigin() != nullptr;
+		governed->unload(next);
+
+		// A throttled load goes through as soon as another thread's unload makes room
+		config.throttleTimeout = std::chrono::milliseconds(10000);
+		MemMng.getGovernor().start(config);
+		held.clear();
+		for (size_t i = 0; i < 4; ++i) held.push_back(&governed->load_s(i * window, 64));
+		std::thread unloader([&]() {
+			std::this_thread::sleep_for(std::chrono::milliseconds(20));
+			governed->unload_s(*held[0]);
+		});
+		const auto waited = std::chrono::steady_clock::now();
+		MemView& late = governed->load_s(4 * window, 64);
+		admitted = admitted && std::chrono::steady_clock::now() - waited < std::chrono::seconds(5);
+		unloader.join();
+		governed->unload_s(late);
+		for (size_t i = 1; i < 4; ++i) governed->unload_s(*held[i]);
+
+		Platform::MemoryStatus status = MemMng.getGovernor().getStatus();
+		MemMng.getGovernor().stop();
+		bool sampled = status.limit != 0 && status.available <= status.limit;
+
+		// No known limit: the budgets left at 0 are off and there is no headroom to keep
+		MemMng.getGovernor().start(GovernorConfig{});
+		MemMng.getGovernor().stop();
+		Platform::MemoryStatus unknown;
+		unknown.available = 1;
+		sampled = sampled && MemMng.getGovernor().poll(unknown) == MemoryPressure::None && MemMng.getGovernor().getCacheCap() == SIZE_MAX;
+		MemMng.getGovernor().stop();
+		MemMng.free(governed);
+
+		print << std::setw(20) << std::left << "Memory governor: " << test(throttled && trimmed && admitted && sampled);
+	}
+
 	{
 		Timer("CRC32");
-		MemMng.calcCRC32(mmf);
-		MemMng.calcCRC64(mmf);
+		MemMng.calcCRC(mmf);
 		print << "CRC32: " << std::hex << mmf->getCRC32() << "\n";
 		print << "CRC64: " << std::hex << mmf->getCRC64() << "\n";
 	}
@@ -81,6 +493,684 @@ int main()
 		//MemMng.memcopy(mmf2, mmf, 4, mmf2->getFileSize());
 	}
 	print << "Copy completed\n";
+
+	{
+		// Unaligned source, size not a multiple of the vector width: the last byte has to arrive too
+		std::vector<uint8_t> unaligned(3 * MemMng.getSysGranularity() + 100);
+		for (size_t i = 0; i < unaligned.size(); ++i) unaligned[i] = static_cast<uint8_t>(i * 31 + 7);
+		const size_t size = unaligned.size() - 1;
+
+		MMFile* copied = nullptr;
+		MemMng.memcopy_AVX2(copied, unaligned.data() + 1, size);
+		MemView& check = copied->load(0, size);
+		bool same = std::memcmp(check.getPtr(), unaligned.data() + 1, size) == 0;
+		copied->unload(check);
+		MemMng.free(copied);
+
+		print << std::setw(20) << std::left << "memcopy_AVX2 tail: " << test(same);
+	}
+
+	{
+		// Small copies stay inline, large ones use the pool plus the caller, or fewer under a bandwidth limit.
+		// Chunks of a 4 GB copy stay far below MemView's 32-bit size.
+		const size_t large = size_t(1) << 32;
+		const CopyPlan inlined = MemMng.planCopy(4096);
+		const CopyPlan spread = MemMng.planCopy(large);
+		MemMng.setCopyBandwidthLimit(2 * MemMng.getCopyBandwidth());
+		const CopyPlan limited = MemMng.planCopy(large);
+		MemMng.setCopyBandwidthLimit(0);
+
+		print << std::setw(20) << std::left << "Copy planner: " << test(MemMng.getCopyBandwidth() > 0 && inlined.tasks == 1
+			&& spread.tasks == MemMng.workerPool->getThreadCount() + 1 && spread.chunkSize <= CopyPlan::maxChunkSize
+			&& limited.tasks == 2 && limited.chunkSize % MemMng.getSysGranularity() == 0 && limited.chunkSize <= CopyPlan::maxChunkSize);
+	}
+
+	{
+		// Ranged file to file copy in the kernel and through views, large enough to be split,
+		// while a view of the destination stays live
+		const size_t size = 4 * 1024 * 1024;
+		std::vector<uint8_t> data(size);
+		for (size_t i = 0; i < size; ++i) data[i] = static_cast<uint8_t>(i * 7 + (i >> 11));
+
+		MMFile* srcFile = nullptr;
+		MMFile* dstFile = nullptr;
+		MemMng.memcopy(srcFile, data.data(), size);
+		MemMng.createTmp(dstFile, size + 4096);
+
+		MemView& live = dstFile->load(0, 64);
+		live.at<uint64_t>(0) = 0xC0FFEE;
+		void* livePtr = live.getPtr();
+
+		bool same = true;
+		for (bool kernelCopy : { true, false }) {
+			MemMng.setKernelFileCopy(kernelCopy);
+			const size_t length = size - 4096 - 13;
+			MemMng.memcopy(dstFile, 1000 + kernelCopy, srcFile, 5, length);
+
+			MemView& check = dstFile->load(1000 + kernelCopy, length);
+			same = same && std::memcmp(check.getPtr(), data.data() + 5, length) == 0;
+			dstFile->unload(check);
+		}
+		MemMng.setKernelFileCopy(true);
+		same = same && live.getPtr() == livePtr && live.at<uint64_t>(0) == 0xC0FFEE && MemMng.planCopy(size).tasks > 1;
+
+		// Two copies grow one destination at once, neither may shrink it back
+		MMFile* grown = nullptr;
+		MemMng.createTmp(grown, 4096);
+		std::thread other([&] { MemMng.memcopy(grown, size, srcFile, 0, size); });
+		MemMng.memcopy(grown, 0, srcFile, 0, size / 2);
+		other.join();
+		MemView& tail = grown->load(size, size);
+		same = same && grown->getFileSize_s() >= 2 * size && std::memcmp(tail.getPtr(), data.data(), size) == 0;
+		grown->unload(tail);
+		MemMng.free(grown);
+
+		dstFile->unload(live);
+		MemMng.free(srcFile);
+		MemMng.free(dstFile);
+
+		print << std::setw(20) << std::left << "File range copy: " << test(same);
+	}
+
+	{
+		// Growth inside the reserved range keeps the base address and live views, loads reuse the range
+		MMFile* file = nullptr;
+		MemMng.createTmp(file, 4096);
+		file->reserve(64 * 1024 * 1024);
+		uint8_t* base = static_cast<uint8_t*>(file->getData());
+
+		MemView& head = file->load(0, 64);
+		head.at<uint64_t>(0) = 0xC0FFEE;
+
+		bool grown = base != nullptr;
+		for (size_t size = 8192; size <= 8 * 1024 * 1024; size += 8192 * 3) {
+			file->resize(size);
+			base[size - 1] = static_cast<uint8_t>(size);
+			grown = grown && file->getData() == base && head.at<uint64_t>(0) == 0xC0FFEE;
+		}
+
+		MemView& tail = file->load(file->getFileSize() - 4096, 4096);
+		grown = grown && tail.at<uint8_t>(4095) == static_cast<uint8_t>(file->getFileSize())
+			&& tail.getViewOrigin() == base && file->getCachedWindows() == 1;
+		file->unload(tail);
+		file->unload(head);
+
+		// Past the capacity the file is remapped the old way
+		file->resize(80 * 1024 * 1024);
+		grown = grown && file->getData() == nullptr && file->load(0, 64).at<uint64_t>(0) == 0xC0FFEE;
+		MemMng.free(file);
+
+		print << std::setw(20) << std::left << "Growable file: " << test(grown);
+	}
+
+	{
+		// Private views and forks read the base until they write, and nobody else sees what they wrote
+		const size_t size = 4 * 65536;
+		MMFile* base = nullptr;
+		MemMng.createTmp(base, size);
+		MemView& shared = base->load_s(0, size);
+		for (uint32_t i = 0; i < size / 4; ++i) shared.at<uint32_t>(i) = i;
+
+		MemView& priv = base->loadPrivate_s(4096, 8192);
+		bool isolated = priv.isPrivate() && priv.at<uint32_t>(0) == 1024;
+		priv.at<uint32_t>(0) = 7;
+		isolated = isolated && shared.at<uint32_t>(1024) == 1024 && base->load_s(4096, 4).at<uint32_t>(0) == 1024;
+		base->unload_s(priv);
+
+		MMFile* forkA = MemMng.fork(base);
+		MMFile* forkB = MemMng.fork(base);
+		forkA->load_s(0, size).at<uint32_t>(5) = 55;
+		forkA->unloadAll_s();
+		bool forked = forkA->isForked() && forkA->load_s(0, 64).at<uint32_t>(5) == 55
+			&& forkB->load_s(0, 64).at<uint32_t>(5) == 5 && shared.at<uint32_t>(5) == 5
+			&& MemMng.calcCRC64(forkB) == MemMng.calcCRC64(base);
+
+		bool fixed = false;
+		try { forkA->resize_s(2 * size); }
+		catch (const std::invalid_argument&) { fixed = true; }
+
+		// The base's name is only handed out again once its forks are gone, a new file would truncate it
+		const size_t baseID = base->getID();
+		MemMng.free(base);
+		MMFile* other = nullptr;
+		MemMng.createTmp(other, size);
+		forked = forked && other->getID() != baseID && forkB->load_s(size - 4, 4).at<uint32_t>(0) == size / 4 - 1;
+
+		MMFile* copy = MemMng.fork(forkA);
+		forked = forked && !copy->isForked() && copy->load_s(0, 64).at<uint32_t>(5) == 55;
+
+		MemMng.free(copy);
+		MemMng.free(other);
+		MemMng.free(forkA);
+		MemMng.free(forkB);
+		print << std::setw(20) << std::left << "Copy-on-write: " << test(isolated && forked && fixed);
+	}
+
+	{
+		// Snapshots hold only the granules that changed, the oldest delta folds into the base past maximumSaves
+		const size_t size = 4 * 1024 * 1024;
+		const size_t granule = 64 * 1024;
+		std::remove("temp/snap.sl.soramem");
+		std::remove("temp/snap.si.soramem");
+		MMFile* file = nullptr;
+		MemMng.createTmp(file, size);
+		{
+			MemView& view = file->load_s(0, size);
+			for (size_t i = 0; i < size / 8; ++i) view.at<uint64_t>(i) = i;
+			file->unload_s(view);
+		}
+		auto poke = [&](size_t granuleIndex, uint64_t value) {
+			MemView& view = file->load_s(granuleIndex * granule, 8);
+			view.at<uint64_t>(0) = value;
+			file->unload_s(view);
+		};
+		auto peek = [&](size_t granuleIndex) {
+			MemView& view = file->load_s(granuleIndex * granule, 8);
+			const uint64_t value = view.at<uint64_t>(0);
+			file->unload_s(view);
+			return value;
+		};
+
+		bool saved = false, restored = false, reopened = false;
+		{
+			SnapshotStore store(MemMng, file, "temp/snap", 3, granule);
+			saved = store.snapshot() == 1 && store.getLastWritten() == size;
+			poke(3, 33);
+			poke(10, 1010);
+			saved = saved && store.snapshot() == 2 && store.getLastWritten() == 2 * granule;
+			poke(5, peek(5));      // touched, not changed
+			saved = saved && store.snapshot() == 3 && store.getLastWritten() == 0;
+			poke(20, 2020);
+			saved = saved && store.snapshot() == 4 && store.getLastWritten() == granule;
+			poke(30, 3030);
+			saved = saved && store.snapshot() == 5 && store.getSnapshots() == std::vector<uint64_t>{ 3, 4, 5 };
+
+			store.restore(3);
+			restored = peek(3) == 33 && peek(10) == 1010 && peek(20) == 20 * granule / 8 && peek(30) == 30 * granule / 8;
+			store.restore(5);
+			restored = restored && peek(20) == 2020 && peek(30) == 3030 && peek(0) == 0;
+
+			// Growing past the base starts a new full one
+			file->resize_s(2 * size);
+			poke(40, 4040);
+			saved = saved && store.snapshot() == 6 && store.getLastWritten() == 2 * size;
+			poke(40, 0);
+		}
+		{
+			// The list is read back, restoring the newest snapshot also makes the next one incremental again.
+			// Headers are CRC64-XZ, so another bound polynomial does not make the store look damaged.
+			CRC32_64::init(CRC32_64::defaultPoly32, 0x000000000000001Bull);
+			SnapshotStore store(MemMng, file, "temp/snap", 16, granule);
+			store.restore(6);
+			reopened = store.getMaximumSaves() == 3 && store.getSnapshots() == std::vector<uint64_t>{ 4, 5, 6 }
+				&& peek(40) == 4040 && peek(30) == 3030 && peek(64) == 0 && store.snapshot() == 7 && store.getLastWritten() == 0;
+			store.restore(5);
+			reopened = reopened && store.getSnapshots() == std::vector<uint64_t>{ 5, 6, 7 } && file->getFileSize_s() == size
+				&& peek(20) == 2020 && peek(30) == 3030;
+			CRC32_64::resetTables();
+		}
+		MemMng.free(file);
+
+		// A store outliving its file leaves the channel of the file's next user open
+		MemMng.createTmp(file, size);
+		auto stale = std::make_unique<SnapshotStore>(MemMng, file, "temp/snap2", 2, granule);
+		MemMng.free(file);
+		MemMng.createTmp(file, size);
+		const uint32_t channel = file->openDirtyChannel();
+		stale.reset();
+		const bool kept = file->isDirty(channel);
+		file->closeDirtyChannel(channel);
+		MemMng.free(file);
+
+		print << std::setw(20) << std::left << "Snapshots: " << test(saved && restored && reopened && kept);
+	}
+
+	{
+		// The tree's root is the file's CRC64, updates rehash only written blocks and diffs find them
+		const size_t gran = MemMng.getSysGranularity();
+		const size_t size = 300 * gran + 192;
+		MMFile* file = nullptr;
+		MemMng.createTmp(file, size);
+		{
+			MemView& view = file->load_s(0, size);
+			for (size_t i = 0; i < size / 8; ++i) view.at<uint64_t>(i) = i * 0x9E3779B97F4A7C15ull;
+			file->unload_s(view);
+		}
+		CRCTree& tree = MemMng.getCRCTree(file);
+		bool rooted = tree.update() == MemMng.calcCRC64(file) && tree.getLastUpdated() == 301;
+
+		MMFile* fork = MemMng.fork(file);
+		bool diffed = MemMng.diff(file, fork).empty();
+		{
+			MemView& view = fork->load_s(17 * gran + 8, 8);
+			view.at<uint64_t>(0) = 1;
+			fork->unload_s(view);
+			MemView& tail = fork->load_s(size - 8, 8);
+			tail.at<uint64_t>(0) = 2;
+			fork->unload_s(tail);
+		}
+		const std::vector<ByteRange> ranges = MemMng.diff(file, fork);
+		diffed = diffed && MemMng.getCRCTree(fork).getLastUpdated() == 2 && ranges.size() == 2
+			&& ranges[0].offset == 17 * gran && ranges[0].size == gran && ranges[1].offset == 300 * gran && ranges[1].size == 192;
+
+		{
+			MemView& view = file->load_s(40 * gran, 8);
+			view.at<uint64_t>(0) = 3;
+			file->unload_s(view);
+		}
+		rooted = rooted && tree.update() == MemMng.calcCRC64(file) && tree.getLastUpdated() == 1;
+
+		// Growth only rehashes the new blocks and the old last one
+		file->resize_s(size + 2 * gran);
+		rooted = rooted && tree.update() == MemMng.calcCRC64(file) && tree.getLastUpdated() == 3;
+		const std::vector<ByteRange> grown = MemMng.diff(file, fork);
+		diffed = diffed && grown.size() == 3 && grown[2].offset == 300 * gran && grown[2].offset + grown[2].size == size + 2 * gran;
+
+		tree.save("temp/tree.soramem");
+		bool persisted = false;
+		{
+			CRCTree loaded(MemMng, file);
+			persisted = loaded.load("temp/tree.soramem") && loaded.getRoot() == tree.getRoot() && loaded.update() == tree.getRoot()
+				&& loaded.getLastUpdated() == 0;
+		}
+		{
+			// Leaves of another polynomial, or a header with a valid CRC but a short body, are refused and the
+			// tree stays as it was
+			const uint64_t root = tree.getRoot();
+			CRC32_64::init(CRC32_64::defaultPoly32, 0x000000000000001Bull);
+			const bool otherPoly = !tree.load("temp/tree.soramem");
+			CRC32_64::resetTables();
+
+			std::vector<uint8_t> bytes(sizeof(SoraMemFileDescriptor) + 1024 * 1024);
+			FILE* saved = std::fopen("temp/tree.soramem", "rb");
+			bytes.resize(std::fread(bytes.data(), 1, bytes.size(), saved));
+			std::fclose(saved);
+			bytes.resize(bytes.size() - 8);
+			SoraMemFileDescriptor descriptor;
+			std::memcpy(&descriptor, bytes.data(), sizeof(descriptor));
+			descriptor.subChunkSize -= 8;
+			descriptor.crc = CRC32_64::crc64XZ(bytes.data() + sizeof(descriptor), bytes.size() - sizeof(descriptor));
+			std::memcpy(bytes.data(), &descriptor, sizeof(descriptor));
+			FILE* shortened = std::fopen("temp/tree.soramem", "wb");
+			std::fwrite(bytes.data(), 1, bytes.size(), shortened);
+			std::fclose(shortened);
+
+			persisted = persisted && otherPoly && !tree.load("temp/tree.soramem") && tree.getRoot() == root
+				&& tree.update() == root && tree.getLastUpdated() == 0;
+		}
+		MemMng.free(fork);
+		MemMng.free(file);
+		std::remove("temp/tree.soramem");
+
+		print << std::setw(20) << std::left << "CRC tree: " << test(rooted && diffed && persisted);
+	}
+
+	{
+		// Permanent files reopen with their data in place and keep a CRC64 seal in their descriptor
+		const size_t size = 2 * 1024 * 1024 + 64;
+		MemMng.setPmntDir("temp/");
+		std::remove("temp/pmnt.bin.soramem");
+		MMFile* file = nullptr;
+		bool created = !MemMng.createPmnt(file, "pmnt", size) && file->isPermanent() && file->getFileSize_s() == size;
+		{
+			MemView& view = file->load_s(0, size);
+			for (size_t i = 0; i < size / 8; ++i) view.at<uint64_t>(i) = i + 7;
+			file->unload_s(view);
+		}
+		const uint64_t crc = MemMng.calcCRC64(file);
+		{
+			// Kernel copies and async reads skip the descriptor block too
+			MMFile* copy = nullptr;
+			MemMng.createTmp(copy, size);
+			MemMng.memcopy(copy, 0, file, 0, size);
+			std::vector<uint8_t> head(16);
+			created = created && MemMng.calcCRC64(copy) == crc && file->readAsync(0, head).get() == head.size()
+				&& reinterpret_cast<uint64_t*>(head.data())[1] == 8;
+			MemMng.free(copy);
+		}
+		MemMng.free(file);
+
+		bool reopened = MemMng.createPmnt(file, "pmnt", 0, PmntCheck::Now) && file->getFileSize_s() == size
+			&& MemMng.calcCRC64(file) == crc;
+		{
+			MemView& view = file->load_s(64, 8);
+			view.at<uint64_t>(0) = 99;
+			file->unload_s(view);
+		}
+		MemMng.sealPmnt(file);
+		reopened = reopened && MemMng.verifyPmnt(file).get();
+		MemMng.free(file);
+		reopened = reopened && MemMng.createPmnt(file, "pmnt", 0) && MemMng.verifyPmnt(file).get();
+		MemMng.free(file);
+
+		// A name is open once, the descriptor follows resizes without reserve's slack
+		bool checked = MemMng.createPmnt(file, "pmnt", 0, PmntCheck::None);
+		MMFile* twice = nullptr;
+		try {
+			MemMng.createPmnt(twice, "pmnt", 0);
+			checked = false;
+		}
+		catch (const std::invalid_argument&) {}
+		auto recorded = []() {
+			SoraMemFileDescriptor descriptor{};
+			Platform::FileHandle handle = Platform::openFile("temp/pmnt.bin.soramem");
+			Platform::readFile(handle, 0, &descriptor, sizeof(descriptor));
+			Platform::closeFile(handle);
+			return descriptor.chunkSize;
+		};
+		file->reserve(8 * size);
+		file->resize(size + 4096);
+		checked = checked && recorded() == size + 4096;
+		file->resize(size);
+		checked = checked && recorded() == size;
+		MemMng.free(file);
+
+		// Damage behind the manager's back fails the check and is never sealed, the file stays unverifiable
+		{
+			Platform::FileHandle handle = Platform::openFile("temp/pmnt.bin.soramem");
+			const uint64_t junk = 0;
+			Platform::writeFile(handle, MemMng.getSysGranularity() + 4096, &junk, sizeof(junk));
+			Platform::closeFile(handle);
+		}
+		auto refused = [&]() {
+			try {
+				MemMng.free(file);
+			}
+			catch (const std::runtime_error&) {
+				return true;
+			}
+			return false;
+		};
+		for (int round = 0; round < 2; ++round) {
+			try {
+				MemMng.createPmnt(file, "pmnt", 0, PmntCheck::Now);
+				checked = false;
+			}
+			catch (const std::runtime_error&) {
+				checked = checked && file == nullptr;
+			}
+			checked = checked && MemMng.createPmnt(file, "pmnt", 0, PmntCheck::None) && !MemMng.verifyPmnt(file).get() && refused();
+
+			// Written after a failed check, still refused
+			checked = checked && MemMng.createPmnt(file, "pmnt", 0, PmntCheck::Background) && !MemMng.verifyPmnt(file).get();
+			{
+				MemView& view = file->load_s(0, 8);
+				view.at<uint64_t>(0) = 5;
+				file->unload_s(view);
+			}
+			checked = checked && refused();
+		}
+
+		{
+			Platform::FileHandle handle = Platform::createFile("temp/junk.bin.soramem");
+			const char junk[64] = "not a descriptor";
+			Platform::writeFile(handle, 0, junk, sizeof(junk));
+			Platform::closeFile(handle);
+		}
+		try {
+			MemMng.createPmnt(file, "junk", size);
+			checked = false;
+		}
+		catch (const std::runtime_error&) {}
+		std::remove("temp/junk.bin.soramem");
+		std::remove("temp/pmnt.bin.soramem");
+
+		print << std::setw(20) << std::left << "Permanent files: " << test(created && reopened && checked);
+	}
+
+	{
+		// Tables for other polynomials are written to the config once and mapped from it afterwards
+		const char* path = "temp/crc.conf.soramem";
+		std::remove(path);
+		std::vector<uint8_t> check = { '9','8','7','6','5','4','3','2','1' };	// the stream runs backwards
+		auto checksOut = [&]() {
+			CRC32_64 crc;
+			crc.appendCRC32(check.data(), check.size());
+			crc.appendCRC64(check.data(), check.size());
+			crc.finallize32();
+			crc.finallize64();
+			return crc.getCRC32() == 0xE3069283 && crc.getCRC64() == 0xB90956C775A41001;	// CRC-32C, CRC-64/GO-ISO
+		};
+
+		MemMng.loadConfig(path, 0x1EDC6F41, 0x1B);
+		bool loaded = MemMng.confView != nullptr && checksOut();
+		{
+			// Every kernel runs on the mapped tables
+			std::vector<uint8_t> buffer(4096 + 77);
+			for (size_t i = 0; i < buffer.size(); ++i) buffer[i] = static_cast<uint8_t>(i * 31 + (i >> 7));
+			const CRC32_64::Kernel best = CRC32_64::getKernel();
+			CRC32_64 ref;
+			CRC32_64::setKernel(CRC32_64::Kernel::Bytewise);
+			ref.appendCRC32(buffer.data(), buffer.size());
+			ref.appendCRC64(buffer.data(), buffer.size());
+			for (CRC32_64::Kernel kernel : { CRC32_64::Kernel::Slice8, CRC32_64::Kernel::Slice16, CRC32_64::Kernel::PCLMUL, CRC32_64::Kernel::VPCLMUL }) {
+				if (!CRC32_64::isKernelSupported(kernel)) continue;
+				CRC32_64 crc;
+				CRC32_64::setKernel(kernel);
+				crc.appendCRC32(buffer.data(), buffer.size());
+				crc.appendCRC64(buffer.data(), buffer.size());
+				loaded = loaded && crc.getCRC32() == ref.getCRC32() && crc.getCRC64() == ref.getCRC64();
+			}
+			CRC32_64::setKernel(best);
+		}
+
+		// The timestamp is outside the CRC, a marked one survives unless the file is rewritten
+		auto timestamp = [&]() {
+			SoraMemFileDescriptor descriptor{};
+			Platform::FileHandle handle = Platform::openFile(path);
+			Platform::readFile(handle, 0, &descriptor, sizeof(descriptor));
+			Platform::closeFile(handle);
+			return descriptor.timestamp;
+		};
+		{
+			Platform::FileHandle handle = Platform::openFile(path);
+			const uint64_t marked = 1;
+			Platform::writeFile(handle, offsetof(SoraMemFileDescriptor, timestamp), &marked, sizeof(marked));
+			Platform::closeFile(handle);
+		}
+		MemMng.loadConfig(path, 0x1EDC6F41, 0x1B);
+		bool mapped = timestamp() == 1 && checksOut();
+
+		// A damaged config is rebuilt, as is one made for other polynomials
+		{
+			Platform::FileHandle handle = Platform::openFile(path);
+			const std::vector<uint8_t> junk(sizeof(uint32_t) * 256, 0x5A);
+			Platform::writeFile(handle, sizeof(SoraMemFileDescriptor) + offsetof(SoraMemConfigFormat, crc32_slice16Lookup), junk.data(), junk.size());
+			Platform::closeFile(handle);
+		}
+		MemMng.loadConfig(path, 0x1EDC6F41, 0x1B);
+		bool rebuilt = timestamp() != 1 && checksOut();
+		MemMng.loadConfig(path, CRC32_64::defaultPoly32, CRC32_64::defaultPoly64);
+		MemMng.loadConfig(path, 0x1EDC6F41, 0x1B);
+		rebuilt = rebuilt && checksOut();
+
+		// The defaults come back, as the tables bound before the config did
+		MemMng.releaseConfig();
+		CRC32_64 standard;
+		standard.appendCRC32(check.data(), check.size());
+		standard.appendCRC64(check.data(), check.size());
+		standard.finallize();
+		const bool restored = MemMng.confView == nullptr && standard.getCRC32() == 0xCBF43926 && standard.getCRC64() == 0x995DC9BBDF1939FA;
+
+		print << std::setw(20) << std::left << "CRC config: " << test(loaded && mapped && rebuilt && restored);
+	}
+
+	{
+		// Huge page files (hugetlbfs or advised) map their windows on huge page boundaries, without either
+		// they keep the normal granularity
+		const size_t hugePage = MemMng.getHugePageSize();
+		MMFile* file = nullptr;
+		MemMng.createTmp(file, 3 * 1024 * 1024, true);
+		const bool huge = hugePage != 0 && (file->getSysPageSize() == hugePage || Platform::canAdviseHugePages());
+
+		MemView& view = file->load(2 * 1024 * 1024 + 100, 4096);
+		view.at<uint64_t>(0) = 0xC0FFEE;
+		const bool aligned = huge ? (file->getSysGran() == hugePage && reinterpret_cast<uintptr_t>(view.getViewOrigin()) % hugePage == 0)
+			: file->getSysGran() == MemMng.getSysGranularity();
+		file->unload(view);
+
+		MemView& again = file->load(2 * 1024 * 1024 + 100, 8);
+		bool kept = again.at<uint64_t>(0) == 0xC0FFEE;
+		file->unload(again);
+
+		// hugetlbfs has no read or write, these copy through views
+		const uint64_t value = 0xBEEF;
+		uint64_t back = 0;
+		file->write(3 * 1024 * 1024 - 8, &value, sizeof(value));
+		file->read(3 * 1024 * 1024 - 8, &back, sizeof(back));
+		kept = kept && back == value;
+		MemMng.free(file);
+
+		print << std::setw(20) << std::left << "Huge pages: " << test(aligned && kept);
+	}
+
+	{
+		// Hints, an explicit prefetch and a sequential stream with read-ahead all see the same data
+		const size_t size = 8 * 1024 * 1024;
+		const size_t step = 256 * 1024;
+		MMFile* file = nullptr;
+		MemMng.createTmp(file, size);
+		{
+			MemView& view = file->load(0, size);
+			for (size_t i = 0; i < size / 8; ++i) view.at<uint64_t>(i) = i;
+			view.advise(Platform::Advice::DontNeed);
+			file->unload(view);
+		}
+		file->advise_s(0, size, Platform::Advice::Sequential);
+
+		std::shared_future<void> done = file->prefetch(1024 * 1024, 3 * 1024 * 1024);
+		done.wait();
+
+		file->setReadAhead(2 * 1024 * 1024);
+		bool streamed = done.valid();
+		for (size_t offset = 0; offset < size; offset += step) {
+			MemView& view = file->load_s(offset, step);
+			streamed = streamed && view.at<uint64_t>(0) == offset / 8 && view.at<uint64_t>(step / 8 - 1) == (offset + step) / 8 - 1;
+			file->unload_s(view);
+		}
+		MemMng.free(file);
+
+		// Every worker frees a file whose prefetch is queued behind them, the queued ones are cancelled
+		const size_t workers = MemMng.getThreadPool()->getThreadCount();
+		std::vector<MMFile*> files(workers, nullptr);
+		for (MMFile*& f : files) MemMng.createTmp(f, step);
+		std::atomic<size_t> busy = 0;
+		std::vector<std::future<void>> freed;
+		for (MMFile* f : files) {
+			freed.push_back(MemMng.getThreadPool()->submit([&, f]() {
+				busy.fetch_add(1);
+				while (busy.load() < workers) std::this_thread::yield();
+				f->prefetch(0, step);
+				MemMng.free(f);
+			}));
+		}
+		for (auto& f : freed) streamed = streamed && f.wait_for(std::chrono::seconds(10)) == std::future_status::ready;
+
+		print << std::setw(20) << std::left << "Read-ahead: " << test(streamed);
+	}
+
+	{
+		// Async writes show up in views and view writes in async reads, a batch completes every callback
+		const size_t size = 1024 * 1024;
+		MMFile* file = nullptr;
+		MemMng.createTmp(file, size);
+
+		std::vector<uint8_t> out(size), in(size);
+		for (size_t i = 0; i < size; ++i) out[i] = static_cast<uint8_t>(i * 13 + (i >> 9));
+
+		bool async = file->writeAsync(0, out).get() == size;
+		MemView& view = file->load(0, size);
+		async = async && std::memcmp(view.getPtr(), out.data(), size) == 0;
+		view.at<uint64_t>(7) = 0xC0FFEE;
+		file->unload(view);
+		std::memcpy(out.data() + 56, "\xEE\xFF\xC0\0\0\0\0\0", 8);
+
+		std::atomic<size_t> completed{ 0 };
+		const size_t chunk = size / 16;
+		for (size_t offset = 0; offset < size; offset += chunk) {
+			file->readAsync(offset, std::span<uint8_t>(in.data() + offset, chunk), [&completed](int64_t bytes) {
+				if (bytes > 0) completed.fetch_add(static_cast<size_t>(bytes), std::memory_order_relaxed);
+			});
+		}
+		file->resize(size);     // same size, returns without waiting
+		MemMng.free(file);      // waits for the reads
+
+		async = async && completed.load() == size && in == out;
+		print << std::setw(20) << std::left << "Async I/O: " << test(async);
+
+		// The native backend took every request. io_uring may be disabled (old kernel, seccomp), IOCP is always there.
+		const std::string backend = MemMng.getAsyncIO().backendName();
+		print << "Async I/O backend: " << backend << "\n";
+#if defined(_WIN32)
+		const bool native = backend == "IOCP";
+#elif defined(__linux__)
+		const bool native = backend == "io_uring" || backend == "blocking";
+#else
+		const bool native = backend == "blocking";
+#endif
+		print << std::setw(20) << std::left << "Async backend: " << test(native && MemMng.getAsyncIO().getBlockingFallbacks() == 0);
+	}
+
+	{
+		// A callback chaining the next read while its own request still holds the only slot must not wait on itself
+		const size_t size = 64 * 1024, chunk = 4096;
+		MMFile* file = nullptr;
+		MemMng.createTmp(file, size);
+		std::vector<uint8_t> out(size), in(size);
+		for (size_t i = 0; i < size; ++i) out[i] = static_cast<uint8_t>(i * 7 + (i >> 12));
+		bool chained = file->writeAsync(0, out).get() == size;
+
+		std::promise<void> finished;
+		{
+			AsyncIO io(MemMng.getThreadPool(), 1);
+			size_t offset = 0;
+			IOCallback next = [&](int64_t bytes) {
+				offset += chunk;
+				if (bytes != static_cast<int64_t>(chunk) || offset == size) {
+					finished.set_value();
+					return;
+				}
+				IORequest request{ file->getFileHandle(), offset, in.data() + offset, static_cast<uint32_t>(chunk) };
+				request.done = next;
+				io.submit(std::span<IORequest>(&request, 1));
+			};
+			IORequest first{ file->getFileHandle(), 0, in.data(), static_cast<uint32_t>(chunk) };
+			first.done = next;
+			io.submit(std::span<IORequest>(&first, 1));
+			chained = chained && finished.get_future().wait_for(std::chrono::seconds(10)) == std::future_status::ready;
+		}
+		MemMng.free(file);
+
+		print << std::setw(20) << std::left << "Chained reads: " << test(chained && in == out);
+	}
+
+	{
+		// Concurrent coroutines: copy into a new file, checksum it and load it back, all resumed on the pool
+		const size_t size = 2 * 1024 * 1024 + 64;   // whole alignment units, the checksum covers the file
+		const int coroutines = 8;
+		std::vector<uint8_t> data(size);
+		for (size_t i = 0; i < size; ++i) data[i] = static_cast<uint8_t>(i * 5 + (i >> 10));
+
+		CRC32_64 expected;
+		expected.appendCRC64(data.data(), size);
+		expected.finallize();
+
+		std::atomic<int> done{ 0 }, good{ 0 };
+		auto operation = [&]() -> Detached {
+			MMFile* file = nullptr;
+			co_await MemMng.copyAsync(file, data.data(), size);
+			const uint64_t crc = co_await MemMng.crc64Async(file);
+			MemView& view = co_await file->loadAsync(0, size);
+			if (crc == expected.getCRC64() && std::memcmp(view.getPtr(), data.data(), size) == 0) good.fetch_add(1);
+			file->unload_s(view);
+			MemMng.free(file);
+			done.fetch_add(1);
+		};
+		for (int i = 0; i < coroutines; ++i) operation();
+		while (done.load() < coroutines) std::this_thread::yield();
+
+		print << std::setw(20) << std::left << "Coroutines: " << test(good.load() == coroutines);
+	}
 	
 	CRC32_64 crc;
 	MemView& view2 = mmf2->load(0, mmf2->getFileSize());
@@ -100,6 +1190,66 @@ int main()
 
 	print << std::setw(20) << "CRC: " << test(crc.getCRC32() == mmf2->getCRC32() && crc.getCRC64() == mmf2->getCRC64());
 
-	print << "------ Passed: " << passCase << " --- Failed: " << failCase << " --------\n";
-	return 0;
+	{
+		// Windows smaller than the file and fewer in flight than windows
+		MemMng.setChecksumWindow(3 * MemMng.getSysGranularity() + 1, 2);
+		CRC32_64& windowed = MemMng.calcCRC(mmf2);
+		print << std::setw(20) << "Windowed CRC: " << test(crc.getCRC32() == windowed.getCRC32() && crc.getCRC64() == windowed.getCRC64());
+		MemMng.setChecksumWindow(16 * 1024 * 1024);
+	}
+
+	{
+		// Two made up nodes sharing this machine's CPUs, the binding to a node the system lacks just fails
+		std::vector<uint32_t> cpus;
+		for (const auto& node : Platform::getNumaTopology()) cpus.insert(cpus.end(), node.begin(), node.end());
+		std::unique_ptr<ThreadPool> numaPool = std::make_unique<ThreadPool>(4, Platform::NumaTopology{ cpus, cpus });
+		ThreadPool* pool = numaPool.get();
+		const bool spread = pool->isNumaAware() && pool->getNodeCount() == 2 && pool->getNodeWorkers(1) == 2
+			&& pool->getWorkerNode(2) == 0 && pool->getWorkerNode(3) == 1 && pool->getCurrentNode() == SIZE_MAX;
+
+		std::atomic<size_t> ranOn{ SIZE_MAX };
+		pool->post(1, [&]() { ranOn = pool->getCurrentNode(); });
+		while (ranOn.load() == SIZE_MAX) std::this_thread::yield();
+
+		MemMng.setThreadPool(numaPool);
+		const size_t stripe = 4 * MemMng.getSysGranularity();
+		MemMng.setNumaStripe(stripe);
+		const bool striped = MemMng.isNumaAware() && MemMng.getHomeNode(0) == 0 && MemMng.getHomeNode(stripe) == 1
+			&& MemMng.getHomeNode(2 * stripe + 1) == 0;
+
+		MemMng.resetNumaStats();
+		CRC32_64& routed = MemMng.calcCRC(mmf2);
+		const bool same = crc.getCRC32() == routed.getCRC32() && crc.getCRC64() == routed.getCRC64();
+		const NumaStats stats = MemMng.getNumaStats();
+		bool counted = stats.localChunks + stats.remoteChunks == (mmf2->getFileSize() + stripe - 1) / stripe
+			&& stats.localBytes + stats.remoteBytes == mmf2->getFileSize() && stats.localChunks > 0;
+
+		// Windows smaller than a stripe are cut at its end, one in flight runs them all on this thread
+		const size_t window = 3 * MemMng.getSysGranularity();
+		size_t windows = 0;
+		for (size_t at = 0; at < mmf2->getFileSize(); at += stripe) windows += ((std::min)(stripe, mmf2->getFileSize() - at) + window - 1) / window;
+		MemMng.setChecksumWindow(window, 1);
+		MemMng.resetNumaStats();
+		CRC32_64& capped = MemMng.calcCRC(mmf2);
+		const NumaStats cappedStats = MemMng.getNumaStats();
+		counted = counted && crc.getCRC32() == capped.getCRC32() && crc.getCRC64() == capped.getCRC64()
+			&& cappedStats.remoteChunks == windows && cappedStats.localChunks == 0;
+		MemMng.setChecksumWindow(16 * 1024 * 1024);
+
+		std::vector<uint64_t> data(1024 * 1024 / 8);
+		for (size_t i = 0; i < data.size(); ++i) data[i] = i * 0x9E3779B97F4A7C15ull;
+		MMFile* copy = nullptr;
+		MemMng.memcopy(copy, data.data(), data.size() * 8);
+		MemView& copied = copy->load_s(0, data.size() * 8);
+		const bool copiedOk = std::memcmp(copied.getPtr(), data.data(), data.size() * 8) == 0;
+		copy->unload_s(copied);
+		MemMng.free(copy);
+
+		std::unique_ptr<ThreadPool> plainPool = std::make_unique<ThreadPool>(4);
+		MemMng.setThreadPool(plainPool);
+		print << std::setw(20) << "NUMA routing: " << test(spread && ranOn.load() < 2 && striped && same && counted && copiedOk && !MemMng.isNumaAware());
+	}
+
+	print << std::dec << "------ Passed: " << passCase << " --- Failed: " << failCase << " --------\n";
+	return failCase == 0 ? 0 : 1;
 }
\ No newline at end of file
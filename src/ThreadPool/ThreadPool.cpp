@@ -1,34 +1,647 @@
 #include "ThreadPool.hpp"
 
-ThreadPool::ThreadPool(size_t threadCount) : stop(false), availableThreads(0) {
+#include <mutex>
+
+#include "src/Platform/Platform.hpp"
+
+namespace
+{
+    // Pool and deque index of the worker running on this thread
+    thread_local const ThreadPool* currentPool = nullptr;
+    thread_local size_t currentIndex = 0;
+
+    thread_local uint64_t stealSeed = 0x9E3779B97F4A7C15ull;
+
+    size_t nextVictim(size_t count)
+    {
+        stealSeed ^= stealSeed << 13;
+        stealSeed ^= stealSeed >> 7;
+        stealSeed ^= stealSeed << 17;
+        return static_cast<size_t>(stealSeed % count);
+    }
+
+    inline void cpuRelax()
+    {
+        std::this_thread::yield();
+    }
+}
+
+//------ Task nodes --------
+
+struct ThreadPool::NodeFreeList
+{
+    static constexpr size_t maxNodes = 1 << 16;
+
+    std::mutex mutex;
+    TaskNode* head = nullptr;
+    size_t count = 0;
+};
+
+struct ThreadPool::NodeCache
+{
+    static constexpr size_t batch = 64;
+    static constexpr size_t maxNodes = 4 * batch;
+
+    TaskNode* head = nullptr;
+    size_t count = 0;
+
+    ~NodeCache()
+    {
+        while (head) {
+            TaskNode* node = head;
+            head = node->next;
+            releaseShared(node);
+        }
+    }
+
+    static void releaseShared(TaskNode* node)
+    {
+        NodeFreeList& shared = sharedNodes();
+        {
+            std::lock_guard<std::mutex> lock(shared.mutex);
+            if (shared.count < NodeFreeList::maxNodes) {
+                node->next = shared.head;
+                shared.head = node;
+                ++shared.count;
+                return;
+            }
+        }
+        delete node;
+    }
+};
+
+ThreadPool::NodeFreeList& ThreadPool::sharedNodes()
+{
+    // Never destroyed: thread caches hand their nodes back during thread/static teardown
+    static NodeFreeList* shared = new NodeFreeList();
+    return *shared;
+}
+
+ThreadPool::NodeCache& ThreadPool::localNodes()
+{
+    thread_local NodeCache cache;
+    return cache;
+}
+
+ThreadPool::TaskNode* ThreadPool::allocateNode()
+{
+    NodeCache& cache = localNodes();
+
+    if (cache.head == nullptr) {
+        // Refill a batch under one lock acquisition
+        NodeFreeList& shared = sharedNodes();
+        std::lock_guard<std::mutex> lock(shared.mutex);
+        for (size_t i = 0; i < NodeCache::batch && shared.head; ++i) {
+            TaskNode* node = shared.head;
+            shared.head = node->next;
+            --shared.count;
+            node->next = cache.head;
+            cache.head = node;
+            ++cache.count;
+        }
+    }
+
+    if (cache.head == nullptr) return new TaskNode();
+
+    TaskNode* node = cache.head;
+    cache.head = node->next;
+    --cache.count;
+    return node;
+}
+
+void ThreadPool::releaseNode(TaskNode* node)
+{
+    NodeCache& cache = localNodes();
+
+    node->run = nullptr;
+    node->next = cache.head;
+    cache.head = node;
+    ++cache.count;
+
+    if (cache.count > NodeCache::maxNodes) {
+        // Hand a batch back so threads that only submit can pick them up
+        TaskNode* first = cache.head;
+        TaskNode* last = first;
+        for (size_t i = 1; i < NodeCache::batch; ++i) last = last->next;
+        cache.head = last->next;
+        cache.count -= NodeCache::batch;
+
+        NodeFreeList& shared = sharedNodes();
+        std::unique_lock<std::mutex> lock(shared.mutex);
+        if (shared.count < NodeFreeList::maxNodes) {
+            last->next = shared.head;
+            shared.head = first;
+            shared.count += NodeCache::batch;
+            return;
+        }
+        lock.unlock();
+        last->next = nullptr;
+        while (first) {
+            TaskNode* node = first;
+            first = node->next;
+            delete node;
+        }
+    }
+}
+
+//------ Work-stealing deque --------
+
+ThreadPool::WorkStealingDeque::WorkStealingDeque() : top(0), bottom(0)
+{
+    rings.emplace_back(std::make_unique<Ring>(1024));
+    ring.store(rings.back().get(), std::memory_order_relaxed);
+}
+
+ThreadPool::WorkStealingDeque::~WorkStealingDeque() = default;
+
+void ThreadPool::WorkStealingDeque::push(TaskNode* node)
+{
+    pushBulk(node, 1);
+}
+
+void ThreadPool::WorkStealingDeque::pushBulk(TaskNode* first, size_t count)
+{
+    const int64_t b = bottom.load(std::memory_order_relaxed);
+    const int64_t t = top.load(std::memory_order_acquire);
+    Ring* r = ring.load(std::memory_order_relaxed);
+
+    const int64_t needed = b - t + static_cast<int64_t>(count);
+    if (needed > r->capacity()) {
+        int64_t capacity = r->capacity() * 2;
+        while (needed > capacity) capacity *= 2;
+        auto grown = std::make_unique<Ring>(capacity);
+        for (int64_t i = t; i < b; ++i) grown->put(i, r->get(i));
+        r = grown.get();
+        rings.push_back(std::move(grown));
+        ring.store(r, std::memory_order_release);
+    }
+
+    // Nothing is visible to thieves until bottom moves, so the chain can be walked while storing
+    TaskNode* node = first;
+    for (size_t i = 0; i < count; ++i, node = node->next) r->put(b + static_cast<int64_t>(i), node);
+    bottom.store(b + static_cast<int64_t>(count), std::memory_order_release);
+}
+
+ThreadPool::TaskNode* ThreadPool::WorkStealingDeque::take()
+{
+    const int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+    Ring* r = ring.load(std::memory_order_relaxed);
+    bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top.load(std::memory_order_relaxed);
+
+    if (t > b) {
+        bottom.store(b + 1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    TaskNode* node = r->get(b);
+    if (t == b) {
+        // Last element, race thieves for it
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            node = nullptr;
+        }
+        bottom.store(b + 1, std::memory_order_relaxed);
+    }
+    return node;
+}
+
+ThreadPool::TaskNode* ThreadPool::WorkStealingDeque::steal()
+{
+    int64_t t = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    const int64_t b = bottom.load(std::memory_order_acquire);
+
+    if (t >= b) return nullptr;
+
+    Ring* r = ring.load(std::memory_order_acquire);
+    TaskNode* node = r->get(t);
+    if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+        return nullptr;
+    }
+    return node;
+}
+
+bool ThreadPool::WorkStealingDeque::empty() const
+{
+    return top.load(std::memory_order_acquire) >= bottom.load(std::memory_order_acquire);
+}
+
+//------ Injection queue --------
+
+ThreadPool::InjectionQueue::InjectionQueue(size_t capacity)
+    : cells(new Cell[capacity]), mask(capacity - 1), enqueuePos(0), dequeuePos(0)
+{
+    for (size_t i = 0; i < capacity; ++i) cells[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+bool ThreadPool::InjectionQueue::push(TaskNode* node)
+{
+    size_t pos = enqueuePos.load(std::memory_order_relaxed);
+    for (;;) {
+        Cell& cell = cells[pos & mask];
+        const size_t seq = cell.sequence.load(std::memory_order_acquire);
+        const intptr_t dif = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+        if (dif == 0) {
+            if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                cell.node = node;
+                cell.sequence.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+        }
+        else if (dif < 0) {
+            return false;   // full
+        }
+        else {
+            pos = enqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+bool ThreadPool::InjectionQueue::pushBulk(TaskNode* first, size_t count)
+{
+    if (count > mask + 1) return false;
+
+    // The batch fits once the last cell it needs has been released by the previous lap
+    size_t pos = enqueuePos.load(std::memory_order_relaxed);
+    for (;;) {
+        const size_t last = pos + count - 1;
+        const size_t seq = cells[last & mask].sequence.load(std::memory_order_acquire);
+        const intptr_t dif = static_cast<intptr_t>(seq) - static_cast<intptr_t>(last);
+        if (dif == 0) {
+            if (enqueuePos.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed)) break;
+        }
+        else if (dif < 0) {
+            return false;   // full
+        }
+        else {
+            pos = enqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+
+    // Earlier cells are already claimed by consumers, wait for the ones still being read.
+    // A published node can be run and recycled at once, so read the chain link before publishing.
+    TaskNode* node = first;
+    for (size_t i = 0; i < count; ++i) {
+        Cell& cell = cells[(pos + i) & mask];
+        while (cell.sequence.load(std::memory_order_acquire) != pos + i) cpuRelax();
+        TaskNode* next = node->next;
+        cell.node = node;
+        cell.sequence.store(pos + i + 1, std::memory_order_release);
+        node = next;
+    }
+    return true;
+}
+
+ThreadPool::TaskNode* ThreadPool::InjectionQueue::pop()
+{
+    size_t pos = dequeuePos.load(std::memory_order_relaxed);
+    for (;;) {
+        Cell& cell = cells[pos & mask];
+        const size_t seq = cell.sequence.load(std::memory_order_acquire);
+        const intptr_t dif = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+        if (dif == 0) {
+            if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                TaskNode* node = cell.node;
+                cell.sequence.store(pos + mask + 1, std::memory_order_release);
+                return node;
+            }
+        }
+        else if (dif < 0) {
+            return nullptr; // empty
+        }
+        else {
+            pos = dequeuePos.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+bool ThreadPool::InjectionQueue::empty() const
+{
+    return enqueuePos.load(std::memory_order_acquire) == dequeuePos.load(std::memory_order_acquire);
+}
+
+//------ Pool --------
+
+ThreadPool::ThreadPool(size_t threadCount) : ThreadPool(threadCount, {}) {}
+
+ThreadPool::ThreadPool(size_t threadCount, const std::vector<std::vector<uint32_t>>& nodeCpus)
+    : injected(1 << 14), stop(false), availableThreads(0), wakeEpoch(0) {
+    // Nodes without CPUs (memory only) get no workers, their work is picked up by the others
+    std::vector<size_t> usable;
+    for (size_t node = 0; node < nodeCpus.size(); ++node) {
+        if (!nodeCpus[node].empty()) usable.push_back(node);
+    }
+
+    if (usable.empty()) {
+        nodeWorkers.resize(1);
+    }
+    else {
+        nodeWorkers.resize(nodeCpus.size());
+        for (size_t node = 0; node < nodeCpus.size(); ++node) nodeQueues.emplace_back(std::make_unique<InjectionQueue>(1 << 12));
+    }
+
     for (size_t i = 0; i < threadCount; ++i) {
-        workers.emplace_back([this]() { workerLoop(); });
+        workers.emplace_back(std::make_unique<Worker>());
+        workers[i]->node = usable.empty() ? 0 : usable[i % usable.size()];
+        nodeWorkers[workers[i]->node].push_back(i);
+    }
+    for (size_t i = 0; i < threadCount; ++i) {
+        if (usable.empty()) {
+            workers[i]->thread = std::thread([this, i]() { workerLoop(i); });
+            continue;
+        }
+        const size_t node = workers[i]->node;
+        workers[i]->thread = std::thread([this, i, node, cpus = nodeCpus[node]]() {
+            SoraMem::Platform::pinThread(cpus);
+            SoraMem::Platform::preferNode(static_cast<uint32_t>(node));
+            workerLoop(i);
+            });
     }
 }
 
 ThreadPool::~ThreadPool() {
     stop = true;
-    condition.notify_all();
-    for (std::thread& worker : workers) {
-        if (worker.joinable()) worker.join();
+    wakeEpoch.fetch_add(1, std::memory_order_seq_cst);
+    wakeEpoch.notify_all();
+    for (auto& worker : workers) {
+        if (worker->thread.joinable()) worker->thread.join();
     }
 }
 
-void ThreadPool::workerLoop() {
-    while (!stop) {
-        std::function<void()> task;
-        {
-            std::unique_lock<std::mutex> lock(queueMutex);
+void ThreadPool::enqueue(TaskNode* node)
+{
+    if (currentPool == this) {
+        workers[currentIndex]->deque.push(node);
+    }
+    else {
+        // Full queue: the workers are busy draining it, wait for a free cell
+        while (!injected.push(node)) cpuRelax();
+    }
+
+    wakeEpoch.fetch_add(1, std::memory_order_seq_cst);
+    if (availableThreads.load(std::memory_order_seq_cst) > 0) wakeEpoch.notify_one();
+}
+
+size_t ThreadPool::getCurrentNode() const
+{
+    return (currentPool == this) ? workers[currentIndex]->node : SIZE_MAX;
+}
+
+void ThreadPool::enqueueBulk(TaskNode* first, size_t count, size_t node)
+{
+    if (nodeQueues.empty()) node = anyNode;
+    InjectionQueue& queue = (node == anyNode) ? injected : *nodeQueues[node];
 
-            availableThreads.fetch_add(1, std::memory_order_relaxed);
-            condition.wait(lock, [this]() { return stop || !tasks.empty(); });
-            availableThreads.fetch_sub(1, std::memory_order_relaxed);
+    // Workers keep their own node's work in their deque
+    if (currentPool == this && (node == anyNode || workers[currentIndex]->node == node)) {
+        workers[currentIndex]->deque.pushBulk(first, count);
+    }
+    else if (!queue.pushBulk(first, count)) {
+        TaskNode* task = first;
+        for (size_t i = 0; i < count; ++i) {
+            TaskNode* next = task->next;
+            while (!queue.push(task)) cpuRelax();
+            task = next;
+        }
+    }
+
+    wakeEpoch.fetch_add(1, std::memory_order_seq_cst);
+    if (availableThreads.load(std::memory_order_seq_cst) > 0) {
+        if (count > 1) wakeEpoch.notify_all();
+        else wakeEpoch.notify_one();
+    }
+}
+
+//------ Bulk submission --------
+
+void ThreadPool::BulkState::work()
+{
+    for (;;) {
+        const size_t index = next.fetch_add(1, std::memory_order_relaxed);
+        if (index >= count) return;
+        runIndex(index);
+    }
+}
+
+void ThreadPool::BulkState::workFrom(size_t home)
+{
+    const size_t nodes = nodeEnd.size();
+    for (size_t i = 0; i < nodes; ++i) {
+        const size_t node = (home + i) % nodes;
+        for (;;) {
+            const size_t at = cursors[node].fetch_add(1, std::memory_order_relaxed);
+            if (at >= nodeEnd[node]) break;
+            runIndex(order[at]);
+        }
+    }
+}
 
-            if (stop && tasks.empty()) return;
-            task = std::move(tasks.front());
-            tasks.pop();
+void ThreadPool::BulkState::runIndex(size_t index)
+{
+    // After a failure the remaining indices are only counted off
+    if (!failed.load(std::memory_order_relaxed)) {
+        try {
+            invoke(fn, index);
+        }
+        catch (...) {
+            if (!failed.exchange(true)) error = std::current_exception();
         }
-        task();
     }
+    if (done.fetch_add(1, std::memory_order_acq_rel) + 1 == count) done.notify_all();
+}
+
+void ThreadPool::BulkState::release()
+{
+    if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) delete this;
 }
 
+void ThreadPool::runBulk(size_t count, size_t maxConcurrency, void (*invoke)(void*, size_t), void* fn)
+{
+    if (count == 0) return;
+
+    size_t participants = workers.size() + 1;
+    if (maxConcurrency > 0) participants = (std::min)(participants, maxConcurrency);
+    participants = (std::min)(participants, count);
+
+    if (participants == 1) {
+        for (size_t i = 0; i < count; ++i) invoke(fn, i);
+        return;
+    }
+    if (stop.load(std::memory_order_relaxed)) throw std::runtime_error("ThreadPool is stopped");
+
+    // Helpers that start after the work ran out only drop their reference, so the state is refcounted
+    // rather than owned by this frame
+    const size_t helpers = participants - 1;
+    BulkState* state = new BulkState(count, invoke, fn, helpers + 1);
+
+    TaskNode* first = nullptr;
+    for (size_t i = 0; i < helpers; ++i) {
+        TaskNode* node = makeTask([state]() { state->work(); state->release(); });
+        node->next = first;
+        first = node;
+    }
+    enqueueBulk(first, helpers);
+
+    state->work();
+    for (size_t done; (done = state->done.load(std::memory_order_acquire)) != count; ) {
+        state->done.wait(done, std::memory_order_acquire);
+    }
+
+    std::exception_ptr error = state->error;
+    state->release();
+    if (error) std::rethrow_exception(error);
+}
+
+void ThreadPool::runBulkNuma(size_t count, size_t maxConcurrency, size_t (*locate)(void*, size_t), void* nodeOf, void (*invoke)(void*, size_t), void* fn)
+{
+    if (nodeQueues.empty() || workers.empty() || maxConcurrency == 1) {
+        runBulk(count, maxConcurrency, invoke, fn);
+        return;
+    }
+    if (count == 0) return;
+    if (stop.load(std::memory_order_relaxed)) throw std::runtime_error("ThreadPool is stopped");
+
+    const size_t nodes = nodeQueues.size();
+    const size_t callerNode = getCurrentNode();
+
+    // Counting sort of the indices by node, nodes past the layout wrap around
+    std::vector<size_t> homes(count);
+    std::vector<size_t> nodeBegin(nodes + 1, 0);
+    for (size_t i = 0; i < count; ++i) {
+        homes[i] = locate(nodeOf, i) % nodes;
+        ++nodeBegin[homes[i] + 1];
+    }
+    for (size_t node = 0; node < nodes; ++node) nodeBegin[node + 1] += nodeBegin[node];
+
+    // One helper per worker of a node with work, the calling worker stands in for one of its node's
+    std::vector<size_t> helpers(nodes);
+    size_t totalHelpers = 0;
+    for (size_t node = 0; node < nodes; ++node) {
+        helpers[node] = (std::min)(nodeWorkers[node].size(), nodeBegin[node + 1] - nodeBegin[node]);
+        if (node == callerNode && helpers[node] > 0) --helpers[node];
+        totalHelpers += helpers[node];
+    }
+    // The cap is dealt round-robin over the nodes, the caller counts against it when it works
+    if (maxConcurrency > 0) {
+        const size_t budget = maxConcurrency - ((callerNode != SIZE_MAX) ? 1 : 0);
+        std::vector<size_t> capped(nodes, 0);
+        size_t dealt = 0;
+        for (bool more = true; more && dealt < budget; ) {
+            more = false;
+            for (size_t node = 0; node < nodes && dealt < budget; ++node) {
+                if (capped[node] == helpers[node]) continue;
+                ++capped[node];
+                ++dealt;
+                more = true;
+            }
+        }
+        helpers.swap(capped);
+        totalHelpers = dealt;
+    }
+    // Everything is on nodes without workers and the caller cannot help
+    if (totalHelpers == 0 && callerNode == SIZE_MAX) {
+        runBulk(count, maxConcurrency, invoke, fn);
+        return;
+    }
+
+    BulkState* state = new BulkState(count, invoke, fn, totalHelpers + 1);
+    state->order.resize(count);
+    state->nodeEnd.assign(nodeBegin.begin() + 1, nodeBegin.end());
+    state->cursors = std::make_unique<std::atomic<size_t>[]>(nodes);
+    for (size_t node = 0; node < nodes; ++node) state->cursors[node].store(nodeBegin[node], std::memory_order_relaxed);
+    for (size_t i = 0; i < count; ++i) state->order[nodeBegin[homes[i]]++] = i;
+
+    for (size_t node = 0; node < nodes; ++node) {
+        if (helpers[node] == 0) continue;
+        TaskNode* first = nullptr;
+        for (size_t i = 0; i < helpers[node]; ++i) {
+            // A worker of another node may pick the helper up, it then starts from its own node
+            TaskNode* task = makeTask([this, state]() { state->workFrom(workers[currentIndex]->node); state->release(); });
+            task->next = first;
+            first = task;
+        }
+        enqueueBulk(first, helpers[node], node);
+    }
+
+    if (callerNode != SIZE_MAX) state->workFrom(callerNode);
+    for (size_t done; (done = state->done.load(std::memory_order_acquire)) != count; ) {
+        state->done.wait(done, std::memory_order_acquire);
+    }
+
+    std::exception_ptr error = state->error;
+    state->release();
+    if (error) std::rethrow_exception(error);
+}
+
+ThreadPool::TaskNode* ThreadPool::findTask(size_t self, bool remote)
+{
+    const size_t home = workers[self]->node;
+    if (TaskNode* node = workers[self]->deque.take()) return node;
+    if (!nodeQueues.empty()) {
+        if (TaskNode* node = nodeQueues[home]->pop()) return node;
+    }
+    if (TaskNode* node = injected.pop()) return node;
+
+    // Siblings on the same node first
+    const std::vector<size_t>& siblings = nodeWorkers[home];
+    const size_t count = siblings.size();
+    const size_t start = nextVictim(count);
+    for (size_t i = 0; i < count; ++i) {
+        const size_t victim = siblings[(start + i) % count];
+        if (victim == self) continue;
+        if (TaskNode* node = workers[victim]->deque.steal()) return node;
+    }
+    if (!remote) return nullptr;
+
+    const size_t nodes = nodeQueues.size();
+    for (size_t i = 1; i < nodes; ++i) {
+        const size_t other = (home + i) % nodes;
+        if (TaskNode* node = nodeQueues[other]->pop()) return node;
+        for (size_t victim : nodeWorkers[other]) {
+            if (TaskNode* node = workers[victim]->deque.steal()) return node;
+        }
+    }
+    return nullptr;
+}
+
+void ThreadPool::workerLoop(size_t index) {
+    constexpr int spinRounds = 64;
+
+    currentPool = this;
+    currentIndex = index;
+
+    for (;;) {
+        TaskNode* node = findTask(index, false);
+        for (int spin = 0; node == nullptr && spin < spinRounds; ++spin) {
+            cpuRelax();
+            node = findTask(index, false);
+        }
+        // Other nodes' work only once this node has none
+        if (node == nullptr && nodeQueues.size() > 1) node = findTask(index, true);
+
+        if (node != nullptr) {
+            node->run(node);
+            releaseNode(node);
+            continue;
+        }
+
+        // Park: announce first, then re-check so an enqueue between the two cannot be missed
+        availableThreads.fetch_add(1, std::memory_order_seq_cst);
+        const uint32_t epoch = wakeEpoch.load(std::memory_order_seq_cst);
+        node = findTask(index, true);
+        if (node == nullptr) {
+            if (stop.load(std::memory_order_seq_cst)) {
+                availableThreads.fetch_sub(1, std::memory_order_relaxed);
+                return;
+            }
+            wakeEpoch.wait(epoch, std::memory_order_seq_cst);
+        }
+        availableThreads.fetch_sub(1, std::memory_order_relaxed);
+
+        if (node != nullptr) {
+            node->run(node);
+            releaseNode(node);
+        }
+    }
+}
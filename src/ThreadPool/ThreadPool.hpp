@@ -1,16 +1,36 @@
 #pragma once
 #include <vector>
-#include <queue>
 #include <thread>
-#include <mutex>
-#include <condition_variable>
+#include <memory>
 #include <functional>
 #include <future>
 #include <atomic>
+#include <coroutine>
+#include <optional>
+#include <cstdint>
+#include <stdexcept>
+#include <cstring>
+#include <new>
+#include <algorithm>
+#include <exception>
+#include <type_traits>
+
+// Work-stealing pool: every worker owns a Chase-Lev deque (LIFO for itself, FIFO for thieves),
+// threads outside the pool go through a lock-free injection queue. Tasks live in recycled
+// 64-byte nodes with inline storage, so small callables never touch the heap.
+// In NUMA mode workers are pinned per node and each node has its own injection queue; workers
+// steal within their node and only take other nodes' work when they have none left.
+
+template<typename T>
+class PoolAwaitable;
 
 class ThreadPool {
 public:
     explicit ThreadPool(size_t threadCount);
+    // NUMA mode: nodeCpus lists the CPUs of every node, from Platform::getNumaTopology() or made up for
+    // testing. Workers are dealt round-robin over the nodes that have CPUs, pinned to them and take memory
+    // from their node first (both best effort, a made up layout may name nodes the system lacks).
+    ThreadPool(size_t threadCount, const std::vector<std::vector<uint32_t>>& nodeCpus);
     ~ThreadPool();
 
     // Submit a task, returning a future
@@ -19,42 +39,334 @@ public:
         -> std::future<std::invoke_result_t<F, Args...>>;
     // Trailing return type deduction;
 
+    // Fire-and-forget task, f must not throw
+    template<typename F>
+    void post(F&& f);
+    // Fire-and-forget task for the workers of node, same as post outside NUMA mode
+    template<typename F>
+    void post(size_t node, F&& f);
+
+    // Runs fn(i) for every i in [0, count) on at most maxConcurrency threads (0 = every worker plus
+    // the caller). Indices are claimed in increasing order from one shared counter and the calling
+    // thread works through them too; returns once all are done and rethrows the first exception.
+    template<typename F>
+    void submit_bulk(size_t count, F&& fn, size_t maxConcurrency = 0);
+
+    // submit_bulk where index i belongs to node nodeOf(i): every worker runs its own node's indices before
+    // helping other nodes. A caller outside the pool sits on no node, it only waits. maxConcurrency caps the
+    // threads as in submit_bulk, shared out over the nodes with work. Outside NUMA mode this is submit_bulk.
+    template<typename F, typename N>
+    void submit_bulk_numa(size_t count, N&& nodeOf, F&& fn, size_t maxConcurrency = 0);
+
+    // Runs fn(lo, hi) over [begin, end) in chunks of grain elements, same completion rules as submit_bulk
+    template<typename F>
+    void parallel_for(size_t begin, size_t end, size_t grain, F&& fn);
+
+    // co_await schedule(fn) runs fn on the pool and resumes the coroutine on the worker that ran it
+    template<typename F>
+    PoolAwaitable<std::invoke_result_t<F>> schedule(F&& fn) { return { this, std::forward<F>(fn) }; }
+
     int getAvailableThreads() const {
         return availableThreads.load(std::memory_order_relaxed);
     }
 
+    size_t getThreadCount() const {
+        return workers.size();
+    }
+
+    bool isNumaAware() const { return !nodeQueues.empty(); }
+    size_t getNodeCount() const { return nodeWorkers.size(); }      // 1 outside NUMA mode
+    size_t getNodeWorkers(size_t node) const { return nodeWorkers[node].size(); }
+    size_t getWorkerNode(size_t worker) const { return workers[worker]->node; }
+    size_t getCurrentNode() const;      // node of the calling worker, SIZE_MAX on threads outside the pool
+
 private:
-    std::vector<std::thread> workers;
-    std::queue<std::function<void()>> tasks;
+    struct TaskNode
+    {
+        static constexpr size_t inlineSize = 48;
+
+        void      (*run)(TaskNode* node) = nullptr;  // invokes and destroys the callable
+        TaskNode* next = nullptr;                    // free list link
+        alignas(void*) unsigned char storage[inlineSize];
+    };
+
+    // Chase-Lev deque (Le, Pop, Cohen, Zappa Nardelli 2013), only the owner pushes and takes
+    class WorkStealingDeque
+    {
+    public:
+        WorkStealingDeque();
+        ~WorkStealingDeque();
+
+        void      push(TaskNode* node);
+        void      pushBulk(TaskNode* first, size_t count);   // nodes chained through next
+        TaskNode* take();
+        TaskNode* steal();
+        bool      empty() const;
+
+    private:
+        struct Ring
+        {
+            explicit Ring(int64_t capacity) : mask(capacity - 1), slots(new std::atomic<TaskNode*>[capacity]) {}
+
+            TaskNode* get(int64_t i) const { return slots[i & mask].load(std::memory_order_relaxed); }
+            void      put(int64_t i, TaskNode* node) { slots[i & mask].store(node, std::memory_order_relaxed); }
+            int64_t   capacity() const { return mask + 1; }
+
+            int64_t mask;
+            std::unique_ptr<std::atomic<TaskNode*>[]> slots;
+        };
+
+        alignas(64) std::atomic<int64_t> top;
+        alignas(64) std::atomic<int64_t> bottom;
+        std::atomic<Ring*> ring;
+        std::vector<std::unique_ptr<Ring>> rings;   // retired rings stay alive for late thieves
+    };
+
+    // Bounded multi-producer/multi-consumer queue (Vyukov) for submitters outside the pool
+    class InjectionQueue
+    {
+    public:
+        explicit InjectionQueue(size_t capacity);
+
+        bool      push(TaskNode* node);
+        bool      pushBulk(TaskNode* first, size_t count);   // claims count cells with one CAS
+        TaskNode* pop();
+        bool      empty() const;
+
+    private:
+        struct Cell
+        {
+            std::atomic<size_t> sequence;
+            TaskNode* node;
+        };
+
+        std::unique_ptr<Cell[]> cells;
+        size_t mask;
+        alignas(64) std::atomic<size_t> enqueuePos;
+        alignas(64) std::atomic<size_t> dequeuePos;
+    };
+
+    struct Worker
+    {
+        WorkStealingDeque deque;
+        std::thread thread;
+        size_t node = 0;
+    };
+
+    static constexpr size_t anyNode = SIZE_MAX;
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    InjectionQueue injected;
+    std::vector<std::unique_ptr<InjectionQueue>> nodeQueues;   // one per node in NUMA mode, else none
+    std::vector<std::vector<size_t>> nodeWorkers;              // worker indices by node
 
-    std::mutex queueMutex;
-    std::condition_variable condition;
     std::atomic<bool> stop;
-    std::atomic<int> availableThreads;
+    std::atomic<int> availableThreads;      // workers parked in wait()
+    std::atomic<uint32_t> wakeEpoch;        // bumped on every enqueue, workers wait on it
+
+    // Nodes are recycled through a per-thread cache backed by a shared list, so steady-state
+    // submission does not allocate
+    struct NodeCache;
+    struct NodeFreeList;
+
+    static NodeFreeList& sharedNodes();
+    static NodeCache&    localNodes();
+    static TaskNode* allocateNode();
+    static void      releaseNode(TaskNode* node);
+
+    template<typename F>
+    static TaskNode* makeTask(F&& f);
+
+    // One submit_bulk call: a claim counter plus a completion latch, shared by the caller and its helpers.
+    // submit_bulk_numa groups the indices by node and gives every node a claim cursor of its own.
+    struct BulkState
+    {
+        BulkState(size_t count, void (*invoke)(void*, size_t), void* fn, size_t refs)
+            : count(count), invoke(invoke), fn(fn), refs(refs) {}
+
+        void work();
+        void workFrom(size_t home);     // home's indices first, then the other nodes'
+        void runIndex(size_t index);
+        void release();
+
+        const size_t count;
+        void (*const invoke)(void* fn, size_t index);
+        void* const fn;
+
+        std::atomic<size_t> next{ 0 };
+        std::atomic<size_t> done{ 0 };
+        std::atomic<size_t> refs;
+        std::atomic<bool> failed{ false };
+        std::exception_ptr error;
+
+        std::vector<size_t> order;      // indices grouped by node
+        std::vector<size_t> nodeEnd;    // end of each node's group in order
+        std::unique_ptr<std::atomic<size_t>[]> cursors;
+    };
+
+    void      runBulk(size_t count, size_t maxConcurrency, void (*invoke)(void*, size_t), void* fn);
+    void      runBulkNuma(size_t count, size_t maxConcurrency, size_t (*locate)(void*, size_t), void* nodeOf, void (*invoke)(void*, size_t), void* fn);
+
+    void      enqueue(TaskNode* node);
+    void      enqueueBulk(TaskNode* first, size_t count, size_t node = anyNode);
+    TaskNode* findTask(size_t self, bool remote);   // remote: other nodes' work too
+    void      workerLoop(size_t index);
+};
+
+// Awaitable for C++20 coroutines, nothing is parked while the work runs: the awaiting coroutine is resumed
+// by the worker that finished it. Without a pool the work runs inline and the coroutine never suspends.
+template<typename T>
+class PoolAwaitable
+{
+public:
+    template<typename F>
+    PoolAwaitable(ThreadPool* pool, F&& fn) : pool(pool), fn(std::forward<F>(fn)) {}
+
+    bool await_ready()
+    {
+        if (pool != nullptr) return false;
+        run();
+        return true;
+    }
+
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+        // The awaitable lives in the suspended frame, nothing here touches it after the resume
+        pool->post([this, handle]() {
+            run();
+            handle.resume();
+        });
+    }
+
+    T await_resume()
+    {
+        if (error) std::rethrow_exception(error);
+        if constexpr (std::is_reference_v<T>) return **result;
+        else if constexpr (!std::is_void_v<T>) return std::move(*result);
+    }
+
+private:
+    // References are kept as pointers, void keeps nothing
+    using Stored = std::conditional_t<std::is_reference_v<T>, std::remove_reference_t<T>*,
+        std::conditional_t<std::is_void_v<T>, bool, T>>;
+
+    void run() noexcept
+    {
+        try {
+            if constexpr (std::is_reference_v<T>) result.emplace(&fn());
+            else if constexpr (std::is_void_v<T>) fn();
+            else result.emplace(fn());
+        }
+        catch (...) {
+            error = std::current_exception();
+        }
+    }
 
-    void workerLoop();
+    ThreadPool* pool;
+    std::function<T()> fn;
+    std::optional<Stored> result;
+    std::exception_ptr error;
+};
+
+// Fire-and-forget coroutine to drive PoolAwaitables from plain code: it starts at once, its frame is freed
+// when it finishes and an escaping exception terminates
+struct Detached
+{
+    struct promise_type
+    {
+        Detached get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
 };
 
 // template definition to prevent linking error
 
+template<typename F>
+ThreadPool::TaskNode* ThreadPool::makeTask(F&& f)
+{
+    using Fn = std::decay_t<F>;
+    TaskNode* node = allocateNode();
+
+    if constexpr (sizeof(Fn) <= TaskNode::inlineSize && alignof(Fn) <= alignof(void*)) {
+        new (node->storage) Fn(std::forward<F>(f));
+        node->run = [](TaskNode* n) {
+            Fn* fn = std::launder(reinterpret_cast<Fn*>(n->storage));
+            (*fn)();
+            fn->~Fn();
+        };
+    }
+    else {
+        Fn* boxed = new Fn(std::forward<F>(f));
+        std::memcpy(node->storage, &boxed, sizeof(boxed));
+        node->run = [](TaskNode* n) {
+            Fn* fn;
+            std::memcpy(&fn, n->storage, sizeof(fn));
+            std::unique_ptr<Fn> owner(fn);
+            (*fn)();
+        };
+    }
+    return node;
+}
+
+template<typename F>
+void ThreadPool::post(F&& f)
+{
+    if (stop.load(std::memory_order_relaxed)) throw std::runtime_error("ThreadPool is stopped");
+    enqueue(makeTask(std::forward<F>(f)));
+}
+
+template<typename F>
+void ThreadPool::post(size_t node, F&& f)
+{
+    if (stop.load(std::memory_order_relaxed)) throw std::runtime_error("ThreadPool is stopped");
+    enqueueBulk(makeTask(std::forward<F>(f)), 1, node);
+}
+
+template<typename F>
+void ThreadPool::submit_bulk(size_t count, F&& fn, size_t maxConcurrency)
+{
+    using Fn = std::remove_reference_t<F>;
+    auto invoke = [](void* f, size_t index) { (*static_cast<Fn*>(f))(index); };
+    runBulk(count, maxConcurrency, invoke, const_cast<void*>(static_cast<const void*>(std::addressof(fn))));
+}
+
+template<typename F, typename N>
+void ThreadPool::submit_bulk_numa(size_t count, N&& nodeOf, F&& fn, size_t maxConcurrency)
+{
+    using Fn = std::remove_reference_t<F>;
+    using NodeFn = std::remove_reference_t<N>;
+    auto invoke = [](void* f, size_t index) { (*static_cast<Fn*>(f))(index); };
+    auto locate = [](void* f, size_t index) -> size_t { return (*static_cast<NodeFn*>(f))(index); };
+    runBulkNuma(count, maxConcurrency, locate, const_cast<void*>(static_cast<const void*>(std::addressof(nodeOf))),
+        invoke, const_cast<void*>(static_cast<const void*>(std::addressof(fn))));
+}
+
+template<typename F>
+void ThreadPool::parallel_for(size_t begin, size_t end, size_t grain, F&& fn)
+{
+    if (end <= begin) return;
+    grain = (std::max)(grain, size_t(1));
+    submit_bulk((end - begin + grain - 1) / grain, [&](size_t chunk) {
+        const size_t lo = begin + chunk * grain;
+        fn(lo, (std::min)(lo + grain, end));
+        });
+}
+
 template<typename F, typename... Args>
 auto ThreadPool::submit(F&& f, Args&&... args)
 -> std::future<std::invoke_result_t<F, Args...>> {
 
     using return_type = std::invoke_result_t<F, Args...>;
 
-    auto task = std::make_shared<std::packaged_task<return_type()>>(
+    // The packaged_task sits inside the task node, its shared state is the only allocation
+    std::packaged_task<return_type()> task(
         std::bind(std::forward<F>(f), std::forward<Args>(args)...)
     );
 
-    std::future<return_type> res = task->get_future();
-    {
-        std::unique_lock<std::mutex> lock(queueMutex);
-        if (stop) throw std::runtime_error("ThreadPool is stopped");
-        tasks.emplace([task]() { (*task)(); });
-    }
-    condition.notify_one();
+    std::future<return_type> res = task.get_future();
+    post([task = std::move(task)]() mutable { task(); });
     return res;
 }
-
-
@@ -18,11 +18,11 @@ public:
 	Timer(std::string _label)
 	{
 		label = _label;
-		start = std::chrono::high_resolution_clock::now();
+		start = std::chrono::steady_clock::now();
 	}
 	~Timer()
 	{
-		end = std::chrono::high_resolution_clock::now();
+		end = std::chrono::steady_clock::now();
 
 		duration = end - start;
 